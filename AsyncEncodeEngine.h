@@ -0,0 +1,609 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: AsyncEncodeEngine.h
+
+DESCRIPTION			: Coroutine based asynchronous API for the encode engine
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+
+// C++20 only: the rest of the filter builds as C++14
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define OPUS_ENCODER_HAS_COROUTINES
+#endif
+#endif
+
+#ifdef OPUS_ENCODER_HAS_COROUTINES
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "OpusEncodeEngine.h"
+
+/**
+ * @brief Recycles coroutine frames in thread-local free lists so that steady-state coroutines don't hit the heap.
+ *
+ * Frames are grouped in 64 byte size classes up to 4 KB; larger frames use the global allocator. A frame that
+ * is released on another thread than it was allocated on moves to that thread's free list.
+ */
+class CoroutineFramePool
+{
+public:
+  static void* allocate(std::size_t uiSize)
+  {
+    std::size_t uiClass = getSizeClass(uiSize);
+    if (uiClass < SIZE_CLASSES)
+    {
+      FreeList& list = getFreeList(uiClass);
+      if (list.pHead)
+      {
+        Node* pNode = list.pHead;
+        list.pHead = pNode->pNext;
+        --list.uiCount;
+        return pNode;
+      }
+      return ::operator new((uiClass + 1) * GRANULARITY);
+    }
+    return ::operator new(uiSize);
+  }
+
+  static void deallocate(void* p, std::size_t uiSize)
+  {
+    std::size_t uiClass = getSizeClass(uiSize);
+    if (uiClass < SIZE_CLASSES)
+    {
+      FreeList& list = getFreeList(uiClass);
+      if (list.uiCount < MAX_CACHED)
+      {
+        Node* pNode = static_cast<Node*>(p);
+        pNode->pNext = list.pHead;
+        list.pHead = pNode;
+        ++list.uiCount;
+        return;
+      }
+    }
+    ::operator delete(p);
+  }
+
+private:
+  static const std::size_t GRANULARITY = 64;
+  static const std::size_t SIZE_CLASSES = 64;
+  /// per size class and thread: bounds the memory that migrates between threads
+  static const std::size_t MAX_CACHED = 256;
+
+  struct Node
+  {
+    Node* pNext;
+  };
+  struct FreeList
+  {
+    Node* pHead = nullptr;
+    std::size_t uiCount = 0;
+  };
+  struct Cache
+  {
+    FreeList lists[SIZE_CLASSES];
+    ~Cache()
+    {
+      for (FreeList& list : lists)
+      {
+        while (list.pHead)
+        {
+          Node* pNext = list.pHead->pNext;
+          ::operator delete(list.pHead);
+          list.pHead = pNext;
+        }
+      }
+    }
+  };
+
+  static std::size_t getSizeClass(std::size_t uiSize) { return (uiSize + GRANULARITY - 1) / GRANULARITY - 1; }
+  static FreeList& getFreeList(std::size_t uiClass)
+  {
+    thread_local Cache cache;
+    return cache.lists[uiClass];
+  }
+};
+
+/**
+ * @brief Fire-and-forget coroutine whose frame comes from the CoroutineFramePool.
+ *
+ * Use it as the return type of the coroutines that drive an AsyncEncodeEngine:
+ *   AsyncTask stream(AsyncEncodeEngine<Executor>& engine) { co_await engine.push(...); ... }
+ * The frame is released when the coroutine returns.
+ */
+class AsyncTask
+{
+public:
+  struct promise_type
+  {
+    AsyncTask get_return_object() { return AsyncTask(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+    static void* operator new(std::size_t uiSize) { return CoroutineFramePool::allocate(uiSize); }
+    static void operator delete(void* p, std::size_t uiSize) { CoroutineFramePool::deallocate(p, uiSize); }
+  };
+};
+
+/**
+ * @brief Executor that resumes coroutines on the calling thread. Any type with post(std::coroutine_handle<>)
+ * can be used instead, e.g. for asio:
+ *   struct AsioExecutor { asio::any_io_executor ex; void post(std::coroutine_handle<> h) { asio::post(ex, [h]() { h.resume(); }); } };
+ */
+struct InlineExecutor
+{
+  void post(std::coroutine_handle<> h) { h.resume(); }
+};
+
+/**
+ * @brief A packet returned by AsyncEncodeEngine::next_packet. The view is valid until the next call to next_packet.
+ */
+struct AsyncPacket
+{
+  enum class Status
+  {
+    AP_OK,
+    /// cancel() was called or the encoding failed
+    AP_CANCELLED
+  };
+  Status eStatus;
+  const uint8_t* pData;
+  int iSize;
+  REFERENCE_TIME tStart;
+  REFERENCE_TIME tStop;
+};
+
+/**
+ * @brief Asynchronous wrapper around OpusEncodeEngine for event-loop based servers.
+ *
+ * co_await push(...) hands PCM to the engine and co_await next_packet() returns the next encoded packet. The
+ * encoding runs on the executor as one long-lived coroutine per engine. Backpressure: push suspends while more
+ * than the configured number of frames is waiting to be encoded, and the encoding pauses while all packet slots
+ * are waiting to be collected. After the first frames no heap allocations are made: packet slots are
+ * preallocated and the awaiters live in the frames of the awaiting coroutines.
+ *
+ * One producer and one consumer coroutine per engine.
+ */
+template <typename Executor>
+class AsyncEncodeEngine
+{
+  /// coroutines to resume once the engine lock has been released
+  struct Wakeups
+  {
+    std::coroutine_handle<> handles[3];
+    int count = 0;
+    void add(std::coroutine_handle<> h) { handles[count++] = h; }
+  };
+
+public:
+  /**
+   * @param uiMaxQueuedFrames Frames that may wait for the encoder before push suspends
+   * @param uiPacketSlots Encoded packets that may wait for next_packet before the encoder pauses
+   */
+  AsyncEncodeEngine(Executor executor, uint32_t uiMaxQueuedFrames = 4, uint32_t uiPacketSlots = 8)
+    :m_executor(executor),
+    m_uiMaxQueuedFrames(uiMaxQueuedFrames),
+    m_vSlots(uiPacketSlots),
+    m_uiSlotHead(0),
+    m_uiSlotCount(0),
+    m_bConsumerHoldsSlot(false),
+    m_bCancelled(false),
+    m_pShared(std::make_shared<SharedState>()),
+    m_pPushAwaiter(nullptr),
+    m_pPacketAwaiter(nullptr)
+  {
+    for (Slot& slot : m_vSlots) slot.vData.resize(MAX_PACKET_SIZE);
+  }
+
+  /**
+   * @brief The producer and consumer must not be suspended on the engine any more. An encoding pass that is queued
+   * on the executor is detached: it ends without touching the engine once the executor resumes it, so that e.g. a
+   * single-threaded executor can destroy the engine while the pass is queued.
+   */
+  ~AsyncEncodeEngine()
+  {
+    std::unique_lock<std::mutex> lock(m_pShared->mutex);
+    m_pShared->bClosing = true;
+    // a pass in progress on another thread stops after the frame it is encoding
+    while (m_pShared->eState == EncoderState::ES_RUNNING)
+    {
+      lock.unlock();
+      std::this_thread::yield();
+      lock.lock();
+    }
+    if (m_pShared->eState == EncoderState::ES_IDLE)
+    {
+      lock.unlock();
+      m_hEncoder.destroy();
+    }
+  }
+
+  OpusEncodeEngine& getEngine() { return m_engine; }
+
+  /**
+   * @brief Opens the encoder, see OpusEncodeEngine::open. Call before the first push.
+   */
+  bool open(int samplesPerSecond, int channels, int bitsPerSample, uint32_t targetBitrateKbps)
+  {
+    bool bStart = false;
+    {
+      std::lock_guard<std::mutex> lock(m_pShared->mutex);
+      if (!m_engine.open(samplesPerSecond, channels, bitsPerSample, targetBitrateKbps)) return false;
+      bStart = m_pShared->eState == EncoderState::ES_NOT_STARTED;
+      if (bStart) m_pShared->eState = EncoderState::ES_RUNNING;
+    }
+    // runs up to the first suspension
+    if (bStart) encodeLoop(m_pShared);
+    return true;
+  }
+
+  class PushAwaiter
+  {
+    friend class AsyncEncodeEngine;
+  public:
+    bool await_ready()
+    {
+      Wakeups wakeups;
+      bool bReady = true;
+      {
+        std::lock_guard<std::mutex> lock(m_engine.m_pShared->mutex);
+        if (m_engine.m_bCancelled) bReady = true;
+        else if (!m_engine.hasInputSpace()) bReady = false;
+        else m_engine.acceptPush(*this, wakeups);
+      }
+      m_engine.post(wakeups);
+      return bReady;
+    }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+      Wakeups wakeups;
+      bool bSuspend = false;
+      {
+        std::lock_guard<std::mutex> lock(m_engine.m_pShared->mutex);
+        // the encoder may have made space since await_ready
+        if (m_engine.m_bCancelled) bSuspend = false;
+        else if (m_engine.hasInputSpace()) m_engine.acceptPush(*this, wakeups);
+        else
+        {
+          m_hWaiter = h;
+          m_engine.m_pPushAwaiter = this;
+          bSuspend = true;
+        }
+      }
+      m_engine.post(wakeups);
+      return bSuspend;
+    }
+    /**
+     * @return false if the engine was cancelled and the data was not accepted
+     */
+    bool await_resume() const { return m_bAccepted; }
+
+  private:
+    PushAwaiter(AsyncEncodeEngine& engine, const uint8_t* pData, uint32_t uiSize, REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+      :m_engine(engine), m_pData(pData), m_uiSize(uiSize), m_tStart(tStart), m_tStop(tStop), m_bAccepted(false)
+    {
+    }
+
+    AsyncEncodeEngine& m_engine;
+    const uint8_t* m_pData;
+    uint32_t m_uiSize;
+    REFERENCE_TIME m_tStart;
+    REFERENCE_TIME m_tStop;
+    bool m_bAccepted;
+    std::coroutine_handle<> m_hWaiter;
+  };
+
+  class PacketAwaiter
+  {
+    friend class AsyncEncodeEngine;
+  public:
+    bool await_ready()
+    {
+      Wakeups wakeups;
+      bool bReady = false;
+      {
+        std::lock_guard<std::mutex> lock(m_engine.m_pShared->mutex);
+        m_engine.releaseConsumerSlot(wakeups);
+        bReady = m_engine.takePacket(m_packet);
+      }
+      m_engine.post(wakeups);
+      return bReady;
+    }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+      std::lock_guard<std::mutex> lock(m_engine.m_pShared->mutex);
+      if (m_engine.takePacket(m_packet)) return false;
+      m_hWaiter = h;
+      m_engine.m_pPacketAwaiter = this;
+      return true;
+    }
+    AsyncPacket await_resume() const { return m_packet; }
+
+  private:
+    explicit PacketAwaiter(AsyncEncodeEngine& engine) :m_engine(engine), m_packet{} {}
+
+    AsyncEncodeEngine& m_engine;
+    AsyncPacket m_packet;
+    std::coroutine_handle<> m_hWaiter;
+  };
+
+  /**
+   * @brief co_await push(...) adds PCM, suspending while the encoder is behind. The data must stay valid until
+   * the co_await completes. Returns false if the engine has been cancelled.
+   */
+  PushAwaiter push(const uint8_t* pData, uint32_t uiSize, REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+  {
+    return PushAwaiter(*this, pData, uiSize, tStart, tStop);
+  }
+  /**
+   * @brief co_await next_packet() returns the next encoded packet, suspending until there is one
+   */
+  PacketAwaiter next_packet() { return PacketAwaiter(*this); }
+
+  /**
+   * @brief Resumes the waiting producer and consumer with a cancelled result. Later awaits complete immediately.
+   */
+  void cancel()
+  {
+    Wakeups wakeups;
+    {
+      std::lock_guard<std::mutex> lock(m_pShared->mutex);
+      m_bCancelled = true;
+      if (m_pPushAwaiter)
+      {
+        wakeups.add(std::exchange(m_pPushAwaiter, nullptr)->m_hWaiter);
+      }
+      if (m_pPacketAwaiter)
+      {
+        PacketAwaiter* pAwaiter = std::exchange(m_pPacketAwaiter, nullptr);
+        takePacket(pAwaiter->m_packet);
+        wakeups.add(pAwaiter->m_hWaiter);
+      }
+    }
+    post(wakeups);
+  }
+
+private:
+  // an Opus packet of 120 ms
+  static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+
+  enum class EncoderState
+  {
+    ES_NOT_STARTED,
+    /// suspended with nothing to do
+    ES_IDLE,
+    /// queued on the executor
+    ES_QUEUED,
+    /// encoding
+    ES_RUNNING
+  };
+
+  /// the state that the encoding coroutine owns a share of, so that a queued pass outlives the engine
+  struct SharedState
+  {
+    std::mutex mutex;
+    EncoderState eState = EncoderState::ES_NOT_STARTED;
+    bool bClosing = false;
+  };
+
+  struct Slot
+  {
+    std::vector<uint8_t> vData;
+    int iSize = 0;
+    REFERENCE_TIME tStart = 0;
+    REFERENCE_TIME tStop = 0;
+  };
+
+  /// suspends the encoder until there is work, it is then resumed on the executor
+  struct WorkAwaiter
+  {
+    AsyncEncodeEngine& engine;
+    SharedState& shared;
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      engine.m_hEncoder = h;
+      if (shared.bClosing || engine.hasWork()) return false;
+      shared.eState = EncoderState::ES_IDLE;
+      return true;
+    }
+    /// the engine may be gone once it is closing
+    bool await_resume()
+    {
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      if (shared.bClosing) return false;
+      shared.eState = EncoderState::ES_RUNNING;
+      return true;
+    }
+  };
+
+  AsyncTask encodeLoop(std::shared_ptr<SharedState> pShared)
+  {
+    while (co_await WorkAwaiter{ *this, *pShared })
+    {
+      REFERENCE_TIME tStart, tStop;
+      uint8_t* pFrame = nullptr;
+      bool bFailed = false;
+      std::unique_lock<std::mutex> lock(pShared->mutex);
+      while (!m_bCancelled && !pShared->bClosing && m_uiSlotCount < m_vSlots.size() && m_engine.readNextAudioFrame(tStart, tStop, pFrame))
+      {
+        // the producer may add data while we encode: work on a copy of the frame
+        m_vFrame.resize(m_engine.getBytesPerFrame());
+        memcpy(m_vFrame.data(), pFrame, m_vFrame.size());
+        // only the encoder adds packets: the slot stays free while the lock is released
+        Slot& slot = m_vSlots[(m_uiSlotHead + m_uiSlotCount) % m_vSlots.size()];
+        Wakeups wakeups;
+        completePush(wakeups);
+        lock.unlock();
+        post(wakeups);
+
+        int iSize = m_engine.encodeFrame(m_vFrame.data(), slot.vData.data(), static_cast<int>(slot.vData.size()));
+
+        wakeups.count = 0;
+        lock.lock();
+        // a size of 1 means that nothing has to be transmitted
+        if (iSize > 1)
+        {
+          slot.iSize = iSize;
+          slot.tStart = tStart;
+          slot.tStop = tStop;
+          ++m_uiSlotCount;
+          completePacket(wakeups);
+        }
+        bFailed = iSize < 0;
+        if (wakeups.count > 0 || bFailed)
+        {
+          lock.unlock();
+          post(wakeups);
+          if (bFailed) break;
+          lock.lock();
+        }
+      }
+      if (bFailed) cancel();
+    }
+    std::lock_guard<std::mutex> lock(pShared->mutex);
+    pShared->eState = EncoderState::ES_NOT_STARTED;
+  }
+
+  void post(const Wakeups& wakeups)
+  {
+    for (int i = 0; i < wakeups.count; ++i) m_executor.post(wakeups.handles[i]);
+  }
+
+  /// called with the engine lock held
+  int getBufferedBytes() const
+  {
+    uint8_t* pData = nullptr;
+    REFERENCE_TIME tStart = 0;
+    return m_engine.getAudioBuffer()->getBufferedData(pData, tStart);
+  }
+
+  /// called with the engine lock held
+  bool hasInputSpace() const
+  {
+    return getBufferedBytes() < static_cast<int>(m_uiMaxQueuedFrames) * m_engine.getBytesPerFrame();
+  }
+
+  /// called with the engine lock held
+  bool hasWork() const
+  {
+    return !m_bCancelled && m_uiSlotCount < m_vSlots.size() && getBufferedBytes() >= m_engine.getBytesPerFrame();
+  }
+
+  /// called with the engine lock held
+  void acceptPush(PushAwaiter& awaiter, Wakeups& wakeups)
+  {
+    awaiter.m_bAccepted = m_engine.addAudioData(const_cast<uint8_t*>(awaiter.m_pData), awaiter.m_uiSize, awaiter.m_tStart, awaiter.m_tStop) != -1;
+    wakeEncoder(wakeups);
+  }
+
+  /// accepts the data of a waiting producer if there is space now. Called with the engine lock held.
+  void completePush(Wakeups& wakeups)
+  {
+    if (m_pPushAwaiter && hasInputSpace())
+    {
+      PushAwaiter* pAwaiter = std::exchange(m_pPushAwaiter, nullptr);
+      pAwaiter->m_bAccepted = m_engine.addAudioData(const_cast<uint8_t*>(pAwaiter->m_pData), pAwaiter->m_uiSize, pAwaiter->m_tStart, pAwaiter->m_tStop) != -1;
+      wakeups.add(pAwaiter->m_hWaiter);
+    }
+  }
+
+  /// hands the oldest packet to a waiting consumer. Called with the engine lock held.
+  void completePacket(Wakeups& wakeups)
+  {
+    if (m_pPacketAwaiter && takePacket(m_pPacketAwaiter->m_packet))
+    {
+      wakeups.add(std::exchange(m_pPacketAwaiter, nullptr)->m_hWaiter);
+    }
+  }
+
+  /// called with the engine lock held
+  bool takePacket(AsyncPacket& packet)
+  {
+    if (m_bCancelled)
+    {
+      packet = AsyncPacket{ AsyncPacket::Status::AP_CANCELLED, nullptr, 0, 0, 0 };
+      return true;
+    }
+    if (m_bConsumerHoldsSlot || m_uiSlotCount == 0) return false;
+    const Slot& slot = m_vSlots[m_uiSlotHead];
+    packet = AsyncPacket{ AsyncPacket::Status::AP_OK, slot.vData.data(), slot.iSize, slot.tStart, slot.tStop };
+    m_bConsumerHoldsSlot = true;
+    return true;
+  }
+
+  /// the consumer is done with the previous packet. Called with the engine lock held.
+  void releaseConsumerSlot(Wakeups& wakeups)
+  {
+    if (!m_bConsumerHoldsSlot) return;
+    m_bConsumerHoldsSlot = false;
+    m_uiSlotHead = (m_uiSlotHead + 1) % m_vSlots.size();
+    --m_uiSlotCount;
+    wakeEncoder(wakeups);
+  }
+
+  /// called with the engine lock held
+  void wakeEncoder(Wakeups& wakeups)
+  {
+    if (m_pShared->eState == EncoderState::ES_IDLE && hasWork())
+    {
+      m_pShared->eState = EncoderState::ES_QUEUED;
+      wakeups.add(m_hEncoder);
+    }
+  }
+
+  Executor m_executor;
+  OpusEncodeEngine m_engine;
+  uint32_t m_uiMaxQueuedFrames;
+  /// copy of the frame being encoded
+  std::vector<uint8_t> m_vFrame;
+  /// ring of encoded packets
+  std::vector<Slot> m_vSlots;
+  size_t m_uiSlotHead;
+  size_t m_uiSlotCount;
+  /// the packet at m_uiSlotHead has been handed out and is in use by the consumer
+  bool m_bConsumerHoldsSlot;
+  bool m_bCancelled;
+  /// the engine lock and the state of the encoding coroutine
+  std::shared_ptr<SharedState> m_pShared;
+  std::coroutine_handle<> m_hEncoder;
+  PushAwaiter* m_pPushAwaiter;
+  PacketAwaiter* m_pPacketAwaiter;
+};
+#endif
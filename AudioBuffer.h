@@ -1,7 +1,18 @@
 #pragma once
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <deque>
 #include <memory>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <strmif.h>
+#else
+// DirectShow reference time: 100ns units
+typedef int64_t REFERENCE_TIME;
+#endif
 
 enum class OpusFrameDuration
 {
@@ -13,76 +24,346 @@ enum class OpusFrameDuration
   OFD_60_MS
 };
 
-class AudioBuffer {
+/**
+ * @brief the frame duration in 100ns units
+ */
+constexpr REFERENCE_TIME frameDurationTo100ns(OpusFrameDuration eFrameDuration)
+{
+  return eFrameDuration == OpusFrameDuration::OFD_2_5_MS ? 25000 :
+    eFrameDuration == OpusFrameDuration::OFD_5_MS ? 50000 :
+    eFrameDuration == OpusFrameDuration::OFD_10_MS ? 100000 :
+    eFrameDuration == OpusFrameDuration::OFD_20_MS ? 200000 :
+    eFrameDuration == OpusFrameDuration::OFD_40_MS ? 400000 : 600000;
+}
+
+// size buffer to store one second of 16bps, 2 channels, 48K sampling rate
+static const int AUDIO_BUFFER_SIZE = 1536000;
+
+/**
+ * @brief How timestamp gaps between consecutive samples are handled
+ */
+enum class GapPolicy
+{
+  /// timestamps of subsequent samples are ignored: the buffer clock runs on from the first sample
+  GP_IGNORE,
+  /// gaps are filled with silence, overlaps and gaps longer than the maximum fill start a new segment
+  GP_FILL_SILENCE,
+  /// every gap or overlap starts a new segment: no packets are produced for the gap so that the receiver runs PLC
+  GP_SIGNAL_LOSS
+};
+
+/**
+ * @brief A segment that starts behind buffered audio, see IAudioBuffer::startNewSegment
+ */
+struct ResyncPoint
+{
+  /// unread bytes before the segment begins
+  int bytes;
+  REFERENCE_TIME tStart;
+};
+
+/**
+ * @brief The timestamp clock of a framing buffer, see IAudioBuffer::getClockState
+ */
+struct AudioClockState
+{
+  /// the time of the first unread sample, -1 until the clock has started
+  REFERENCE_TIME tStart;
+  REFERENCE_TIME tStop;
+  /// the pending segment starts, oldest first
+  std::vector<ResyncPoint> vResync;
+  /// whether the next frame read starts a new segment
+  bool discontinuity;
+};
+
+/**
+ * @brief The final buffer classes, see visitAudioBuffer
+ */
+enum class AudioBufferKind
+{
+  /// AudioBuffer
+  ABK_GENERIC,
+  /// StereoAudioBuffer48k
+  ABK_48000_2_20_MS,
+  /// MonoAudioBuffer16k
+  ABK_16000_1_20_MS
+};
+
+/**
+ * @brief Interface of the framing buffers so that the encode engine can use a buffer specialised
+ * for the negotiated format.
+ */
+class IAudioBuffer
+{
 public:
+  virtual ~IAudioBuffer() {}
 
-  AudioBuffer(int samplesPerSecond, int channels, int bitsPerSample)
-    :m_eFrameDurationMs(OpusFrameDuration::OFD_20_MS),
-    m_inputFrameDurationMs(0.0),
+  /**
+   * @brief the final class of the buffer so that the per frame calls can be dispatched to it, see visitAudioBuffer
+   */
+  virtual AudioBufferKind getKind() const = 0;
+  virtual OpusFrameDuration getFrameDurationMsEnum() const = 0;
+  virtual double getFrameDurationMs() const = 0;
+  virtual int getBytesPerSecond() const = 0;
+  virtual int getBytesPerFrame() const = 0;
+  /**
+   * @brief Changes the frame duration. Takes effect from the next frame read from the buffer.
+   * @return false if the buffer does not support the frame duration
+   */
+  virtual bool setFrameDuration(OpusFrameDuration eFrameDuration) = 0;
+  /**
+   * @brief Returns whether the queued segments start on frame boundaries of the frame duration. Until they do, a
+   * switch would glue the audio of two segments into one frame and misplace the segment starts.
+   */
+  virtual bool canSwitchFrameDuration(OpusFrameDuration eFrameDuration) const = 0;
+  /**
+   * @brief Appends audio data to the buffer. We are expecting one call of addAudioData to be followed by
+   * several readNextAudioFrame calls until there isn't enough data in the buffer to read an audio frame.
+   * @return the number of complete frames in the buffer or -1 if there is not enough space
+   */
+  virtual int addAudioData(uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop) = 0;
+  /**
+   * @brief Reserves space for size bytes of audio starting at tStart so that e.g. a decoder can write it in place.
+   * Handles the timestamp gap like addAudioData and must be followed by commitAudioData.
+   * @return the destination or null if there is not enough space
+   */
+  virtual uint8_t* reserveAudioData(uint32_t size, REFERENCE_TIME tStart) = 0;
+  /**
+   * @brief Appends the size bytes written to the space returned by reserveAudioData
+   * @return the number of complete frames in the buffer
+   */
+  virtual int commitAudioData(uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop) = 0;
+  virtual bool readNextAudioFrame(REFERENCE_TIME& tStart, REFERENCE_TIME& tStop, uint8_t*& p) = 0;
+  /**
+   * @brief Gives access to the buffered data that has not been read yet e.g. to move it to another buffer.
+   * @return the number of buffered bytes
+   */
+  virtual int getBufferedData(uint8_t*& p, REFERENCE_TIME& tStart) = 0;
+  /**
+   * @brief Configures the handling of timestamp gaps. Deviations up to the tolerance are treated as jitter.
+   */
+  virtual void setGapPolicy(GapPolicy ePolicy, REFERENCE_TIME tTolerance, REFERENCE_TIME tMaxFill) = 0;
+  /**
+   * @brief Ends the current segment e.g. on a data discontinuity: the partial frame is padded with silence so that
+   * stale audio is not glued to the new audio, and the clock restarts at tStart with the first frame after the audio
+   * buffered so far. Segments started before that audio has been read are queued.
+   */
+  virtual void startNewSegment(REFERENCE_TIME tStart) = 0;
+  /**
+   * @brief Pads the partial frame at the end of the buffer with silence so that it can be read e.g. on end of stream
+   * @return true if a partial frame was padded
+   */
+  virtual bool padPartialFrame() = 0;
+  /**
+   * @brief Discards all buffered audio and restarts the clock with the next sample e.g. on flush or seek
+   */
+  virtual void reset() = 0;
+  /**
+   * @brief Returns whether the last frame read starts a new segment and clears the flag
+   */
+  virtual bool takeDiscontinuity() = 0;
+  /**
+   * @brief the number of silent bytes inserted to fill gaps
+   */
+  virtual uint64_t getGapFillBytes() const = 0;
+  /**
+   * @brief the number of segments started because of gaps, overlaps or discontinuities
+   */
+  virtual uint32_t getSegmentCount() const = 0;
+  /**
+   * @brief Continues the counts of another buffer e.g. when the buffer is replaced while streaming
+   */
+  virtual void setCounts(uint64_t uiGapFillBytes, uint32_t uiSegments) = 0;
+  /**
+   * @brief the timestamp clock, which together with getBufferedData describes the buffer e.g. for a checkpoint
+   */
+  virtual AudioClockState getClockState() const = 0;
+  /**
+   * @brief Replaces the buffered audio and the clock e.g. with those of a checkpoint
+   * @return false if the data doesn't fit or the clock doesn't match it
+   */
+  virtual bool restore(const uint8_t* pData, uint32_t size, const AudioClockState& clock) = 0;
+};
+
+/**
+ * @brief Audio format whose parameters are only known at runtime
+ */
+class RuntimeAudioFormat
+{
+public:
+  RuntimeAudioFormat(int samplesPerSecond, int channels, int bitsPerSample)
+    :m_eFrameDuration(OpusFrameDuration::OFD_20_MS),
     m_samplesPerSecond(samplesPerSecond),
     m_channels(channels),
-    m_bitsPerSample(bitsPerSample),
-    m_currentBufferSize(1536000), // size buffer to store one second of 16bps, 2 channels, 48K sampling rate
-    m_currentSize(0),
-    m_startPos(0),
-    m_endPos(0),
-    m_pDataBuffer(std::unique_ptr<uint8_t[]>(new uint8_t[m_currentBufferSize])),
-    m_tStart(-1),
-    m_tStop(0)
+    m_bitsPerSample(bitsPerSample)
   {
     init();
   }
 
-  ~AudioBuffer() {};
-
-  OpusFrameDuration getFrameDurationMsEnum() { return m_eFrameDurationMs; }
-  double getFrameDurationMs() { return m_inputFrameDurationMs; }
+  OpusFrameDuration getFrameDuration() const { return m_eFrameDuration; }
+  REFERENCE_TIME getFrameDuration100ns() const { return m_frameDuration100ns; }
   int getBytesPerSecond() const { return m_bytesPerSecond; }
   int getBytesPerFrame() const { return m_bytesPerFrame; }
+  int getBlockAlign() const { return m_channels * (m_bitsPerSample / 8); }
+  bool setFrameDuration(OpusFrameDuration eFrameDuration)
+  {
+    m_eFrameDuration = eFrameDuration;
+    init();
+    return true;
+  }
+
+private:
+  void init()
+  {
+    m_frameDuration100ns = frameDurationTo100ns(m_eFrameDuration);
+    // total bytes per second
+    m_bytesPerSecond = m_samplesPerSecond * m_channels * (m_bitsPerSample / 8);
+    // frame size in bytes
+    m_bytesPerFrame = static_cast<int>(m_samplesPerSecond * m_frameDuration100ns / 10000000) * m_channels * (m_bitsPerSample / 8);
+  }
+
+  OpusFrameDuration m_eFrameDuration;
+  int m_samplesPerSecond;
+  int m_channels;
+  int m_bitsPerSample;
+  REFERENCE_TIME m_frameDuration100ns;
+  int m_bytesPerSecond;
+  int m_bytesPerFrame;
+};
+
+/**
+ * @brief Audio format that is fixed at compile time so that frame sizes and timestamp steps are constants
+ */
+template <int SamplesPerSecond, int Channels, typename SampleT, OpusFrameDuration FrameDuration>
+class FixedAudioFormat
+{
+public:
+  static constexpr REFERENCE_TIME FRAME_DURATION_100NS = frameDurationTo100ns(FrameDuration);
+  static constexpr int BYTES_PER_SECOND = SamplesPerSecond * Channels * static_cast<int>(sizeof(SampleT));
+  static constexpr int BYTES_PER_FRAME = static_cast<int>(SamplesPerSecond * FRAME_DURATION_100NS / 10000000) * Channels * static_cast<int>(sizeof(SampleT));
 
+  OpusFrameDuration getFrameDuration() const { return FrameDuration; }
+  REFERENCE_TIME getFrameDuration100ns() const { return FRAME_DURATION_100NS; }
+  int getBytesPerSecond() const { return BYTES_PER_SECOND; }
+  int getBytesPerFrame() const { return BYTES_PER_FRAME; }
+  int getBlockAlign() const { return Channels * static_cast<int>(sizeof(SampleT)); }
+  bool setFrameDuration(OpusFrameDuration eFrameDuration) { return eFrameDuration == FrameDuration; }
+};
+
+/**
+ * @brief Buffers incoming PCM and cuts it into frames of the configured duration.
+ * The Format policy provides the frame size and duration, see RuntimeAudioFormat and FixedAudioFormat. Used through
+ * the final classes AudioBuffer and FixedAudioBuffer, which the calls of visitAudioBuffer are bound to.
+ */
+template <class Format>
+class BasicAudioBuffer : public IAudioBuffer
+{
+public:
   /**
-   *
+   * @param pStorage capacity bytes that outlive the buffer, e.g. from a NumaArena, or null to allocate from the heap
+   * @param capacity the size of the buffer in bytes
    */
-  int addAudioData(uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+  explicit BasicAudioBuffer(const Format& format = Format(), uint8_t* pStorage = nullptr, int capacity = AUDIO_BUFFER_SIZE)
+    :m_format(format),
+    m_numberOfFrames(0),
+    m_currentBufferSize(capacity),
+    m_currentSize(0),
+    m_startPos(0),
+    m_pOwnedBuffer(pStorage ? nullptr : new uint8_t[capacity]),
+    m_pDataBuffer(pStorage ? pStorage : m_pOwnedBuffer.get()),
+    m_tStart(-1),
+    m_tStop(0),
+    m_eGapPolicy(GapPolicy::GP_IGNORE),
+    m_tGapTolerance(0),
+    m_tMaxGapFill(0),
+    m_bDiscontinuity(false),
+    m_uiGapFillBytes(0),
+    m_uiSegments(0)
+  {
+  }
+
+  OpusFrameDuration getFrameDurationMsEnum() const override { return m_format.getFrameDuration(); }
+  double getFrameDurationMs() const override { return m_format.getFrameDuration100ns() / 10000.0; }
+  int getBytesPerSecond() const override { return m_format.getBytesPerSecond(); }
+  int getBytesPerFrame() const override { return m_format.getBytesPerFrame(); }
+
+  bool setFrameDuration(OpusFrameDuration eFrameDuration) override
+  {
+    if (eFrameDuration == m_format.getFrameDuration()) return true;
+    if (!m_format.setFrameDuration(eFrameDuration)) return false;
+    m_numberOfFrames = m_currentSize / m_format.getBytesPerFrame();
+    return true;
+  }
+
+  bool canSwitchFrameDuration(OpusFrameDuration eFrameDuration) const override
+  {
+    const int blockAlign = m_format.getBlockAlign();
+    const int64_t bytesPerFrame = static_cast<int64_t>(m_format.getBytesPerSecond() / blockAlign) * frameDurationTo100ns(eFrameDuration) / 10000000 * blockAlign;
+    for (const ResyncPoint& resync : m_dqResync)
+    {
+      if (resync.bytes % bytesPerFrame != 0) return false;
+    }
+    return true;
+  }
+
+  int addAudioData(uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop) override
+  {
+    uint8_t* pDest = reserveAudioData(size, tStart);
+    if (!pDest) { return -1; }
+    memcpy(pDest, pData, size);
+    return commitAudioData(size, tStart, tStop);
+  }
+
+  uint8_t* reserveAudioData(uint32_t size, REFERENCE_TIME tStart) override
   {
     // first version: we only read data if the buffer has enough space: in our case this should be sufficient
-    if (freeSpace() < size) { return -1; }
+    if (freeSpace() < static_cast<int>(size)) { return nullptr; }
 
-    // re-position data in buffer: we are expecting one call of addAudioData to be followed by several 
-    // readNextAudioFrame calls until there isn't enough data in the buffer to read an audio frame
-    if (m_startPos > 0 && m_currentSize > 0)
+    compact();
+    if (m_eGapPolicy != GapPolicy::GP_IGNORE && m_tStart != -1)
     {
-      memcpy(m_pDataBuffer.get(), m_pDataBuffer.get() + m_startPos, m_currentSize);
+      handleGap(tStart, size);
+      // a new segment pads the partial frame: the data may no longer fit
+      if (freeSpace() < static_cast<int>(size)) { return nullptr; }
     }
-    m_startPos = 0;
-    m_endPos = m_currentSize;
+    return m_pDataBuffer + m_currentSize;
+  }
 
-    memcpy(m_pDataBuffer.get() + m_currentSize, pData, size);
+  int commitAudioData(uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop) override
+  {
     m_currentSize += size;
 
     if (m_tStart == -1) m_tStart = tStart;
     m_tStop = tStop;
 
-    m_sampleBufferDurationInMs = m_currentSize * 1000 / m_bytesPerSecond;
-
-    m_numberOfFrames = m_sampleBufferDurationInMs / m_inputFrameDurationMs;
-    m_additionalDataInMs = std::fmod(m_sampleBufferDurationInMs, m_inputFrameDurationMs);
+    m_numberOfFrames = m_currentSize / m_format.getBytesPerFrame();
     return m_numberOfFrames;
   }
 
-  bool readNextAudioFrame(REFERENCE_TIME& tStart, REFERENCE_TIME& tStop, uint8_t*& p)
+  bool readNextAudioFrame(REFERENCE_TIME& tStart, REFERENCE_TIME& tStop, uint8_t*& p) override
   {
     if (m_numberOfFrames > 0)
     {
-      p = m_pDataBuffer.get() + m_startPos;
-      m_startPos += m_bytesPerFrame;
-      assert(m_currentSize >= m_bytesPerFrame);
-      m_currentSize -= m_bytesPerFrame;
+      const int bytesPerFrame = m_format.getBytesPerFrame();
+      // first frame of a new segment: segments that ended up empty after a frame duration change are skipped
+      while (!m_dqResync.empty() && m_dqResync.front().bytes == 0)
+      {
+        m_tStart = m_dqResync.front().tStart;
+        m_dqResync.pop_front();
+        m_bDiscontinuity = true;
+      }
+      for (ResyncPoint& resync : m_dqResync)
+      {
+        resync.bytes = (resync.bytes > bytesPerFrame) ? resync.bytes - bytesPerFrame : 0;
+      }
+      p = m_pDataBuffer + m_startPos;
+      m_startPos += bytesPerFrame;
+      assert(m_currentSize >= bytesPerFrame);
+      m_currentSize -= bytesPerFrame;
       m_numberOfFrames--;
       tStart = m_tStart;
-      m_tStart += getFrameDurationMs() * 10000;
+      m_tStart += m_format.getFrameDuration100ns();
       tStop = m_tStart;
-      m_sampleBufferDurationInMs -= getFrameDurationMs();
       return true;
     }
     else {
@@ -90,109 +371,254 @@ public:
     }
   }
 
-private:
-  AudioBuffer(const AudioBuffer&) = delete;
-  AudioBuffer& operator=(const AudioBuffer&) = delete;
+  int getBufferedData(uint8_t*& p, REFERENCE_TIME& tStart) override
+  {
+    p = m_pDataBuffer + m_startPos;
+    tStart = m_tStart;
+    return m_currentSize;
+  }
 
-  void init() {
-    switch (m_eFrameDurationMs) {
-    case OpusFrameDuration::OFD_2_5_MS:
-    {
-      m_inputFrameDurationMs = 2.5;
-      break;
-    }
-    case OpusFrameDuration::OFD_5_MS:
-    {
-      m_inputFrameDurationMs = 5;
-      break;
-    }
-    case OpusFrameDuration::OFD_10_MS:
-    {
-      m_inputFrameDurationMs = 10;
-      break;
-    }
-    case OpusFrameDuration::OFD_20_MS:
-    {
-      m_inputFrameDurationMs = 20;
-      break;
-    }
-    case OpusFrameDuration::OFD_40_MS:
+  void setGapPolicy(GapPolicy ePolicy, REFERENCE_TIME tTolerance, REFERENCE_TIME tMaxFill) override
+  {
+    m_eGapPolicy = ePolicy;
+    m_tGapTolerance = tTolerance;
+    m_tMaxGapFill = tMaxFill;
+  }
+
+  void startNewSegment(REFERENCE_TIME tStart) override
+  {
+    if (m_tStart == -1 || m_currentSize == 0)
     {
-      m_inputFrameDurationMs = 40;
-      break;
+      // nothing buffered: simply restart the clock
+      m_tStart = tStart;
+      m_dqResync.clear();
+      m_bDiscontinuity = true;
     }
-    case OpusFrameDuration::OFD_60_MS:
+    else
     {
-      m_inputFrameDurationMs = 60;
-      break;
-    }
+      // the discontinuity is flagged once the first frame of the new segment is read
+      padPartialFrame();
+      if (!m_dqResync.empty() && m_dqResync.back().bytes == m_currentSize)
+      {
+        // the last segment is still empty: the new one replaces it
+        m_dqResync.back().tStart = tStart;
+      }
+      else
+      {
+        m_dqResync.push_back({ m_currentSize, tStart });
+      }
     }
+    ++m_uiSegments;
+  }
 
-    // the number of these frames per second e.g. 50 20ms frames
-    int iInputFrameCountPerSecond = 1000 / m_inputFrameDurationMs;
-    // total bytes per second
-    m_bytesPerSecond = m_samplesPerSecond * m_channels * (m_bitsPerSample / 8);
-    // frame size in bytes
-    m_bytesPerFrame = m_bytesPerSecond / iInputFrameCountPerSecond;
+  bool padPartialFrame() override
+  {
+    const int bytesPerFrame = m_format.getBytesPerFrame();
+    int partial = m_currentSize % bytesPerFrame;
+    if (partial == 0) return false;
+    int pad = bytesPerFrame - partial;
+    if (m_startPos + m_currentSize + pad > m_currentBufferSize) compact();
+    if (m_currentSize + pad > m_currentBufferSize) return false;
+    memset(m_pDataBuffer + m_startPos + m_currentSize, 0, pad);
+    m_currentSize += pad;
+    m_numberOfFrames = m_currentSize / bytesPerFrame;
+    return true;
+  }
 
-    //int iDataPerChannelInSample = lSourceSize / (pwfx->nChannels * pwfx->wBitsPerSample / 8);
-    //int iSampleBufferDurationInMs = lSourceSize * 1000 / iBytesPerSecond;
+  void reset() override
+  {
+    m_currentSize = 0;
+    m_startPos = 0;
+    m_numberOfFrames = 0;
+    m_tStart = -1;
+    m_dqResync.clear();
+    m_bDiscontinuity = true;
   }
 
-  int freeSpace() const { return m_currentBufferSize - m_currentSize; }
+  bool takeDiscontinuity() override
+  {
+    bool bDiscontinuity = m_bDiscontinuity;
+    m_bDiscontinuity = false;
+    return bDiscontinuity;
+  }
 
-  double getFrameDurationMs() const
+  uint64_t getGapFillBytes() const override { return m_uiGapFillBytes; }
+  uint32_t getSegmentCount() const override { return m_uiSegments; }
+  void setCounts(uint64_t uiGapFillBytes, uint32_t uiSegments) override
   {
-    switch (m_eFrameDurationMs)
-    {
-    case OpusFrameDuration::OFD_2_5_MS:
-    {
-      return 2.5;
-    }
-    case OpusFrameDuration::OFD_5_MS:
-    {
-      return 5;
-    }
-    case OpusFrameDuration::OFD_10_MS:
-    {
-      return 10;
-    }
-    case OpusFrameDuration::OFD_20_MS:
+    m_uiGapFillBytes = uiGapFillBytes;
+    m_uiSegments = uiSegments;
+  }
+
+  AudioClockState getClockState() const override
+  {
+    return { m_tStart, m_tStop, std::vector<ResyncPoint>(m_dqResync.begin(), m_dqResync.end()), m_bDiscontinuity };
+  }
+
+  bool restore(const uint8_t* pData, uint32_t size, const AudioClockState& clock) override
+  {
+    if (static_cast<int>(size) > m_currentBufferSize) return false;
+    if (size > 0 && clock.tStart == -1) return false;
+    int previousBytes = 0;
+    for (const ResyncPoint& resync : clock.vResync)
     {
-      return 20;
+      if (resync.bytes < previousBytes || resync.bytes > static_cast<int>(size)) return false;
+      previousBytes = resync.bytes;
     }
-    case OpusFrameDuration::OFD_40_MS:
+    if (size > 0) memcpy(m_pDataBuffer, pData, size);
+    m_startPos = 0;
+    m_currentSize = size;
+    m_numberOfFrames = m_currentSize / m_format.getBytesPerFrame();
+    m_tStart = clock.tStart;
+    m_tStop = clock.tStop;
+    m_dqResync.assign(clock.vResync.begin(), clock.vResync.end());
+    m_bDiscontinuity = clock.discontinuity;
+    return true;
+  }
+
+private:
+  BasicAudioBuffer(const BasicAudioBuffer&) = delete;
+  BasicAudioBuffer& operator=(const BasicAudioBuffer&) = delete;
+
+  int freeSpace() const { return m_currentBufferSize - m_currentSize; }
+
+  /// moves the unread data to the start of the buffer
+  void compact()
+  {
+    if (m_startPos > 0 && m_currentSize > 0)
     {
-      return 40;
+      memmove(m_pDataBuffer, m_pDataBuffer + m_startPos, m_currentSize);
     }
-    case OpusFrameDuration::OFD_60_MS:
+    m_startPos = 0;
+  }
+
+  /// the time just after the last buffered byte
+  REFERENCE_TIME getEndTime() const
+  {
+    const int bytesPerSecond = m_format.getBytesPerSecond();
+    if (!m_dqResync.empty())
     {
-      return 60;
-    }
+      const ResyncPoint& resync = m_dqResync.back();
+      return resync.tStart + static_cast<REFERENCE_TIME>(m_currentSize - resync.bytes) * 10000000 / bytesPerSecond;
     }
+    return m_tStart + static_cast<REFERENCE_TIME>(m_currentSize) * 10000000 / bytesPerSecond;
   }
 
-  OpusFrameDuration m_eFrameDurationMs;
-  double m_inputFrameDurationMs;
+  /// compares the timestamp of new data with the buffer clock and fills or signals the gap
+  void handleGap(REFERENCE_TIME tStart, uint32_t size)
+  {
+    REFERENCE_TIME tGap = tStart - getEndTime();
+    if (tGap <= m_tGapTolerance && tGap >= -m_tGapTolerance) return;
 
-  int m_samplesPerSecond;
-  int m_channels;
-  int m_bitsPerSample;
+    if (m_eGapPolicy == GapPolicy::GP_FILL_SILENCE && tGap > 0 && tGap <= m_tMaxGapFill)
+    {
+      const int blockAlign = m_format.getBlockAlign();
+      int fill = static_cast<int>(tGap * m_format.getBytesPerSecond() / 10000000) / blockAlign * blockAlign;
+      if (fill + static_cast<int>(size) <= freeSpace())
+      {
+        memset(m_pDataBuffer + m_currentSize, 0, fill);
+        m_currentSize += fill;
+        m_uiGapFillBytes += fill;
+        return;
+      }
+    }
+    // overlap, gap too long to fill or loss should be signalled
+    startNewSegment(tStart);
+  }
 
-  int m_bytesPerSecond;
-  int m_bytesPerFrame;
-  int m_sampleBufferDurationInMs;
+  Format m_format;
   int m_numberOfFrames;
-  double m_additionalDataInMs;
 
   //buffer we will use to manage the audio data
   int m_currentBufferSize;
   int m_currentSize;
   int m_startPos;
-  int m_endPos;
 
-  std::unique_ptr<uint8_t[]> m_pDataBuffer;
+  std::unique_ptr<uint8_t[]> m_pOwnedBuffer;
+  uint8_t* m_pDataBuffer;
   // the time of the first sample in the buffer
   REFERENCE_TIME m_tStart;
   REFERENCE_TIME m_tStop;
+
+  GapPolicy m_eGapPolicy;
+  REFERENCE_TIME m_tGapTolerance;
+  REFERENCE_TIME m_tMaxGapFill;
+  // the segments that start behind the buffered audio, oldest first
+  std::deque<ResyncPoint> m_dqResync;
+  // set when the next frame read starts a new segment
+  bool m_bDiscontinuity;
+  uint64_t m_uiGapFillBytes;
+  uint32_t m_uiSegments;
 };
+
+/**
+ * @brief Generic buffer for any format
+ */
+class AudioBuffer final : public BasicAudioBuffer<RuntimeAudioFormat>
+{
+public:
+  AudioBuffer(int samplesPerSecond, int channels, int bitsPerSample, uint8_t* pStorage = nullptr, int capacity = AUDIO_BUFFER_SIZE)
+    :BasicAudioBuffer<RuntimeAudioFormat>(RuntimeAudioFormat(samplesPerSecond, channels, bitsPerSample), pStorage, capacity)
+  {
+  }
+
+  AudioBufferKind getKind() const override { return AudioBufferKind::ABK_GENERIC; }
+};
+
+/**
+ * @brief Buffer specialised for a format that is fixed at compile time
+ * @param pStorage, capacity see BasicAudioBuffer
+ */
+template <int SamplesPerSecond, int Channels, typename SampleT, OpusFrameDuration FrameDuration, AudioBufferKind Kind>
+class FixedAudioBuffer final : public BasicAudioBuffer<FixedAudioFormat<SamplesPerSecond, Channels, SampleT, FrameDuration>>
+{
+public:
+  typedef FixedAudioFormat<SamplesPerSecond, Channels, SampleT, FrameDuration> Format;
+
+  explicit FixedAudioBuffer(uint8_t* pStorage = nullptr, int capacity = AUDIO_BUFFER_SIZE)
+    :BasicAudioBuffer<Format>(Format(), pStorage, capacity)
+  {
+  }
+
+  AudioBufferKind getKind() const override { return Kind; }
+};
+
+typedef FixedAudioBuffer<48000, 2, int16_t, OpusFrameDuration::OFD_20_MS, AudioBufferKind::ABK_48000_2_20_MS> StereoAudioBuffer48k;
+typedef FixedAudioBuffer<16000, 1, int16_t, OpusFrameDuration::OFD_20_MS, AudioBufferKind::ABK_16000_1_20_MS> MonoAudioBuffer16k;
+
+/**
+ * @brief Calls visitor with the buffer as its final class, like std::visit, so that the calls of the visitor are direct
+ * and can be inlined rather than made through IAudioBuffer
+ * @param eKind buffer.getKind(), e.g. looked up once when the buffer is created
+ * @return the result of the visitor
+ */
+template <class Visitor>
+auto visitAudioBuffer(IAudioBuffer& buffer, AudioBufferKind eKind, Visitor&& visitor)
+{
+  switch (eKind)
+  {
+  case AudioBufferKind::ABK_48000_2_20_MS:
+    return visitor(static_cast<StereoAudioBuffer48k&>(buffer));
+  case AudioBufferKind::ABK_16000_1_20_MS:
+    return visitor(static_cast<MonoAudioBuffer16k&>(buffer));
+  default:
+    return visitor(static_cast<AudioBuffer&>(buffer));
+  }
+}
+
+/**
+ * @brief Creates the buffer specialised for the format if there is one, otherwise a generic AudioBuffer.
+ * @param pStorage, capacity see BasicAudioBuffer
+ */
+inline std::unique_ptr<IAudioBuffer> createAudioBuffer(int samplesPerSecond, int channels, int bitsPerSample, OpusFrameDuration eFrameDuration,
+  uint8_t* pStorage = nullptr, int capacity = AUDIO_BUFFER_SIZE)
+{
+  if (bitsPerSample == 16 && eFrameDuration == OpusFrameDuration::OFD_20_MS)
+  {
+    if (samplesPerSecond == 48000 && channels == 2) return std::make_unique<StereoAudioBuffer48k>(pStorage, capacity);
+    if (samplesPerSecond == 16000 && channels == 1) return std::make_unique<MonoAudioBuffer16k>(pStorage, capacity);
+  }
+  std::unique_ptr<IAudioBuffer> pBuffer = std::make_unique<AudioBuffer>(samplesPerSecond, channels, bitsPerSample, pStorage, capacity);
+  pBuffer->setFrameDuration(eFrameDuration);
+  return pBuffer;
+}
@@ -0,0 +1,108 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: BatchEncoder.cpp
+
+DESCRIPTION			: Encodes many mono streams with batched preprocessing
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "BatchEncoder.h"
+
+// maximum size of a 20ms Opus packet with some headroom
+static const int MAX_OPUS_PACKET_SIZE = 1275 * 3;
+
+BatchEncoder::BatchEncoder(int streams, int samplesPerSecond, uint32_t targetBitrateKbps)
+  :m_samplesPerSecond(samplesPerSecond),
+  m_uiTargetBitrateKbps(targetBitrateKbps),
+  m_preprocessor(streams, samplesPerSecond / 50),
+  m_vRawFrames(streams, nullptr),
+  m_vFrames(streams, nullptr),
+  m_vOutputs(streams, nullptr),
+  m_vProcessed(streams * (samplesPerSecond / 50)),
+  m_vPackets(streams, std::vector<uint8_t>(MAX_OPUS_PACKET_SIZE)),
+  m_vPacketInfo(streams, Packet{ nullptr, 0, 0, 0 })
+{
+  for (int i = 0; i < streams; ++i)
+  {
+    m_vEngines.push_back(std::make_unique<OpusEncodeEngine>());
+  }
+}
+
+bool BatchEncoder::open()
+{
+  for (auto& pEngine : m_vEngines)
+  {
+    if (!pEngine->open(m_samplesPerSecond, 1, 16, m_uiTargetBitrateKbps))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+int BatchEncoder::encode()
+{
+  const int iSamplesPerFrame = m_preprocessor.getSamplesPerFrame();
+  const int iBytesPerFrame = iSamplesPerFrame * static_cast<int>(sizeof(int16_t));
+  for (size_t i = 0; i < m_vEngines.size(); ++i)
+  {
+    REFERENCE_TIME tStart = 0, tStop = 0;
+    m_vRawFrames[i] = nullptr;
+    m_vFrames[i] = nullptr;
+    m_vOutputs[i] = nullptr;
+    m_vPacketInfo[i] = Packet{ m_vPackets[i].data(), 0, 0, 0 };
+    if (!m_vEngines[i]->readNextAudioFrame(tStart, tStop, m_vRawFrames[i])) continue;
+    m_vPacketInfo[i].tStart = tStart;
+    m_vPacketInfo[i].tStop = tStop;
+    // the governor may have stretched the frames of this stream: it is then encoded without preprocessing
+    if (m_vEngines[i]->getBytesPerFrame() == iBytesPerFrame)
+    {
+      m_vFrames[i] = reinterpret_cast<const int16_t*>(m_vRawFrames[i]);
+      m_vOutputs[i] = m_vProcessed.data() + i * iSamplesPerFrame;
+    }
+  }
+
+  m_preprocessor.process(m_vFrames.data(), m_vOutputs.data());
+
+  int iEncodes = 0;
+  for (size_t i = 0; i < m_vEngines.size(); ++i)
+  {
+    if (!m_vRawFrames[i]) continue;
+    uint8_t* pFrame = m_vOutputs[i] ? reinterpret_cast<uint8_t*>(m_vOutputs[i]) : m_vRawFrames[i];
+    int iSize = m_vEngines[i]->encodeFrame(pFrame, m_vPackets[i].data(), MAX_OPUS_PACKET_SIZE);
+    if (iSize < 0) return -1;
+    m_vPacketInfo[i].iSize = iSize;
+    ++iEncodes;
+  }
+  return iEncodes;
+}
+
+BatchEncoder::Packet BatchEncoder::getPacket(int stream) const
+{
+  return m_vPacketInfo[stream];
+}
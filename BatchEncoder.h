@@ -0,0 +1,97 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: BatchEncoder.h
+
+DESCRIPTION			: Encodes many mono streams with batched preprocessing
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "BatchPreprocessor.h"
+#include "OpusEncodeEngine.h"
+
+/**
+ * @brief Encodes N independent mono 16 bit streams whose frames are preprocessed together by a BatchPreprocessor.
+ */
+class BatchEncoder
+{
+public:
+  struct Packet
+  {
+    const uint8_t* pData;
+    /// 0 if the stream had no complete frame
+    int iSize;
+    REFERENCE_TIME tStart;
+    REFERENCE_TIME tStop;
+  };
+
+  BatchEncoder(int streams, int samplesPerSecond, uint32_t targetBitrateKbps);
+
+  /**
+   * @brief Opens all encoders
+   * @return false if any of the encoders failed to open
+   */
+  bool open();
+  int getStreams() const { return static_cast<int>(m_vEngines.size()); }
+  OpusEncodeEngine& getEngine(int stream) { return *m_vEngines[stream]; }
+  BatchPreprocessor& getPreprocessor() { return m_preprocessor; }
+  /**
+   * @brief Adds PCM to the buffer of a stream, see OpusEncodeEngine::addAudioData
+   */
+  int addAudioData(int stream, uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+  {
+    return m_vEngines[stream]->addAudioData(pData, size, tStart, tStop);
+  }
+  /**
+   * @brief Takes the next frame of every stream that has one, preprocesses them in one batch and encodes them.
+   * @return the number of encoded frames or -1 on error
+   */
+  int encode();
+  /**
+   * @brief the packet of a stream produced by the last call to encode()
+   */
+  Packet getPacket(int stream) const;
+
+private:
+  int m_samplesPerSecond;
+  uint32_t m_uiTargetBitrateKbps;
+  BatchPreprocessor m_preprocessor;
+  std::vector<std::unique_ptr<OpusEncodeEngine>> m_vEngines;
+  /// per stream frame read from the engine or null
+  std::vector<uint8_t*> m_vRawFrames;
+  /// per stream input of the preprocessor or null if the stream is not part of the batch
+  std::vector<const int16_t*> m_vFrames;
+  /// per stream preprocessed frame or null if the stream is not part of the batch
+  std::vector<int16_t*> m_vOutputs;
+  std::vector<int16_t> m_vProcessed;
+  std::vector<std::vector<uint8_t>> m_vPackets;
+  std::vector<Packet> m_vPacketInfo;
+};
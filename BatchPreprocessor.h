@@ -0,0 +1,325 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: BatchPreprocessor.h
+
+DESCRIPTION			: Structure-of-arrays preprocessing of many mono streams
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BATCH_PREPROCESSOR_SSE2
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BATCH_PREPROCESSOR_AVX2
+#endif
+
+/**
+ * @brief Applies gain, DC removal and level metering to the current frame of many mono streams at once.
+ *
+ * Per stream the kernels are recursive (the DC blocker) or reductions (the meters), so a single short frame
+ * vectorises badly. Instead the frames of LANES streams are transposed into one block in which each vector holds
+ * the same sample of LANES streams: all kernels then run at full vector width with the per-stream state in
+ * registers. The blocks are transposed back into each stream's output frame.
+ */
+class BatchPreprocessor
+{
+public:
+  /// streams per block: one AVX register or two SSE registers of floats
+  static const int LANES = 8;
+
+  BatchPreprocessor(int streams, int samplesPerFrame)
+    :m_streams(streams),
+    m_blocks((streams + LANES - 1) / LANES),
+    m_samplesPerFrame(samplesPerFrame),
+    m_bDcRemoval(true),
+    m_vBlocks(m_blocks * samplesPerFrame * LANES),
+    m_vGain(m_blocks * LANES, 1.0f),
+    m_vX1(m_blocks * LANES, 0.0f),
+    m_vY1(m_blocks * LANES, 0.0f),
+    m_vPeak(m_blocks * LANES, 0.0f),
+    m_vSumSquares(m_blocks * LANES, 0.0f)
+  {
+  }
+
+  int getStreams() const { return m_streams; }
+  int getSamplesPerFrame() const { return m_samplesPerFrame; }
+  void setGain(int stream, float fGain) { m_vGain[stream] = fGain; }
+  float getGain(int stream) const { return m_vGain[stream]; }
+  void setDcRemoval(bool bEnable) { m_bDcRemoval = bEnable; }
+  /**
+   * @brief Clears the filter state of a stream, e.g. when it is (re)started
+   */
+  void reset(int stream)
+  {
+    m_vX1[stream] = 0.0f;
+    m_vY1[stream] = 0.0f;
+  }
+  /**
+   * @brief Processes one frame of every stream
+   * @param ppIn ppIn[k] points to the frame of stream k or is null if the stream has no frame (processed as silence)
+   * @param ppOut ppOut[k] receives the processed frame of stream k. Null to discard. May be the same as ppIn[k].
+   */
+  void process(const int16_t* const* ppIn, int16_t* const* ppOut)
+  {
+    for (int b = 0; b < m_blocks; ++b)
+    {
+      gather(b, ppIn);
+      processBlock(b);
+      scatter(b, ppOut);
+    }
+  }
+  /**
+   * @brief the absolute peak of the last processed frame of a stream in [0, 1]
+   */
+  float getPeak(int stream) const { return m_vPeak[stream] / 32768.0f; }
+  /**
+   * @brief the RMS of the last processed frame of a stream in [0, 1]
+   */
+  float getRms(int stream) const { return std::sqrt(m_vSumSquares[stream] / m_samplesPerFrame) / 32768.0f; }
+
+private:
+  /// DC blocker pole: -3 dB at about 20 Hz at 16 kHz
+  static constexpr float DC_POLE = 0.992f;
+
+  float* getBlock(int b) { return m_vBlocks.data() + b * m_samplesPerFrame * LANES; }
+
+  const int16_t* getInput(const int16_t* const* ppIn, int stream) const
+  {
+    return stream < m_streams ? ppIn[stream] : nullptr;
+  }
+
+  int16_t* getOutput(int16_t* const* ppOut, int stream) const
+  {
+    return stream < m_streams ? ppOut[stream] : nullptr;
+  }
+
+  void gather(int b, const int16_t* const* ppIn)
+  {
+    float* pBlock = getBlock(b);
+    int i = 0;
+#ifdef BATCH_PREPROCESSOR_SSE2
+    for (; i + 8 <= m_samplesPerFrame; i += 8)
+    {
+      __m128i rows[LANES];
+      for (int k = 0; k < LANES; ++k)
+      {
+        const int16_t* pIn = getInput(ppIn, b * LANES + k);
+        rows[k] = pIn ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + i)) : _mm_setzero_si128();
+      }
+      // rows[j] now holds sample i + j of the LANES streams
+      transpose8x8(rows);
+      for (int j = 0; j < 8; ++j)
+      {
+        float* pRow = pBlock + (i + j) * LANES;
+        _mm_storeu_ps(pRow, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(rows[j], rows[j]), 16)));
+        _mm_storeu_ps(pRow + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(rows[j], rows[j]), 16)));
+      }
+    }
+#endif
+    for (int k = 0; k < LANES; ++k)
+    {
+      const int16_t* pIn = getInput(ppIn, b * LANES + k);
+      for (int j = i; j < m_samplesPerFrame; ++j)
+      {
+        pBlock[j * LANES + k] = pIn ? pIn[j] : 0.0f;
+      }
+    }
+  }
+
+  void processBlock(int b)
+  {
+    float* pBlock = getBlock(b);
+    float* pGain = &m_vGain[b * LANES];
+    float* pX1 = &m_vX1[b * LANES];
+    float* pY1 = &m_vY1[b * LANES];
+    float* pPeak = &m_vPeak[b * LANES];
+    float* pSumSquares = &m_vSumSquares[b * LANES];
+#ifdef BATCH_PREPROCESSOR_AVX2
+    const __m256 gain = _mm256_loadu_ps(pGain);
+    const __m256 pole = _mm256_set1_ps(m_bDcRemoval ? DC_POLE : 0.0f);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 x1 = _mm256_loadu_ps(pX1);
+    __m256 y1 = _mm256_loadu_ps(pY1);
+    __m256 peak = _mm256_setzero_ps();
+    __m256 sum = _mm256_setzero_ps();
+    for (int i = 0; i < m_samplesPerFrame; ++i)
+    {
+      float* pRow = pBlock + i * LANES;
+      __m256 x = _mm256_mul_ps(_mm256_loadu_ps(pRow), gain);
+      __m256 y = x;
+      if (m_bDcRemoval)
+      {
+        y = _mm256_add_ps(_mm256_sub_ps(x, x1), _mm256_mul_ps(pole, y1));
+        x1 = x;
+        y1 = y;
+      }
+      _mm256_storeu_ps(pRow, y);
+      peak = _mm256_max_ps(peak, _mm256_and_ps(y, absMask));
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(y, y));
+    }
+    _mm256_storeu_ps(pX1, x1);
+    _mm256_storeu_ps(pY1, y1);
+    _mm256_storeu_ps(pPeak, peak);
+    _mm256_storeu_ps(pSumSquares, sum);
+#elif defined(BATCH_PREPROCESSOR_SSE2)
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 pole = _mm_set1_ps(DC_POLE);
+    for (int h = 0; h < LANES; h += 4)
+    {
+      const __m128 gain = _mm_loadu_ps(pGain + h);
+      __m128 x1 = _mm_loadu_ps(pX1 + h);
+      __m128 y1 = _mm_loadu_ps(pY1 + h);
+      __m128 peak = _mm_setzero_ps();
+      __m128 sum = _mm_setzero_ps();
+      for (int i = 0; i < m_samplesPerFrame; ++i)
+      {
+        float* pRow = pBlock + i * LANES + h;
+        __m128 x = _mm_mul_ps(_mm_loadu_ps(pRow), gain);
+        __m128 y = x;
+        if (m_bDcRemoval)
+        {
+          y = _mm_add_ps(_mm_sub_ps(x, x1), _mm_mul_ps(pole, y1));
+          x1 = x;
+          y1 = y;
+        }
+        _mm_storeu_ps(pRow, y);
+        peak = _mm_max_ps(peak, _mm_and_ps(y, absMask));
+        sum = _mm_add_ps(sum, _mm_mul_ps(y, y));
+      }
+      _mm_storeu_ps(pX1 + h, x1);
+      _mm_storeu_ps(pY1 + h, y1);
+      _mm_storeu_ps(pPeak + h, peak);
+      _mm_storeu_ps(pSumSquares + h, sum);
+    }
+#else
+    for (int k = 0; k < LANES; ++k)
+    {
+      float x1 = pX1[k], y1 = pY1[k], peak = 0.0f, sum = 0.0f;
+      for (int i = 0; i < m_samplesPerFrame; ++i)
+      {
+        float& fSample = pBlock[i * LANES + k];
+        float x = fSample * pGain[k];
+        float y = x;
+        if (m_bDcRemoval)
+        {
+          y = x - x1 + DC_POLE * y1;
+          x1 = x;
+          y1 = y;
+        }
+        fSample = y;
+        peak = std::max(peak, std::fabs(y));
+        sum += y * y;
+      }
+      pX1[k] = x1;
+      pY1[k] = y1;
+      pPeak[k] = peak;
+      pSumSquares[k] = sum;
+    }
+#endif
+  }
+
+  void scatter(int b, int16_t* const* ppOut)
+  {
+    const float* pBlock = getBlock(b);
+    int i = 0;
+#ifdef BATCH_PREPROCESSOR_SSE2
+    for (; i + 8 <= m_samplesPerFrame; i += 8)
+    {
+      __m128i rows[LANES];
+      for (int j = 0; j < 8; ++j)
+      {
+        const float* pRow = pBlock + (i + j) * LANES;
+        // round to nearest and saturate
+        rows[j] = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(pRow)), _mm_cvtps_epi32(_mm_loadu_ps(pRow + 4)));
+      }
+      transpose8x8(rows);
+      for (int k = 0; k < LANES; ++k)
+      {
+        int16_t* pOut = getOutput(ppOut, b * LANES + k);
+        if (pOut) _mm_storeu_si128(reinterpret_cast<__m128i*>(pOut + i), rows[k]);
+      }
+    }
+#endif
+    for (int k = 0; k < LANES; ++k)
+    {
+      int16_t* pOut = getOutput(ppOut, b * LANES + k);
+      if (!pOut) continue;
+      for (int j = i; j < m_samplesPerFrame; ++j)
+      {
+        long lSample = std::lround(pBlock[j * LANES + k]);
+        pOut[j] = static_cast<int16_t>(std::min(std::max(lSample, -32768L), 32767L));
+      }
+    }
+  }
+
+#ifdef BATCH_PREPROCESSOR_SSE2
+  /// transposes 8 rows of 8 16 bit values in place
+  static void transpose8x8(__m128i* r)
+  {
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+    r[0] = _mm_unpacklo_epi64(b0, b4);
+    r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5);
+    r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6);
+    r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7);
+    r[7] = _mm_unpackhi_epi64(b3, b7);
+  }
+#endif
+
+  int m_streams;
+  int m_blocks;
+  int m_samplesPerFrame;
+  bool m_bDcRemoval;
+  /// m_blocks blocks of m_samplesPerFrame rows of LANES streams
+  std::vector<float> m_vBlocks;
+  std::vector<float> m_vGain;
+  /// DC blocker state
+  std::vector<float> m_vX1;
+  std::vector<float> m_vY1;
+  /// meters of the last frame
+  std::vector<float> m_vPeak;
+  std::vector<float> m_vSumSquares;
+};
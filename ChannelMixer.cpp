@@ -0,0 +1,284 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: ChannelMixer.cpp
+
+DESCRIPTION			: Downmixes or remaps the input channels to the channels that are encoded
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "ChannelMixer.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// -3 dB
+static const double K = 0.70710678118654752;
+// the speaker positions of WAVE_FORMAT_EXTENSIBLE and their ITU-R BS.775 gains to the left and right output.
+// Mono is K * (left + right): L/R at -3 dB, C at 0 dB, the surrounds at -6 dB.
+static const struct
+{
+  uint32_t mask;
+  double left;
+  double right;
+} SPEAKERS[] =
+{
+  { 0x00001, 1.0, 0.0 },          // front left
+  { 0x00002, 0.0, 1.0 },          // front right
+  { 0x00004, K, K },              // front centre
+  { 0x00008, 0.0, 0.0 },          // LFE
+  { 0x00010, K, 0.0 },            // back left
+  { 0x00020, 0.0, K },            // back right
+  { 0x00040, 1.0, 0.0 },          // front left of centre
+  { 0x00080, 0.0, 1.0 },          // front right of centre
+  { 0x00100, 0.5, 0.5 },          // back centre
+  { 0x00200, K, 0.0 },            // side left
+  { 0x00400, 0.0, K },            // side right
+  { 0x00800, 0.5, 0.5 },          // top centre
+  { 0x01000, K, 0.0 },            // top front left
+  { 0x02000, 0.5, 0.5 },          // top front centre
+  { 0x04000, 0.0, K },            // top front right
+  { 0x08000, 0.5, 0.0 },          // top back left
+  { 0x10000, K * 0.5, K * 0.5 },  // top back centre
+  { 0x20000, 0.0, 0.5 }           // top back right
+};
+// the layouts Windows assumes for WAVEFORMATEX input: mono, stereo, 3.0, quad, 5.0, 5.1, 6.1 and 7.1
+static const uint32_t DEFAULT_MASKS[] = { 0x0, 0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x13F, 0x63F };
+
+static int16_t quantiseGain(double dGain)
+{
+  return static_cast<int16_t>(lround(dGain * (1 << ChannelMixer::GAIN_BITS)));
+}
+
+#ifdef CHANNEL_MIXER_SSE2
+// the sums of the four 32 bit lanes of each of a, b, c and d
+static inline __m128i horizontalSum4(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+  const __m128i ab = _mm_add_epi32(_mm_unpacklo_epi32(a, b), _mm_unpackhi_epi32(a, b));
+  const __m128i cd = _mm_add_epi32(_mm_unpacklo_epi32(c, d), _mm_unpackhi_epi32(c, d));
+  return _mm_add_epi32(_mm_unpacklo_epi64(ab, cd), _mm_unpackhi_epi64(ab, cd));
+}
+#endif
+
+ChannelMixer::ChannelMixer(const std::vector<double>& vMatrix, int inputChannels, int outputChannels)
+  :m_iInputChannels(inputChannels),
+  m_iOutputChannels(outputChannels),
+  m_vGains(vMatrix.size()),
+  m_uiCarry(0)
+{
+  std::transform(vMatrix.begin(), vMatrix.end(), m_vGains.begin(), quantiseGain);
+  memset(m_vRowGains, 0, sizeof(m_vRowGains));
+  for (int o = 0; o < m_iOutputChannels; ++o)
+  {
+    std::copy_n(&m_vGains[o * m_iInputChannels], m_iInputChannels, m_vRowGains[o]);
+  }
+}
+
+ChannelMixer::Config ChannelMixer::getDefaultConfig()
+{
+  Config config;
+  config.inputChannels = 0;
+  config.channelMask = 0;
+  return config;
+}
+
+std::vector<double> ChannelMixer::getDownmixMatrix(uint32_t channelMask, int inputChannels, int outputChannels)
+{
+  if (channelMask == 0 && inputChannels <= MAX_INPUT_CHANNELS) channelMask = DEFAULT_MASKS[inputChannels];
+  std::vector<double> vMatrix(outputChannels * inputChannels, 0.0);
+  // the channels are in the order of their bits in the mask; channels beyond the mask have no position
+  int c = 0;
+  for (const auto& speaker : SPEAKERS)
+  {
+    if (c == inputChannels) break;
+    if ((channelMask & speaker.mask) == 0) continue;
+    if (outputChannels == 1)
+    {
+      vMatrix[c] = K * (speaker.left + speaker.right);
+    }
+    else
+    {
+      vMatrix[c] = speaker.left;
+      vMatrix[inputChannels + c] = speaker.right;
+    }
+    ++c;
+  }
+  return vMatrix;
+}
+
+std::vector<double> ChannelMixer::getSelectMatrix(const std::vector<int>& vSelected, int inputChannels)
+{
+  std::vector<double> vMatrix(vSelected.size() * inputChannels, 0.0);
+  for (size_t o = 0; o < vSelected.size(); ++o)
+  {
+    if (vSelected[o] < 0 || vSelected[o] >= inputChannels) return std::vector<double>();
+    vMatrix[o * inputChannels + vSelected[o]] = 1.0;
+  }
+  return vMatrix;
+}
+
+bool ChannelMixer::isValid(const std::vector<double>& vMatrix, int inputChannels, int outputChannels)
+{
+  if (inputChannels < 1 || inputChannels > MAX_INPUT_CHANNELS || outputChannels < 1 || outputChannels > 2) return false;
+  if (vMatrix.size() != static_cast<size_t>(inputChannels * outputChannels)) return false;
+  for (int o = 0; o < outputChannels; ++o)
+  {
+    // full scale times the sum of the gains must fit 32 bits with the rounding
+    int iSum = 0;
+    for (int c = 0; c < inputChannels; ++c)
+    {
+      const double dGain = vMatrix[o * inputChannels + c];
+      if (!std::isfinite(dGain) || std::fabs(dGain) >= 4.0) return false;
+      iSum += std::abs(static_cast<int>(quantiseGain(dGain)));
+    }
+    if (iSum >= 65535) return false;
+  }
+  return true;
+}
+
+bool ChannelMixer::parseMatrix(const std::string& sMatrix, std::vector<double>& vMatrix)
+{
+  vMatrix.clear();
+  const char* p = sMatrix.c_str();
+  for (;;)
+  {
+    while (*p == ',' || *p == ';' || isspace(static_cast<unsigned char>(*p))) ++p;
+    if (*p == '\0') break;
+    char* pEnd = nullptr;
+    const double dGain = strtod(p, &pEnd);
+    if (pEnd == p) return false;
+    vMatrix.push_back(dGain);
+    p = pEnd;
+  }
+  return !vMatrix.empty();
+}
+
+bool ChannelMixer::parseSelection(const std::string& sSelection, std::vector<int>& vSelected)
+{
+  vSelected.clear();
+  const char* p = sSelection.c_str();
+  for (;;)
+  {
+    while (*p == ',' || isspace(static_cast<unsigned char>(*p))) ++p;
+    if (*p == '\0') break;
+    char* pEnd = nullptr;
+    const long lChannel = strtol(p, &pEnd, 10);
+    if (pEnd == p || lChannel < 0 || lChannel >= MAX_INPUT_CHANNELS) return false;
+    vSelected.push_back(static_cast<int>(lChannel));
+    p = pEnd;
+  }
+  return vSelected.size() == 1 || vSelected.size() == 2;
+}
+
+uint32_t ChannelMixer::getMixedSize(uint32_t size) const
+{
+  const uint32_t uiFrames = (m_uiCarry + size) / (m_iInputChannels * sizeof(int16_t));
+  return uiFrames * m_iOutputChannels * sizeof(int16_t);
+}
+
+uint32_t ChannelMixer::process(const uint8_t* pData, uint32_t size, int16_t* pOut)
+{
+  const uint32_t uiBlockAlign = m_iInputChannels * sizeof(int16_t);
+  uint32_t uiWritten = 0;
+  if (m_uiCarry > 0)
+  {
+    const uint32_t uiTake = std::min(uiBlockAlign - m_uiCarry, size);
+    memcpy(m_vCarry + m_uiCarry, pData, uiTake);
+    m_uiCarry += uiTake;
+    pData += uiTake;
+    size -= uiTake;
+    if (m_uiCarry < uiBlockAlign) return 0;
+    mixFrames(m_vCarry, 1, pOut);
+    pOut += m_iOutputChannels;
+    uiWritten += m_iOutputChannels * sizeof(int16_t);
+    m_uiCarry = 0;
+  }
+  const uint32_t uiFrames = size / uiBlockAlign;
+  mixFrames(pData, uiFrames, pOut);
+  uiWritten += uiFrames * m_iOutputChannels * sizeof(int16_t);
+  m_uiCarry = size - uiFrames * uiBlockAlign;
+  memcpy(m_vCarry, pData + uiFrames * uiBlockAlign, m_uiCarry);
+  return uiWritten;
+}
+
+void ChannelMixer::mixFrames(const uint8_t* pIn, size_t uiFrames, int16_t* pOut) const
+{
+  const int iIn = m_iInputChannels;
+  const int iOut = m_iOutputChannels;
+  const size_t uiBlockAlign = iIn * sizeof(int16_t);
+  size_t f = 0;
+#ifdef CHANNEL_MIXER_SSE2
+  {
+    // each frame is loaded as a whole vector: the samples of the next frame have zero gains. The last frames
+    // whose vector would extend past the input are left to the scalar loop.
+    const size_t uiSamples = uiFrames * iIn;
+    const size_t uiVectorFrames = uiSamples >= MAX_INPUT_CHANNELS ? (uiSamples - MAX_INPUT_CHANNELS) / iIn + 1 : 0;
+    const __m128i round = _mm_set1_epi32(1 << (GAIN_BITS - 1));
+    const __m128i gains0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m_vRowGains[0]));
+    const __m128i gains1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m_vRowGains[1]));
+    for (; f + 4 <= uiVectorFrames; f += 4)
+    {
+      const __m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + f * uiBlockAlign));
+      const __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + (f + 1) * uiBlockAlign));
+      const __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + (f + 2) * uiBlockAlign));
+      const __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + (f + 3) * uiBlockAlign));
+      if (iOut == 1)
+      {
+        __m128i sum = horizontalSum4(_mm_madd_epi16(x0, gains0), _mm_madd_epi16(x1, gains0),
+          _mm_madd_epi16(x2, gains0), _mm_madd_epi16(x3, gains0));
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, round), GAIN_BITS);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(pOut + f), _mm_packs_epi32(sum, sum));
+      }
+      else
+      {
+        // L0 R0 L1 R1 and L2 R2 L3 R3
+        __m128i sum01 = horizontalSum4(_mm_madd_epi16(x0, gains0), _mm_madd_epi16(x0, gains1),
+          _mm_madd_epi16(x1, gains0), _mm_madd_epi16(x1, gains1));
+        __m128i sum23 = horizontalSum4(_mm_madd_epi16(x2, gains0), _mm_madd_epi16(x2, gains1),
+          _mm_madd_epi16(x3, gains0), _mm_madd_epi16(x3, gains1));
+        sum01 = _mm_srai_epi32(_mm_add_epi32(sum01, round), GAIN_BITS);
+        sum23 = _mm_srai_epi32(_mm_add_epi32(sum23, round), GAIN_BITS);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pOut + f * 2), _mm_packs_epi32(sum01, sum23));
+      }
+    }
+  }
+#endif
+  for (; f < uiFrames; ++f)
+  {
+    int16_t vFrame[MAX_INPUT_CHANNELS];
+    memcpy(vFrame, pIn + f * uiBlockAlign, uiBlockAlign);
+    for (int o = 0; o < iOut; ++o)
+    {
+      const int16_t* pGains = &m_vGains[o * iIn];
+      int32_t iSum = 1 << (GAIN_BITS - 1);
+      for (int c = 0; c < iIn; ++c) iSum += vFrame[c] * pGains[c];
+      pOut[f * iOut + o] = static_cast<int16_t>(std::max(-32768, std::min(32767, iSum >> GAIN_BITS)));
+    }
+  }
+}
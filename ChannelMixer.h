@@ -0,0 +1,134 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: ChannelMixer.h
+
+DESCRIPTION			: Downmixes or remaps the input channels to the channels that are encoded
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CHANNEL_MIXER_SSE2
+#endif
+
+/**
+ * @brief Mixes interleaved 16 bit PCM of any number of channels down to the one or two channels that are encoded,
+ * so that multichannel sources can be sent as stereo or mono without a separate mixer filter.
+ *
+ * Each output channel is a weighted sum of the input channels. The default weights are the ITU-R BS.775
+ * downmix of the speaker layout (centre and surrounds at -3 dB, LFE dropped); a custom matrix or a channel
+ * selection, e.g. for dual-mono broadcast feeds, replaces them.
+ *
+ * The gains are Q13 so that the products of a frame sum in 32 bits and rounding is the same for the vector and
+ * the scalar path. With SSE2 a frame is one vector and each output sample is one pmaddwd followed by a transposed
+ * horizontal add over 4 frames.
+ * Input that ends in the middle of a frame is carried over to the next call.
+ */
+class ChannelMixer
+{
+public:
+  /// fractional bits of the gains
+  static const int GAIN_BITS = 13;
+  /// up to 7.1: a frame fits one vector, and the gains of the default downmix sum to less than 8
+  static const int MAX_INPUT_CHANNELS = 8;
+
+  struct Config
+  {
+    /// channels of the input, 0 to encode the input channels as they are
+    int inputChannels;
+    /// WAVE_FORMAT_EXTENSIBLE speaker positions of the input channels, 0 for the default layout of the count
+    uint32_t channelMask;
+    /// gains from each input channel, one row of inputChannels gains per output channel; empty for the
+    /// ITU-R BS.775 downmix of the layout
+    std::vector<double> matrix;
+  };
+
+  ChannelMixer(const std::vector<double>& vMatrix, int inputChannels, int outputChannels);
+  /// no mixing
+  static Config getDefaultConfig();
+  /**
+   * @brief the ITU-R BS.775 downmix of the speaker layout to mono or stereo
+   * @param channelMask WAVE_FORMAT_EXTENSIBLE speaker positions, 0 for the Windows default layout of the count
+   */
+  static std::vector<double> getDownmixMatrix(uint32_t channelMask, int inputChannels, int outputChannels);
+  /**
+   * @brief passes the selected input channel to each output channel, e.g. {1} for the second programme
+   * of a dual-mono feed or {0, 0} for the first one on both sides
+   */
+  static std::vector<double> getSelectMatrix(const std::vector<int>& vSelected, int inputChannels);
+  /**
+   * @brief Checks the size of the matrix and that its gains fit: |gain| < 4 and the sum of |gain| per output
+   * channel < 8
+   */
+  static bool isValid(const std::vector<double>& vMatrix, int inputChannels, int outputChannels);
+  /**
+   * @brief Parses gains separated by commas, semicolons or spaces, e.g. "1,0,0.707,0,0.707,0; 0,1,0.707,0,0,0.707"
+   */
+  static bool parseMatrix(const std::string& sMatrix, std::vector<double>& vMatrix);
+  /**
+   * @brief Parses one or two zero-based channel indices separated by a comma, e.g. "1" or "0,0"
+   */
+  static bool parseSelection(const std::string& sSelection, std::vector<int>& vSelected);
+
+  int getInputChannels() const { return m_iInputChannels; }
+  int getOutputChannels() const { return m_iOutputChannels; }
+  /**
+   * @brief the number of PCM bytes that process() writes for size bytes of input
+   */
+  uint32_t getMixedSize(uint32_t size) const;
+  /**
+   * @brief Mixes the carried partial frame followed by the complete frames of pData
+   * @param pOut getMixedSize(size) bytes
+   * @return the number of PCM bytes written
+   */
+  uint32_t process(const uint8_t* pData, uint32_t size, int16_t* pOut);
+  /**
+   * @brief Discards the partial frame, e.g. on a discontinuity
+   */
+  void reset() { m_uiCarry = 0; }
+
+private:
+  /// pIn needn't be aligned: after a carried partial frame the input continues at any byte
+  void mixFrames(const uint8_t* pIn, size_t uiFrames, int16_t* pOut) const;
+
+  int m_iInputChannels;
+  int m_iOutputChannels;
+  /// Q13 gains, output channel by output channel
+  std::vector<int16_t> m_vGains;
+  /// the gains of each output channel padded to a vector
+  int16_t m_vRowGains[2][MAX_INPUT_CHANNELS];
+  /// the start of a frame that was cut off at the end of the last input
+  uint8_t m_vCarry[MAX_INPUT_CHANNELS * sizeof(int16_t)];
+  uint32_t m_uiCarry;
+};
@@ -0,0 +1,113 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: ConferenceEncoder.cpp
+
+DESCRIPTION			: Mix-minus conference encoder with shared encodes for identical mixes
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "ConferenceEncoder.h"
+#include <algorithm>
+
+// maximum size of a 60ms Opus packet: three frames of 1275 bytes and their lengths
+static const int MAX_OPUS_PACKET_SIZE = 1275 * 3 + 7;
+
+ConferenceEncoder::ConferenceEncoder(int participants, int samplesPerSecond, int channels, uint32_t targetBitrateKbps,
+  OpusFrameDuration frameDuration)
+  :m_mixer(participants, static_cast<int>(samplesPerSecond * frameDurationTo100ns(frameDuration) / 10000000) * channels),
+  m_samplesPerSecond(samplesPerSecond),
+  m_channels(channels),
+  m_uiTargetBitrateKbps(targetBitrateKbps),
+  m_eFrameDuration(frameDuration),
+  m_maxPacketSize(MAX_OPUS_PACKET_SIZE),
+  m_vPackets(participants + 1, std::vector<uint8_t>(MAX_OPUS_PACKET_SIZE)),
+  m_vPacketSizes(participants + 1, 0),
+  m_vReceiverEngines(participants, -1),
+  m_vDiscontinuities(participants, false),
+  m_uiEncoderSwitches(0)
+{
+  for (int i = 0; i <= participants; ++i)
+  {
+    m_vEngines.push_back(std::make_unique<OpusEncodeEngine>());
+  }
+}
+
+bool ConferenceEncoder::open()
+{
+  for (auto& pEngine : m_vEngines)
+  {
+    // the mixes are encoded with encodeFrame as they are: no framing is needed
+    pEngine->setFramingBufferSize(0);
+    pEngine->setFrameDuration(m_eFrameDuration);
+    if (!pEngine->open(m_samplesPerSecond, m_channels, 16, m_uiTargetBitrateKbps))
+    {
+      return false;
+    }
+  }
+  std::fill(m_vReceiverEngines.begin(), m_vReceiverEngines.end(), -1);
+  std::fill(m_vDiscontinuities.begin(), m_vDiscontinuities.end(), false);
+  m_uiEncoderSwitches = 0;
+  return true;
+}
+
+int ConferenceEncoder::encode(const int16_t* const* ppInputs)
+{
+  m_mixer.mix(ppInputs);
+
+  int iEncodes = 0;
+  bool bFullMixEncoded = false;
+  for (int i = 0; i < m_mixer.getParticipants(); ++i)
+  {
+    int iMix = m_mixer.getMixIndex(i);
+    int iEngine = getEngineIndex(i);
+    m_vDiscontinuities[i] = m_vReceiverEngines[i] != -1 && iEngine != m_vReceiverEngines[i];
+    m_vReceiverEngines[i] = iEngine;
+    if (m_vDiscontinuities[i])
+    {
+      ++m_uiEncoderSwitches;
+      // the own encoder last encoded for the receiver before the hold time ran out
+      if (iEngine != 0 && !m_vEngines[iEngine]->restartCodec()) return -1;
+    }
+    if (iMix == MixMinusMixer::FULL_MIX && bFullMixEncoded) continue;
+    uint8_t* pMix = reinterpret_cast<uint8_t*>(m_mixer.getMix(iMix));
+    int iSize = m_vEngines[iEngine]->encodeFrame(pMix, m_vPackets[iEngine].data(), m_maxPacketSize);
+    if (iSize < 0) return -1;
+    m_vPacketSizes[iEngine] = iSize;
+    // the full mix is shared: only encode it once
+    if (iMix == MixMinusMixer::FULL_MIX) bFullMixEncoded = true;
+    ++iEncodes;
+  }
+  return iEncodes;
+}
+
+ConferenceEncoder::Packet ConferenceEncoder::getPacket(int receiver) const
+{
+  int iEngine = getEngineIndex(receiver);
+  Packet packet = { m_vPackets[iEngine].data(), m_vPacketSizes[iEngine], m_vDiscontinuities[receiver] };
+  return packet;
+}
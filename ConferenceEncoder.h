@@ -0,0 +1,112 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: ConferenceEncoder.h
+
+DESCRIPTION			: Mix-minus conference encoder with shared encodes for identical mixes
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "MixMinus.h"
+#include "OpusEncodeEngine.h"
+
+/**
+ * @brief Mixes N participants and encodes the resulting mix-minus outputs.
+ *
+ * Each participant owns an encoder for its own mix-minus so that the encoder state stays continuous
+ * while it is speaking. All receivers that get the full mix share one encoder and one packet buffer.
+ * When a receiver moves between the two, which the hold time of the mixer limits to the start and the end
+ * of a talk spurt, its packet is flagged so that the decoder of the receiver can be reset: the packets of
+ * the other encoder don't continue the state of the decoder. An encoder that takes a receiver over is
+ * restarted so that it doesn't continue from the state it had when it last sent to the receiver.
+ */
+class ConferenceEncoder
+{
+public:
+  /**
+   * @brief a view onto an encoded packet. Receivers in the same mix group get the same view.
+   */
+  struct Packet
+  {
+    const uint8_t* pData;
+    int iSize;
+    /// the packet comes from another encoder than the last one sent to the receiver, e.g. to be signalled with a new SSRC
+    bool bDiscontinuity;
+  };
+
+  /**
+   * @param frameDuration the frame duration of every stream: the inputs of encode() are one frame of this duration
+   */
+  ConferenceEncoder(int participants, int samplesPerSecond, int channels, uint32_t targetBitrateKbps,
+    OpusFrameDuration frameDuration = OpusFrameDuration::OFD_20_MS);
+
+  /**
+   * @brief Opens all encoders
+   * @return false if any of the encoders failed to open
+   */
+  bool open();
+  MixMinusMixer& getMixer() { return m_mixer; }
+  /**
+   * @brief Mixes and encodes one frame. ppInputs[i] points to one frame of 16 bit PCM of participant i.
+   * @return the number of encodes performed or -1 on error
+   */
+  int encode(const int16_t* const* ppInputs);
+  /**
+   * @brief the packet to send to receiver i for the last encoded frame
+   */
+  Packet getPacket(int receiver) const;
+  /**
+   * @brief the number of times receivers moved between encoders since the encoder was opened
+   */
+  uint64_t getEncoderSwitches() const { return m_uiEncoderSwitches; }
+
+private:
+  /// engine 0 encodes the shared full mix, engine i + 1 the mix-minus of participant i
+  int getEngineIndex(int receiver) const
+  {
+    return (m_mixer.getMixIndex(receiver) == MixMinusMixer::FULL_MIX) ? 0 : receiver + 1;
+  }
+
+  MixMinusMixer m_mixer;
+  int m_samplesPerSecond;
+  int m_channels;
+  uint32_t m_uiTargetBitrateKbps;
+  OpusFrameDuration m_eFrameDuration;
+  int m_maxPacketSize;
+  std::vector<std::unique_ptr<OpusEncodeEngine>> m_vEngines;
+  std::vector<std::vector<uint8_t>> m_vPackets;
+  std::vector<int> m_vPacketSizes;
+  /// the engine whose packet each receiver was sent last, -1 before the first packet
+  std::vector<int> m_vReceiverEngines;
+  /// whether the last packet of each receiver comes from another engine than the one before
+  std::vector<bool> m_vDiscontinuities;
+  uint64_t m_uiEncoderSwitches;
+};
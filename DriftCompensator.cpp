@@ -0,0 +1,212 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: DriftCompensator.cpp
+
+DESCRIPTION			: Clock drift compensation via adaptive asynchronous resampling
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "DriftCompensator.h"
+#include <algorithm>
+#include <cmath>
+
+// normalised cut-off of the interpolation filter: slightly below Nyquist to suppress imaging
+static const double CUTOFF = 0.95;
+static const double KAISER_BETA = 8.0;
+// controller gains: the error is in sample frames
+static const double PROPORTIONAL_GAIN = 2e-6;
+static const double INTEGRAL_GAIN = 2e-7;
+// weight of a new error measurement: the upstream timestamps are jittery
+static const double ERROR_SMOOTHING = 0.02;
+// limit of the correction
+static const double MAX_CORRECTION = 1000e-6;
+// time constant of the occupancy average in seconds: long against the sawtooth of the block and frame sizes
+static const double OCCUPANCY_TIME_CONSTANT = 10.0;
+// controller gains in occupancy mode, where the error is in seconds: whether a frame is taken by the sink just before
+// or just after a block arrives moves the average by up to a frame, so the loop settles over about 1000 s
+// (critically damped at 0.001 rad/s) to keep that from showing in the ratio
+static const double OCCUPANCY_PROPORTIONAL_GAIN = 1.4e-3;
+static const double OCCUPANCY_INTEGRAL_GAIN = 1e-6;
+
+static double besselI0(double x)
+{
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 30; ++k)
+  {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+AsyncResampler::AsyncResampler(int channels)
+  :m_iChannels(channels),
+  m_dStep(1.0),
+  m_dPos(HALF_TAPS - 1),
+  m_vTable((PHASES + 1) * TAPS)
+{
+  const double PI = 3.14159265358979323846;
+  const double dNorm = besselI0(KAISER_BETA);
+  for (int p = 0; p <= PHASES; ++p)
+  {
+    double dFrac = static_cast<double>(p) / PHASES;
+    for (int k = 0; k < TAPS; ++k)
+    {
+      // distance of tap k from the interpolated position
+      double t = (k - (HALF_TAPS - 1)) - dFrac;
+      double dSinc = (t == 0.0) ? 1.0 : std::sin(PI * CUTOFF * t) / (PI * CUTOFF * t);
+      double w = t / HALF_TAPS;
+      double dWindow = (std::fabs(w) < 1.0) ? besselI0(KAISER_BETA * std::sqrt(1.0 - w * w)) / dNorm : 0.0;
+      m_vTable[p * TAPS + k] = static_cast<float>(CUTOFF * dSinc * dWindow);
+    }
+  }
+  reset();
+}
+
+void AsyncResampler::reset()
+{
+  // start with silence as history so that the first output sample lines up with the first input sample
+  m_vWork.assign((HALF_TAPS - 1) * m_iChannels, 0.0f);
+  m_dPos = HALF_TAPS - 1;
+}
+
+int AsyncResampler::process(const int16_t* pIn, int iInFrames, std::vector<int16_t>& vOut)
+{
+  for (int i = 0; i < iInFrames * m_iChannels; ++i)
+  {
+    m_vWork.push_back(pIn[i]);
+  }
+  const int iAvailable = static_cast<int>(m_vWork.size()) / m_iChannels;
+  int iOut = 0;
+  // the filter needs HALF_TAPS samples after the position
+  while (m_dPos + HALF_TAPS < iAvailable)
+  {
+    int iPos = static_cast<int>(m_dPos);
+    double dPhase = (m_dPos - iPos) * PHASES;
+    int iPhase = static_cast<int>(dPhase);
+    float fWeight = static_cast<float>(dPhase - iPhase);
+    const float* pH0 = &m_vTable[iPhase * TAPS];
+    const float* pH1 = pH0 + TAPS;
+    const float* pX = &m_vWork[(iPos - (HALF_TAPS - 1)) * m_iChannels];
+    for (int c = 0; c < m_iChannels; ++c)
+    {
+      float fAcc = 0.0f;
+      for (int k = 0; k < TAPS; ++k)
+      {
+        float h = pH0[k] + fWeight * (pH1[k] - pH0[k]);
+        fAcc += h * pX[k * m_iChannels + c];
+      }
+      long lSample = std::lround(fAcc);
+      vOut.push_back(static_cast<int16_t>(std::min(std::max(lSample, -32768L), 32767L)));
+    }
+    m_dPos += m_dStep;
+    ++iOut;
+  }
+  // keep the history required for the next block
+  int iDiscard = static_cast<int>(m_dPos) - (HALF_TAPS - 1);
+  if (iDiscard > 0)
+  {
+    m_vWork.erase(m_vWork.begin(), m_vWork.begin() + iDiscard * m_iChannels);
+    m_dPos -= iDiscard;
+  }
+  return iOut;
+}
+
+DriftCompensator::DriftCompensator(int samplesPerSecond, int channels, Mode eMode)
+  :m_resampler(channels),
+  m_iSamplesPerSecond(samplesPerSecond),
+  m_eMode(eMode),
+  m_iTargetOccupancy(samplesPerSecond / 100)
+{
+  reset();
+}
+
+void DriftCompensator::reset()
+{
+  resync();
+  m_dIntegral = 0.0;
+  m_dOccupancy = -1.0;
+  m_iUnmeasured = 0;
+  m_resampler.setRatio(1.0);
+}
+
+void DriftCompensator::resync()
+{
+  m_resampler.reset();
+  m_tFirst = -1;
+  m_iProduced = 0;
+  m_dError = 0.0;
+}
+
+void DriftCompensator::process(const int16_t* pIn, int iInFrames, REFERENCE_TIME tStart, std::vector<int16_t>& vOut)
+{
+  const double dSeconds = static_cast<double>(iInFrames) / m_iSamplesPerSecond;
+  if (m_eMode == Mode::DC_TIMESTAMPS)
+  {
+    if (m_tFirst == -1) m_tFirst = tStart;
+    // the reference clock says this many sample frames should have been produced before this block
+    double dExpected = static_cast<double>(tStart - m_tFirst) * m_iSamplesPerSecond / 10000000.0;
+    update(dExpected - m_iProduced, dSeconds, PROPORTIONAL_GAIN, INTEGRAL_GAIN);
+  }
+  else
+  {
+    // a filling buffer means the source is fast: produce fewer samples
+    const double dError = m_dOccupancy >= 0.0 ? (m_iTargetOccupancy - m_dOccupancy) / m_iSamplesPerSecond : 0.0;
+    update(dError, dSeconds, OCCUPANCY_PROPORTIONAL_GAIN, OCCUPANCY_INTEGRAL_GAIN);
+  }
+  m_iProduced += m_resampler.process(pIn, iInFrames, vOut);
+  m_iUnmeasured += iInFrames;
+}
+
+void DriftCompensator::measureOccupancy(int iOccupancyFrames)
+{
+  // e.g. several reads without new input in between
+  if (m_iUnmeasured == 0) return;
+  const double dSeconds = static_cast<double>(m_iUnmeasured) / m_iSamplesPerSecond;
+  m_iUnmeasured = 0;
+  if (m_dOccupancy < 0.0)
+  {
+    m_dOccupancy = iOccupancyFrames;
+    return;
+  }
+  m_dOccupancy += (1.0 - std::exp(-dSeconds / OCCUPANCY_TIME_CONSTANT)) * (iOccupancyFrames - m_dOccupancy);
+}
+
+void DriftCompensator::update(double dError, double dSeconds, double dProportionalGain, double dIntegralGain)
+{
+  m_dError += ERROR_SMOOTHING * (dError - m_dError);
+  m_dIntegral += m_dError * dSeconds;
+  double dCorrection = dProportionalGain * m_dError + dIntegralGain * m_dIntegral;
+  // anti-windup: stop integrating while the correction is limited
+  if (std::fabs(dCorrection) > MAX_CORRECTION)
+  {
+    m_dIntegral -= m_dError * dSeconds;
+    dCorrection = std::min(std::max(dCorrection, -MAX_CORRECTION), MAX_CORRECTION);
+  }
+  m_resampler.setRatio(1.0 + dCorrection);
+}
@@ -0,0 +1,151 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: DriftCompensator.h
+
+DESCRIPTION			: Clock drift compensation via adaptive asynchronous resampling
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "AudioBuffer.h"
+
+/**
+ * @brief Asynchronous resampler for ratios close to 1.
+ *
+ * Windowed-sinc interpolation from a polyphase table with linear interpolation between phases. The read
+ * position is kept in double precision so that ratio changes well below one ppm take effect.
+ */
+class AsyncResampler
+{
+public:
+  explicit AsyncResampler(int channels);
+  /**
+   * @brief Sets the ratio of output to input samples
+   */
+  void setRatio(double dRatio) { m_dStep = 1.0 / dRatio; }
+  double getRatio() const { return 1.0 / m_dStep; }
+  /**
+   * @brief Resamples interleaved 16 bit PCM
+   * @param pIn The input samples
+   * @param iInFrames The number of input sample frames (samples per channel)
+   * @param vOut The output samples are appended to this vector
+   * @return the number of output sample frames
+   */
+  int process(const int16_t* pIn, int iInFrames, std::vector<int16_t>& vOut);
+  void reset();
+
+private:
+  static const int HALF_TAPS = 8;
+  static const int TAPS = 2 * HALF_TAPS;
+  static const int PHASES = 256;
+
+  int m_iChannels;
+  double m_dStep;
+  /// read position in m_vWork in sample frames
+  double m_dPos;
+  /// input history followed by the new input, interleaved
+  std::vector<float> m_vWork;
+  /// (PHASES + 1) x TAPS filter table
+  std::vector<float> m_vTable;
+};
+
+/**
+ * @brief Compensates the drift between the clock of the audio source and the reference clock.
+ *
+ * A PI controller steers the resampling ratio so that the number of produced samples follows either the
+ * upstream timestamps (which are stamped by the reference clock) or a target buffer occupancy. The occupancy is
+ * followed as a long-term average: with blocks and frames of different sizes the occupancy after the frames have
+ * been read is a sawtooth whose mean depends on their phase.
+ */
+class DriftCompensator
+{
+public:
+  enum class Mode
+  {
+    /// follow the slope of the upstream timestamps
+    DC_TIMESTAMPS,
+    /// keep the occupancy of the framing buffer at a target
+    DC_OCCUPANCY
+  };
+
+  DriftCompensator(int samplesPerSecond, int channels, Mode eMode);
+  /**
+   * @brief Resamples a block of interleaved 16 bit PCM and updates the controller
+   * @param pIn The input PCM
+   * @param iInFrames The number of sample frames
+   * @param tStart The upstream timestamp of the block, used in DC_TIMESTAMPS mode
+   * @param vOut The resampled PCM is appended to this vector
+   */
+  void process(const int16_t* pIn, int iInFrames, REFERENCE_TIME tStart, std::vector<int16_t>& vOut);
+  /**
+   * @brief Adds a measurement of the number of sample frames in the framing buffer, used in DC_OCCUPANCY mode.
+   * Measure after the frames that can be delivered have been read. The measurement is weighted with the input
+   * processed since the last one.
+   */
+  void measureOccupancy(int iOccupancyFrames);
+  /**
+   * @brief Restarts the controller
+   */
+  void reset();
+  /**
+   * @brief Re-anchors the timestamps after a discontinuity but keeps the learnt drift
+   */
+  void resync();
+  void setTargetOccupancy(int iFrames) { m_iTargetOccupancy = iFrames; }
+  int getTargetOccupancy() const { return m_iTargetOccupancy; }
+  /**
+   * @brief the long-term average of the occupancy in sample frames, -1 before the first measurement
+   */
+  double getAverageOccupancy() const { return m_dOccupancy; }
+  /**
+   * @brief the current correction in ppm: positive if samples are inserted
+   */
+  double getCorrectionPpm() const { return (m_resampler.getRatio() - 1.0) * 1e6; }
+
+private:
+  /// steers the ratio with the error in sample frames (timestamps) or seconds (occupancy)
+  void update(double dError, double dSeconds, double dProportionalGain, double dIntegralGain);
+
+  AsyncResampler m_resampler;
+  int m_iSamplesPerSecond;
+  Mode m_eMode;
+  int m_iTargetOccupancy;
+
+  REFERENCE_TIME m_tFirst;
+  /// sample frames produced since m_tFirst
+  int64_t m_iProduced;
+  /// smoothed error in sample frames (timestamps) or seconds (occupancy)
+  double m_dError;
+  double m_dIntegral;
+  /// long-term average of the occupancy in sample frames, -1 before the first measurement
+  double m_dOccupancy;
+  /// input sample frames processed since the last occupancy measurement
+  int64_t m_iUnmeasured;
+};
@@ -0,0 +1,336 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: EncodeTrace.cpp
+
+DESCRIPTION			: Binary record and replay trace of the encoder input
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "EncodeTrace.h"
+#include <cstring>
+
+static const char TRACE_MAGIC[4] = { 'O', 'P', 'T', 'R' };
+static const uint8_t TRACE_VERSION = 1;
+static const size_t TRACE_FILE_BUFFER = 1 << 20;
+
+static void writeVarint(std::vector<uint8_t>& vOut, uint64_t uiValue)
+{
+  while (uiValue >= 0x80)
+  {
+    vOut.push_back(static_cast<uint8_t>(uiValue | 0x80));
+    uiValue >>= 7;
+  }
+  vOut.push_back(static_cast<uint8_t>(uiValue));
+}
+
+static uint64_t zigzag(int64_t iValue)
+{
+  return (static_cast<uint64_t>(iValue) << 1) ^ static_cast<uint64_t>(iValue >> 63);
+}
+
+static int64_t unzigzag(uint64_t uiValue)
+{
+  return static_cast<int64_t>(uiValue >> 1) ^ -static_cast<int64_t>(uiValue & 1);
+}
+
+static void writeString(std::vector<uint8_t>& vOut, const char* szValue)
+{
+  size_t uiLength = strlen(szValue);
+  writeVarint(vOut, uiLength);
+  vOut.insert(vOut.end(), szValue, szValue + uiLength);
+}
+
+TraceRecorder::TraceRecorder()
+  :m_pFile(nullptr),
+  m_format{ 0, 0, 0, 0 },
+  m_bCompress(false),
+  m_tLastStart(0)
+{
+}
+
+TraceRecorder::~TraceRecorder()
+{
+  close();
+}
+
+bool TraceRecorder::open(const std::string& sPath, const TraceFormat& format, bool bCompress)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_pFile) fclose(m_pFile);
+  m_pFile = fopen(sPath.c_str(), "wb");
+  if (!m_pFile) return false;
+  setvbuf(m_pFile, nullptr, _IOFBF, TRACE_FILE_BUFFER);
+  m_format = format;
+  // delta encoding is only implemented for 16 bit PCM
+  m_bCompress = bCompress && format.bitsPerSample == 16;
+  m_tLastStart = 0;
+
+  m_vRecord.assign(TRACE_MAGIC, TRACE_MAGIC + sizeof(TRACE_MAGIC));
+  m_vRecord.push_back(TRACE_VERSION);
+  writeVarint(m_vRecord, format.samplesPerSecond);
+  writeVarint(m_vRecord, format.channels);
+  writeVarint(m_vRecord, format.bitsPerSample);
+  writeVarint(m_vRecord, format.targetBitrateKbps);
+  flushRecord();
+  return true;
+}
+
+void TraceRecorder::close()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_pFile) fclose(m_pFile);
+  m_pFile = nullptr;
+}
+
+void TraceRecorder::recordSample(const uint8_t* pData, uint32_t uiSize, REFERENCE_TIME tStart, REFERENCE_TIME tStop, uint32_t uiFlags)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!m_pFile) return;
+  m_vRecord.clear();
+  m_vRecord.push_back(static_cast<uint8_t>(TraceRecordType::TR_SAMPLE));
+  writeVarint(m_vRecord, uiFlags);
+  writeVarint(m_vRecord, zigzag(tStart - m_tLastStart));
+  writeVarint(m_vRecord, zigzag(tStop - tStart));
+  writeVarint(m_vRecord, uiSize);
+  m_tLastStart = tStart;
+
+  const size_t uiBlockAlign = m_format.channels * sizeof(int16_t);
+  if (m_bCompress && uiSize % uiBlockAlign == 0)
+  {
+    m_vPayload.clear();
+    const int16_t* pSamples = reinterpret_cast<const int16_t*>(pData);
+    const size_t uiSamples = uiSize / sizeof(int16_t);
+    // the predictor restarts with every sample so that records can be decoded independently
+    for (size_t i = 0; i < uiSamples; ++i)
+    {
+      int32_t iPrevious = (i >= m_format.channels) ? pSamples[i - m_format.channels] : 0;
+      writeVarint(m_vPayload, zigzag(pSamples[i] - iPrevious));
+    }
+    m_vRecord.push_back(static_cast<uint8_t>(TracePayloadEncoding::TP_DELTA));
+    writeVarint(m_vRecord, m_vPayload.size());
+    flushRecord();
+    fwrite(m_vPayload.data(), 1, m_vPayload.size(), m_pFile);
+  }
+  else
+  {
+    m_vRecord.push_back(static_cast<uint8_t>(TracePayloadEncoding::TP_RAW));
+    writeVarint(m_vRecord, uiSize);
+    flushRecord();
+    fwrite(pData, 1, uiSize, m_pFile);
+  }
+}
+
+void TraceRecorder::recordParameter(const char* szName, const char* szValue)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!m_pFile) return;
+  m_vRecord.clear();
+  m_vRecord.push_back(static_cast<uint8_t>(TraceRecordType::TR_PARAMETER));
+  writeString(m_vRecord, szName);
+  writeString(m_vRecord, szValue);
+  flushRecord();
+}
+
+void TraceRecorder::recordEvent(TraceRecordType eType)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!m_pFile) return;
+  m_vRecord.assign(1, static_cast<uint8_t>(eType));
+  flushRecord();
+  if (eType == TraceRecordType::TR_END_OF_STREAM) fflush(m_pFile);
+}
+
+void TraceRecorder::recordNewSegment(REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!m_pFile) return;
+  m_vRecord.assign(1, static_cast<uint8_t>(TraceRecordType::TR_NEW_SEGMENT));
+  writeVarint(m_vRecord, zigzag(tStart));
+  writeVarint(m_vRecord, zigzag(tStop));
+  flushRecord();
+}
+
+void TraceRecorder::flushRecord()
+{
+  fwrite(m_vRecord.data(), 1, m_vRecord.size(), m_pFile);
+}
+
+TraceReader::TraceReader()
+  :m_pFile(nullptr),
+  m_format{ 0, 0, 0, 0 },
+  m_tLastStart(0)
+{
+}
+
+TraceReader::~TraceReader()
+{
+  if (m_pFile) fclose(m_pFile);
+}
+
+bool TraceReader::open(const std::string& sPath)
+{
+  if (m_pFile) fclose(m_pFile);
+  m_pFile = fopen(sPath.c_str(), "rb");
+  if (!m_pFile)
+  {
+    m_sLastError = "Unable to open " + sPath;
+    return false;
+  }
+  setvbuf(m_pFile, nullptr, _IOFBF, TRACE_FILE_BUFFER);
+  char magic[sizeof(TRACE_MAGIC)];
+  uint64_t uiRate, uiChannels, uiBits, uiKbps;
+  if (fread(magic, 1, sizeof(magic), m_pFile) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+    fgetc(m_pFile) != TRACE_VERSION)
+  {
+    m_sLastError = sPath + " is not a version 1 encoder trace";
+    return false;
+  }
+  if (!readVarint(uiRate) || !readVarint(uiChannels) || !readVarint(uiBits) || !readVarint(uiKbps) || uiChannels == 0)
+  {
+    m_sLastError = "Truncated trace header";
+    return false;
+  }
+  m_format = { static_cast<uint32_t>(uiRate), static_cast<uint32_t>(uiChannels), static_cast<uint32_t>(uiBits), static_cast<uint32_t>(uiKbps) };
+  m_tLastStart = 0;
+  return true;
+}
+
+bool TraceReader::next(TraceRecord& record)
+{
+  int iType = fgetc(m_pFile);
+  if (iType == EOF) return false;
+  record.eType = static_cast<TraceRecordType>(iType);
+  switch (record.eType)
+  {
+  case TraceRecordType::TR_SAMPLE:
+  {
+    uint64_t uiFlags, uiStartDelta, uiDuration, uiSize, uiStoredSize;
+    int iEncoding;
+    if (!readVarint(uiFlags) || !readVarint(uiStartDelta) || !readVarint(uiDuration) || !readVarint(uiSize) ||
+      (iEncoding = fgetc(m_pFile)) == EOF || !readVarint(uiStoredSize) || !readBytes(m_vStored, uiStoredSize))
+    {
+      m_sLastError = "Truncated sample record";
+      return false;
+    }
+    record.uiFlags = static_cast<uint32_t>(uiFlags);
+    record.tStart = m_tLastStart + unzigzag(uiStartDelta);
+    record.tStop = record.tStart + unzigzag(uiDuration);
+    m_tLastStart = record.tStart;
+    if (static_cast<TracePayloadEncoding>(iEncoding) == TracePayloadEncoding::TP_RAW)
+    {
+      record.vData.swap(m_vStored);
+      return true;
+    }
+    // TP_DELTA
+    record.vData.resize(uiSize);
+    int16_t* pSamples = reinterpret_cast<int16_t*>(record.vData.data());
+    const size_t uiSamples = uiSize / sizeof(int16_t);
+    size_t uiPos = 0;
+    for (size_t i = 0; i < uiSamples; ++i)
+    {
+      uint64_t uiValue = 0;
+      int iShift = 0;
+      do
+      {
+        if (uiPos >= m_vStored.size() || iShift > 63)
+        {
+          m_sLastError = "Corrupt sample payload";
+          return false;
+        }
+        uiValue |= static_cast<uint64_t>(m_vStored[uiPos] & 0x7F) << iShift;
+        iShift += 7;
+      } while (m_vStored[uiPos++] & 0x80);
+      int32_t iPrevious = (i >= m_format.channels) ? pSamples[i - m_format.channels] : 0;
+      pSamples[i] = static_cast<int16_t>(iPrevious + unzigzag(uiValue));
+    }
+    return true;
+  }
+  case TraceRecordType::TR_PARAMETER:
+  {
+    uint64_t uiLength;
+    if (!readVarint(uiLength) || !readBytes(m_vStored, uiLength))
+    {
+      m_sLastError = "Truncated parameter record";
+      return false;
+    }
+    record.sName.assign(m_vStored.begin(), m_vStored.end());
+    if (!readVarint(uiLength) || !readBytes(m_vStored, uiLength))
+    {
+      m_sLastError = "Truncated parameter record";
+      return false;
+    }
+    record.sValue.assign(m_vStored.begin(), m_vStored.end());
+    return true;
+  }
+  case TraceRecordType::TR_NEW_SEGMENT:
+  {
+    int64_t iStart, iStop;
+    if (!readSignedVarint(iStart) || !readSignedVarint(iStop))
+    {
+      m_sLastError = "Truncated segment record";
+      return false;
+    }
+    record.tStart = iStart;
+    record.tStop = iStop;
+    return true;
+  }
+  case TraceRecordType::TR_END_OF_STREAM:
+  case TraceRecordType::TR_FLUSH:
+    return true;
+  default:
+    m_sLastError = "Unknown record type " + std::to_string(iType);
+    return false;
+  }
+}
+
+bool TraceReader::readVarint(uint64_t& uiValue)
+{
+  uiValue = 0;
+  for (int iShift = 0; iShift < 64; iShift += 7)
+  {
+    int c = fgetc(m_pFile);
+    if (c == EOF) return false;
+    uiValue |= static_cast<uint64_t>(c & 0x7F) << iShift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+bool TraceReader::readSignedVarint(int64_t& iValue)
+{
+  uint64_t uiValue;
+  if (!readVarint(uiValue)) return false;
+  iValue = unzigzag(uiValue);
+  return true;
+}
+
+bool TraceReader::readBytes(std::vector<uint8_t>& vData, size_t uiSize)
+{
+  vData.resize(uiSize);
+  return fread(vData.data(), 1, uiSize, m_pFile) == uiSize;
+}
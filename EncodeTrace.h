@@ -0,0 +1,154 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: EncodeTrace.h
+
+DESCRIPTION			: Binary record and replay trace of the encoder input
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "AudioBuffer.h"
+
+/**
+ * Trace file layout, version 1. Integers are little endian; varints are LEB128 and signed values are zigzag
+ * encoded before the varint encoding.
+ *
+ * Header: "OPTR" uint8 version, varint samplesPerSecond, varint channels, varint bitsPerSample,
+ *         varint targetBitrateKbps
+ * Records: uint8 type followed by
+ *   TR_SAMPLE:    varint flags (AM_SAMPLE_* of the media sample), signed varint start time delta to the
+ *                 previous sample, signed varint duration, varint size, varint payload encoding, varint
+ *                 stored size, stored bytes
+ *   TR_PARAMETER: varint name length, name, varint value length, value
+ *   TR_END_OF_STREAM, TR_FLUSH: no data
+ *   TR_NEW_SEGMENT: signed varint start, signed varint stop
+ * Payload encoding TP_RAW stores the PCM as is. TP_DELTA stores each 16 bit sample as the signed varint of
+ * its difference to the previous sample of the same channel: lossless, and typically a third smaller for speech
+ * and music.
+ */
+enum class TraceRecordType : uint8_t
+{
+  TR_SAMPLE = 1,
+  TR_PARAMETER = 2,
+  TR_END_OF_STREAM = 3,
+  TR_FLUSH = 4,
+  TR_NEW_SEGMENT = 5
+};
+
+enum class TracePayloadEncoding : uint8_t
+{
+  TP_RAW = 0,
+  TP_DELTA = 1
+};
+
+struct TraceFormat
+{
+  uint32_t samplesPerSecond;
+  uint32_t channels;
+  uint32_t bitsPerSample;
+  uint32_t targetBitrateKbps;
+};
+
+struct TraceRecord
+{
+  TraceRecordType eType;
+  uint32_t uiFlags;
+  REFERENCE_TIME tStart;
+  REFERENCE_TIME tStop;
+  /// decoded PCM of TR_SAMPLE
+  std::vector<uint8_t> vData;
+  std::string sName;
+  std::string sValue;
+};
+
+/**
+ * @brief Writes the encoder input to a trace file. All methods are thread-safe.
+ */
+class TraceRecorder
+{
+public:
+  TraceRecorder();
+  ~TraceRecorder();
+  /**
+   * @brief Starts a new trace file
+   * @param bCompress Delta encode 16 bit PCM
+   */
+  bool open(const std::string& sPath, const TraceFormat& format, bool bCompress);
+  void close();
+  bool isOpen() const { return m_pFile != nullptr; }
+  void recordSample(const uint8_t* pData, uint32_t uiSize, REFERENCE_TIME tStart, REFERENCE_TIME tStop, uint32_t uiFlags);
+  void recordParameter(const char* szName, const char* szValue);
+  void recordEvent(TraceRecordType eType);
+  void recordNewSegment(REFERENCE_TIME tStart, REFERENCE_TIME tStop);
+
+private:
+  void flushRecord();
+
+  std::mutex m_mutex;
+  FILE* m_pFile;
+  TraceFormat m_format;
+  bool m_bCompress;
+  REFERENCE_TIME m_tLastStart;
+  /// record being assembled
+  std::vector<uint8_t> m_vRecord;
+  std::vector<uint8_t> m_vPayload;
+};
+
+/**
+ * @brief Reads a trace written by TraceRecorder
+ */
+class TraceReader
+{
+public:
+  TraceReader();
+  ~TraceReader();
+  bool open(const std::string& sPath);
+  const TraceFormat& getFormat() const { return m_format; }
+  /**
+   * @brief Reads the next record
+   * @return false at the end of the file or if the file is corrupt, see getLastError()
+   */
+  bool next(TraceRecord& record);
+  const std::string& getLastError() const { return m_sLastError; }
+
+private:
+  bool readVarint(uint64_t& uiValue);
+  bool readSignedVarint(int64_t& iValue);
+  bool readBytes(std::vector<uint8_t>& vData, size_t uiSize);
+
+  FILE* m_pFile;
+  TraceFormat m_format;
+  REFERENCE_TIME m_tLastStart;
+  std::vector<uint8_t> m_vStored;
+  std::string m_sLastError;
+};
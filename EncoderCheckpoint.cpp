@@ -0,0 +1,392 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: EncoderCheckpoint.cpp
+
+DESCRIPTION			: Compact snapshot of the state of an encode engine for a hot standby
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "EncoderCheckpoint.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+static const char CHECKPOINT_MAGIC[4] = { 'O', 'P', 'C', 'K' };
+static const uint8_t CHECKPOINT_VERSION = 1;
+static const uint8_t PAYLOAD_RAW = 0;
+static const uint8_t PAYLOAD_DELTA = 1;
+
+static void writeVarint(std::vector<uint8_t>& vOut, uint64_t uiValue)
+{
+  while (uiValue >= 0x80)
+  {
+    vOut.push_back(static_cast<uint8_t>(uiValue | 0x80));
+    uiValue >>= 7;
+  }
+  vOut.push_back(static_cast<uint8_t>(uiValue));
+}
+
+static uint64_t zigzag(int64_t iValue)
+{
+  return (static_cast<uint64_t>(iValue) << 1) ^ static_cast<uint64_t>(iValue >> 63);
+}
+
+static int64_t unzigzag(uint64_t uiValue)
+{
+  return static_cast<int64_t>(uiValue >> 1) ^ -static_cast<int64_t>(uiValue & 1);
+}
+
+/**
+ * @brief Bounds checked reading of the checkpoint fields
+ */
+class CheckpointReader
+{
+public:
+  CheckpointReader(const uint8_t* pData, size_t uiSize)
+    :m_pData(pData),
+    m_uiSize(uiSize),
+    m_uiPos(0)
+  {
+  }
+
+  bool readByte(uint8_t& uiValue)
+  {
+    if (m_uiPos >= m_uiSize) return false;
+    uiValue = m_pData[m_uiPos++];
+    return true;
+  }
+
+  bool readVarint(uint64_t& uiValue)
+  {
+    uiValue = 0;
+    for (int iShift = 0; iShift < 64; iShift += 7)
+    {
+      uint8_t c;
+      if (!readByte(c)) return false;
+      uiValue |= static_cast<uint64_t>(c & 0x7F) << iShift;
+      if (!(c & 0x80)) return true;
+    }
+    return false;
+  }
+
+  bool readSignedVarint(int64_t& iValue)
+  {
+    uint64_t uiValue;
+    if (!readVarint(uiValue)) return false;
+    iValue = unzigzag(uiValue);
+    return true;
+  }
+
+  const uint8_t* readBytes(size_t uiSize)
+  {
+    if (uiSize > m_uiSize - m_uiPos) return nullptr;
+    const uint8_t* p = m_pData + m_uiPos;
+    m_uiPos += uiSize;
+    return p;
+  }
+
+private:
+  const uint8_t* m_pData;
+  size_t m_uiSize;
+  size_t m_uiPos;
+};
+
+/// appends the audio, delta encoded if it is whole blocks of 16 bit PCM and that makes it smaller
+static void writeAudio(std::vector<uint8_t>& vOut, const std::vector<uint8_t>& vAudio, uint32_t uiChannels, uint32_t uiBitsPerSample)
+{
+  writeVarint(vOut, vAudio.size());
+  const size_t uiBlockAlign = uiChannels * sizeof(int16_t);
+  std::vector<uint8_t> vPayload;
+  if (uiBitsPerSample == 16 && uiChannels > 0 && vAudio.size() % uiBlockAlign == 0)
+  {
+    vPayload.reserve(vAudio.size());
+    const size_t uiSamples = vAudio.size() / sizeof(int16_t);
+    for (size_t i = 0; i < uiSamples; ++i)
+    {
+      int16_t iSample, iPrevious = 0;
+      memcpy(&iSample, &vAudio[i * sizeof(int16_t)], sizeof(int16_t));
+      if (i >= uiChannels) memcpy(&iPrevious, &vAudio[(i - uiChannels) * sizeof(int16_t)], sizeof(int16_t));
+      writeVarint(vPayload, zigzag(static_cast<int32_t>(iSample) - iPrevious));
+    }
+  }
+  // loud high frequencies and noise take up to three bytes per sample
+  if (vPayload.empty() || vPayload.size() >= vAudio.size())
+  {
+    vOut.push_back(PAYLOAD_RAW);
+    writeVarint(vOut, vAudio.size());
+    vOut.insert(vOut.end(), vAudio.begin(), vAudio.end());
+    return;
+  }
+  vOut.push_back(PAYLOAD_DELTA);
+  writeVarint(vOut, vPayload.size());
+  vOut.insert(vOut.end(), vPayload.begin(), vPayload.end());
+}
+
+static bool readAudio(CheckpointReader& reader, std::vector<uint8_t>& vAudio, uint32_t uiChannels)
+{
+  uint64_t uiSize, uiStoredSize;
+  uint8_t uiEncoding;
+  const uint8_t* pStored;
+  if (!reader.readVarint(uiSize) || !reader.readByte(uiEncoding) || !reader.readVarint(uiStoredSize) ||
+    !(pStored = reader.readBytes(uiStoredSize)) || uiSize > static_cast<uint64_t>(AUDIO_BUFFER_SIZE))
+  {
+    return false;
+  }
+  if (uiEncoding == PAYLOAD_RAW)
+  {
+    if (uiStoredSize != uiSize) return false;
+    vAudio.assign(pStored, pStored + uiStoredSize);
+    return true;
+  }
+  if (uiEncoding != PAYLOAD_DELTA || uiSize % sizeof(int16_t) != 0) return false;
+  vAudio.resize(uiSize);
+  CheckpointReader payload(pStored, uiStoredSize);
+  const size_t uiSamples = uiSize / sizeof(int16_t);
+  for (size_t i = 0; i < uiSamples; ++i)
+  {
+    int64_t iDelta;
+    if (!payload.readSignedVarint(iDelta)) return false;
+    int16_t iPrevious = 0;
+    if (i >= uiChannels) memcpy(&iPrevious, &vAudio[(i - uiChannels) * sizeof(int16_t)], sizeof(int16_t));
+    const int16_t iSample = static_cast<int16_t>(iPrevious + iDelta);
+    memcpy(&vAudio[i * sizeof(int16_t)], &iSample, sizeof(int16_t));
+  }
+  return true;
+}
+
+void EncoderCheckpoint::serialize(std::vector<uint8_t>& vOut) const
+{
+  vOut.insert(vOut.end(), CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + sizeof(CHECKPOINT_MAGIC));
+  vOut.push_back(CHECKPOINT_VERSION);
+  writeVarint(vOut, samplesPerSecond);
+  writeVarint(vOut, channels);
+  writeVarint(vOut, bitsPerSample);
+  writeVarint(vOut, targetBitrateKbps);
+  vOut.push_back(static_cast<uint8_t>(frameDuration));
+  writeVarint(vOut, packetSequenceNumber);
+  writeVarint(vOut, framesEncoded);
+  writeVarint(vOut, zigzag(clock.tStart));
+  writeVarint(vOut, zigzag(clock.tStop));
+  writeVarint(vOut, clock.vResync.size());
+  for (const ResyncPoint& resync : clock.vResync)
+  {
+    writeVarint(vOut, static_cast<uint64_t>(resync.bytes));
+    writeVarint(vOut, zigzag(resync.tStart));
+  }
+  vOut.push_back(clock.discontinuity ? 1 : 0);
+  writeAudio(vOut, vBuffered, channels, bitsPerSample);
+  writeAudio(vOut, vHistory, channels, bitsPerSample);
+}
+
+bool EncoderCheckpoint::parse(const uint8_t* pData, size_t uiSize, std::string& sError)
+{
+  CheckpointReader reader(pData, uiSize);
+  const uint8_t* pMagic = reader.readBytes(sizeof(CHECKPOINT_MAGIC));
+  uint8_t uiVersion;
+  if (!pMagic || memcmp(pMagic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 || !reader.readByte(uiVersion) ||
+    uiVersion != CHECKPOINT_VERSION)
+  {
+    sError = "Not a version 1 encoder checkpoint";
+    return false;
+  }
+  uint64_t uiRate, uiChannels, uiBits, uiKbps, uiSequence, uiFrames;
+  uint8_t uiFrameDuration, uiDiscontinuity;
+  uint64_t uiResyncCount;
+  int64_t iStart, iStop;
+  if (!reader.readVarint(uiRate) || !reader.readVarint(uiChannels) || !reader.readVarint(uiBits) || !reader.readVarint(uiKbps) ||
+    !reader.readByte(uiFrameDuration) || !reader.readVarint(uiSequence) || !reader.readVarint(uiFrames) ||
+    !reader.readSignedVarint(iStart) || !reader.readSignedVarint(iStop) || !reader.readVarint(uiResyncCount))
+  {
+    sError = "Truncated checkpoint header";
+    return false;
+  }
+  // every pending segment starts at a different frame of the buffered audio
+  std::vector<ResyncPoint> vResync;
+  bool bCorrupt = uiResyncCount > static_cast<uint64_t>(AUDIO_BUFFER_SIZE);
+  for (uint64_t i = 0; i < uiResyncCount && !bCorrupt; ++i)
+  {
+    uint64_t uiBytes;
+    int64_t iResync;
+    if (!reader.readVarint(uiBytes) || !reader.readSignedVarint(iResync))
+    {
+      sError = "Truncated checkpoint header";
+      return false;
+    }
+    bCorrupt = uiBytes > static_cast<uint64_t>(AUDIO_BUFFER_SIZE);
+    vResync.push_back({ static_cast<int>(uiBytes), iResync });
+  }
+  if (!bCorrupt && !reader.readByte(uiDiscontinuity))
+  {
+    sError = "Truncated checkpoint header";
+    return false;
+  }
+  if (bCorrupt || uiChannels == 0 || uiChannels > 255 || uiFrameDuration > static_cast<uint8_t>(OpusFrameDuration::OFD_60_MS))
+  {
+    sError = "Corrupt checkpoint header";
+    return false;
+  }
+  samplesPerSecond = static_cast<uint32_t>(uiRate);
+  channels = static_cast<uint32_t>(uiChannels);
+  bitsPerSample = static_cast<uint32_t>(uiBits);
+  targetBitrateKbps = static_cast<uint32_t>(uiKbps);
+  frameDuration = static_cast<OpusFrameDuration>(uiFrameDuration);
+  packetSequenceNumber = uiSequence;
+  framesEncoded = uiFrames;
+  clock = { iStart, iStop, std::move(vResync), uiDiscontinuity != 0 };
+  if (!readAudio(reader, vBuffered, channels) || !readAudio(reader, vHistory, channels))
+  {
+    sError = "Corrupt checkpoint audio";
+    return false;
+  }
+  return true;
+}
+
+bool EncoderCheckpoint::writeFile(const std::string& sPath, const std::vector<uint8_t>& vData)
+{
+  const std::string sTemporary = sPath + ".tmp";
+  FILE* pFile = fopen(sTemporary.c_str(), "wb");
+  if (!pFile) return false;
+  const bool bWritten = fwrite(vData.data(), 1, vData.size(), pFile) == vData.size();
+  if (fclose(pFile) != 0 || !bWritten)
+  {
+    remove(sTemporary.c_str());
+    return false;
+  }
+#ifdef _WIN32
+  // rename doesn't replace an existing file on Windows
+  return MoveFileExA(sTemporary.c_str(), sPath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  return rename(sTemporary.c_str(), sPath.c_str()) == 0;
+#endif
+}
+
+bool EncoderCheckpoint::readFile(const std::string& sPath, std::vector<uint8_t>& vData)
+{
+  FILE* pFile = fopen(sPath.c_str(), "rb");
+  if (!pFile) return false;
+  vData.clear();
+  uint8_t buffer[16384];
+  size_t uiRead;
+  while ((uiRead = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+  {
+    vData.insert(vData.end(), buffer, buffer + uiRead);
+  }
+  const bool bError = ferror(pFile) != 0;
+  fclose(pFile);
+  return !bError;
+}
+
+CheckpointWriter::CheckpointWriter()
+  :m_bPending(false),
+  m_bRunning(false),
+  m_stats()
+{
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+  stop();
+}
+
+void CheckpointWriter::start(const std::string& sPath)
+{
+  stop();
+  m_sPath = sPath;
+  m_bPending = false;
+  m_bRunning = true;
+  m_stats = Stats();
+  m_worker = std::thread(&CheckpointWriter::run, this);
+}
+
+void CheckpointWriter::stop()
+{
+  if (!m_worker.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_bRunning = false;
+  }
+  m_cond.notify_all();
+  m_worker.join();
+}
+
+std::vector<uint8_t>* CheckpointWriter::getSpareBuffer()
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  if (m_bPending)
+  {
+    ++m_stats.dropped;
+    return nullptr;
+  }
+  m_vSpare.clear();
+  return &m_vSpare;
+}
+
+void CheckpointWriter::submit()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_bRunning || m_bPending) return;
+    m_vSpare.swap(m_vPending);
+    m_bPending = true;
+  }
+  m_cond.notify_one();
+}
+
+CheckpointWriter::Stats CheckpointWriter::getStats() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  return m_stats;
+}
+
+void CheckpointWriter::run()
+{
+  std::unique_lock<std::mutex> lock(m_lock);
+  while (true)
+  {
+    // the checkpoint submitted last is written before stopping so that the file is as recent as possible
+    m_cond.wait(lock, [this] { return !m_bRunning || m_bPending; });
+    if (!m_bPending) break;
+    lock.unlock();
+    auto tStart = std::chrono::steady_clock::now();
+    // a failed write leaves the previous checkpoint in place: the standby continues from further back
+    const bool bWritten = EncoderCheckpoint::writeFile(m_sPath, m_vPending);
+    const uint32_t uiWriteUs = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count());
+    lock.lock();
+    if (bWritten)
+    {
+      ++m_stats.written;
+      m_stats.bytes = static_cast<uint32_t>(m_vPending.size());
+      m_stats.writeUs = uiWriteUs;
+    }
+    else
+    {
+      ++m_stats.failed;
+    }
+    m_bPending = false;
+  }
+}
@@ -0,0 +1,147 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: EncoderCheckpoint.h
+
+DESCRIPTION			: Compact snapshot of the state of an encode engine for a hot standby
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "AudioBuffer.h"
+
+/**
+ * Checkpoint layout, version 1. Varints are LEB128 and signed values are zigzag encoded, as in the encoder trace.
+ *
+ * "OPCK" uint8 version, varint samplesPerSecond, varint channels, varint bitsPerSample, varint targetBitrateKbps,
+ * uint8 frame duration (OpusFrameDuration), varint packet sequence number, varint frames encoded,
+ * signed varint clock start, signed varint clock stop, varint number of pending segment starts, each as varint unread
+ * bytes before the segment and signed varint segment start time, uint8 discontinuity, followed by the buffered audio
+ * and the history, each as varint size, uint8 payload encoding, varint stored size, stored bytes. The payload encodings
+ * are those of the trace: 0 stores the PCM as is, 1 stores each 16 bit sample as the signed varint of its difference
+ * to the previous sample of the same channel. The smaller of the two is stored.
+ */
+struct EncoderCheckpoint
+{
+  uint32_t samplesPerSecond;
+  uint32_t channels;
+  uint32_t bitsPerSample;
+  uint32_t targetBitrateKbps;
+  /// the frame duration of the framing buffer, which the governor or the adaptation may have changed
+  OpusFrameDuration frameDuration;
+  /// of the next packet published by OpusEncodeEngine::encodeAndPublish
+  uint64_t packetSequenceNumber;
+  uint64_t framesEncoded;
+  AudioClockState clock;
+  /// the audio of the framing buffer that hasn't been encoded yet
+  std::vector<uint8_t> vBuffered;
+  /// the most recently encoded input, oldest first, which a standby encodes to bring its codec into step
+  std::vector<uint8_t> vHistory;
+
+  /**
+   * @brief Appends the checkpoint to vOut
+   */
+  void serialize(std::vector<uint8_t>& vOut) const;
+  /**
+   * @brief Reads a checkpoint written by serialize
+   * @return false if the data is not a complete version 1 checkpoint, see sError
+   */
+  bool parse(const uint8_t* pData, size_t uiSize, std::string& sError);
+  /**
+   * @brief Replaces sPath with the data by renaming a temporary file so that a standby never reads a partial checkpoint
+   */
+  static bool writeFile(const std::string& sPath, const std::vector<uint8_t>& vData);
+  static bool readFile(const std::string& sPath, std::vector<uint8_t>& vData);
+};
+
+/**
+ * @brief Replaces a checkpoint file on a worker thread so that a slow disk never stalls the streaming thread.
+ *
+ * Double-buffered: the streaming thread serializes into the spare buffer while the worker writes the other one.
+ * A checkpoint that falls due while the previous one is still being written is dropped rather than queued: the
+ * standby only ever needs the latest one. The buffers keep their capacity, so steady-state checkpoints don't allocate.
+ */
+class CheckpointWriter
+{
+public:
+  struct Stats
+  {
+    uint32_t written;
+    /// checkpoints skipped because the previous one was still being written
+    uint32_t dropped;
+    uint32_t failed;
+    /// size and file replacement time of the last checkpoint written
+    uint32_t bytes;
+    uint32_t writeUs;
+  };
+
+  CheckpointWriter();
+  ~CheckpointWriter();
+  /**
+   * @brief Starts the worker thread, which replaces sPath with every checkpoint submitted
+   */
+  void start(const std::string& sPath);
+  /**
+   * @brief Waits for the checkpoint being written and stops the worker thread
+   */
+  void stop();
+  bool isRunning() const { return m_worker.joinable(); }
+  /**
+   * @brief The buffer to serialize the next checkpoint into, to be handed over with submit()
+   * @return null if the previous checkpoint is still being written, in which case the checkpoint counts as dropped
+   */
+  std::vector<uint8_t>* getSpareBuffer();
+  /**
+   * @brief Hands the spare buffer to the worker thread
+   */
+  void submit();
+  Stats getStats() const;
+
+private:
+  CheckpointWriter(const CheckpointWriter&) = delete;
+  CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+  void run();
+
+  std::string m_sPath;
+  mutable std::mutex m_lock;
+  std::condition_variable m_cond;
+  /// only touched by the streaming thread
+  std::vector<uint8_t> m_vSpare;
+  /// owned by the worker while m_bPending is set
+  std::vector<uint8_t> m_vPending;
+  bool m_bPending;
+  bool m_bRunning;
+  Stats m_stats;
+  std::thread m_worker;
+};
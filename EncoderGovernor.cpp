@@ -0,0 +1,234 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: EncoderGovernor.cpp
+
+DESCRIPTION			: Process-wide CPU budget governor for all encoder instances
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "EncoderGovernor.h"
+#include <algorithm>
+#include <cmath>
+
+// degradation levels: complexity is lowered first since it is the cheapest knob in terms of latency. The complexity
+// is the reduction from the configured complexity.
+static const EncoderGovernor::Adaptation LEVELS[] =
+{
+  { 0, OpusFrameDuration::OFD_2_5_MS },
+  { 2, OpusFrameDuration::OFD_2_5_MS },
+  { 4, OpusFrameDuration::OFD_2_5_MS },
+  { 6, OpusFrameDuration::OFD_2_5_MS },
+  { 8, OpusFrameDuration::OFD_2_5_MS },
+  { 8, OpusFrameDuration::OFD_40_MS },
+  { 8, OpusFrameDuration::OFD_60_MS }
+};
+static const int LEVEL_COUNT = sizeof(LEVELS) / sizeof(LEVELS[0]);
+// the complexity is not lowered below this unless the stream is configured lower
+static const uint32_t MIN_COMPLEXITY = 2;
+
+// degrade above this fraction of the budget
+static const double HIGH_WATERMARK = 0.9;
+// restore below this fraction of the budget
+static const double LOW_WATERMARK = 0.7;
+// number of evaluations the load has to stay below the low watermark before restoring a level
+static const int RESTORE_HOLDOFF = 10;
+static const std::chrono::milliseconds EVALUATION_INTERVAL(100);
+// time constant of the smoothed load, independent of the frame duration
+static const double LOAD_TIME_CONSTANT_MS = 400.0;
+// about three time constants: the smoothed load has moved 95% of the way to the effect of a level change
+static const std::chrono::milliseconds LEVEL_CHANGE_HOLDOFF(1200);
+// the load of a stream that hasn't reported for this long is dropped, e.g. a paused or stopped stream
+static const std::chrono::milliseconds STALE_LOAD_TIMEOUT(1000);
+
+EncoderGovernor& EncoderGovernor::instance()
+{
+  static EncoderGovernor governor;
+  return governor;
+}
+
+EncoderGovernor::EncoderGovernor()
+  :m_iNextId(0),
+  m_uiBudgetPercent(0),
+  m_tNextEvaluation(std::chrono::steady_clock::now()),
+  m_tHoldUntil(m_tNextEvaluation),
+  m_iEvaluationsBelowLowWatermark(0)
+{
+}
+
+int EncoderGovernor::registerStream(uint32_t uiPriority)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  int id = m_iNextId++;
+  m_mStreams[id] = std::make_shared<Stream>(uiPriority);
+  return id;
+}
+
+void EncoderGovernor::unregisterStream(int id)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_mStreams.erase(id);
+}
+
+void EncoderGovernor::setPriority(int id, uint32_t uiPriority)
+{
+  std::shared_ptr<Stream> pStream = findStream(id);
+  if (pStream) pStream->priority = uiPriority;
+}
+
+void EncoderGovernor::setBudgetPercent(uint32_t uiBudgetPercent)
+{
+  m_uiBudgetPercent = uiBudgetPercent;
+  if (uiBudgetPercent == 0)
+  {
+    // governor disabled: restore all streams
+    std::lock_guard<std::mutex> lock(m_lock);
+    for (auto& it : m_mStreams)
+    {
+      it.second->level = 0;
+    }
+  }
+}
+
+std::shared_ptr<EncoderGovernor::Stream> EncoderGovernor::findStream(int id) const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_mStreams.find(id);
+  return (it != m_mStreams.end()) ? it->second : std::shared_ptr<Stream>();
+}
+
+void EncoderGovernor::reportEncode(int id, double dEncodeMs, double dFrameDurationMs)
+{
+  if (m_uiBudgetPercent == 0 || dFrameDurationMs <= 0.0) return;
+
+  std::unique_lock<std::mutex> lock(m_lock, std::try_to_lock);
+  // another stream is updating the governor: it is fine to miss a measurement
+  if (!lock.owns_lock()) return;
+
+  auto it = m_mStreams.find(id);
+  if (it == m_mStreams.end()) return;
+  Stream& stream = *it->second;
+  double dLoad = dEncodeMs / dFrameDurationMs;
+  double dSmoothing = 1.0 - exp(-dFrameDurationMs / LOAD_TIME_CONSTANT_MS);
+  stream.load = stream.load + dSmoothing * (dLoad - stream.load);
+
+  auto tNow = std::chrono::steady_clock::now();
+  stream.lastReport = tNow;
+  if (tNow >= m_tNextEvaluation)
+  {
+    m_tNextEvaluation = tNow + EVALUATION_INTERVAL;
+    evaluate(tNow);
+  }
+}
+
+void EncoderGovernor::evaluate(std::chrono::steady_clock::time_point tNow)
+{
+  double dBudget = m_uiBudgetPercent / 100.0;
+  double dTotal = 0.0;
+  for (auto& it : m_mStreams)
+  {
+    if (tNow - it.second->lastReport > STALE_LOAD_TIMEOUT) it.second->load = 0.0;
+    dTotal += it.second->load;
+  }
+  if (tNow < m_tHoldUntil) return;
+
+  if (dTotal > dBudget * HIGH_WATERMARK)
+  {
+    m_iEvaluationsBelowLowWatermark = 0;
+    // degrade the lowest priority stream that can still be degraded
+    Stream* pVictim = nullptr;
+    for (auto& it : m_mStreams)
+    {
+      Stream* pStream = it.second.get();
+      // degrading a stream that doesn't encode frees nothing
+      if (pStream->level >= LEVEL_COUNT - 1 || tNow - pStream->lastReport > STALE_LOAD_TIMEOUT) continue;
+      if (!pVictim || pStream->priority < pVictim->priority ||
+        (pStream->priority == pVictim->priority && pStream->level < pVictim->level))
+      {
+        pVictim = pStream;
+      }
+    }
+    if (pVictim)
+    {
+      ++pVictim->level;
+      m_tHoldUntil = tNow + LEVEL_CHANGE_HOLDOFF;
+    }
+  }
+  else if (dTotal < dBudget * LOW_WATERMARK)
+  {
+    if (++m_iEvaluationsBelowLowWatermark < RESTORE_HOLDOFF) return;
+    m_iEvaluationsBelowLowWatermark = 0;
+    // restore the highest priority degraded stream
+    Stream* pCandidate = nullptr;
+    for (auto& it : m_mStreams)
+    {
+      Stream* pStream = it.second.get();
+      if (pStream->level == 0) continue;
+      if (!pCandidate || pStream->priority > pCandidate->priority ||
+        (pStream->priority == pCandidate->priority && pStream->level > pCandidate->level))
+      {
+        pCandidate = pStream;
+      }
+    }
+    if (pCandidate)
+    {
+      --pCandidate->level;
+      m_tHoldUntil = tNow + LEVEL_CHANGE_HOLDOFF;
+    }
+  }
+  else
+  {
+    m_iEvaluationsBelowLowWatermark = 0;
+  }
+}
+
+std::shared_ptr<const std::atomic<int>> EncoderGovernor::getLevel(int id) const
+{
+  std::shared_ptr<Stream> pStream = findStream(id);
+  if (!pStream) return std::shared_ptr<const std::atomic<int>>();
+  // shares the ownership of the stream
+  return std::shared_ptr<const std::atomic<int>>(pStream, &pStream->level);
+}
+
+EncoderGovernor::Adaptation EncoderGovernor::getAdaptation(int iLevel, uint32_t uiComplexity)
+{
+  const Adaptation& level = LEVELS[std::min(std::max(iLevel, 0), LEVEL_COUNT - 1)];
+  const uint32_t uiFloor = std::min(uiComplexity, MIN_COMPLEXITY);
+  Adaptation adaptation = { uiComplexity > level.complexity + uiFloor ? uiComplexity - level.complexity : uiFloor, level.minFrameDuration };
+  return adaptation;
+}
+
+double EncoderGovernor::getLoadPercent() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  double dTotal = 0.0;
+  for (auto& it : m_mStreams)
+  {
+    dTotal += it.second->load;
+  }
+  return dTotal * 100.0;
+}
@@ -0,0 +1,136 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: EncoderGovernor.h
+
+DESCRIPTION			: Process-wide CPU budget governor for all encoder instances
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "AudioBuffer.h"
+
+/**
+ * @brief Process-wide governor that keeps the total encode cost of all streams within a CPU budget.
+ *
+ * Every stream reports the wall-clock cost of each encode. The cost is normalised by the frame duration
+ * so that the load of a stream is the fraction of a core it consumes. When the total load exceeds the
+ * budget the lowest-priority streams are degraded one level at a time: first the encoder complexity is
+ * lowered relative to the complexity the stream is configured with, then the frame duration is stretched.
+ * Streams are restored highest-priority first once the load has stayed below the low watermark for a number
+ * of evaluations (hysteresis). After every change of a level the governor waits for the smoothed load to
+ * reflect it before it changes another one. Streams that stop reporting, e.g. because they are paused, no
+ * longer count towards the load.
+ * A budget of 0 disables the governor.
+ *
+ * The level of a stream is an atomic that the stream polls at every frame without taking the lock, see getLevel.
+ */
+class EncoderGovernor
+{
+public:
+  /**
+   * @brief the encoder settings that a stream should use
+   */
+  struct Adaptation
+  {
+    uint32_t complexity;
+    /// the minimum frame duration the stream should use
+    OpusFrameDuration minFrameDuration;
+  };
+
+  static EncoderGovernor& instance();
+
+  /**
+   * @brief Registers a stream. Higher priorities are degraded last.
+   * @return the stream id
+   */
+  int registerStream(uint32_t uiPriority);
+  void unregisterStream(int id);
+  void setPriority(int id, uint32_t uiPriority);
+  /**
+   * @brief Sets the process-wide budget in percent of a core (e.g. 400 = 4 cores). 0 disables the governor.
+   */
+  void setBudgetPercent(uint32_t uiBudgetPercent);
+  uint32_t getBudgetPercent() const { return m_uiBudgetPercent.load(); }
+  /**
+   * @brief Reports the cost of one encode
+   * @param id The stream id
+   * @param dEncodeMs The time spent encoding the frame
+   * @param dFrameDurationMs The duration of the encoded frame
+   */
+  void reportEncode(int id, double dEncodeMs, double dFrameDurationMs);
+  /**
+   * @brief the degradation level of a stream, which the stream can poll without taking the lock of the governor.
+   * The level stays valid after the stream has been unregistered.
+   */
+  std::shared_ptr<const std::atomic<int>> getLevel(int id) const;
+  /**
+   * @brief the settings of a degradation level for a stream that is configured with uiComplexity
+   */
+  static Adaptation getAdaptation(int iLevel, uint32_t uiComplexity);
+  /**
+   * @brief total load of all streams in percent of a core
+   */
+  double getLoadPercent() const;
+
+private:
+  struct Stream
+  {
+    Stream(uint32_t uiPriority) :priority(uiPriority), load(0.0), level(0), lastReport(std::chrono::steady_clock::now()) {}
+    std::atomic<uint32_t> priority;
+    /// smoothed fraction of a core used by the stream
+    std::atomic<double> load;
+    /// index into the degradation levels: 0 is full quality
+    std::atomic<int> level;
+    /// when the stream last reported an encode, guarded by m_lock
+    std::chrono::steady_clock::time_point lastReport;
+  };
+
+  EncoderGovernor();
+  EncoderGovernor(const EncoderGovernor&) = delete;
+  EncoderGovernor& operator=(const EncoderGovernor&) = delete;
+
+  /// must be called with m_lock held
+  void evaluate(std::chrono::steady_clock::time_point tNow);
+  std::shared_ptr<Stream> findStream(int id) const;
+
+  mutable std::mutex m_lock;
+  std::map<int, std::shared_ptr<Stream>> m_mStreams;
+  int m_iNextId;
+  std::atomic<uint32_t> m_uiBudgetPercent;
+  std::chrono::steady_clock::time_point m_tNextEvaluation;
+  /// no level is changed before the smoothed load reflects the last change
+  std::chrono::steady_clock::time_point m_tHoldUntil;
+  /// number of consecutive evaluations below the low watermark
+  int m_iEvaluationsBelowLowWatermark;
+};
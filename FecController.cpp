@@ -0,0 +1,163 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: FecController.cpp
+
+DESCRIPTION			: Adapts the Opus in-band FEC to the packet loss reported by the receiver
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "FecController.h"
+#include <algorithm>
+#include <cmath>
+
+/// weight of a report above the estimate
+static const double LOSS_ATTACK = 0.5;
+/// weight of a report below the estimate
+static const double LOSS_DECAY = 0.1;
+/// hysteresis of the FEC, in recoverable loss
+static const double FEC_ON_LOSS = 0.01;
+static const double FEC_OFF_LOSS = 0.005;
+/// headroom on the expected loss, the estimate lags the link
+static const double LOSS_MARGIN = 1.25;
+static const uint32_t MAX_EXPECTED_LOSS_PERCENT = 30;
+/// the LBRR frames cost roughly this share of the bitrate at the lowest expected loss, growing with it
+static const double BASE_FEC_SHARE = 0.1;
+static const double FEC_SHARE_PER_PERCENT = 0.015;
+static const double MAX_FEC_SHARE = 0.4;
+/// the payload is not starved below this, it needs at least wideband SILK quality to be worth protecting
+static const double MIN_PAYLOAD_KBPS = 12.0;
+
+FecController::FecController()
+  :m_eMode(Mode::FM_OFF),
+  m_uiFixedLossPercent(0),
+  m_uiTargetBitrateKbps(0),
+  m_uiReports(0),
+  m_dLoss(0.0),
+  m_dMeanBurstLength(1.0),
+  m_bFec(false),
+  m_decision()
+{
+}
+
+void FecController::setMode(Mode eMode, uint32_t uiFixedLossPercent)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_eMode = eMode;
+  m_uiFixedLossPercent = std::min(uiFixedLossPercent, 100u);
+}
+
+void FecController::setTargetBitrate(uint32_t uiKbps)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_uiTargetBitrateKbps = uiKbps;
+}
+
+void FecController::reportLoss(double dLossFraction, double dMeanBurstLength)
+{
+  dLossFraction = std::min(std::max(dLossFraction, 0.0), 1.0);
+  dMeanBurstLength = std::max(dMeanBurstLength, 1.0);
+  std::lock_guard<std::mutex> lock(m_lock);
+  if (m_uiReports++ == 0)
+  {
+    m_dLoss = dLossFraction;
+    m_dMeanBurstLength = dMeanBurstLength;
+    return;
+  }
+  m_dLoss += (dLossFraction > m_dLoss ? LOSS_ATTACK : LOSS_DECAY) * (dLossFraction - m_dLoss);
+  m_dMeanBurstLength += LOSS_DECAY * (dMeanBurstLength - m_dMeanBurstLength);
+}
+
+FecController::Decision FecController::decide()
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  switch (m_eMode)
+  {
+  case Mode::FM_OFF:
+    m_bFec = false;
+    m_decision = split(0);
+    break;
+  case Mode::FM_FIXED:
+    m_bFec = true;
+    m_decision = split(m_uiFixedLossPercent);
+    break;
+  case Mode::FM_ADAPTIVE:
+  {
+    // only the last packet of a burst can be recovered, from the packet that follows it
+    const double dRecoverable = m_dLoss / m_dMeanBurstLength;
+    m_bFec = m_bFec ? dRecoverable >= FEC_OFF_LOSS : dRecoverable >= FEC_ON_LOSS;
+    uint32_t uiExpected = 0;
+    if (m_bFec)
+    {
+      uiExpected = static_cast<uint32_t>(std::ceil(dRecoverable * 100.0 * LOSS_MARGIN));
+      uiExpected = std::min(std::max(uiExpected, 1u), MAX_EXPECTED_LOSS_PERCENT);
+    }
+    m_decision = split(uiExpected);
+    break;
+  }
+  }
+  return m_decision;
+}
+
+FecController::Decision FecController::split(uint32_t uiExpectedLossPercent) const
+{
+  Decision decision;
+  decision.fec = m_bFec && uiExpectedLossPercent > 0;
+  decision.expectedLossPercent = decision.fec ? uiExpectedLossPercent : 0;
+  decision.fecKbps = 0.0;
+  decision.payloadKbps = m_uiTargetBitrateKbps;
+  if (!decision.fec || m_uiTargetBitrateKbps == 0) return decision;
+
+  double dShare = std::min(BASE_FEC_SHARE + FEC_SHARE_PER_PERCENT * uiExpectedLossPercent, MAX_FEC_SHARE);
+  const double dMaxShare = 1.0 - MIN_PAYLOAD_KBPS / m_uiTargetBitrateKbps;
+  if (dMaxShare < BASE_FEC_SHARE)
+  {
+    // too little bitrate to protect
+    decision.fec = false;
+    decision.expectedLossPercent = 0;
+    return decision;
+  }
+  if (dShare > dMaxShare)
+  {
+    dShare = dMaxShare;
+    decision.expectedLossPercent = std::max(1u, static_cast<uint32_t>((dShare - BASE_FEC_SHARE) / FEC_SHARE_PER_PERCENT));
+  }
+  decision.fecKbps = m_uiTargetBitrateKbps * dShare;
+  decision.payloadKbps = m_uiTargetBitrateKbps - decision.fecKbps;
+  return decision;
+}
+
+FecController::Stats FecController::getStats() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  Stats stats;
+  stats.reports = m_uiReports;
+  stats.lossPercent = m_dLoss * 100.0;
+  stats.meanBurstLength = m_dMeanBurstLength;
+  stats.decision = m_decision;
+  return stats;
+}
@@ -0,0 +1,111 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: FecController.h
+
+DESCRIPTION			: Adapts the Opus in-band FEC to the packet loss reported by the receiver
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstdint>
+#include <mutex>
+
+/**
+ * @brief Decides per frame whether to use the Opus in-band FEC and which packet loss the encoder should expect.
+ *
+ * The receiver reports the fraction of packets lost, e.g. from RTCP receiver reports, and optionally the mean
+ * burst length, e.g. from RTCP XR. The estimate follows rising loss quickly and falling loss slowly. The in-band
+ * FEC can only recover a single lost packet from the next one, so only the part of the loss that is isolated
+ * is worth protecting: with a mean burst length of b only 1/b of the losses are recoverable.
+ *
+ * The expected loss is what the encoder spends LBRR (FEC) bits on. The controller estimates the resulting split of
+ * the target bitrate between FEC and payload and caps the expected loss so that the payload keeps a minimum
+ * bitrate. If even a small FEC share would starve the payload the FEC is turned off.
+ */
+class FecController
+{
+public:
+  enum class Mode
+  {
+    FM_OFF,
+    /// the FEC is always on with the configured expected loss
+    FM_FIXED,
+    /// follows the loss reports
+    FM_ADAPTIVE
+  };
+
+  struct Decision
+  {
+    bool fec;
+    uint32_t expectedLossPercent;
+    /// estimated split of the target bitrate
+    double fecKbps;
+    double payloadKbps;
+  };
+
+  struct Stats
+  {
+    uint64_t reports;
+    /// smoothed reported loss
+    double lossPercent;
+    double meanBurstLength;
+    Decision decision;
+  };
+
+  FecController();
+  /**
+   * @param uiFixedLossPercent the expected loss in FM_FIXED mode
+   */
+  void setMode(Mode eMode, uint32_t uiFixedLossPercent);
+  void setTargetBitrate(uint32_t uiKbps);
+  /**
+   * @brief Takes a loss report of the receiver
+   * @param dLossFraction fraction of the packets lost since the last report
+   * @param dMeanBurstLength mean number of consecutive packets lost, 1 if unknown
+   */
+  void reportLoss(double dLossFraction, double dMeanBurstLength);
+  /**
+   * @brief the settings for the next frame
+   */
+  Decision decide();
+  Stats getStats() const;
+
+private:
+  /// splits the bitrate for an expected loss. Must be called with m_lock held.
+  Decision split(uint32_t uiExpectedLossPercent) const;
+
+  mutable std::mutex m_lock;
+  Mode m_eMode;
+  uint32_t m_uiFixedLossPercent;
+  uint32_t m_uiTargetBitrateKbps;
+  uint64_t m_uiReports;
+  double m_dLoss;
+  double m_dMeanBurstLength;
+  bool m_bFec;
+  Decision m_decision;
+};
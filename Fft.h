@@ -0,0 +1,84 @@
+#pragma once
+#include <cassert>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+/**
+ * @brief Radix-2 in-place FFT with precomputed twiddles and bit reversal table.
+ */
+class Fft
+{
+public:
+  explicit Fft(int size)
+    :m_size(size),
+    m_vTwiddles(size / 2),
+    m_vBitReversed(size)
+  {
+    assert(size > 1 && (size & (size - 1)) == 0);
+    const double PI = 3.14159265358979323846;
+    for (int i = 0; i < size / 2; ++i)
+    {
+      m_vTwiddles[i] = std::polar(1.0f, static_cast<float>(-2.0 * PI * i / size));
+    }
+    int bits = 0;
+    while ((1 << bits) < size) ++bits;
+    for (int i = 0; i < size; ++i)
+    {
+      int r = 0;
+      for (int b = 0; b < bits; ++b)
+      {
+        if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+      }
+      m_vBitReversed[i] = r;
+    }
+  }
+
+  int getSize() const { return m_size; }
+
+  /**
+   * @brief forward transform of m_size complex values
+   */
+  void forward(std::complex<float>* pData) const
+  {
+    transform(pData, false);
+  }
+  /**
+   * @brief inverse transform of m_size complex values including the 1/N scaling
+   */
+  void inverse(std::complex<float>* pData) const
+  {
+    transform(pData, true);
+    const float scale = 1.0f / m_size;
+    for (int i = 0; i < m_size; ++i) pData[i] *= scale;
+  }
+
+private:
+  void transform(std::complex<float>* pData, bool bInverse) const
+  {
+    for (int i = 0; i < m_size; ++i)
+    {
+      int r = m_vBitReversed[i];
+      if (r > i) std::swap(pData[i], pData[r]);
+    }
+    for (int len = 2; len <= m_size; len <<= 1)
+    {
+      const int half = len / 2;
+      const int step = m_size / len;
+      for (int i = 0; i < m_size; i += len)
+      {
+        for (int j = 0; j < half; ++j)
+        {
+          std::complex<float> w = bInverse ? std::conj(m_vTwiddles[j * step]) : m_vTwiddles[j * step];
+          std::complex<float> t = w * pData[i + j + half];
+          pData[i + j + half] = pData[i + j] - t;
+          pData[i + j] += t;
+        }
+      }
+    }
+  }
+
+  int m_size;
+  std::vector<std::complex<float>> m_vTwiddles;
+  std::vector<int> m_vBitReversed;
+};
@@ -2,3 +2,7 @@
 
 #define CODEC_PARAM_TARGET_BITRATE_KBPS "target_bitrate_kbps"
 #define CODEC_PARAM_OPUS_APPLICATION "opus_application"
+#define CODEC_PARAM_COMPLEXITY "complexity"
+#define CODEC_PARAM_INBAND_FEC "inband_fec"
+#define CODEC_PARAM_PACKET_LOSS_PERCENTAGE "packet_loss_percentage"
+#define CODEC_PARAM_DECODE_FEC "decode_fec"
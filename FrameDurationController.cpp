@@ -0,0 +1,199 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: FrameDurationController.cpp
+
+DESCRIPTION			: Chooses the frame duration from voice activity, a latency ceiling and a packet rate budget
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "FrameDurationController.h"
+#include <algorithm>
+#include <cmath>
+
+static const OpusFrameDuration ADAPTIVE_DURATIONS[] =
+{
+  OpusFrameDuration::OFD_10_MS,
+  OpusFrameDuration::OFD_20_MS,
+  OpusFrameDuration::OFD_40_MS,
+  OpusFrameDuration::OFD_60_MS
+};
+
+/// activity must be this far above the noise floor
+static const double ACTIVITY_THRESHOLD_DB = 9.0;
+/// quieter frames are never active
+static const double ABSOLUTE_THRESHOLD_DBFS = -55.0;
+/// the floor follows a falling level immediately but rises slowly so that speech does not lift it
+static const double NOISE_FLOOR_RISE_DB_PER_S = 3.0;
+static const double INITIAL_NOISE_FLOOR_DBFS = -60.0;
+static const double HANGOVER_MS = 300.0;
+/// the turn-taking window during which the shortest frames are used
+static const double ONSET_MS = 400.0;
+/// activity longer than this is considered steady and uses the longest frames
+static const double STEADY_MS = 2000.0;
+/// minimum time between switches to a longer duration
+static const double HOLD_OFF_MS = 500.0;
+
+static double durationMs(OpusFrameDuration eFrameDuration)
+{
+  return frameDurationTo100ns(eFrameDuration) / 10000.0;
+}
+
+FrameDurationController::FrameDurationController(int samplesPerSecond, int channels)
+  :m_iSamplesPerSecond(samplesPerSecond),
+  m_iChannels(channels),
+  m_config(getDefaultConfig()),
+  m_dNoiseFloorDb(INITIAL_NOISE_FLOOR_DBFS),
+  m_dHangoverMs(0.0),
+  m_dActiveMs(0.0),
+  m_bActive(false),
+  m_eFrameDuration(m_config.referenceFrameDuration),
+  m_dSinceSwitchMs(0.0),
+  m_uiPackets(0),
+  m_dEncodedMs(0.0)
+{
+}
+
+FrameDurationController::Config FrameDurationController::getDefaultConfig()
+{
+  Config config;
+  config.minFrameDuration = OpusFrameDuration::OFD_10_MS;
+  config.maxFrameDuration = OpusFrameDuration::OFD_60_MS;
+  config.packetRateBudget = 0;
+  config.headerBytes = 40;
+  config.referenceFrameDuration = OpusFrameDuration::OFD_20_MS;
+  return config;
+}
+
+void FrameDurationController::setConfig(const Config& config)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_config = config;
+}
+
+void FrameDurationController::reset()
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_dNoiseFloorDb = INITIAL_NOISE_FLOOR_DBFS;
+  m_dHangoverMs = 0.0;
+  m_dActiveMs = 0.0;
+  m_bActive = false;
+}
+
+OpusFrameDuration FrameDurationController::update(const int16_t* pSamples, int iFrames)
+{
+  const double dFrameMs = iFrames * 1000.0 / m_iSamplesPerSecond;
+  std::lock_guard<std::mutex> lock(m_lock);
+  bool bActive = detectActivity(pSamples, iFrames, dFrameMs);
+  ++m_uiPackets;
+  m_dEncodedMs += dFrameMs;
+  m_bActive = bActive;
+  m_dActiveMs = bActive ? m_dActiveMs + dFrameMs : 0.0;
+  m_dSinceSwitchMs += dFrameMs;
+
+  OpusFrameDuration eTarget = chooseFrameDuration(bActive);
+  // shorter frames lower the latency right away, longer ones wait for the hold-off
+  if (eTarget < m_eFrameDuration || (eTarget > m_eFrameDuration && m_dSinceSwitchMs >= HOLD_OFF_MS))
+  {
+    m_eFrameDuration = eTarget;
+    m_dSinceSwitchMs = 0.0;
+  }
+  return m_eFrameDuration;
+}
+
+bool FrameDurationController::detectActivity(const int16_t* pSamples, int iFrames, double dFrameMs)
+{
+  const int iSamples = iFrames * m_iChannels;
+  int64_t iSumOfSquares = 0;
+  for (int i = 0; i < iSamples; ++i)
+  {
+    iSumOfSquares += static_cast<int32_t>(pSamples[i]) * pSamples[i];
+  }
+  const double dMeanSquare = iSamples > 0 ? static_cast<double>(iSumOfSquares) / iSamples : 0.0;
+  const double dEnergyDb = 10.0 * std::log10(dMeanSquare / (32768.0 * 32768.0) + 1e-10);
+
+  if (dEnergyDb < m_dNoiseFloorDb)
+  {
+    m_dNoiseFloorDb = dEnergyDb;
+  }
+  else
+  {
+    m_dNoiseFloorDb = std::min(dEnergyDb, m_dNoiseFloorDb + NOISE_FLOOR_RISE_DB_PER_S * dFrameMs / 1000.0);
+  }
+
+  if (dEnergyDb > ABSOLUTE_THRESHOLD_DBFS && dEnergyDb > m_dNoiseFloorDb + ACTIVITY_THRESHOLD_DB)
+  {
+    m_dHangoverMs = HANGOVER_MS;
+    return true;
+  }
+  m_dHangoverMs = std::max(0.0, m_dHangoverMs - dFrameMs);
+  return m_dHangoverMs > 0.0;
+}
+
+OpusFrameDuration FrameDurationController::chooseFrameDuration(bool bActive) const
+{
+  OpusFrameDuration eLower = m_config.minFrameDuration;
+  if (m_config.packetRateBudget > 0)
+  {
+    // the shortest duration that stays within the budget
+    for (OpusFrameDuration eDuration : ADAPTIVE_DURATIONS)
+    {
+      eLower = std::max(eLower, eDuration);
+      if (1000.0 / durationMs(eDuration) <= m_config.packetRateBudget) break;
+    }
+  }
+  const OpusFrameDuration eUpper = m_config.maxFrameDuration;
+
+  OpusFrameDuration eTarget;
+  if (!bActive || m_dActiveMs >= STEADY_MS)
+  {
+    eTarget = eUpper;
+  }
+  else if (m_dActiveMs < ONSET_MS)
+  {
+    eTarget = eLower;
+  }
+  else
+  {
+    eTarget = std::max(eLower, OpusFrameDuration::OFD_20_MS);
+  }
+  return std::min(std::max(eTarget, eLower), eUpper);
+}
+
+FrameDurationController::Stats FrameDurationController::getStats() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  Stats stats;
+  stats.packets = m_uiPackets;
+  stats.encodedMs = m_dEncodedMs;
+  stats.packetRate = m_dEncodedMs > 0.0 ? m_uiPackets * 1000.0 / m_dEncodedMs : 0.0;
+  const double dReferencePackets = m_dEncodedMs / durationMs(m_config.referenceFrameDuration);
+  stats.overheadSavedBytes = static_cast<int64_t>(std::llround((dReferencePackets - m_uiPackets) * m_config.headerBytes));
+  stats.frameDurationMs = durationMs(m_eFrameDuration);
+  stats.voiceActive = m_bActive;
+  return stats;
+}
@@ -0,0 +1,123 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: FrameDurationController.h
+
+DESCRIPTION			: Chooses the frame duration from voice activity, a latency ceiling and a packet rate budget
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include "AudioBuffer.h"
+
+/**
+ * @brief Adapts the frame duration to the signal so that packets are only short when latency matters.
+ *
+ * An energy based voice activity detector tracks the noise floor of the input. At the onset of activity
+ * (turn-taking) the shortest allowed frame is used; once the activity has lasted for a while the duration is
+ * stepped up to amortise the IP/UDP/RTP header overhead, and during inactivity the longest allowed frame is used.
+ * Shorter frames are applied immediately, longer ones only after a hold-off so that the duration does not oscillate.
+ *
+ * The packet rate budget sets a lower bound on the duration and the latency ceiling an upper bound. If they
+ * conflict the latency ceiling wins. The controller only decides: the engine applies the duration at the next
+ * frame boundary, where the audio buffer carries the timestamps over exactly.
+ */
+class FrameDurationController
+{
+public:
+  struct Config
+  {
+    /// the shortest duration used at onsets
+    OpusFrameDuration minFrameDuration;
+    /// latency ceiling: the longest duration ever used
+    OpusFrameDuration maxFrameDuration;
+    /// maximum packets per second, 0 for no limit
+    uint32_t packetRateBudget;
+    /// per-packet header size (IP + UDP + RTP) used to report the overhead saved
+    uint32_t headerBytes;
+    /// the fixed duration the savings are reported against
+    OpusFrameDuration referenceFrameDuration;
+  };
+
+  struct Stats
+  {
+    uint64_t packets;
+    /// duration of the audio in the packets
+    double encodedMs;
+    /// mean packets per second
+    double packetRate;
+    /// header bytes saved compared to fixed framing at the reference duration, negative if more were sent
+    int64_t overheadSavedBytes;
+    /// the duration of the last frame
+    double frameDurationMs;
+    bool voiceActive;
+  };
+
+  FrameDurationController(int samplesPerSecond, int channels);
+  static Config getDefaultConfig();
+  void setConfig(const Config& config);
+  /**
+   * @brief Analyses the frame that was just encoded
+   * @param pSamples interleaved 16 bit PCM
+   * @param iFrames number of samples per channel
+   * @return the duration to use for the next frame
+   */
+  OpusFrameDuration update(const int16_t* pSamples, int iFrames);
+  /**
+   * @brief Restarts the activity detection, e.g. after a discontinuity. The statistics are kept.
+   */
+  void reset();
+  Stats getStats() const;
+
+private:
+  /// @return true if the frame contains voice or other foreground activity. Must be called with m_lock held.
+  bool detectActivity(const int16_t* pSamples, int iFrames, double dFrameMs);
+  /// @return the duration to use given the activity, before the hold-off
+  OpusFrameDuration chooseFrameDuration(bool bActive) const;
+
+  int m_iSamplesPerSecond;
+  int m_iChannels;
+
+  mutable std::mutex m_lock;
+  Config m_config;
+
+  /// frame energy below which the input is always considered inactive
+  double m_dNoiseFloorDb;
+  /// time left before activity that has ended is reported as inactive
+  double m_dHangoverMs;
+  /// how long the current activity has lasted, 0 when inactive
+  double m_dActiveMs;
+  bool m_bActive;
+  OpusFrameDuration m_eFrameDuration;
+  /// time since the duration was last changed
+  double m_dSinceSwitchMs;
+
+  uint64_t m_uiPackets;
+  double m_dEncodedMs;
+};
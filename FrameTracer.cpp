@@ -0,0 +1,173 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: FrameTracer.cpp
+
+DESCRIPTION			: Per-frame latency tracer with Chrome trace export
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "FrameTracer.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+
+std::atomic<bool> FrameTracer::s_bEnabled(false);
+std::atomic<uint32_t> FrameTracer::s_uiNextStreamId(0);
+uint32_t FrameTracer::s_uiNextThreadId(0);
+std::mutex FrameTracer::s_lock;
+std::vector<std::shared_ptr<FrameTracer::Ring>> FrameTracer::s_vRings;
+
+void FrameTracer::setEnabled(bool bEnabled)
+{
+  s_bEnabled.store(bEnabled, std::memory_order_relaxed);
+}
+
+uint32_t FrameTracer::newStreamId()
+{
+  return s_uiNextStreamId++;
+}
+
+FrameTracer::ThreadRing::~ThreadRing()
+{
+  // publishes the last records to the thread that takes the ring over
+  if (pRing) pRing->inUse.store(false, std::memory_order_release);
+}
+
+FrameTracer::ThreadRing& FrameTracer::getThreadRing()
+{
+  thread_local ThreadRing t_ring;
+  if (!t_ring.pRing)
+  {
+    // first event on this thread: take over the ring of a thread that has exited or register a new one
+    std::lock_guard<std::mutex> lock(s_lock);
+    for (auto& pRing : s_vRings)
+    {
+      if (!pRing->inUse.load(std::memory_order_acquire))
+      {
+        pRing->inUse.store(true, std::memory_order_relaxed);
+        t_ring.pRing = pRing.get();
+        break;
+      }
+    }
+    if (!t_ring.pRing)
+    {
+      s_vRings.push_back(std::make_shared<Ring>());
+      t_ring.pRing = s_vRings.back().get();
+    }
+    t_ring.threadId = s_uiNextThreadId++;
+  }
+  return t_ring;
+}
+
+void FrameTracer::record(Event eEvent, uint32_t uiStreamId, uint32_t uiFrame)
+{
+  ThreadRing& threadRing = getThreadRing();
+  Ring& ring = *threadRing.pRing;
+  uint64_t uiPos = ring.writePos.load(std::memory_order_relaxed);
+  Record& r = ring.records[uiPos & (RING_SIZE - 1)];
+  r.timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  r.streamId = uiStreamId;
+  r.frame = uiFrame;
+  r.threadId = threadRing.threadId;
+  r.event = eEvent;
+  // publish the record to the exporter
+  ring.writePos.store(uiPos + 1, std::memory_order_release);
+}
+
+void FrameTracer::clear()
+{
+  std::lock_guard<std::mutex> lock(s_lock);
+  for (auto& pRing : s_vRings)
+  {
+    // only the owning thread may write records, so just skip the published ones on export
+    pRing->clearPos.store(pRing->writePos.load(std::memory_order_acquire), std::memory_order_relaxed);
+  }
+}
+
+size_t FrameTracer::getRingCount()
+{
+  std::lock_guard<std::mutex> lock(s_lock);
+  return s_vRings.size();
+}
+
+bool FrameTracer::exportChromeTrace(const std::string& sFilename)
+{
+  std::ofstream out(sFilename.c_str(), std::ios::out | std::ios::trunc);
+  if (!out) return false;
+
+  struct EventInfo
+  {
+    const char* name;
+    /// Chrome trace phase: B(egin), E(nd) or i(nstant)
+    char phase;
+  };
+  static const EventInfo EVENTS[] =
+  {
+    { "sample_arrival", 'i' },
+    { "frame_cut", 'i' },
+    { "encode", 'B' },
+    { "encode", 'E' },
+    { "allocator_wait", 'B' },
+    { "allocator_wait", 'E' },
+    { "deliver", 'B' },
+    { "deliver", 'E' }
+  };
+
+  std::vector<std::shared_ptr<Ring>> vRings;
+  {
+    std::lock_guard<std::mutex> lock(s_lock);
+    vRings = s_vRings;
+  }
+
+  out << "{\"traceEvents\":[\n";
+  bool bFirst = true;
+  for (auto& pRing : vRings)
+  {
+    uint64_t uiEnd = pRing->writePos.load(std::memory_order_acquire);
+    uint64_t uiBegin = (uiEnd > RING_SIZE) ? uiEnd - RING_SIZE : 0;
+    uiBegin = std::max(uiBegin, pRing->clearPos.load(std::memory_order_relaxed));
+    for (uint64_t i = uiBegin; i < uiEnd; ++i)
+    {
+      Record r = pRing->records[i & (RING_SIZE - 1)];
+      // skip records the writer may have overwritten while we were reading
+      uint64_t uiNow = pRing->writePos.load(std::memory_order_acquire);
+      if (uiNow > RING_SIZE && i < uiNow - RING_SIZE) continue;
+
+      const EventInfo& info = EVENTS[static_cast<int>(r.event)];
+      if (!bFirst) out << ",\n";
+      bFirst = false;
+      out << "{\"name\":\"" << info.name << "\",\"ph\":\"" << info.phase << "\"";
+      if (info.phase == 'i') out << ",\"s\":\"t\"";
+      out << ",\"ts\":" << r.timestampNs / 1000 << "." << (r.timestampNs % 1000) / 100
+        << ",\"pid\":" << r.streamId << ",\"tid\":" << r.threadId
+        << ",\"args\":{\"frame\":" << r.frame << "}}";
+    }
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  return out.good();
+}
@@ -0,0 +1,141 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: FrameTracer.h
+
+DESCRIPTION			: Per-frame latency tracer with Chrome trace export
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Records timestamped per-frame events into lock-free per-thread rings and exports them
+ * as Chrome trace (chrome://tracing, Perfetto) JSON.
+ *
+ * Each thread writes to its own ring so that recording never takes a lock: when tracing is disabled
+ * the cost of a trace point is a single relaxed atomic load. The rings are fixed size and overwrite
+ * the oldest events. The ring of a thread that exits is handed to the next thread that records, so that
+ * the number of rings is bounded by the number of threads recording at the same time, e.g. across graph
+ * restarts. The events of the exited thread stay in the ring until they are overwritten.
+ * Trace points are compiled out entirely unless OPUS_ENCODER_TRACING is defined.
+ */
+class FrameTracer
+{
+public:
+  enum class Event : uint8_t
+  {
+    SampleArrival,
+    FrameCut,
+    EncodeStart,
+    EncodeEnd,
+    AllocatorWaitStart,
+    AllocatorWaitEnd,
+    DeliverStart,
+    DeliverEnd
+  };
+
+  static bool isEnabled() { return s_bEnabled.load(std::memory_order_relaxed); }
+  static void setEnabled(bool bEnabled);
+  /**
+   * @brief allocates an id that identifies a stream in the trace
+   */
+  static uint32_t newStreamId();
+  /**
+   * @brief records an event on the ring of the calling thread
+   */
+  static void record(Event eEvent, uint32_t uiStreamId, uint32_t uiFrame);
+  /**
+   * @brief writes the events of all threads to a Chrome trace JSON file
+   * @return false if the file could not be written
+   */
+  static bool exportChromeTrace(const std::string& sFilename);
+  /**
+   * @brief discards all recorded events, e.g. when a new tracing session starts
+   */
+  static void clear();
+  /**
+   * @brief the number of rings allocated so far
+   */
+  static size_t getRingCount();
+
+private:
+  struct Record
+  {
+    int64_t timestampNs;
+    uint32_t streamId;
+    uint32_t frame;
+    /// the ring may have been written by several threads one after another
+    uint32_t threadId;
+    Event event;
+  };
+
+  /// single producer ring owned by one thread at a time
+  struct Ring
+  {
+    Ring() :inUse(true), writePos(0), clearPos(0), records(RING_SIZE) {}
+    /// false once the owning thread has exited, guarded by s_lock when it is set
+    std::atomic<bool> inUse;
+    std::atomic<uint64_t> writePos;
+    /// events before this position have been cleared
+    std::atomic<uint64_t> clearPos;
+    std::vector<Record> records;
+  };
+
+  static const uint32_t RING_SIZE = 1 << 16;
+
+  /// releases the ring of a thread when the thread exits
+  struct ThreadRing
+  {
+    ThreadRing() :pRing(nullptr), threadId(0) {}
+    ~ThreadRing();
+    Ring* pRing;
+    uint32_t threadId;
+  };
+
+  static ThreadRing& getThreadRing();
+
+  static std::atomic<bool> s_bEnabled;
+  static std::atomic<uint32_t> s_uiNextStreamId;
+  static uint32_t s_uiNextThreadId;
+  static std::mutex s_lock;
+  /// the rings outlive their threads so that events can be exported after a thread has exited
+  static std::vector<std::shared_ptr<Ring>> s_vRings;
+};
+
+#ifdef OPUS_ENCODER_TRACING
+#define FRAME_TRACE(eEvent, uiStreamId, uiFrame) \
+  do { if (FrameTracer::isEnabled()) FrameTracer::record(FrameTracer::Event::eEvent, uiStreamId, uiFrame); } while (0)
+#else
+#define FRAME_TRACE(eEvent, uiStreamId, uiFrame) do {} while (0)
+#endif
@@ -0,0 +1,410 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: InputConditioner.cpp
+
+DESCRIPTION			: High-pass, DC removal and spectral noise gate applied to the frames before they are encoded
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "InputConditioner.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define INPUT_CONDITIONER_SSE2
+#endif
+
+static const double PI = 3.14159265358979323846;
+static const double DC_CUTOFF_HZ = 10.0;
+/// the gate window is the shortest power of two of at least this duration
+static const int GATE_WINDOW_DIVISOR = 125;
+/// recursive smoothing of the bin powers per hop
+static const float POWER_SMOOTHING = 0.3f;
+/// the noise floor is the minimum over this window, tracked in sub-windows so that old minima expire
+static const double NOISE_WINDOW_SECONDS = 1.5;
+static const int NOISE_SUBWINDOWS = 4;
+/// the minimum of the smoothed power underestimates the mean noise power by about this factor
+static const float NOISE_BIAS = 3.0f;
+/// bins within this factor of the noise floor are attenuated fully
+static const float OVER_SUBTRACTION = 2.0f;
+/// the gain opens immediately and closes by this fraction of the difference per hop, against musical noise
+static const float GAIN_RELEASE = 0.5f;
+/// filter states below this are flushed to zero so that silence doesn't decay into denormals
+static const float DENORMAL_THRESHOLD = 1e-15f;
+
+const int InputConditioner::LANES;
+
+static int gateWindowSize(int samplesPerSecond)
+{
+  int iSize = 16;
+  while (iSize < samplesPerSecond / GATE_WINDOW_DIVISOR) iSize <<= 1;
+  return iSize;
+}
+
+InputConditioner::InputConditioner(int samplesPerSecond, int channels)
+  :m_iSamplesPerSecond(samplesPerSecond),
+  m_iChannels(channels),
+  m_iBlocks((channels + LANES - 1) / LANES),
+  m_config(getDefaultConfig()),
+  m_iBlockFrames(0),
+  m_fDcPole(static_cast<float>(std::exp(-2.0 * PI * DC_CUTOFF_HZ / samplesPerSecond))),
+  m_vDcX1(m_iBlocks * LANES, 0.0f),
+  m_vDcY1(m_iBlocks * LANES, 0.0f),
+  m_fB0(1.0f), m_fB1(0.0f), m_fB2(0.0f), m_fA1(0.0f), m_fA2(0.0f),
+  m_vZ1(m_iBlocks * LANES, 0.0f),
+  m_vZ2(m_iBlocks * LANES, 0.0f),
+  m_iFftSize(gateWindowSize(samplesPerSecond)),
+  m_iHop(m_iFftSize / 2),
+  m_fft(m_iFftSize),
+  m_vWindow(m_iFftSize),
+  m_vSpectrum(m_iFftSize),
+  m_vGate(channels),
+  m_fGateFloor(1.0f),
+  m_iSubwindowHops(std::max(1, static_cast<int>(NOISE_WINDOW_SECONDS * samplesPerSecond / (m_iFftSize / 2) / NOISE_SUBWINDOWS))),
+  m_dAttenuationDb(0.0)
+{
+  for (int n = 0; n < m_iFftSize; ++n)
+  {
+    m_vWindow[n] = static_cast<float>(std::sin(PI * n / m_iFftSize));
+  }
+  resetGate();
+}
+
+InputConditioner::Config InputConditioner::getDefaultConfig()
+{
+  Config config;
+  config.dcRemoval = false;
+  config.highPassHz = 0.0;
+  config.noiseGateDb = 0.0;
+  return config;
+}
+
+void InputConditioner::setConfig(const Config& config)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  // switching the gate changes the delay: restart it from silence
+  if ((config.noiseGateDb > 0.0) != (m_config.noiseGateDb > 0.0))
+  {
+    resetGate();
+  }
+  m_config = config;
+  m_fGateFloor = static_cast<float>(std::pow(10.0, -std::max(config.noiseGateDb, 0.0) / 20.0));
+  updateCoefficients();
+}
+
+bool InputConditioner::isEnabled() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  return m_config.dcRemoval || m_config.highPassHz > 0.0 || m_config.noiseGateDb > 0.0;
+}
+
+void InputConditioner::updateCoefficients()
+{
+  if (m_config.highPassHz <= 0.0) return;
+  // RBJ cookbook high-pass with Q = 1/sqrt(2), kept below Nyquist
+  const double dCutoff = std::min(m_config.highPassHz, 0.45 * m_iSamplesPerSecond);
+  const double dW0 = 2.0 * PI * dCutoff / m_iSamplesPerSecond;
+  const double dCos = std::cos(dW0);
+  const double dAlpha = std::sin(dW0) / std::sqrt(2.0);
+  const double dA0 = 1.0 + dAlpha;
+  m_fB0 = static_cast<float>((1.0 + dCos) / 2.0 / dA0);
+  m_fB1 = static_cast<float>(-(1.0 + dCos) / dA0);
+  m_fB2 = m_fB0;
+  m_fA1 = static_cast<float>(-2.0 * dCos / dA0);
+  m_fA2 = static_cast<float>((1.0 - dAlpha) / dA0);
+}
+
+void InputConditioner::process(int16_t* pSamples, int iFrames)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  const bool bFilter = m_config.dcRemoval || m_config.highPassHz > 0.0;
+  const bool bGate = m_config.noiseGateDb > 0.0;
+  if ((!bFilter && !bGate) || iFrames <= 0) return;
+
+  gather(pSamples, iFrames);
+  if (bFilter)
+  {
+    for (int b = 0; b < m_iBlocks; ++b) filterBlock(b, iFrames);
+  }
+  if (bGate)
+  {
+    for (int c = 0; c < m_iChannels; ++c) gateChannel(c, iFrames);
+  }
+  scatter(pSamples, iFrames);
+}
+
+void InputConditioner::reset()
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  std::fill(m_vDcX1.begin(), m_vDcX1.end(), 0.0f);
+  std::fill(m_vDcY1.begin(), m_vDcY1.end(), 0.0f);
+  std::fill(m_vZ1.begin(), m_vZ1.end(), 0.0f);
+  std::fill(m_vZ2.begin(), m_vZ2.end(), 0.0f);
+  resetGate();
+}
+
+InputConditioner::Stats InputConditioner::getStats() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  Stats stats;
+  stats.noiseFloorDb = -HUGE_VAL;
+  stats.attenuationDb = m_config.noiseGateDb > 0.0 ? m_dAttenuationDb : 0.0;
+  stats.latencySamples = m_config.noiseGateDb > 0.0 ? m_iFftSize : 0;
+  const GateChannel& channel = m_vGate.front();
+  if (channel.bNoiseFloorValid)
+  {
+    // Parseval over the one-sided spectrum, normalised by the energy of the window
+    const int iBins = m_iFftSize / 2;
+    double dPower = channel.vNoiseFloor[0] + channel.vNoiseFloor[iBins];
+    for (int k = 1; k < iBins; ++k) dPower += 2.0 * channel.vNoiseFloor[k];
+    dPower /= static_cast<double>(m_iFftSize) * (m_iFftSize / 2);
+    stats.noiseFloorDb = 10.0 * std::log10(std::max(dPower, 1e-10) / (32768.0 * 32768.0));
+  }
+  return stats;
+}
+
+void InputConditioner::gather(const int16_t* pSamples, int iFrames)
+{
+  const size_t uiSize = static_cast<size_t>(m_iBlocks) * iFrames * LANES;
+  if (m_vBlocks.size() < uiSize) m_vBlocks.resize(uiSize);
+  m_iBlockFrames = iFrames;
+  for (int b = 0; b < m_iBlocks; ++b)
+  {
+    float* pBlock = getBlock(b);
+    const int iLanes = std::min(LANES, m_iChannels - b * LANES);
+    for (int i = 0; i < iFrames; ++i)
+    {
+      const int16_t* pIn = pSamples + i * m_iChannels + b * LANES;
+      float* pRow = pBlock + i * LANES;
+      int k = 0;
+      for (; k < iLanes; ++k) pRow[k] = pIn[k];
+      for (; k < LANES; ++k) pRow[k] = 0.0f;
+    }
+  }
+}
+
+void InputConditioner::scatter(int16_t* pSamples, int iFrames)
+{
+  for (int b = 0; b < m_iBlocks; ++b)
+  {
+    const float* pBlock = getBlock(b);
+    const int iLanes = std::min(LANES, m_iChannels - b * LANES);
+    for (int i = 0; i < iFrames; ++i)
+    {
+      int16_t* pOut = pSamples + i * m_iChannels + b * LANES;
+      const float* pRow = pBlock + i * LANES;
+      for (int k = 0; k < iLanes; ++k)
+      {
+        long lSample = std::lround(pRow[k]);
+        pOut[k] = static_cast<int16_t>(std::min(std::max(lSample, -32768L), 32767L));
+      }
+    }
+  }
+}
+
+void InputConditioner::filterBlock(int b, int iFrames)
+{
+  float* pBlock = getBlock(b);
+  float* pDcX1 = &m_vDcX1[b * LANES];
+  float* pDcY1 = &m_vDcY1[b * LANES];
+  float* pZ1 = &m_vZ1[b * LANES];
+  float* pZ2 = &m_vZ2[b * LANES];
+  const bool bDc = m_config.dcRemoval;
+  const bool bHighPass = m_config.highPassHz > 0.0;
+#ifdef INPUT_CONDITIONER_SSE2
+  const __m128 pole = _mm_set1_ps(m_fDcPole);
+  const __m128 b0 = _mm_set1_ps(m_fB0), b1 = _mm_set1_ps(m_fB1), b2 = _mm_set1_ps(m_fB2);
+  const __m128 a1 = _mm_set1_ps(m_fA1), a2 = _mm_set1_ps(m_fA2);
+  __m128 x1 = _mm_loadu_ps(pDcX1);
+  __m128 y1 = _mm_loadu_ps(pDcY1);
+  __m128 z1 = _mm_loadu_ps(pZ1);
+  __m128 z2 = _mm_loadu_ps(pZ2);
+  for (int i = 0; i < iFrames; ++i)
+  {
+    float* pRow = pBlock + i * LANES;
+    __m128 x = _mm_loadu_ps(pRow);
+    if (bDc)
+    {
+      __m128 y = _mm_add_ps(_mm_sub_ps(x, x1), _mm_mul_ps(pole, y1));
+      x1 = x;
+      y1 = y;
+      x = y;
+    }
+    if (bHighPass)
+    {
+      __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+      z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+      z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+      x = y;
+    }
+    _mm_storeu_ps(pRow, x);
+  }
+  _mm_storeu_ps(pDcX1, x1);
+  _mm_storeu_ps(pDcY1, y1);
+  _mm_storeu_ps(pZ1, z1);
+  _mm_storeu_ps(pZ2, z2);
+#else
+  for (int k = 0; k < LANES; ++k)
+  {
+    float x1 = pDcX1[k], y1 = pDcY1[k], z1 = pZ1[k], z2 = pZ2[k];
+    for (int i = 0; i < iFrames; ++i)
+    {
+      float& fSample = pBlock[i * LANES + k];
+      float x = fSample;
+      if (bDc)
+      {
+        float y = x - x1 + m_fDcPole * y1;
+        x1 = x;
+        y1 = y;
+        x = y;
+      }
+      if (bHighPass)
+      {
+        float y = m_fB0 * x + z1;
+        z1 = m_fB1 * x - m_fA1 * y + z2;
+        z2 = m_fB2 * x - m_fA2 * y;
+        x = y;
+      }
+      fSample = x;
+    }
+    pDcX1[k] = x1;
+    pDcY1[k] = y1;
+    pZ1[k] = z1;
+    pZ2[k] = z2;
+  }
+#endif
+  for (int k = 0; k < LANES; ++k)
+  {
+    if (std::fabs(pDcY1[k]) < DENORMAL_THRESHOLD) pDcY1[k] = 0.0f;
+    if (std::fabs(pZ1[k]) < DENORMAL_THRESHOLD) pZ1[k] = 0.0f;
+    if (std::fabs(pZ2[k]) < DENORMAL_THRESHOLD) pZ2[k] = 0.0f;
+  }
+}
+
+void InputConditioner::gateChannel(int iChannel, int iFrames)
+{
+  GateChannel& channel = m_vGate[iChannel];
+  float* pBlock = getBlock(iChannel / LANES) + iChannel % LANES;
+  for (int i = 0; i < iFrames; ++i)
+  {
+    channel.vInput.push_back(pBlock[i * LANES]);
+  }
+  size_t uiConsumed = 0;
+  while (channel.vInput.size() - uiConsumed >= static_cast<size_t>(m_iFftSize))
+  {
+    std::complex<float>* pSpectrum = m_vSpectrum.data();
+    for (int n = 0; n < m_iFftSize; ++n)
+    {
+      pSpectrum[n] = channel.vInput[uiConsumed + n] * m_vWindow[n];
+    }
+    gateWindow(channel);
+    uiConsumed += m_iHop;
+    if (iChannel == 0)
+    {
+      double dSum = 0.0;
+      for (float fGain : channel.vGain) dSum += fGain;
+      m_dAttenuationDb = -20.0 * std::log10(std::max(dSum / channel.vGain.size(), 1e-6));
+    }
+  }
+  channel.vInput.erase(channel.vInput.begin(), channel.vInput.begin() + uiConsumed);
+  // the output was primed with a hop, so a frame is always available
+  for (int i = 0; i < iFrames; ++i)
+  {
+    pBlock[i * LANES] = channel.vOutput[i];
+  }
+  channel.vOutput.erase(channel.vOutput.begin(), channel.vOutput.begin() + iFrames);
+}
+
+void InputConditioner::gateWindow(GateChannel& channel)
+{
+  std::complex<float>* pSpectrum = m_vSpectrum.data();
+  m_fft.forward(pSpectrum);
+  const int iBins = m_iFftSize / 2;
+  for (int k = 0; k <= iBins; ++k)
+  {
+    const float fPower = std::norm(pSpectrum[k]);
+    float& fSmoothed = channel.vSmoothedPower[k];
+    float& fNoise = channel.vNoiseFloor[k];
+    fSmoothed = channel.bNoiseFloorValid ? fSmoothed + POWER_SMOOTHING * (fPower - fSmoothed) : fPower;
+    float& fMinimum = channel.vMinimum[k];
+    fMinimum = std::min(fMinimum, fSmoothed);
+    fNoise = fMinimum;
+    for (int w = 0; w < NOISE_SUBWINDOWS; ++w)
+    {
+      fNoise = std::min(fNoise, channel.vMinima[w * (iBins + 1) + k]);
+    }
+    fNoise = std::max(fNoise * NOISE_BIAS, 1.0f);
+
+    float fTarget = 1.0f - OVER_SUBTRACTION * fNoise / std::max(fSmoothed, 1.0f);
+    fTarget = std::min(std::max(fTarget, m_fGateFloor), 1.0f);
+    float& fGain = channel.vGain[k];
+    fGain = fTarget > fGain ? fTarget : fGain + GAIN_RELEASE * (fTarget - fGain);
+    pSpectrum[k] *= fGain;
+    if (k > 0 && k < iBins) pSpectrum[m_iFftSize - k] *= fGain;
+  }
+  channel.bNoiseFloorValid = true;
+  if (++channel.iHops == m_iSubwindowHops)
+  {
+    // the oldest sub-window expires
+    std::copy(channel.vMinimum.begin(), channel.vMinimum.end(), channel.vMinima.begin() + channel.iSubwindow * (iBins + 1));
+    std::fill(channel.vMinimum.begin(), channel.vMinimum.end(), FLT_MAX);
+    channel.iSubwindow = (channel.iSubwindow + 1) % NOISE_SUBWINDOWS;
+    channel.iHops = 0;
+  }
+  m_fft.inverse(pSpectrum);
+
+  for (int n = 0; n < m_iFftSize; ++n)
+  {
+    channel.vOverlap[n] += pSpectrum[n].real() * m_vWindow[n];
+  }
+  channel.vOutput.insert(channel.vOutput.end(), channel.vOverlap.begin(), channel.vOverlap.begin() + m_iHop);
+  std::copy(channel.vOverlap.begin() + m_iHop, channel.vOverlap.end(), channel.vOverlap.begin());
+  std::fill(channel.vOverlap.end() - m_iHop, channel.vOverlap.end(), 0.0f);
+}
+
+void InputConditioner::resetGate()
+{
+  const int iBins = m_iFftSize / 2 + 1;
+  for (GateChannel& channel : m_vGate)
+  {
+    channel.vInput.assign(m_iFftSize - m_iHop, 0.0f);
+    channel.vOverlap.assign(m_iFftSize, 0.0f);
+    channel.vOutput.assign(m_iHop, 0.0f);
+    channel.vSmoothedPower.assign(iBins, 0.0f);
+    channel.vNoiseFloor.assign(iBins, 0.0f);
+    channel.vMinimum.assign(iBins, FLT_MAX);
+    channel.vMinima.assign(NOISE_SUBWINDOWS * iBins, FLT_MAX);
+    channel.iHops = 0;
+    channel.iSubwindow = 0;
+    channel.vGain.assign(iBins, 1.0f);
+    channel.bNoiseFloorValid = false;
+  }
+  m_dAttenuationDb = 0.0;
+}
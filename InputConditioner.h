@@ -0,0 +1,161 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: InputConditioner.h
+
+DESCRIPTION			: High-pass, DC removal and spectral noise gate applied to the frames before they are encoded
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Fft.h"
+
+/**
+ * @brief Cleans up the input in place before it is encoded so that Opus doesn't spend bits on hum and noise.
+ *
+ * The stages run in this order, each one optional:
+ * - a one-pole DC blocker at about 10 Hz,
+ * - a second order Butterworth high-pass at a configurable cut-off,
+ * - a spectral noise gate: a 50% overlap STFT with sqrt-Hann windows of about 8 ms that attenuates the bins
+ *   close to their noise floor by up to the configured depth. The noise floor is the minimum of the smoothed
+ *   bin power over the last 1.5 s, so it follows rising noise and forgets pauses and digital silence.
+ *
+ * The filters are recursive per channel, so they vectorise across channels: the interleaved frame is gathered
+ * into blocks of LANES channels in which each vector holds one sample time, as in BatchPreprocessor.
+ * The noise gate delays the audio by one STFT window; the filters add no delay.
+ */
+class InputConditioner
+{
+public:
+  /// channels per block: one SSE register of floats
+  static const int LANES = 4;
+
+  struct Config
+  {
+    bool dcRemoval;
+    /// high-pass cut-off in Hz, 0 to disable
+    double highPassHz;
+    /// maximum attenuation of the noise in dB, 0 to disable the gate
+    double noiseGateDb;
+  };
+
+  struct Stats
+  {
+    /// the tracked noise floor of the first channel, in dBFS
+    double noiseFloorDb;
+    /// mean attenuation of the last frame of the first channel, in dB
+    double attenuationDb;
+    /// delay added by the gate
+    int latencySamples;
+  };
+
+  InputConditioner(int samplesPerSecond, int channels);
+  /// every stage disabled
+  static Config getDefaultConfig();
+  void setConfig(const Config& config);
+  bool isEnabled() const;
+  /**
+   * @brief Conditions a frame in place
+   * @param pSamples interleaved 16 bit PCM
+   * @param iFrames number of samples per channel
+   */
+  void process(int16_t* pSamples, int iFrames);
+  /**
+   * @brief Clears the filter and gate state, e.g. after a discontinuity
+   */
+  void reset();
+  Stats getStats() const;
+
+private:
+  /// STFT state of one channel
+  struct GateChannel
+  {
+    /// input not yet consumed by a full window, primed with the overlap
+    std::vector<float> vInput;
+    /// overlap-add accumulator of one window
+    std::vector<float> vOverlap;
+    /// gated output not yet returned, primed with one hop
+    std::vector<float> vOutput;
+    std::vector<float> vSmoothedPower;
+    /// minimum of the smoothed power over the last NOISE_SUBWINDOWS sub-windows and the current one
+    std::vector<float> vNoiseFloor;
+    /// minimum of the current sub-window
+    std::vector<float> vMinimum;
+    /// minima of the previous sub-windows, [sub-window][bin]
+    std::vector<float> vMinima;
+    int iHops;
+    int iSubwindow;
+    std::vector<float> vGain;
+    bool bNoiseFloorValid;
+  };
+
+  float* getBlock(int b) { return m_vBlocks.data() + static_cast<size_t>(b) * m_iBlockFrames * LANES; }
+  void updateCoefficients();
+  void gather(const int16_t* pSamples, int iFrames);
+  void scatter(int16_t* pSamples, int iFrames);
+  void filterBlock(int b, int iFrames);
+  void gateChannel(int iChannel, int iFrames);
+  void gateWindow(GateChannel& channel);
+  void resetGate();
+
+  int m_iSamplesPerSecond;
+  int m_iChannels;
+  int m_iBlocks;
+
+  mutable std::mutex m_lock;
+  Config m_config;
+
+  /// [block][sample][lane], grown to the largest frame
+  std::vector<float> m_vBlocks;
+  int m_iBlockFrames;
+
+  float m_fDcPole;
+  /// DC blocker state per lane
+  std::vector<float> m_vDcX1;
+  std::vector<float> m_vDcY1;
+  /// high-pass biquad, transposed direct form II
+  float m_fB0, m_fB1, m_fB2, m_fA1, m_fA2;
+  std::vector<float> m_vZ1;
+  std::vector<float> m_vZ2;
+
+  int m_iFftSize;
+  int m_iHop;
+  Fft m_fft;
+  /// sqrt-Hann: the analysis and synthesis windows multiply to a Hann window, which overlap-adds to one at 50%
+  std::vector<float> m_vWindow;
+  std::vector<std::complex<float>> m_vSpectrum;
+  std::vector<GateChannel> m_vGate;
+  float m_fGateFloor;
+  /// hops per noise tracking sub-window
+  int m_iSubwindowHops;
+  double m_dAttenuationDb;
+};
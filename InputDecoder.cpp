@@ -0,0 +1,262 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: InputDecoder.cpp
+
+DESCRIPTION			: Expands G.711 and IMA ADPCM input to 16 bit PCM in front of the encoder
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "InputDecoder.h"
+#include <algorithm>
+
+// IMA ADPCM step sizes per step index
+static const int16_t IMA_STEPS[89] =
+{
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97,
+  107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+  876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871,
+  5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623,
+  27086, 29794, 32767
+};
+static const int IMA_INDEX_ADJUST[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+// bytes of the block header per channel: predictor, step index and a reserved byte
+static const int IMA_HEADER_BYTES = 4;
+
+namespace
+{
+  /**
+   * @brief The G.711 expansions and the IMA ADPCM step table, built once
+   */
+  struct DecoderTables
+  {
+    int16_t vMuLaw[256];
+    int16_t vALaw[256];
+    /// signed predictor change per step index and nibble
+    int32_t vImaDelta[89][16];
+    /// next step index per step index and nibble
+    uint8_t vImaNextIndex[89][16];
+
+    DecoderTables()
+    {
+      for (int i = 0; i < 256; ++i)
+      {
+        // G.711: the bits are inverted, the segment scales a 4 bit mantissa with a bias of 0x84
+        const int u = ~i & 0xff;
+        int t = (((u & 0x0f) << 3) + 0x84) << ((u & 0x70) >> 4);
+        vMuLaw[i] = static_cast<int16_t>((u & 0x80) ? 0x84 - t : t - 0x84);
+
+        // G.711: even bits are inverted, segment 0 is linear
+        const int a = i ^ 0x55;
+        const int iSegment = (a & 0x70) >> 4;
+        int v = (a & 0x0f) << 4;
+        if (iSegment == 0) v += 8;
+        else v = (v + 0x108) << (iSegment - 1);
+        vALaw[i] = static_cast<int16_t>((a & 0x80) ? v : -v);
+      }
+      for (int iIndex = 0; iIndex < 89; ++iIndex)
+      {
+        const int iStep = IMA_STEPS[iIndex];
+        for (int n = 0; n < 16; ++n)
+        {
+          int iDelta = iStep >> 3;
+          if (n & 1) iDelta += iStep >> 2;
+          if (n & 2) iDelta += iStep >> 1;
+          if (n & 4) iDelta += iStep;
+          vImaDelta[iIndex][n] = (n & 8) ? -iDelta : iDelta;
+          int iNext = iIndex + IMA_INDEX_ADJUST[n & 7];
+          vImaNextIndex[iIndex][n] = static_cast<uint8_t>(iNext < 0 ? 0 : (iNext > 88 ? 88 : iNext));
+        }
+      }
+    }
+  };
+
+  const DecoderTables& getTables()
+  {
+    static const DecoderTables tables;
+    return tables;
+  }
+
+  inline int16_t clamp16(int32_t i)
+  {
+    return static_cast<int16_t>(i < -32768 ? -32768 : (i > 32767 ? 32767 : i));
+  }
+}
+
+InputDecoder::InputDecoder(const Config& config, int channels)
+  :m_config(config),
+  m_iChannels(channels)
+{
+  if (m_config.encoding == InputEncoding::IE_MULAW || m_config.encoding == InputEncoding::IE_ALAW)
+  {
+    m_config.blockAlign = channels;
+    m_config.samplesPerBlock = 1;
+  }
+  m_vCarry.reserve(m_config.blockAlign);
+  // build the tables before the first call on the streaming thread
+  getTables();
+}
+
+InputDecoder::Config InputDecoder::getDefaultConfig()
+{
+  Config config = { InputEncoding::IE_PCM, 0, 0 };
+  return config;
+}
+
+bool InputDecoder::isValid(const Config& config, int channels)
+{
+  if (channels <= 0) return false;
+  switch (config.encoding)
+  {
+  case InputEncoding::IE_MULAW:
+  case InputEncoding::IE_ALAW:
+    return true;
+  case InputEncoding::IE_IMA_ADPCM:
+  {
+    // whole 4 byte groups per channel after the headers, each holding 8 samples, plus the header sample
+    const int iData = config.blockAlign - IMA_HEADER_BYTES * channels;
+    if (iData < 0 || iData % (4 * channels) != 0) return false;
+    return config.samplesPerBlock == iData * 2 / channels + 1;
+  }
+  default:
+    return false;
+  }
+}
+
+uint32_t InputDecoder::getDecodedSize(uint32_t size) const
+{
+  const size_t uiBlocks = (m_vCarry.size() + size) / m_config.blockAlign;
+  return static_cast<uint32_t>(uiBlocks * m_config.samplesPerBlock * m_iChannels * sizeof(int16_t));
+}
+
+int InputDecoder::getCarriedFrames() const
+{
+  return m_vCarry.empty() ? 0 : static_cast<int>(m_vCarry.size() * m_config.samplesPerBlock / m_config.blockAlign);
+}
+
+uint32_t InputDecoder::decode(const uint8_t* pData, uint32_t size, int16_t* pOut)
+{
+  const size_t uiBlockAlign = static_cast<size_t>(m_config.blockAlign);
+  const size_t uiBlockSamples = static_cast<size_t>(m_config.samplesPerBlock) * m_iChannels;
+  int16_t* pStart = pOut;
+  if (!m_vCarry.empty())
+  {
+    const size_t uiMissing = std::min(uiBlockAlign - m_vCarry.size(), static_cast<size_t>(size));
+    m_vCarry.insert(m_vCarry.end(), pData, pData + uiMissing);
+    pData += uiMissing;
+    size -= static_cast<uint32_t>(uiMissing);
+    if (m_vCarry.size() < uiBlockAlign) return 0;
+    decodeBlocks(m_vCarry.data(), 1, pOut);
+    pOut += uiBlockSamples;
+    m_vCarry.clear();
+  }
+  const size_t uiBlocks = size / uiBlockAlign;
+  decodeBlocks(pData, uiBlocks, pOut);
+  pOut += uiBlocks * uiBlockSamples;
+  m_vCarry.assign(pData + uiBlocks * uiBlockAlign, pData + size);
+  return static_cast<uint32_t>((pOut - pStart) * sizeof(int16_t));
+}
+
+void InputDecoder::decodeBlocks(const uint8_t* pData, size_t uiBlocks, int16_t* pOut) const
+{
+  switch (m_config.encoding)
+  {
+  case InputEncoding::IE_MULAW:
+    decodeMuLaw(pData, uiBlocks * m_config.blockAlign, pOut);
+    break;
+  case InputEncoding::IE_ALAW:
+    decodeALaw(pData, uiBlocks * m_config.blockAlign, pOut);
+    break;
+  case InputEncoding::IE_IMA_ADPCM:
+    for (size_t b = 0; b < uiBlocks; ++b)
+    {
+      decodeImaAdpcmBlock(pData + b * m_config.blockAlign, m_iChannels, m_config.samplesPerBlock,
+        pOut + b * m_config.samplesPerBlock * m_iChannels);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+/// one table lookup per byte, unrolled so that the loads of 8 bytes are independent
+static void expand(const int16_t* pTable, const uint8_t* pData, size_t uiSize, int16_t* pOut)
+{
+  size_t i = 0;
+  for (; i + 8 <= uiSize; i += 8)
+  {
+    pOut[i] = pTable[pData[i]];
+    pOut[i + 1] = pTable[pData[i + 1]];
+    pOut[i + 2] = pTable[pData[i + 2]];
+    pOut[i + 3] = pTable[pData[i + 3]];
+    pOut[i + 4] = pTable[pData[i + 4]];
+    pOut[i + 5] = pTable[pData[i + 5]];
+    pOut[i + 6] = pTable[pData[i + 6]];
+    pOut[i + 7] = pTable[pData[i + 7]];
+  }
+  for (; i < uiSize; ++i) pOut[i] = pTable[pData[i]];
+}
+
+void InputDecoder::decodeMuLaw(const uint8_t* pData, size_t uiSize, int16_t* pOut)
+{
+  expand(getTables().vMuLaw, pData, uiSize, pOut);
+}
+
+void InputDecoder::decodeALaw(const uint8_t* pData, size_t uiSize, int16_t* pOut)
+{
+  expand(getTables().vALaw, pData, uiSize, pOut);
+}
+
+void InputDecoder::decodeImaAdpcmBlock(const uint8_t* pBlock, int iChannels, int iSamplesPerBlock, int16_t* pOut)
+{
+  const DecoderTables& tables = getTables();
+  const uint8_t* pGroups = pBlock + IMA_HEADER_BYTES * iChannels;
+  for (int c = 0; c < iChannels; ++c)
+  {
+    const uint8_t* pHeader = pBlock + IMA_HEADER_BYTES * c;
+    int32_t iPredictor = static_cast<int16_t>(pHeader[0] | (pHeader[1] << 8));
+    int iIndex = pHeader[2] > 88 ? 88 : pHeader[2];
+    int16_t* pChannel = pOut + c;
+    pChannel[0] = static_cast<int16_t>(iPredictor);
+    // each group of 4 bytes per channel holds 8 samples, low nibble first
+    const uint8_t* pGroup = pGroups + 4 * c;
+    for (int i = 1; i < iSamplesPerBlock; pGroup += 4 * iChannels)
+    {
+      for (int k = 0; k < 4; ++k, i += 2)
+      {
+        const int iLow = pGroup[k] & 0x0f;
+        iPredictor = clamp16(iPredictor + tables.vImaDelta[iIndex][iLow]);
+        iIndex = tables.vImaNextIndex[iIndex][iLow];
+        pChannel[static_cast<size_t>(i) * iChannels] = static_cast<int16_t>(iPredictor);
+        const int iHigh = pGroup[k] >> 4;
+        iPredictor = clamp16(iPredictor + tables.vImaDelta[iIndex][iHigh]);
+        iIndex = tables.vImaNextIndex[iIndex][iHigh];
+        pChannel[static_cast<size_t>(i + 1) * iChannels] = static_cast<int16_t>(iPredictor);
+      }
+    }
+  }
+}
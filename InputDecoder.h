@@ -0,0 +1,113 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: InputDecoder.h
+
+DESCRIPTION			: Expands G.711 and IMA ADPCM input to 16 bit PCM in front of the encoder
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief The encodings the filter accepts in addition to 16 bit PCM
+ */
+enum class InputEncoding
+{
+  IE_PCM,
+  IE_MULAW,
+  IE_ALAW,
+  IE_IMA_ADPCM
+};
+
+/**
+ * @brief Expands G.711 µ-law/A-law and IMA ADPCM to 16 bit PCM so that telephony input can be encoded without
+ * a separate decoder filter.
+ *
+ * G.711 is a lookup in a 256-entry table per byte. IMA ADPCM uses the Microsoft block layout (a 4 byte header per
+ * channel followed by 4 byte groups of 8 nibbles per channel) and a table of the predictor step and next step
+ * index per step index and nibble, so that decoding a nibble has no branches other than the clamp.
+ * Input that ends in the middle of a block is carried over to the next call.
+ */
+class InputDecoder
+{
+public:
+  struct Config
+  {
+    InputEncoding encoding;
+    /// bytes per block: the number of channels for G.711, nBlockAlign for IMA ADPCM
+    int blockAlign;
+    /// samples per channel per block: 1 for G.711, wSamplesPerBlock for IMA ADPCM
+    int samplesPerBlock;
+  };
+
+  InputDecoder(const Config& config, int channels);
+  /// 16 bit PCM: nothing to decode
+  static Config getDefaultConfig();
+  /**
+   * @brief Checks an IMA ADPCM block layout, or the G.711 one, against the number of channels
+   */
+  static bool isValid(const Config& config, int channels);
+  /**
+   * @brief the number of PCM bytes that decode() writes for size bytes of input
+   */
+  uint32_t getDecodedSize(uint32_t size) const;
+  /**
+   * @brief the samples per channel in the partial block carried over from the previous call. They are decoded
+   * in front of the next input, so they are this much older than its start time.
+   */
+  int getCarriedFrames() const;
+  /**
+   * @brief Decodes all complete blocks of the carried input followed by pData
+   * @param pOut getDecodedSize(size) bytes
+   * @return the number of PCM bytes written
+   */
+  uint32_t decode(const uint8_t* pData, uint32_t size, int16_t* pOut);
+  /**
+   * @brief Discards the partial block, e.g. on a discontinuity
+   */
+  void reset() { m_vCarry.clear(); }
+
+  static void decodeMuLaw(const uint8_t* pData, size_t uiSize, int16_t* pOut);
+  static void decodeALaw(const uint8_t* pData, size_t uiSize, int16_t* pOut);
+  /**
+   * @brief Decodes one Microsoft IMA ADPCM block
+   * @param pOut iSamplesPerBlock interleaved samples per channel
+   */
+  static void decodeImaAdpcmBlock(const uint8_t* pBlock, int iChannels, int iSamplesPerBlock, int16_t* pOut);
+
+private:
+  void decodeBlocks(const uint8_t* pData, size_t uiBlocks, int16_t* pOut) const;
+
+  Config m_config;
+  int m_iChannels;
+  /// the start of a block that was cut off at the end of the last input
+  std::vector<uint8_t> m_vCarry;
+};
@@ -0,0 +1,510 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: LoudnessMeter.cpp
+
+DESCRIPTION			: EBU R128 loudness, true peak and RMS metering
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "LoudnessMeter.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LOUDNESS_METER_SSE2
+#endif
+
+static const double PI = 3.14159265358979323846;
+static const int MOMENTARY_SUB_BLOCKS = 4;
+static const int SHORT_TERM_SUB_BLOCKS = 30;
+static const double ABSOLUTE_GATE_LUFS = -70.0;
+static const double RELATIVE_GATE_LU = -10.0;
+static const double HISTOGRAM_MAX_LUFS = 5.0;
+static const double HISTOGRAM_RESOLUTION_LU = 0.1;
+static const int HISTOGRAM_BINS = static_cast<int>((HISTOGRAM_MAX_LUFS - ABSOLUTE_GATE_LUFS) / HISTOGRAM_RESOLUTION_LU);
+static const int TRUE_PEAK_PHASES = 4;
+static const int TRUE_PEAK_TAPS = 12;
+/// interpolated samples computed together, their sums held in registers
+static const int TRUE_PEAK_BLOCK = 8;
+#ifdef LOUDNESS_METER_SSE2
+static_assert(TRUE_PEAK_BLOCK == 8 && TRUE_PEAK_TAPS == 12, "the SSE2 true peak filter holds a block in two vectors");
+#endif
+/// a frame can only raise the true peak if its sample peak is within this factor (6 dB)
+static const double TRUE_PEAK_HEADROOM = 2.0;
+/// quieter frames (-12 dBFS) cannot get near clipping: their sample peak is used
+static const double TRUE_PEAK_MIN_LEVEL = 0.25;
+
+/// the sum of the squares of the samples, exact in integers
+static uint64_t sumOfSquares(const int16_t* pSamples, int iSamples)
+{
+  uint64_t uiSum = 0;
+  int i = 0;
+#ifdef LOUDNESS_METER_SSE2
+  // the sum of two squares fits an unsigned 32 bit lane
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sum = _mm_setzero_si128();
+  for (; i + 8 <= iSamples; i += 8)
+  {
+    const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSamples + i));
+    const __m128i squares = _mm_madd_epi16(in, in);
+    sum = _mm_add_epi64(sum, _mm_add_epi64(_mm_unpacklo_epi32(squares, zero), _mm_unpackhi_epi32(squares, zero)));
+  }
+  uint64_t vSum[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(vSum), sum);
+  uiSum = vSum[0] + vSum[1];
+#endif
+  for (; i < iSamples; ++i) uiSum += static_cast<uint64_t>(static_cast<int32_t>(pSamples[i]) * pSamples[i]);
+  return uiSum;
+}
+
+LoudnessMeter::LoudnessMeter(int samplesPerSecond, int channels)
+  :m_iSamplesPerSecond(samplesPerSecond),
+  m_iChannels(channels),
+  m_vState(channels * 6, 0.0),
+  m_iSubBlockSamples(samplesPerSecond / 10),
+  m_iSubBlockPos(0),
+  m_vSubBlockSum(channels, 0.0),
+  m_dSubBlockSquares(0.0),
+  m_vSubBlocks(SHORT_TERM_SUB_BLOCKS, 0.0),
+  m_vSubBlockSquares(MOMENTARY_SUB_BLOCKS, 0.0),
+  m_iSubBlockCount(0),
+  m_vTruePeakTaps(TRUE_PEAK_PHASES * TRUE_PEAK_TAPS),
+  m_fTruePeakGain(0.0f),
+  m_vTruePeakHistory(channels * TRUE_PEAK_TAPS, 0.0f),
+  m_vHistogramCounts(HISTOGRAM_BINS, 0),
+  m_vHistogramEnergy(HISTOGRAM_BINS, 0.0)
+{
+  // BS.1770 K-weighting filters for the actual sample rate
+  double f0 = 1681.974450955533;
+  double G = 3.999843853973347;
+  double Q = 0.7071752369554196;
+  double K = std::tan(PI * f0 / samplesPerSecond);
+  double Vh = std::pow(10.0, G / 20.0);
+  double Vb = std::pow(Vh, 0.4996667741545416);
+  double a0 = 1.0 + K / Q + K * K;
+  m_shelf = { (Vh + Vb * K / Q + K * K) / a0, 2.0 * (K * K - Vh) / a0, (Vh - Vb * K / Q + K * K) / a0,
+    2.0 * (K * K - 1.0) / a0, (1.0 - K / Q + K * K) / a0 };
+  f0 = 38.13547087602444;
+  Q = 0.5003270373238773;
+  K = std::tan(PI * f0 / samplesPerSecond);
+  a0 = 1.0 + K / Q + K * K;
+  // kWeight applies the numerator as second differences
+  m_highPass = { 1.0, -2.0, 1.0, 2.0 * (K * K - 1.0) / a0, (1.0 - K / Q + K * K) / a0 };
+
+  // windowed sinc interpolating between history samples 5 and 6
+  for (int p = 0; p < TRUE_PEAK_PHASES; ++p)
+  {
+    float fGain = 0.0f;
+    for (int k = 0; k < TRUE_PEAK_TAPS; ++k)
+    {
+      double t = (k - (TRUE_PEAK_TAPS / 2 - 1)) - static_cast<double>(p) / TRUE_PEAK_PHASES;
+      double dSinc = (t == 0.0) ? 1.0 : std::sin(PI * t) / (PI * t);
+      // Blackman window over the filter span
+      double w = 0.5 + t / TRUE_PEAK_TAPS;
+      double dWindow = 0.42 - 0.5 * std::cos(2.0 * PI * w) + 0.08 * std::cos(4.0 * PI * w);
+      m_vTruePeakTaps[p * TRUE_PEAK_TAPS + k] = static_cast<float>(dSinc * dWindow);
+      fGain += std::fabs(m_vTruePeakTaps[p * TRUE_PEAK_TAPS + k]);
+    }
+    m_fTruePeakGain = std::max(m_fTruePeakGain, fGain);
+  }
+  reset();
+}
+
+void LoudnessMeter::reset()
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  std::fill(m_vHistogramCounts.begin(), m_vHistogramCounts.end(), 0);
+  std::fill(m_vHistogramEnergy.begin(), m_vHistogramEnergy.end(), 0.0);
+  m_dTruePeak = 0.0;
+  m_dSamplePeak = 0.0;
+  m_stats = { -HUGE_VAL, -HUGE_VAL, -HUGE_VAL, -HUGE_VAL, -HUGE_VAL, -HUGE_VAL, 0 };
+}
+
+void LoudnessMeter::process(const int16_t* pSamples, int iFrames)
+{
+  const double dScale = 1.0 / 32768.0;
+  int iFrame = 0;
+  while (iFrame < iFrames)
+  {
+    int iCount = std::min(iFrames - iFrame, m_iSubBlockSamples - m_iSubBlockPos);
+    const int16_t* pFrameIn = pSamples + iFrame * m_iChannels;
+    int c = 0;
+#ifdef LOUDNESS_METER_SSE2
+    for (; c + 2 <= m_iChannels; c += 2) kWeightPair(pFrameIn, iCount, c);
+#endif
+    for (; c < m_iChannels; ++c) kWeight(pFrameIn, iCount, c);
+    m_dSubBlockSquares += sumOfSquares(pFrameIn, iCount * m_iChannels) * (dScale * dScale);
+    m_iSubBlockPos += iCount;
+    iFrame += iCount;
+    if (m_iSubBlockPos == m_iSubBlockSamples) endSubBlock();
+  }
+
+  // sample peak and clipping: cheap, done for every frame. Only a frame that reaches full scale is searched for the
+  // clipped samples.
+  const int iSamples = iFrames * m_iChannels;
+  int iMax = 0, iMin = 0;
+  int i = 0;
+#ifdef LOUDNESS_METER_SSE2
+  __m128i max = _mm_setzero_si128(), min = _mm_setzero_si128();
+  for (; i + 8 <= iSamples; i += 8)
+  {
+    const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSamples + i));
+    max = _mm_max_epi16(max, in);
+    min = _mm_min_epi16(min, in);
+  }
+  int16_t vMax[8], vMin[8];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(vMax), max);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(vMin), min);
+  iMax = *std::max_element(vMax, vMax + 8);
+  iMin = *std::min_element(vMin, vMin + 8);
+#endif
+  for (; i < iSamples; ++i)
+  {
+    iMax = std::max(iMax, static_cast<int>(pSamples[i]));
+    iMin = std::min(iMin, static_cast<int>(pSamples[i]));
+  }
+  const int iPeak = std::max(iMax, -iMin);
+  uint64_t uiClipped = 0;
+  if (iPeak >= 32767)
+  {
+    for (i = 0; i < iSamples; ++i) uiClipped += (std::abs(static_cast<int>(pSamples[i])) >= 32767) ? 1 : 0;
+  }
+  double dPeak = iPeak * dScale;
+  if (dPeak > TRUE_PEAK_MIN_LEVEL && dPeak * TRUE_PEAK_HEADROOM > m_dTruePeak)
+  {
+    processTruePeak(pSamples, iFrames);
+  }
+  else
+  {
+    updateHistory(pSamples, iFrames);
+  }
+
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_stats.clippedSamples += uiClipped;
+  if (dPeak > m_dSamplePeak)
+  {
+    m_dSamplePeak = dPeak;
+    m_stats.samplePeakDb = 20.0 * std::log10(dPeak);
+  }
+  m_dTruePeak = std::max(m_dTruePeak, m_dSamplePeak);
+  m_stats.truePeakDb = m_dTruePeak > 0.0 ? 20.0 * std::log10(m_dTruePeak) : -HUGE_VAL;
+}
+
+void LoudnessMeter::kWeight(const int16_t* pSamples, int iFrames, int iChannel)
+{
+  // the shelf takes the samples unscaled
+  const double dScale = 1.0 / 32768.0;
+  const double b0 = m_shelf.b0 * dScale, b1 = m_shelf.b1 * dScale, b2 = m_shelf.b2 * dScale;
+  const double a1 = m_shelf.a1, a2 = m_shelf.a2;
+  const double ha1 = m_highPass.a1, ha2 = m_highPass.a2;
+  double* pState = &m_vState[iChannel * 6];
+  double x1 = pState[0], x2 = pState[1], y1 = pState[2], y2 = pState[3], z1 = pState[4], z2 = pState[5];
+  double d1 = y1 - y2;
+  double dSum = 0.0;
+  for (int i = 0; i < iFrames; ++i)
+  {
+    const double x = pSamples[i * m_iChannels + iChannel];
+    // direct form I: only the feedback of the last output is on the critical path of the recursion. The numerator
+    // 1, -2, 1 of the high pass is the difference of the first differences of the shelf output.
+    const double y = (b0 * x + b1 * x1 + b2 * x2 - a2 * y2) - a1 * y1;
+    const double d = y - y1;
+    const double z = ((d - d1) - ha2 * z2) - ha1 * z1;
+    x2 = x1;
+    x1 = x;
+    y2 = y1;
+    y1 = y;
+    d1 = d;
+    z2 = z1;
+    z1 = z;
+    dSum += z * z;
+  }
+  pState[0] = x1;
+  pState[1] = x2;
+  pState[2] = y1;
+  pState[3] = y2;
+  pState[4] = z1;
+  pState[5] = z2;
+  m_vSubBlockSum[iChannel] += dSum;
+}
+
+void LoudnessMeter::kWeightPair(const int16_t* pSamples, int iFrames, int iChannel)
+{
+#ifdef LOUDNESS_METER_SSE2
+  const __m128d scale = _mm_set1_pd(1.0 / 32768.0);
+  const __m128d b0 = _mm_mul_pd(_mm_set1_pd(m_shelf.b0), scale), b1 = _mm_mul_pd(_mm_set1_pd(m_shelf.b1), scale);
+  const __m128d b2 = _mm_mul_pd(_mm_set1_pd(m_shelf.b2), scale);
+  const __m128d a1 = _mm_set1_pd(m_shelf.a1), a2 = _mm_set1_pd(m_shelf.a2);
+  const __m128d ha1 = _mm_set1_pd(m_highPass.a1), ha2 = _mm_set1_pd(m_highPass.a2);
+  double* pState0 = &m_vState[iChannel * 6];
+  double* pState1 = &m_vState[(iChannel + 1) * 6];
+  __m128d x1 = _mm_set_pd(pState1[0], pState0[0]), x2 = _mm_set_pd(pState1[1], pState0[1]);
+  __m128d y1 = _mm_set_pd(pState1[2], pState0[2]), y2 = _mm_set_pd(pState1[3], pState0[3]);
+  __m128d z1 = _mm_set_pd(pState1[4], pState0[4]), z2 = _mm_set_pd(pState1[5], pState0[5]);
+  __m128d d1 = _mm_sub_pd(y1, y2);
+  __m128d sum = _mm_setzero_pd();
+  const int16_t* pIn = pSamples + iChannel;
+  for (int i = 0; i < iFrames; ++i, pIn += m_iChannels)
+  {
+    // as in kWeight
+    const __m128d x = _mm_set_pd(pIn[1], pIn[0]);
+    const __m128d y = _mm_sub_pd(_mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(b0, x), _mm_mul_pd(b1, x1)), _mm_mul_pd(b2, x2)),
+      _mm_mul_pd(a2, y2)), _mm_mul_pd(a1, y1));
+    const __m128d d = _mm_sub_pd(y, y1);
+    const __m128d z = _mm_sub_pd(_mm_sub_pd(_mm_sub_pd(d, d1), _mm_mul_pd(ha2, z2)), _mm_mul_pd(ha1, z1));
+    x2 = x1;
+    x1 = x;
+    y2 = y1;
+    y1 = y;
+    d1 = d;
+    z2 = z1;
+    z1 = z;
+    sum = _mm_add_pd(sum, _mm_mul_pd(z, z));
+  }
+  double vLanes[2];
+  _mm_storeu_pd(vLanes, x1);
+  pState0[0] = vLanes[0];
+  pState1[0] = vLanes[1];
+  _mm_storeu_pd(vLanes, x2);
+  pState0[1] = vLanes[0];
+  pState1[1] = vLanes[1];
+  _mm_storeu_pd(vLanes, y1);
+  pState0[2] = vLanes[0];
+  pState1[2] = vLanes[1];
+  _mm_storeu_pd(vLanes, y2);
+  pState0[3] = vLanes[0];
+  pState1[3] = vLanes[1];
+  _mm_storeu_pd(vLanes, z1);
+  pState0[4] = vLanes[0];
+  pState1[4] = vLanes[1];
+  _mm_storeu_pd(vLanes, z2);
+  pState0[5] = vLanes[0];
+  pState1[5] = vLanes[1];
+  _mm_storeu_pd(vLanes, sum);
+  m_vSubBlockSum[iChannel] += vLanes[0];
+  m_vSubBlockSum[iChannel + 1] += vLanes[1];
+#else
+  kWeight(pSamples, iFrames, iChannel);
+  kWeight(pSamples, iFrames, iChannel + 1);
+#endif
+}
+
+void LoudnessMeter::processTruePeak(const int16_t* pSamples, int iFrames)
+{
+  const float fScale = 1.0f / 32768.0f;
+  // whole blocks: the samples after the frame are zero and their interpolation is not counted
+  const int iBlocks = (iFrames + TRUE_PEAK_BLOCK - 1) / TRUE_PEAK_BLOCK;
+  m_vTruePeakInput.resize(TRUE_PEAK_TAPS + iBlocks * TRUE_PEAK_BLOCK);
+  std::fill(m_vTruePeakInput.begin() + TRUE_PEAK_TAPS + iFrames, m_vTruePeakInput.end(), 0.0f);
+  float* pInput = m_vTruePeakInput.data();
+  const float* pTaps = m_vTruePeakTaps.data();
+  // a block can only raise the true peak if the gain of the filter lifts its input peak above it
+  const float fThreshold = static_cast<float>(m_dTruePeak) / m_fTruePeakGain;
+  float fPeak = 0.0f;
+#ifdef LOUDNESS_METER_SSE2
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  const __m128 threshold = _mm_set1_ps(fThreshold);
+  __m128 peak = _mm_setzero_ps();
+#endif
+  for (int c = 0; c < m_iChannels; ++c)
+  {
+    // the history followed by the frame, contiguous so that the filter vectorises over the outputs
+    float* pHistory = &m_vTruePeakHistory[c * TRUE_PEAK_TAPS];
+    std::copy(pHistory, pHistory + TRUE_PEAK_TAPS, pInput);
+    for (int i = 0; i < iFrames; ++i)
+    {
+      pInput[TRUE_PEAK_TAPS + i] = pSamples[i * m_iChannels + c] * fScale;
+    }
+    for (int b = 0; b < iBlocks; ++b)
+    {
+      const float* pIn = pInput + 1 + b * TRUE_PEAK_BLOCK;
+#ifdef LOUDNESS_METER_SSE2
+      // the 19 inputs of the block in five overlapping loads
+      __m128 inputPeak = _mm_max_ps(_mm_and_ps(absMask, _mm_loadu_ps(pIn)), _mm_and_ps(absMask, _mm_loadu_ps(pIn + 4)));
+      inputPeak = _mm_max_ps(inputPeak, _mm_and_ps(absMask, _mm_loadu_ps(pIn + 8)));
+      inputPeak = _mm_max_ps(inputPeak, _mm_and_ps(absMask, _mm_loadu_ps(pIn + 12)));
+      inputPeak = _mm_max_ps(inputPeak, _mm_and_ps(absMask, _mm_loadu_ps(pIn + TRUE_PEAK_BLOCK + TRUE_PEAK_TAPS - 5)));
+      if (_mm_movemask_ps(_mm_cmpgt_ps(inputPeak, threshold)) == 0) continue;
+#else
+      float fInputPeak = 0.0f;
+      for (int i = 0; i < TRUE_PEAK_BLOCK + TRUE_PEAK_TAPS - 1; ++i) fInputPeak = std::max(fInputPeak, std::fabs(pIn[i]));
+      if (fInputPeak <= fThreshold) continue;
+#endif
+      // the three interpolating phases share the loads of the input and their sums stay in registers
+      float vPhases[3][TRUE_PEAK_BLOCK];
+#ifdef LOUDNESS_METER_SSE2
+      __m128 phase1Lo = _mm_setzero_ps(), phase1Hi = _mm_setzero_ps(), phase2Lo = _mm_setzero_ps(), phase2Hi = _mm_setzero_ps();
+      __m128 phase3Lo = _mm_setzero_ps(), phase3Hi = _mm_setzero_ps();
+      for (int k = 0; k < TRUE_PEAK_TAPS; ++k)
+      {
+        const __m128 lo = _mm_loadu_ps(pIn + k), hi = _mm_loadu_ps(pIn + k + 4);
+        const __m128 tap1 = _mm_set1_ps(pTaps[TRUE_PEAK_TAPS + k]);
+        const __m128 tap2 = _mm_set1_ps(pTaps[2 * TRUE_PEAK_TAPS + k]);
+        const __m128 tap3 = _mm_set1_ps(pTaps[3 * TRUE_PEAK_TAPS + k]);
+        phase1Lo = _mm_add_ps(phase1Lo, _mm_mul_ps(tap1, lo));
+        phase1Hi = _mm_add_ps(phase1Hi, _mm_mul_ps(tap1, hi));
+        phase2Lo = _mm_add_ps(phase2Lo, _mm_mul_ps(tap2, lo));
+        phase2Hi = _mm_add_ps(phase2Hi, _mm_mul_ps(tap2, hi));
+        phase3Lo = _mm_add_ps(phase3Lo, _mm_mul_ps(tap3, lo));
+        phase3Hi = _mm_add_ps(phase3Hi, _mm_mul_ps(tap3, hi));
+      }
+      if (b * TRUE_PEAK_BLOCK + TRUE_PEAK_BLOCK <= iFrames)
+      {
+        peak = _mm_max_ps(peak, _mm_and_ps(absMask, _mm_max_ps(_mm_max_ps(phase1Lo, phase2Lo), phase3Lo)));
+        peak = _mm_max_ps(peak, _mm_and_ps(absMask, _mm_max_ps(_mm_max_ps(phase1Hi, phase2Hi), phase3Hi)));
+        peak = _mm_max_ps(peak, _mm_and_ps(absMask, _mm_min_ps(_mm_min_ps(phase1Lo, phase2Lo), phase3Lo)));
+        peak = _mm_max_ps(peak, _mm_and_ps(absMask, _mm_min_ps(_mm_min_ps(phase1Hi, phase2Hi), phase3Hi)));
+        continue;
+      }
+      _mm_storeu_ps(vPhases[0], phase1Lo);
+      _mm_storeu_ps(vPhases[0] + 4, phase1Hi);
+      _mm_storeu_ps(vPhases[1], phase2Lo);
+      _mm_storeu_ps(vPhases[1] + 4, phase2Hi);
+      _mm_storeu_ps(vPhases[2], phase3Lo);
+      _mm_storeu_ps(vPhases[2] + 4, phase3Hi);
+#else
+      std::fill(&vPhases[0][0], &vPhases[0][0] + 3 * TRUE_PEAK_BLOCK, 0.0f);
+      for (int k = 0; k < TRUE_PEAK_TAPS; ++k)
+      {
+        for (int p = 0; p < 3; ++p)
+        {
+          const float fTap = pTaps[(p + 1) * TRUE_PEAK_TAPS + k];
+          for (int i = 0; i < TRUE_PEAK_BLOCK; ++i) vPhases[p][i] += fTap * pIn[k + i];
+        }
+      }
+#endif
+      // the interpolation past the end of the frame is done with the next frame
+      const int iOutputs = std::min(TRUE_PEAK_BLOCK, iFrames - b * TRUE_PEAK_BLOCK);
+      for (int p = 0; p < 3; ++p)
+      {
+        for (int i = 0; i < iOutputs; ++i) fPeak = std::max(fPeak, std::fabs(vPhases[p][i]));
+      }
+    }
+    std::copy(pInput + iFrames, pInput + iFrames + TRUE_PEAK_TAPS, pHistory);
+  }
+#ifdef LOUDNESS_METER_SSE2
+  float vPeak[4];
+  _mm_storeu_ps(vPeak, peak);
+  fPeak = std::max(fPeak, *std::max_element(vPeak, vPeak + 4));
+#endif
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_dTruePeak = std::max(m_dTruePeak, static_cast<double>(fPeak));
+}
+
+void LoudnessMeter::updateHistory(const int16_t* pSamples, int iFrames)
+{
+  const float fScale = 1.0f / 32768.0f;
+  int iKeep = std::min(iFrames, TRUE_PEAK_TAPS);
+  for (int c = 0; c < m_iChannels; ++c)
+  {
+    float* pHistory = &m_vTruePeakHistory[c * TRUE_PEAK_TAPS];
+    std::copy(pHistory + iKeep, pHistory + TRUE_PEAK_TAPS, pHistory);
+    for (int i = 0; i < iKeep; ++i)
+    {
+      pHistory[TRUE_PEAK_TAPS - iKeep + i] = pSamples[(iFrames - iKeep + i) * m_iChannels + c] * fScale;
+    }
+  }
+}
+
+void LoudnessMeter::endSubBlock()
+{
+  // channel weights: 1.0 for the front channels, 1.41 for the surround channels of 5.1
+  double dEnergy = 0.0;
+  for (int c = 0; c < m_iChannels; ++c)
+  {
+    double dWeight = (m_iChannels > 4 && c >= 4) ? 1.41 : 1.0;
+    if (m_iChannels == 6 && c == 3) dWeight = 0.0; // LFE
+    dEnergy += dWeight * m_vSubBlockSum[c] / m_iSubBlockSamples;
+    m_vSubBlockSum[c] = 0.0;
+  }
+  m_vSubBlocks[m_iSubBlockCount % SHORT_TERM_SUB_BLOCKS] = dEnergy;
+  m_vSubBlockSquares[m_iSubBlockCount % MOMENTARY_SUB_BLOCKS] = m_dSubBlockSquares / (static_cast<double>(m_iSubBlockSamples) * m_iChannels);
+  m_dSubBlockSquares = 0.0;
+  m_iSubBlockPos = 0;
+  ++m_iSubBlockCount;
+
+  int iMomentary = std::min(m_iSubBlockCount, MOMENTARY_SUB_BLOCKS);
+  int iShortTerm = std::min(m_iSubBlockCount, SHORT_TERM_SUB_BLOCKS);
+  double dMomentary = 0.0, dShortTerm = 0.0, dSquares = 0.0;
+  for (int i = 0; i < iShortTerm; ++i)
+  {
+    double e = m_vSubBlocks[(m_iSubBlockCount - 1 - i) % SHORT_TERM_SUB_BLOCKS];
+    if (i < iMomentary)
+    {
+      dMomentary += e;
+      dSquares += m_vSubBlockSquares[(m_iSubBlockCount - 1 - i) % MOMENTARY_SUB_BLOCKS];
+    }
+    dShortTerm += e;
+  }
+  dMomentary /= iMomentary;
+  dShortTerm /= iShortTerm;
+
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_stats.momentaryLufs = toLufs(dMomentary);
+  m_stats.shortTermLufs = toLufs(dShortTerm);
+  m_stats.rmsDb = dSquares > 0.0 ? 10.0 * std::log10(dSquares / iMomentary) : -HUGE_VAL;
+  // gating blocks of 400 ms overlap by 75%: one ends with every sub-block
+  if (m_iSubBlockCount >= MOMENTARY_SUB_BLOCKS && m_stats.momentaryLufs > ABSOLUTE_GATE_LUFS)
+  {
+    int iBin = static_cast<int>((m_stats.momentaryLufs - ABSOLUTE_GATE_LUFS) / HISTOGRAM_RESOLUTION_LU);
+    iBin = std::min(iBin, HISTOGRAM_BINS - 1);
+    ++m_vHistogramCounts[iBin];
+    m_vHistogramEnergy[iBin] += dMomentary;
+  }
+}
+
+double LoudnessMeter::toLufs(double dEnergy)
+{
+  return dEnergy > 0.0 ? -0.691 + 10.0 * std::log10(dEnergy) : -HUGE_VAL;
+}
+
+LoudnessMeter::Stats LoudnessMeter::getStats() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  Stats stats = m_stats;
+  // integrated loudness: the blocks above the absolute gate determine the relative gate
+  uint64_t uiCount = 0;
+  double dEnergy = 0.0;
+  for (int i = 0; i < HISTOGRAM_BINS; ++i)
+  {
+    uiCount += m_vHistogramCounts[i];
+    dEnergy += m_vHistogramEnergy[i];
+  }
+  if (uiCount == 0) return stats;
+  double dRelativeGate = toLufs(dEnergy / uiCount) + RELATIVE_GATE_LU;
+  int iFirstBin = std::max(0, static_cast<int>(std::ceil((dRelativeGate - ABSOLUTE_GATE_LUFS) / HISTOGRAM_RESOLUTION_LU)));
+  uiCount = 0;
+  dEnergy = 0.0;
+  for (int i = iFirstBin; i < HISTOGRAM_BINS; ++i)
+  {
+    uiCount += m_vHistogramCounts[i];
+    dEnergy += m_vHistogramEnergy[i];
+  }
+  if (uiCount > 0) stats.integratedLufs = toLufs(dEnergy / uiCount);
+  return stats;
+}
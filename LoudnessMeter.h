@@ -0,0 +1,134 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: LoudnessMeter.h
+
+DESCRIPTION			: EBU R128 loudness, true peak and RMS metering
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Measures loudness according to ITU-R BS.1770-4 / EBU R128, the true peak and the RMS of 16 bit PCM.
+ *
+ * The K-weighted mean square is accumulated in 100 ms sub-blocks from which the momentary (400 ms) and short-term
+ * (3 s) loudness are derived. The gating blocks for the integrated loudness are kept in a 0.1 LU histogram so that
+ * the memory does not grow with the duration of the stream.
+ *
+ * The true peak is measured by 4x oversampling. To keep the cost negligible only frames that could raise it are
+ * oversampled: frames whose sample peak is above -12 dBFS and within 6 dB of the highest true peak so far. Below
+ * -12 dBFS the sample peak is reported, since inter-sample peaks there cannot come near clipping. Within a frame,
+ * blocks whose samples the gain of the interpolation filter cannot lift above the true peak so far are skipped.
+ */
+class LoudnessMeter
+{
+public:
+  struct Stats
+  {
+    /// LUFS, -inf (as -HUGE_VAL) until there is enough audio
+    double momentaryLufs;
+    double shortTermLufs;
+    double integratedLufs;
+    /// maximum since the last reset in dBTP
+    double truePeakDb;
+    /// maximum sample peak since the last reset in dBFS
+    double samplePeakDb;
+    /// RMS of the last 400 ms in dBFS
+    double rmsDb;
+    /// samples at full scale since the last reset
+    uint64_t clippedSamples;
+  };
+
+  LoudnessMeter(int samplesPerSecond, int channels);
+  /**
+   * @brief Meters one frame of interleaved 16 bit PCM
+   */
+  void process(const int16_t* pSamples, int iFrames);
+  /**
+   * @brief Restarts the integrated loudness and the peak maxima
+   */
+  void reset();
+  Stats getStats() const;
+
+private:
+  struct Biquad
+  {
+    double b0, b1, b2, a1, a2;
+  };
+
+  /**
+   * @brief K-weights the channel iChannel and adds its energy to the sub-block
+   */
+  void kWeight(const int16_t* pSamples, int iFrames, int iChannel);
+  /**
+   * @brief K-weights the channels iChannel and iChannel + 1 in the two lanes of a vector
+   */
+  void kWeightPair(const int16_t* pSamples, int iFrames, int iChannel);
+  void processTruePeak(const int16_t* pSamples, int iFrames);
+  void updateHistory(const int16_t* pSamples, int iFrames);
+  void endSubBlock();
+  static double toLufs(double dEnergy);
+
+  int m_iSamplesPerSecond;
+  int m_iChannels;
+  Biquad m_shelf;
+  Biquad m_highPass;
+  /// per channel direct form I state of both biquads: the last two unscaled inputs, shelf outputs and high pass outputs
+  std::vector<double> m_vState;
+
+  int m_iSubBlockSamples;
+  int m_iSubBlockPos;
+  /// K-weighted energy of the current sub-block per channel
+  std::vector<double> m_vSubBlockSum;
+  /// unweighted energy of the current sub-block
+  double m_dSubBlockSquares;
+  /// ring of the channel-weighted energies of the last 30 sub-blocks
+  std::vector<double> m_vSubBlocks;
+  std::vector<double> m_vSubBlockSquares;
+  int m_iSubBlockCount;
+
+  /// 4x oversampling filter: 4 phases of 12 taps
+  std::vector<float> m_vTruePeakTaps;
+  /// the largest sum of the absolute taps of a phase: no interpolated sample exceeds the input peak by more
+  float m_fTruePeakGain;
+  /// last 12 samples per channel, oldest first
+  std::vector<float> m_vTruePeakHistory;
+  /// history and frame of the channel being oversampled
+  std::vector<float> m_vTruePeakInput;
+
+  mutable std::mutex m_lock;
+  /// gating block histogram: counts and energies per 0.1 LU bin from -70 LUFS
+  std::vector<uint32_t> m_vHistogramCounts;
+  std::vector<double> m_vHistogramEnergy;
+  Stats m_stats;
+  double m_dTruePeak;
+  double m_dSamplePeak;
+};
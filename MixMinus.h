@@ -0,0 +1,223 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: MixMinus.h
+
+DESCRIPTION			: Conference mix-minus mixer
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MIX_MINUS_SSE2
+#endif
+
+/**
+ * @brief Builds N mix-minus outputs for N conference participants from a single full mix.
+ *
+ * The sum of all active participants is computed once per frame. Each active speaker receives
+ * the full mix minus its own contribution. Receivers that do not contribute to the mix (listen-only
+ * participants or participants whose frame is silent) would receive exactly the full mix: they all
+ * share mix 0 so that the full mix only has to be encoded once. The number of distinct mixes and
+ * thus encodes per frame is (active speakers + 1).
+ *
+ * Moving a receiver between its own mix and the shared one moves its stream to another encoder, which the
+ * decoder has to be told about. A speaker therefore keeps its own mix for a hold time after it stops contributing
+ * so that pauses between words don't move it back and forth.
+ *
+ * Accumulation is done in 32 bit and each output mix is saturated to 16 bit once, since saturating
+ * the intermediate sum would make the subtraction inexact.
+ */
+class MixMinusMixer
+{
+public:
+  /// index of the shared full mix
+  static const int FULL_MIX = 0;
+  /// frames a speaker keeps its own mix after it stops contributing
+  static const int DEFAULT_HOLD_FRAMES = 50;
+
+  MixMinusMixer(int participants, int samplesPerFrame)
+    :m_participants(participants),
+    m_samplesPerFrame(samplesPerFrame),
+    m_holdFrames(DEFAULT_HOLD_FRAMES),
+    m_vActive(participants, true),
+    m_vHold(participants, 0),
+    m_vMixIndex(participants, FULL_MIX),
+    m_vSum(samplesPerFrame),
+    m_vMixes((participants + 1) * samplesPerFrame),
+    m_mixCount(1)
+  {
+  }
+
+  int getParticipants() const { return m_participants; }
+  int getSamplesPerFrame() const { return m_samplesPerFrame; }
+  /**
+   * @brief Marks a participant as (in)active e.g. from VAD or floor control. Inactive participants
+   * are excluded from the mix and receive the shared full mix.
+   */
+  void setActive(int participant, bool bActive) { m_vActive[participant] = bActive; }
+  bool isActive(int participant) const { return m_vActive[participant]; }
+  /**
+   * @brief Sets the number of frames a speaker keeps its own mix after it goes inactive or silent. 0 moves it to the
+   * shared full mix with the first frame it doesn't contribute to.
+   */
+  void setHoldFrames(int frames) { m_holdFrames = frames; }
+  int getHoldFrames() const { return m_holdFrames; }
+  /**
+   * @brief Mixes one frame.
+   * @param ppInputs ppInputs[i] points to getSamplesPerFrame() interleaved samples of participant i
+   * @return the number of distinct mixes that have to be encoded
+   */
+  int mix(const int16_t* const* ppInputs)
+  {
+    int32_t* pSum = m_vSum.data();
+    std::fill(m_vSum.begin(), m_vSum.end(), 0);
+
+    // build the full sum once over all participants that actually contribute
+    for (int i = 0; i < m_participants; ++i)
+    {
+      if (m_vActive[i] && !isSilent(ppInputs[i]))
+      {
+        accumulate(pSum, ppInputs[i]);
+        m_vHold[i] = m_holdFrames + 1;
+      }
+      else if (m_vHold[i] > 0)
+      {
+        --m_vHold[i];
+      }
+      // assigned below
+      m_vMixIndex[i] = m_vHold[i] > 0 ? -1 : FULL_MIX;
+    }
+    saturate(pSum, nullptr, getMix(FULL_MIX));
+
+    // derive the mix-minus of each contributor by subtraction. A speaker in its hold time gets the full mix on
+    // its own encoder: a silent frame subtracts nothing and an inactive participant isn't in the sum.
+    m_mixCount = 1;
+    for (int i = 0; i < m_participants; ++i)
+    {
+      if (m_vMixIndex[i] == FULL_MIX) continue;
+      m_vMixIndex[i] = m_mixCount;
+      saturate(pSum, m_vActive[i] ? ppInputs[i] : nullptr, getMix(m_mixCount));
+      ++m_mixCount;
+    }
+    return m_mixCount;
+  }
+  /**
+   * @brief the number of distinct mixes produced by the last call to mix()
+   */
+  int getMixCount() const { return m_mixCount; }
+  /**
+   * @brief the index of the mix that receiver i should be sent. Receivers with the same index share the encode.
+   */
+  int getMixIndex(int receiver) const { return m_vMixIndex[receiver]; }
+  const int16_t* getMix(int mixIndex) const { return m_vMixes.data() + mixIndex * m_samplesPerFrame; }
+  int16_t* getMix(int mixIndex) { return m_vMixes.data() + mixIndex * m_samplesPerFrame; }
+
+private:
+
+  bool isSilent(const int16_t* pIn) const
+  {
+    int i = 0;
+#ifdef MIX_MINUS_SSE2
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= m_samplesPerFrame; i += 8)
+    {
+      acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + i)));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) return false;
+#endif
+    for (; i < m_samplesPerFrame; ++i)
+    {
+      if (pIn[i]) return false;
+    }
+    return true;
+  }
+
+  void accumulate(int32_t* pSum, const int16_t* pIn) const
+  {
+    int i = 0;
+#ifdef MIX_MINUS_SSE2
+    for (; i + 8 <= m_samplesPerFrame; i += 8)
+    {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + i));
+      // sign extend to 32 bit
+      __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+      __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+      __m128i* pS = reinterpret_cast<__m128i*>(pSum + i);
+      _mm_storeu_si128(pS, _mm_add_epi32(_mm_loadu_si128(pS), lo));
+      _mm_storeu_si128(pS + 1, _mm_add_epi32(_mm_loadu_si128(pS + 1), hi));
+    }
+#endif
+    for (; i < m_samplesPerFrame; ++i)
+    {
+      pSum[i] += pIn[i];
+    }
+  }
+
+  /// writes saturate(sum - own) or saturate(sum) if pOwn is null
+  void saturate(const int32_t* pSum, const int16_t* pOwn, int16_t* pOut) const
+  {
+    int i = 0;
+#ifdef MIX_MINUS_SSE2
+    for (; i + 8 <= m_samplesPerFrame; i += 8)
+    {
+      __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSum + i));
+      __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSum + i + 4));
+      if (pOwn)
+      {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pOwn + i));
+        lo = _mm_sub_epi32(lo, _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+        hi = _mm_sub_epi32(hi, _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pOut + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i < m_samplesPerFrame; ++i)
+    {
+      int32_t v = pOwn ? pSum[i] - pOwn[i] : pSum[i];
+      pOut[i] = static_cast<int16_t>(v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : v));
+    }
+  }
+
+  int m_participants;
+  int m_samplesPerFrame;
+  int m_holdFrames;
+  std::vector<bool> m_vActive;
+  /// frames left before a participant that stopped contributing moves to the full mix, counting the current one
+  std::vector<int> m_vHold;
+  std::vector<int> m_vMixIndex;
+  std::vector<int32_t> m_vSum;
+  /// slot 0 is the full mix, slots 1..N the mix-minus of the contributing and held participants
+  std::vector<int16_t> m_vMixes;
+  int m_mixCount;
+};
@@ -0,0 +1,172 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: NumaArena.cpp
+
+DESCRIPTION			: Node-local, cache-line aligned storage for the buffers of a stream
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "NumaArena.h"
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+/// the huge page size on x86-64 and most aarch64 configurations
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+#endif
+
+static size_t roundUp(size_t uiSize, size_t uiMultiple)
+{
+  return (uiSize + uiMultiple - 1) / uiMultiple * uiMultiple;
+}
+
+int NumaArena::getCurrentNode()
+{
+#ifdef _WIN32
+  PROCESSOR_NUMBER processor;
+  GetCurrentProcessorNumberEx(&processor);
+  USHORT uiNode = 0;
+  if (!GetNumaProcessorNodeEx(&processor, &uiNode)) return 0;
+  return uiNode;
+#elif defined(__linux__)
+  unsigned uiCpu = 0;
+  unsigned uiNode = 0;
+  if (syscall(SYS_getcpu, &uiCpu, &uiNode, nullptr) != 0) return 0;
+  return static_cast<int>(uiNode);
+#else
+  return 0;
+#endif
+}
+
+NumaArena::NumaArena(size_t uiCapacity, int iNode, bool bHugePages)
+  :m_pBlock(nullptr),
+  m_uiCapacity(0),
+  m_uiUsed(0),
+  m_iNode(iNode < 0 ? getCurrentNode() : iNode),
+  m_bHugePages(false)
+{
+#ifdef _WIN32
+  if (bHugePages)
+  {
+    // needs SeLockMemoryPrivilege: fall back to normal pages without it
+    const SIZE_T uiLargePage = GetLargePageMinimum();
+    if (uiLargePage > 0)
+    {
+      const size_t uiSize = roundUp(uiCapacity, uiLargePage);
+      m_pBlock = static_cast<uint8_t*>(VirtualAllocExNuma(GetCurrentProcess(), nullptr, uiSize,
+        MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, static_cast<DWORD>(m_iNode)));
+      if (m_pBlock)
+      {
+        m_uiCapacity = uiSize;
+        m_bHugePages = true;
+      }
+    }
+  }
+  if (!m_pBlock)
+  {
+    m_pBlock = static_cast<uint8_t*>(VirtualAllocExNuma(GetCurrentProcess(), nullptr, uiCapacity,
+      MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, static_cast<DWORD>(m_iNode)));
+    if (m_pBlock) m_uiCapacity = uiCapacity;
+  }
+#else
+  size_t uiSize = uiCapacity;
+  void* pBlock = MAP_FAILED;
+#if defined(__linux__)
+  if (bHugePages)
+  {
+    // reserved huge pages first, then transparent huge pages
+    uiSize = roundUp(uiCapacity, HUGE_PAGE_SIZE);
+    pBlock = mmap(nullptr, uiSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (pBlock != MAP_FAILED)
+    {
+      m_bHugePages = true;
+    }
+  }
+#endif
+  if (pBlock == MAP_FAILED)
+  {
+    pBlock = mmap(nullptr, uiSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (pBlock != MAP_FAILED && bHugePages)
+    {
+      m_bHugePages = madvise(pBlock, uiSize, MADV_HUGEPAGE) == 0;
+    }
+#endif
+  }
+  if (pBlock != MAP_FAILED)
+  {
+    m_pBlock = static_cast<uint8_t*>(pBlock);
+    m_uiCapacity = uiSize;
+#if defined(__linux__)
+    // without the policy the pages still follow the first touch below, i.e. the calling thread
+    if (m_iNode < static_cast<int>(sizeof(unsigned long) * 8))
+    {
+      unsigned long uiNodeMask = 1UL << m_iNode;
+      syscall(SYS_mbind, m_pBlock, m_uiCapacity, MPOL_PREFERRED, &uiNodeMask, sizeof(uiNodeMask) * 8, 0);
+    }
+#endif
+  }
+#endif
+  if (m_pBlock)
+  {
+    // commit the pages now rather than on the first encode
+    memset(m_pBlock, 0, m_uiCapacity);
+  }
+}
+
+NumaArena::~NumaArena()
+{
+  if (!m_pBlock) return;
+#ifdef _WIN32
+  VirtualFree(m_pBlock, 0, MEM_RELEASE);
+#else
+  munmap(m_pBlock, m_uiCapacity);
+#endif
+}
+
+uint8_t* NumaArena::allocate(size_t uiSize)
+{
+  // padded to whole cache lines so that the next buffer starts on its own line
+  const size_t uiPadded = roundUp(uiSize, CACHE_LINE_SIZE);
+  if (!m_pBlock || uiPadded > m_uiCapacity - m_uiUsed) return nullptr;
+  uint8_t* p = m_pBlock + m_uiUsed;
+  m_uiUsed += uiPadded;
+  return p;
+}
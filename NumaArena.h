@@ -0,0 +1,85 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: NumaArena.h
+
+DESCRIPTION			: Node-local, cache-line aligned storage for the buffers of a stream
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief One block of memory on a NUMA node from which the buffers of a stream are carved.
+ *
+ * The framing buffer and the packet buffers of a stream are placed next to each other on the node of the
+ * thread that encodes the stream instead of wherever the heap happens to have space. Allocations are cache-line
+ * aligned and padded so that the buffers of different streams never share a cache line. The arena only grows:
+ * everything is released together when it is destroyed.
+ *
+ * The block is backed by huge pages if requested and available, otherwise by normal pages. It is touched when
+ * it is created so that the pages are committed on the node up front instead of on the first encode.
+ */
+class NumaArena
+{
+public:
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  /**
+   * @param uiCapacity the size of the block in bytes
+   * @param iNode the node to allocate on, -1 for the node of the calling thread
+   * @param bHugePages true to try huge pages
+   */
+  NumaArena(size_t uiCapacity, int iNode = -1, bool bHugePages = false);
+  ~NumaArena();
+  /**
+   * @brief Carves a cache-line aligned buffer from the block
+   * @return null if the block is exhausted: the caller falls back to the heap
+   */
+  uint8_t* allocate(size_t uiSize);
+  /// the node the block was placed on, -1 if unknown
+  int getNode() const { return m_iNode; }
+  bool usesHugePages() const { return m_bHugePages; }
+  size_t getCapacity() const { return m_uiCapacity; }
+  size_t getUsed() const { return m_uiUsed; }
+  /**
+   * @brief the NUMA node of the processor the calling thread is running on, 0 if the system can't tell
+   */
+  static int getCurrentNode();
+
+private:
+  NumaArena(const NumaArena&) = delete;
+  NumaArena& operator=(const NumaArena&) = delete;
+
+  uint8_t* m_pBlock;
+  size_t m_uiCapacity;
+  size_t m_uiUsed;
+  int m_iNode;
+  bool m_bHugePages;
+};
@@ -0,0 +1,819 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: OpusEncodeEngine.cpp
+
+DESCRIPTION			: Portable Opus encode engine: AudioBuffer framing + ICodecv2 encoding
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "OpusEncodeEngine.h"
+#include <algorithm>
+#include <chrono>
+#include "EncoderGovernor.h"
+#include "FilterParameters.h"
+#include "OpusPacket.h"
+
+//Codec classes
+#include <OpusCodec/OpusFactory.h>
+#include <CodecUtils/ICodecv2.h>
+
+// an Opus packet of 120 ms: 6 frames of at most 1275 bytes plus the framing bytes
+static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+static const int INITIAL_PACKETS = 64;
+static const size_t PACKET_STORAGE_SIZE = INITIAL_PACKETS * ((MAX_PACKET_SIZE + NumaArena::CACHE_LINE_SIZE - 1) & ~(NumaArena::CACHE_LINE_SIZE - 1));
+static const double METERING_OVERHEAD_SMOOTHING = 0.01;
+
+OpusEncodeEngine::OpusEncodeEngine()
+  :m_pCodec(nullptr),
+  m_bOpen(false),
+  m_iMaxComprSize(0),
+  m_iSamplesPerSecond(0),
+  m_iChannels(0),
+  m_iBitsPerSample(0),
+  m_uiTargetBitrateKbps(0),
+  m_eFrameDuration(OpusFrameDuration::OFD_20_MS),
+  m_bFecSupported(true),
+  m_bFecApplied(false),
+  m_uiExpectedLossApplied(0),
+  m_uiCbrLinkRateBps(0),
+  m_uiCbrOverheadBytes(0),
+  m_uiCbrOverruns(0),
+  m_bAdaptiveFrameDuration(false),
+  m_adaptiveFrameDurationConfig(FrameDurationController::getDefaultConfig()),
+  m_eAdaptiveFrameDuration(OpusFrameDuration::OFD_20_MS),
+  m_iGovernorId(EncoderGovernor::instance().registerStream(0)),
+  m_pGovernorLevel(EncoderGovernor::instance().getLevel(m_iGovernorId)),
+  m_uiConfiguredComplexity(10),
+  m_uiComplexity(10),
+  m_bComplexitySupported(true),
+  m_bFrameDurationHeld(false),
+  m_dLastEncodeMs(0.0),
+  m_tAudioArrival(std::chrono::steady_clock::now()),
+  m_eGapPolicy(GapPolicy::GP_IGNORE),
+  m_tGapTolerance(0),
+  m_tMaxGapFill(0),
+  m_bNumaPlacement(false),
+  m_bHugePages(false),
+  m_iFramingBufferSize(AUDIO_BUFFER_SIZE),
+  m_eAudioBufferKind(AudioBufferKind::ABK_GENERIC),
+  m_bDriftCompensation(false),
+  m_eDriftMode(DriftCompensator::Mode::DC_TIMESTAMPS),
+  m_uiMaxQueuedMs(0),
+  m_bLoudnessMeter(false),
+  m_dMeteringOverhead(0.0),
+  m_conditioningConfig(InputConditioner::getDefaultConfig()),
+  m_dConditioningOverhead(0.0),
+  m_inputEncoding(InputDecoder::getDefaultConfig()),
+  m_channelMix(ChannelMixer::getDefaultConfig()),
+  m_distributor(0),
+  m_uiPacketSequenceNumber(0),
+  m_uiFramesEncoded(0),
+  m_uiCheckpointHistoryMs(0),
+  m_uiHistoryPos(0),
+  m_uiHistoryFill(0)
+{
+  OpusFactory factory;
+  m_pCodec = factory.GetCodecInstance();
+  if (!m_pCodec)
+  {
+    m_sLastError = "Unable to create Opus Encoder from Factory.";
+  }
+}
+
+OpusEncodeEngine::~OpusEncodeEngine()
+{
+  EncoderGovernor::instance().unregisterStream(m_iGovernorId);
+  if (m_pCodec)
+  {
+    m_pCodec->Close();
+    OpusFactory factory;
+    factory.ReleaseCodecInstance(m_pCodec);
+  }
+}
+
+bool OpusEncodeEngine::open(int samplesPerSecond, int channels, int bitsPerSample, uint32_t targetBitrateKbps)
+{
+  if (!m_pCodec) return false;
+  if (m_bOpen) close();
+
+  m_iSamplesPerSecond = samplesPerSecond;
+  m_iChannels = channels;
+  m_iBitsPerSample = bitsPerSample;
+  m_uiTargetBitrateKbps = targetBitrateKbps;
+  createBuffers(m_eFrameDuration);
+  createDriftCompensator();
+  createLoudnessMeter();
+  createFrameDurationController();
+  createInputConditioner();
+  createCheckpointHistory();
+  if (!createInputDecoder())
+  {
+    m_sLastError = "Invalid block layout of the encoded input";
+    return false;
+  }
+  if (!createChannelMixer())
+  {
+    m_sLastError = "Invalid channel matrix";
+    return false;
+  }
+
+  m_pCodec->SetParameter("samples_per_second", std::to_string(samplesPerSecond).c_str());
+  m_pCodec->SetParameter("channels", std::to_string(channels).c_str());
+  m_pCodec->SetParameter("bits_per_sample", std::to_string(bitsPerSample).c_str());
+  m_pCodec->SetParameter("target_bitrate_kbps", std::to_string(targetBitrateKbps).c_str());
+  m_iMaxComprSize = 0;
+  m_fecController.setTargetBitrate(targetBitrateKbps);
+  // the codec starts without FEC
+  m_bFecApplied = false;
+  m_uiExpectedLossApplied = 0;
+
+  if (!m_pCodec->Open())
+  {
+    //Houston: we have a failure
+    m_sLastError = m_pCodec->GetErrorStr();
+    return false;
+  }
+  m_bOpen = true;
+  if (m_pQualityMonitor && !m_pQualityMonitor->open(samplesPerSecond, channels))
+  {
+    m_sLastError = m_pQualityMonitor->getLastError();
+    m_pQualityMonitor.reset();
+  }
+  return true;
+}
+
+bool OpusEncodeEngine::restartCodec()
+{
+  if (!m_bOpen) return false;
+  m_pCodec->Close();
+  m_bOpen = false;
+  // the settings applied while encoding are applied again before the next frame
+  m_iMaxComprSize = 0;
+  m_bFecApplied = false;
+  m_uiExpectedLossApplied = 0;
+  if (!m_pCodec->Open())
+  {
+    m_sLastError = m_pCodec->GetErrorStr();
+    return false;
+  }
+  if (m_bComplexitySupported)
+  {
+    m_bComplexitySupported = m_pCodec->SetParameter(CODEC_PARAM_COMPLEXITY, std::to_string(m_uiComplexity).c_str()) != 0;
+  }
+  m_bOpen = true;
+  return true;
+}
+
+void OpusEncodeEngine::close()
+{
+  if (m_pCodec && m_bOpen)
+  {
+    m_pCodec->Close();
+  }
+  m_bOpen = false;
+}
+
+int OpusEncodeEngine::addAudioData(uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+{
+  if (!m_pChannelMixer) return bufferAudioData(pData, size, tStart, tStop);
+  const uint32_t uiMixed = m_pChannelMixer->getMixedSize(size);
+  if (m_pDriftCompensator || uiMixed == 0)
+  {
+    // the compensator resamples into a buffer of its own
+    m_vMixed.resize(uiMixed / sizeof(int16_t) + 1);
+    m_pChannelMixer->process(pData, size, m_vMixed.data());
+    if (uiMixed == 0) return getCompleteFrames();
+    return bufferAudioData(reinterpret_cast<uint8_t*>(m_vMixed.data()), uiMixed, tStart, tStop);
+  }
+  // mixed straight into the framing buffer
+  m_tAudioArrival = std::chrono::steady_clock::now();
+  uint8_t* pDest = m_pAudioBuffer->reserveAudioData(uiMixed, tStart);
+  if (!pDest) return -1;
+  const uint32_t uiWritten = m_pChannelMixer->process(pData, size, reinterpret_cast<int16_t*>(pDest));
+  return m_pAudioBuffer->commitAudioData(uiWritten, tStart, tStop);
+}
+
+int OpusEncodeEngine::bufferAudioData(uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+{
+  m_tAudioArrival = std::chrono::steady_clock::now();
+  if (!m_pDriftCompensator)
+  {
+    return visitAudioBuffer(*m_pAudioBuffer, m_eAudioBufferKind, [&](auto& buffer) { return buffer.addAudioData(pData, size, tStart, tStop); });
+  }
+  const int iBlockAlign = m_iChannels * sizeof(int16_t);
+  m_vResampled.clear();
+  m_pDriftCompensator->process(reinterpret_cast<const int16_t*>(pData), size / iBlockAlign, tStart, m_vResampled);
+  return m_pAudioBuffer->addAudioData(reinterpret_cast<uint8_t*>(m_vResampled.data()), static_cast<uint32_t>(m_vResampled.size() * sizeof(int16_t)), tStart, tStop);
+}
+
+int OpusEncodeEngine::addEncodedAudioData(const uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+{
+  if (!m_pInputDecoder) return addAudioData(const_cast<uint8_t*>(pData), size, tStart, tStop);
+  // the partial block carried over from the last input is decoded in front of this one
+  const int iCarriedBefore = m_pInputDecoder->getCarriedFrames();
+  const REFERENCE_TIME tDecodedStart = iCarriedBefore == 0 ? tStart : tStart - static_cast<REFERENCE_TIME>(iCarriedBefore) * 10000000 / m_iSamplesPerSecond;
+  const uint32_t uiDecoded = m_pInputDecoder->getDecodedSize(size);
+  if (m_pDriftCompensator || m_pChannelMixer || uiDecoded == 0)
+  {
+    // the compensator resamples and the mixer mixes into a buffer of their own
+    m_vDecoded.resize(uiDecoded / sizeof(int16_t) + 1);
+    m_pInputDecoder->decode(pData, size, m_vDecoded.data());
+    if (uiDecoded == 0) return getCompleteFrames();
+    return addAudioData(reinterpret_cast<uint8_t*>(m_vDecoded.data()), uiDecoded, tDecodedStart, tStop);
+  }
+  m_tAudioArrival = std::chrono::steady_clock::now();
+  uint8_t* pDest = m_pAudioBuffer->reserveAudioData(uiDecoded, tDecodedStart);
+  if (!pDest) return -1;
+  // samples are int16_t aligned in the buffer: the gap fill and the frames are whole blocks
+  const uint32_t uiWritten = m_pInputDecoder->decode(pData, size, reinterpret_cast<int16_t*>(pDest));
+  const int iCarriedAfter = m_pInputDecoder->getCarriedFrames();
+  const REFERENCE_TIME tDecodedStop = iCarriedAfter == 0 ? tStop : tStop - static_cast<REFERENCE_TIME>(iCarriedAfter) * 10000000 / m_iSamplesPerSecond;
+  return m_pAudioBuffer->commitAudioData(uiWritten, tDecodedStart, tDecodedStop);
+}
+
+uint8_t* OpusEncodeEngine::reserveAudioData(uint32_t size, REFERENCE_TIME tStart)
+{
+  if (m_pDriftCompensator || m_pChannelMixer) return nullptr;
+  return m_pAudioBuffer->reserveAudioData(size, tStart);
+}
+
+int OpusEncodeEngine::commitAudioData(uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+{
+  m_tAudioArrival = std::chrono::steady_clock::now();
+  return m_pAudioBuffer->commitAudioData(size, tStart, tStop);
+}
+
+uint32_t OpusEncodeEngine::getDecodedSize(uint32_t size) const
+{
+  if (m_pInputDecoder) size = m_pInputDecoder->getDecodedSize(size);
+  return m_pChannelMixer ? m_pChannelMixer->getMixedSize(size) : size;
+}
+
+int OpusEncodeEngine::getCompleteFrames() const
+{
+  uint8_t* pBuffered = nullptr;
+  REFERENCE_TIME tBuffered = 0;
+  return m_pAudioBuffer->getBufferedData(pBuffered, tBuffered) / m_pAudioBuffer->getBytesPerFrame();
+}
+
+void OpusEncodeEngine::reset()
+{
+  if (m_pAudioBuffer) m_pAudioBuffer->reset();
+  m_bFrameDurationHeld = false;
+  if (m_pInputDecoder) m_pInputDecoder->reset();
+  if (m_pChannelMixer) m_pChannelMixer->reset();
+  if (m_pDriftCompensator) m_pDriftCompensator->reset();
+  if (m_pFrameDurationController) m_pFrameDurationController->reset();
+  if (m_pInputConditioner) m_pInputConditioner->reset();
+}
+
+void OpusEncodeEngine::startNewSegment(REFERENCE_TIME tStart)
+{
+  m_pAudioBuffer->startNewSegment(tStart);
+  // a partial block before the discontinuity doesn't continue in the new segment
+  if (m_pInputDecoder) m_pInputDecoder->reset();
+  if (m_pChannelMixer) m_pChannelMixer->reset();
+  // the timestamps jump: keep the learnt drift but re-anchor the measurement
+  if (m_pDriftCompensator) m_pDriftCompensator->resync();
+  if (m_pFrameDurationController) m_pFrameDurationController->reset();
+  // the filters would ring across the jump
+  if (m_pInputConditioner) m_pInputConditioner->reset();
+}
+
+int OpusEncodeEngine::encodeAndPublish(uint8_t* pFrame, REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+{
+  // the pool is created with the first packet: engines that are only used through encodeFrame don't carry it
+  if (!m_pPacketArena) m_pPacketArena = std::make_shared<PacketArena>(MAX_PACKET_SIZE, INITIAL_PACKETS, m_pArena);
+  PacketRef packet = m_pPacketArena->acquire();
+  Packet* pPacket = packet.getWritable();
+  int iSize = encodeFrame(pFrame, pPacket->getBuffer(), pPacket->getCapacity());
+  if (iSize > 0)
+  {
+    pPacket->setSize(iSize);
+    pPacket->setTime(tStart, tStop);
+    pPacket->setSequenceNumber(m_uiPacketSequenceNumber++);
+    m_distributor.publish(packet);
+  }
+  return iSize;
+}
+
+int OpusEncodeEngine::encodeFrame(uint8_t* pFrame, uint8_t* pOut, int iOutSize)
+{
+  assert(m_pCodec && m_pAudioBuffer);
+  // the format of the frame, from the final class of the buffer
+  const int iBytesPerFrame = getBytesPerFrame();
+  const double dFrameDurationMs = visitAudioBuffer(*m_pAudioBuffer, m_eAudioBufferKind, [](const auto& buffer) { return buffer.getFrameDurationMs(); });
+  const int iConstantSize = getConstantPacketSize();
+  if (m_uiCbrLinkRateBps > 0 && (iConstantSize <= OpusPacket::MAX_PADDING_HEADER || iConstantSize > iOutSize))
+  {
+    m_sLastError = "The CBR link rate gives a packet size of " + std::to_string(iConstantSize) + " bytes which cannot be used";
+    return -1;
+  }
+  // the codec of a standby is brought into step with the input as it was before the conditioning, see restoreCheckpoint
+  if (!m_vHistory.empty()) recordHistory(pFrame, iBytesPerFrame);
+  double dConditioningMs = 0.0;
+  if (m_pInputConditioner)
+  {
+    auto tConditioningStart = std::chrono::steady_clock::now();
+    m_pInputConditioner->process(reinterpret_cast<int16_t*>(pFrame), static_cast<int>(iBytesPerFrame / (m_iChannels * sizeof(int16_t))));
+    dConditioningMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tConditioningStart).count();
+  }
+  applyFecDecision();
+  // leave room for the padding header
+  setMaxCompressedSize(iConstantSize > 0 ? iConstantSize - OpusPacket::MAX_PADDING_HEADER : iOutSize);
+  auto tStart = std::chrono::steady_clock::now();
+  if (!m_pCodec->Code(pFrame, pOut, iBytesPerFrame))
+  {
+    m_sLastError = m_pCodec->GetErrorStr();
+    return -1;
+  }
+  std::chrono::duration<double, std::milli> encodeMs = std::chrono::steady_clock::now() - tStart;
+  m_dLastEncodeMs = encodeMs.count();
+  ++m_uiFramesEncoded;
+  if (m_pInputConditioner && m_dLastEncodeMs > 0.0)
+  {
+    m_dConditioningOverhead += METERING_OVERHEAD_SMOOTHING * (dConditioningMs / m_dLastEncodeMs - m_dConditioningOverhead);
+  }
+  EncoderGovernor::instance().reportEncode(m_iGovernorId, m_dLastEncodeMs, dFrameDurationMs);
+  int iCompressedSize = m_pCodec->GetCompressedByteLength();
+  if (iConstantSize > 0)
+  {
+    iCompressedSize = padToConstantSize(pOut, iCompressedSize, iConstantSize, iOutSize);
+  }
+  if (m_pLoudnessMeter)
+  {
+    // the frame is still in the cache
+    auto tMeterStart = std::chrono::steady_clock::now();
+    m_pLoudnessMeter->process(reinterpret_cast<const int16_t*>(pFrame), static_cast<int>(iBytesPerFrame / (m_iChannels * sizeof(int16_t))));
+    std::chrono::duration<double, std::milli> meterMs = std::chrono::steady_clock::now() - tMeterStart;
+    if (m_dLastEncodeMs > 0.0)
+    {
+      m_dMeteringOverhead += METERING_OVERHEAD_SMOOTHING * (meterMs.count() / m_dLastEncodeMs - m_dMeteringOverhead);
+    }
+  }
+  if (m_pFrameDurationController)
+  {
+    // takes effect at the next frame boundary in applyGovernorAdaptation
+    m_eAdaptiveFrameDuration = m_pFrameDurationController->update(reinterpret_cast<const int16_t*>(pFrame),
+      static_cast<int>(iBytesPerFrame / (m_iChannels * sizeof(int16_t))));
+  }
+  if (m_pQualityMonitor)
+  {
+    m_pQualityMonitor->submit(pFrame, iBytesPerFrame, pOut, iCompressedSize, m_dLastEncodeMs);
+  }
+  // the frames of a large input buffer are encoded back to back: the later ones complete later
+  std::chrono::duration<double, std::milli> completionMs = std::chrono::steady_clock::now() - m_tAudioArrival;
+  m_deadlineTracker.record(completionMs.count(), dFrameDurationMs);
+  return iCompressedSize;
+}
+
+void OpusEncodeEngine::applyFecDecision()
+{
+  if (!m_bFecSupported) return;
+  FecController::Decision decision = m_fecController.decide();
+  if (decision.expectedLossPercent != m_uiExpectedLossApplied)
+  {
+    m_bFecSupported = m_pCodec->SetParameter(CODEC_PARAM_PACKET_LOSS_PERCENTAGE, std::to_string(decision.expectedLossPercent).c_str()) != 0;
+    m_uiExpectedLossApplied = decision.expectedLossPercent;
+  }
+  if (m_bFecSupported && decision.fec != m_bFecApplied)
+  {
+    m_bFecSupported = m_pCodec->SetParameter(CODEC_PARAM_INBAND_FEC, decision.fec ? "1" : "0") != 0;
+    m_bFecApplied = decision.fec;
+  }
+}
+
+void OpusEncodeEngine::setConstantBitrate(uint32_t uiLinkRateBps, uint32_t uiOverheadBytes)
+{
+  m_uiCbrLinkRateBps = uiLinkRateBps;
+  m_uiCbrOverheadBytes = uiOverheadBytes;
+}
+
+int OpusEncodeEngine::getConstantPacketSize() const
+{
+  if (m_uiCbrLinkRateBps == 0 || !m_pAudioBuffer) return 0;
+  // round down so that the link rate is never exceeded
+  const int64_t iLinkBytes = static_cast<int64_t>(m_uiCbrLinkRateBps) * frameDurationTo100ns(m_pAudioBuffer->getFrameDurationMsEnum()) / 80000000;
+  return static_cast<int>(std::max<int64_t>(0, iLinkBytes - m_uiCbrOverheadBytes));
+}
+
+int OpusEncodeEngine::padToConstantSize(uint8_t* pOut, int iSize, int iConstantSize, int iOutSize)
+{
+  if (!OpusPacket::pad(pOut, iSize, iConstantSize, iOutSize))
+  {
+    // the link must see a packet of the exact size: send one the decoder conceals
+    ++m_uiCbrOverruns;
+    OpusPacket::writeEmpty(pOut, pOut[0], iConstantSize);
+  }
+  return iConstantSize;
+}
+
+void OpusEncodeEngine::setMaxCompressedSize(int iSize)
+{
+  if (iSize != m_iMaxComprSize)
+  {
+    m_pCodec->SetParameter("max_compr_size", std::to_string(iSize).c_str());
+    m_iMaxComprSize = iSize;
+  }
+}
+
+void OpusEncodeEngine::setFrameDuration(OpusFrameDuration eFrameDuration)
+{
+  m_eFrameDuration = eFrameDuration;
+  m_adaptiveFrameDurationConfig.referenceFrameDuration = eFrameDuration;
+  if (m_pFrameDurationController)
+  {
+    m_pFrameDurationController->setConfig(m_adaptiveFrameDurationConfig);
+    return;
+  }
+  if (m_pAudioBuffer) applyFrameDuration(eFrameDuration);
+}
+
+void OpusEncodeEngine::enableAdaptiveFrameDuration(bool bEnable)
+{
+  if (bEnable == m_bAdaptiveFrameDuration) return;
+  m_bAdaptiveFrameDuration = bEnable;
+  createFrameDurationController();
+}
+
+void OpusEncodeEngine::setAdaptiveFrameDurationConfig(const FrameDurationController::Config& config)
+{
+  m_adaptiveFrameDurationConfig = config;
+  m_adaptiveFrameDurationConfig.referenceFrameDuration = m_eFrameDuration;
+  if (m_pFrameDurationController) m_pFrameDurationController->setConfig(m_adaptiveFrameDurationConfig);
+}
+
+void OpusEncodeEngine::createFrameDurationController()
+{
+  m_pFrameDurationController.reset();
+  m_eAdaptiveFrameDuration = m_eFrameDuration;
+  if (m_bAdaptiveFrameDuration && m_iBitsPerSample == 16 && m_iChannels > 0)
+  {
+    m_pFrameDurationController = std::make_unique<FrameDurationController>(m_iSamplesPerSecond, m_iChannels);
+    m_pFrameDurationController->setConfig(m_adaptiveFrameDurationConfig);
+  }
+}
+
+void OpusEncodeEngine::setConditioningConfig(const InputConditioner::Config& config)
+{
+  m_conditioningConfig = config;
+  if (m_pInputConditioner) m_pInputConditioner->setConfig(m_conditioningConfig);
+}
+
+void OpusEncodeEngine::createInputConditioner()
+{
+  m_pInputConditioner.reset();
+  m_dConditioningOverhead = 0.0;
+  // created even while every stage is disabled so that the stages can be switched while streaming
+  if (m_iBitsPerSample == 16 && m_iChannels > 0)
+  {
+    m_pInputConditioner = std::make_unique<InputConditioner>(m_iSamplesPerSecond, m_iChannels);
+    m_pInputConditioner->setConfig(m_conditioningConfig);
+  }
+}
+
+bool OpusEncodeEngine::createInputDecoder()
+{
+  m_pInputDecoder.reset();
+  if (m_inputEncoding.encoding == InputEncoding::IE_PCM) return true;
+  // the decoder expands the input channels, which are mixed afterwards
+  if (m_iBitsPerSample != 16 || !InputDecoder::isValid(m_inputEncoding, getInputChannels())) return false;
+  m_pInputDecoder = std::make_unique<InputDecoder>(m_inputEncoding, getInputChannels());
+  return true;
+}
+
+bool OpusEncodeEngine::createChannelMixer()
+{
+  m_pChannelMixer.reset();
+  if (m_channelMix.inputChannels == 0) return true;
+  const std::vector<double> vMatrix = m_channelMix.matrix.empty() ?
+    ChannelMixer::getDownmixMatrix(m_channelMix.channelMask, m_channelMix.inputChannels, m_iChannels) : m_channelMix.matrix;
+  if (m_iBitsPerSample != 16 || !ChannelMixer::isValid(vMatrix, m_channelMix.inputChannels, m_iChannels)) return false;
+  m_pChannelMixer = std::make_unique<ChannelMixer>(vMatrix, m_channelMix.inputChannels, m_iChannels);
+  return true;
+}
+
+void OpusEncodeEngine::setPriority(uint32_t uiPriority)
+{
+  EncoderGovernor::instance().setPriority(m_iGovernorId, uiPriority);
+}
+
+bool OpusEncodeEngine::setComplexity(uint32_t uiComplexity)
+{
+  if (!m_pCodec || !m_pCodec->SetParameter(CODEC_PARAM_COMPLEXITY, std::to_string(uiComplexity).c_str())) return false;
+  m_uiConfiguredComplexity = uiComplexity;
+  m_uiComplexity = uiComplexity;
+  m_bComplexitySupported = true;
+  return true;
+}
+
+void OpusEncodeEngine::applyGovernorAdaptation()
+{
+  if (!m_pAudioBuffer) return;
+  const int iLevel = m_pGovernorLevel ? m_pGovernorLevel->load(std::memory_order_relaxed) : 0;
+  EncoderGovernor::Adaptation adaptation = EncoderGovernor::getAdaptation(iLevel, m_uiConfiguredComplexity);
+  if (m_bComplexitySupported && adaptation.complexity != m_uiComplexity)
+  {
+    m_bComplexitySupported = m_pCodec->SetParameter(CODEC_PARAM_COMPLEXITY, std::to_string(adaptation.complexity).c_str()) != 0;
+    m_uiComplexity = adaptation.complexity;
+  }
+  if (m_bFrameDurationHeld) return;
+  OpusFrameDuration eBase = m_pFrameDurationController ? m_eAdaptiveFrameDuration : m_eFrameDuration;
+  OpusFrameDuration eFrameDuration = (adaptation.minFrameDuration > eBase) ? adaptation.minFrameDuration : eBase;
+  applyFrameDuration(eFrameDuration);
+}
+
+bool OpusEncodeEngine::padPartialFrame()
+{
+  if (!m_pAudioBuffer) return false;
+  applyGovernorAdaptation();
+  m_bFrameDurationHeld = true;
+  return m_pAudioBuffer->padPartialFrame();
+}
+
+void OpusEncodeEngine::applyFrameDuration(OpusFrameDuration eFrameDuration)
+{
+  // checked for every frame read
+  if (eFrameDuration == visitAudioBuffer(*m_pAudioBuffer, m_eAudioBufferKind, [](const auto& buffer) { return buffer.getFrameDurationMsEnum(); })) return;
+  // e.g. 60 ms of a segment can't be cut into 40 ms frames: the switch waits until the queued segments have been read,
+  // which the next read retries
+  if (!m_pAudioBuffer->canSwitchFrameDuration(eFrameDuration)) return;
+  if (m_pAudioBuffer->setFrameDuration(eFrameDuration)) return;
+
+  // move the buffered data over to a generic buffer
+  std::unique_ptr<IAudioBuffer> pBuffer = std::make_unique<AudioBuffer>(m_iSamplesPerSecond, m_iChannels, m_iBitsPerSample, allocateAudioStorage(), m_iFramingBufferSize);
+  pBuffer->setFrameDuration(eFrameDuration);
+  pBuffer->setGapPolicy(m_eGapPolicy, m_tGapTolerance, m_tMaxGapFill);
+  uint8_t* pData = nullptr;
+  REFERENCE_TIME tStart = 0;
+  const int iSize = m_pAudioBuffer->getBufferedData(pData, tStart);
+  // the whole clock moves along: the end time that the gap detection compares with, the queued segment starts and the
+  // discontinuity of the next frame
+  pBuffer->restore(pData, static_cast<uint32_t>(iSize), m_pAudioBuffer->getClockState());
+  pBuffer->setCounts(m_pAudioBuffer->getGapFillBytes(), m_pAudioBuffer->getSegmentCount());
+  setAudioBuffer(std::move(pBuffer));
+}
+
+void OpusEncodeEngine::setNumaPlacement(bool bEnable, bool bHugePages)
+{
+  m_bNumaPlacement = bEnable;
+  m_bHugePages = bHugePages;
+}
+
+bool OpusEncodeEngine::placeOnCurrentNode()
+{
+  if (!m_bNumaPlacement || !m_pAudioBuffer) return false;
+  if (m_pArena && m_pArena->getNode() == NumaArena::getCurrentNode() && m_pArena->usesHugePages() == m_bHugePages) return false;
+  // e.g. the audio and the clock of a restored checkpoint move along
+  uint8_t* pBuffered = nullptr;
+  REFERENCE_TIME tBuffered = 0;
+  const int iBuffered = m_pAudioBuffer->getBufferedData(pBuffered, tBuffered);
+  const std::vector<uint8_t> vBuffered(pBuffered, pBuffered + iBuffered);
+  const AudioClockState clock = m_pAudioBuffer->getClockState();
+  const uint64_t uiGapFillBytes = m_pAudioBuffer->getGapFillBytes();
+  const uint32_t uiSegments = m_pAudioBuffer->getSegmentCount();
+  createBuffers(m_pAudioBuffer->getFrameDurationMsEnum());
+  m_pAudioBuffer->restore(vBuffered.data(), static_cast<uint32_t>(vBuffered.size()), clock);
+  m_pAudioBuffer->setCounts(uiGapFillBytes, uiSegments);
+  return true;
+}
+
+void OpusEncodeEngine::createBuffers(OpusFrameDuration eFrameDuration)
+{
+  // the old arena lives on in the packets that are still out
+  const bool bHadArena = m_pArena != nullptr;
+  m_pAudioBuffer.reset();
+  m_pArena.reset();
+  if (m_bNumaPlacement)
+  {
+    // room for a second framing buffer in case a specialised buffer is replaced by a generic one
+    m_pArena = std::make_shared<NumaArena>(2 * static_cast<size_t>(m_iFramingBufferSize) + PACKET_STORAGE_SIZE, -1, m_bHugePages);
+  }
+  setAudioBuffer(createAudioBuffer(m_iSamplesPerSecond, m_iChannels, m_iBitsPerSample, eFrameDuration, allocateAudioStorage(), m_iFramingBufferSize));
+  m_pAudioBuffer->setGapPolicy(m_eGapPolicy, m_tGapTolerance, m_tMaxGapFill);
+  if (m_pPacketArena && (m_pArena || bHadArena))
+  {
+    m_pPacketArena = std::make_shared<PacketArena>(MAX_PACKET_SIZE, INITIAL_PACKETS, m_pArena);
+  }
+}
+
+void OpusEncodeEngine::setAudioBuffer(std::unique_ptr<IAudioBuffer> pBuffer)
+{
+  m_pAudioBuffer = std::move(pBuffer);
+  m_eAudioBufferKind = m_pAudioBuffer->getKind();
+}
+
+uint8_t* OpusEncodeEngine::allocateAudioStorage()
+{
+  return m_pArena ? m_pArena->allocate(m_iFramingBufferSize) : nullptr;
+}
+
+bool OpusEncodeEngine::enableQualityMonitor(bool bEnable)
+{
+  if (!bEnable)
+  {
+    m_pQualityMonitor.reset();
+    return true;
+  }
+  if (m_pQualityMonitor) return true;
+  m_pQualityMonitor = std::make_unique<QualityMonitor>();
+  if (m_bOpen && !m_pQualityMonitor->open(m_iSamplesPerSecond, m_iChannels))
+  {
+    m_sLastError = m_pQualityMonitor->getLastError();
+    m_pQualityMonitor.reset();
+    return false;
+  }
+  return true;
+}
+
+void OpusEncodeEngine::setGapPolicy(GapPolicy ePolicy, REFERENCE_TIME tTolerance, REFERENCE_TIME tMaxFill)
+{
+  m_eGapPolicy = ePolicy;
+  m_tGapTolerance = tTolerance;
+  m_tMaxGapFill = tMaxFill;
+  if (m_pAudioBuffer) m_pAudioBuffer->setGapPolicy(ePolicy, tTolerance, tMaxFill);
+}
+
+void OpusEncodeEngine::enableDriftCompensation(bool bEnable, DriftCompensator::Mode eMode)
+{
+  if (bEnable == m_bDriftCompensation && eMode == m_eDriftMode) return;
+  m_bDriftCompensation = bEnable;
+  m_eDriftMode = eMode;
+  createDriftCompensator();
+}
+
+void OpusEncodeEngine::createDriftCompensator()
+{
+  m_pDriftCompensator.reset();
+  if (m_bDriftCompensation && m_iBitsPerSample == 16 && m_iChannels > 0)
+  {
+    m_pDriftCompensator = std::make_unique<DriftCompensator>(m_iSamplesPerSecond, m_iChannels, m_eDriftMode);
+  }
+}
+
+void OpusEncodeEngine::measureDriftOccupancy()
+{
+  if (!m_pDriftCompensator || !m_pAudioBuffer) return;
+  const int iBlockAlign = m_iChannels * sizeof(int16_t);
+  // with every complete frame read the occupancy runs from empty to just short of a frame, and a queue is kept half
+  // full so that the delivery neither runs dry nor drops audio; the frame duration may have changed since the last call
+  int iTarget = m_pAudioBuffer->getBytesPerFrame() / iBlockAlign / 2;
+  if (m_uiMaxQueuedMs != 0)
+  {
+    iTarget = std::max(iTarget, static_cast<int>(static_cast<int64_t>(m_uiMaxQueuedMs) * m_iSamplesPerSecond / 2000));
+  }
+  m_pDriftCompensator->setTargetOccupancy(iTarget);
+  uint8_t* pBuffered = nullptr;
+  REFERENCE_TIME tBuffered = 0;
+  m_pDriftCompensator->measureOccupancy(m_pAudioBuffer->getBufferedData(pBuffered, tBuffered) / iBlockAlign);
+}
+
+void OpusEncodeEngine::enableLoudnessMeter(bool bEnable)
+{
+  if (bEnable == m_bLoudnessMeter) return;
+  m_bLoudnessMeter = bEnable;
+  createLoudnessMeter();
+}
+
+void OpusEncodeEngine::createLoudnessMeter()
+{
+  m_pLoudnessMeter.reset();
+  m_dMeteringOverhead = 0.0;
+  if (m_bLoudnessMeter && m_iBitsPerSample == 16 && m_iChannels > 0)
+  {
+    m_pLoudnessMeter = std::make_unique<LoudnessMeter>(m_iSamplesPerSecond, m_iChannels);
+  }
+}
+
+void OpusEncodeEngine::setCheckpointHistory(uint32_t uiMs)
+{
+  m_uiCheckpointHistoryMs = uiMs;
+}
+
+void OpusEncodeEngine::createCheckpointHistory()
+{
+  const size_t uiBlockAlign = static_cast<size_t>(m_iChannels) * (m_iBitsPerSample / 8);
+  m_vHistory.assign(static_cast<size_t>(m_iSamplesPerSecond) * m_uiCheckpointHistoryMs / 1000 * uiBlockAlign, 0);
+  m_uiHistoryPos = 0;
+  m_uiHistoryFill = 0;
+}
+
+void OpusEncodeEngine::recordHistory(const uint8_t* pFrame, size_t uiSize)
+{
+  const size_t uiCapacity = m_vHistory.size();
+  if (uiSize > uiCapacity)
+  {
+    // only the end of a long frame fits
+    pFrame += uiSize - uiCapacity;
+    uiSize = uiCapacity;
+  }
+  const size_t uiFirst = std::min(uiSize, uiCapacity - m_uiHistoryPos);
+  memcpy(m_vHistory.data() + m_uiHistoryPos, pFrame, uiFirst);
+  memcpy(m_vHistory.data(), pFrame + uiFirst, uiSize - uiFirst);
+  m_uiHistoryPos = (m_uiHistoryPos + uiSize) % uiCapacity;
+  m_uiHistoryFill = std::min(m_uiHistoryFill + uiSize, uiCapacity);
+}
+
+bool OpusEncodeEngine::saveCheckpoint(EncoderCheckpoint& checkpoint) const
+{
+  if (!m_bOpen || m_vHistory.empty()) return false;
+  checkpoint.samplesPerSecond = m_iSamplesPerSecond;
+  checkpoint.channels = m_iChannels;
+  checkpoint.bitsPerSample = m_iBitsPerSample;
+  checkpoint.targetBitrateKbps = m_uiTargetBitrateKbps;
+  checkpoint.frameDuration = m_pAudioBuffer->getFrameDurationMsEnum();
+  checkpoint.packetSequenceNumber = m_uiPacketSequenceNumber;
+  checkpoint.framesEncoded = m_uiFramesEncoded;
+  checkpoint.clock = m_pAudioBuffer->getClockState();
+  uint8_t* pBuffered = nullptr;
+  REFERENCE_TIME tBuffered = 0;
+  const int iBuffered = m_pAudioBuffer->getBufferedData(pBuffered, tBuffered);
+  checkpoint.vBuffered.assign(pBuffered, pBuffered + iBuffered);
+  // oldest first
+  const size_t uiOldest = (m_uiHistoryPos + m_vHistory.size() - m_uiHistoryFill) % m_vHistory.size();
+  const size_t uiFirst = std::min(m_uiHistoryFill, m_vHistory.size() - uiOldest);
+  checkpoint.vHistory.assign(m_vHistory.begin() + uiOldest, m_vHistory.begin() + uiOldest + uiFirst);
+  checkpoint.vHistory.insert(checkpoint.vHistory.end(), m_vHistory.begin(), m_vHistory.begin() + (m_uiHistoryFill - uiFirst));
+  return true;
+}
+
+bool OpusEncodeEngine::restoreCheckpoint(const EncoderCheckpoint& checkpoint)
+{
+  if (!m_bOpen)
+  {
+    m_sLastError = "The engine must be opened before a checkpoint is restored";
+    return false;
+  }
+  if (checkpoint.samplesPerSecond != static_cast<uint32_t>(m_iSamplesPerSecond) || checkpoint.channels != static_cast<uint32_t>(m_iChannels) ||
+    checkpoint.bitsPerSample != static_cast<uint32_t>(m_iBitsPerSample) || checkpoint.targetBitrateKbps != m_uiTargetBitrateKbps)
+  {
+    m_sLastError = "The checkpoint was taken from a stream of " + std::to_string(checkpoint.samplesPerSecond) + " Hz, " +
+      std::to_string(checkpoint.channels) + " channels, " + std::to_string(checkpoint.bitsPerSample) + " bits at " +
+      std::to_string(checkpoint.targetBitrateKbps) + " kbps";
+    return false;
+  }
+  reset();
+  applyFrameDuration(checkpoint.frameDuration);
+  m_eAdaptiveFrameDuration = checkpoint.frameDuration;
+
+  // the frames of the history end where the buffered audio begins
+  const int iBytesPerFrame = m_pAudioBuffer->getBytesPerFrame();
+  const size_t uiPrimingFrames = checkpoint.vHistory.size() / iBytesPerFrame;
+  const uint8_t* pHistory = checkpoint.vHistory.data() + checkpoint.vHistory.size() - uiPrimingFrames * iBytesPerFrame;
+  std::vector<uint8_t> vFrame(iBytesPerFrame);
+  std::vector<uint8_t> vDiscarded(MAX_PACKET_SIZE);
+  const int iConstantSize = getConstantPacketSize();
+  for (size_t i = 0; i < uiPrimingFrames; ++i, pHistory += iBytesPerFrame)
+  {
+    memcpy(vFrame.data(), pHistory, iBytesPerFrame);
+    const int iSamples = static_cast<int>(iBytesPerFrame / (m_iChannels * sizeof(int16_t)));
+    // the stages in front of the codec have state of their own
+    if (m_pInputConditioner) m_pInputConditioner->process(reinterpret_cast<int16_t*>(vFrame.data()), iSamples);
+    applyFecDecision();
+    setMaxCompressedSize(iConstantSize > OpusPacket::MAX_PADDING_HEADER ? iConstantSize - OpusPacket::MAX_PADDING_HEADER : MAX_PACKET_SIZE);
+    if (!m_pCodec->Code(vFrame.data(), vDiscarded.data(), iBytesPerFrame))
+    {
+      m_sLastError = m_pCodec->GetErrorStr();
+      return false;
+    }
+    if (m_pFrameDurationController) m_pFrameDurationController->update(reinterpret_cast<const int16_t*>(vFrame.data()), iSamples);
+  }
+  // a standby can take checkpoints of its own from the start
+  m_uiHistoryPos = 0;
+  m_uiHistoryFill = 0;
+  if (!m_vHistory.empty()) recordHistory(checkpoint.vHistory.data(), checkpoint.vHistory.size());
+
+  if (!m_pAudioBuffer->restore(checkpoint.vBuffered.data(), static_cast<uint32_t>(checkpoint.vBuffered.size()), checkpoint.clock))
+  {
+    m_sLastError = "The buffered audio of the checkpoint doesn't fit";
+    return false;
+  }
+  m_uiPacketSequenceNumber = checkpoint.packetSequenceNumber;
+  m_uiFramesEncoded = checkpoint.framesEncoded;
+  return true;
+}
@@ -0,0 +1,492 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: OpusEncodeEngine.h
+
+DESCRIPTION			: Portable Opus encode engine: AudioBuffer framing + ICodecv2 encoding
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "AudioBuffer.h"
+#include "ChannelMixer.h"
+#include "DriftCompensator.h"
+#include "EncoderCheckpoint.h"
+#include "FecController.h"
+#include "FrameDurationController.h"
+#include "InputConditioner.h"
+#include "InputDecoder.h"
+#include "LoudnessMeter.h"
+#include "PacketArena.h"
+#include "QualityMonitor.h"
+#include "RealtimeScheduling.h"
+
+// Forward
+class ICodecv2;
+
+/**
+ * @brief The encode engine frames PCM with an AudioBuffer and encodes each frame with the Opus codec.
+ * It has no DirectShow dependencies so that it can also be driven outside of a filter graph.
+ */
+class OpusEncodeEngine
+{
+public:
+  /**
+   * @brief Constructor: creates the codec instance from the OpusFactory
+   */
+  OpusEncodeEngine();
+  /**
+   * @brief Destructor: closes and releases the codec
+   */
+  ~OpusEncodeEngine();
+  /**
+   * @brief Configures and opens the codec and (re)creates the audio buffer for the format.
+   * @return true on success, false otherwise in which case getLastError() describes the error.
+   */
+  bool open(int samplesPerSecond, int channels, int bitsPerSample, uint32_t targetBitrateKbps);
+  /**
+   * @brief Closes the codec. The engine can be re-opened.
+   */
+  void close();
+
+  bool isOpen() const { return m_bOpen; }
+  ICodecv2* getCodec() const { return m_pCodec; }
+  IAudioBuffer* getAudioBuffer() const { return m_pAudioBuffer.get(); }
+  const std::string& getLastError() const { return m_sLastError; }
+
+  int getSamplesPerSecond() const { return m_iSamplesPerSecond; }
+  int getChannels() const { return m_iChannels; }
+  /// the channels of the audio passed in, which are mixed down to getChannels() if they differ
+  int getInputChannels() const { return m_channelMix.inputChannels > 0 ? m_channelMix.inputChannels : m_iChannels; }
+  int getBitsPerSample() const { return m_iBitsPerSample; }
+  int getBytesPerFrame() const
+  {
+    return m_pAudioBuffer ? visitAudioBuffer(*m_pAudioBuffer, m_eAudioBufferKind, [](const auto& buffer) { return buffer.getBytesPerFrame(); }) : 0;
+  }
+
+  /**
+   * @brief Adds PCM to the framing buffer, mixing it down first if a channel mix is set and resampling it if
+   * drift compensation is enabled
+   * @return the number of complete frames available or -1 if the buffer is full.
+   */
+  int addAudioData(uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop);
+  /**
+   * @brief Sets the channels of the input and how they are mixed to the channels passed to open(), see
+   * ChannelMixer. Takes effect at open(), which fails if the matrix doesn't fit.
+   */
+  void setChannelMix(const ChannelMixer::Config& config) { m_channelMix = config; }
+  /**
+   * @brief Sets the encoding of the input of addEncodedAudioData, see InputDecoder. Takes effect at open(),
+   * which fails if the block layout doesn't match the channels. The engine is opened with 16 bits per sample.
+   */
+  void setInputEncoding(const InputDecoder::Config& config) { m_inputEncoding = config; }
+  /**
+   * @brief Expands G.711 or IMA ADPCM straight into the framing buffer, or into the input of the drift compensator.
+   * PCM is passed on to addAudioData.
+   * @return the number of complete frames available or -1 if the buffer is full.
+   */
+  int addEncodedAudioData(const uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop);
+  /**
+   * @brief Space for size bytes of PCM in the framing buffer so that e.g. read() can fill it without a copy.
+   * Must be followed by commitAudioData. Not available with drift compensation or a channel mix, which
+   * process the input on its way into the buffer.
+   * @return the destination or null if the buffer is full, drift compensation is enabled or a channel mix is set
+   */
+  uint8_t* reserveAudioData(uint32_t size, REFERENCE_TIME tStart);
+  /**
+   * @brief Appends the size bytes written to the space returned by reserveAudioData
+   * @return the number of complete frames available
+   */
+  int commitAudioData(uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop);
+  /**
+   * @brief the number of bytes of the framing buffer that size bytes of input take once expanded and mixed
+   */
+  uint32_t getDecodedSize(uint32_t size) const;
+  /**
+   * @brief Discards the buffered audio and restarts the drift compensation
+   */
+  void reset();
+  /**
+   * @brief Starts a new segment after a discontinuity, see IAudioBuffer::startNewSegment
+   */
+  void startNewSegment(REFERENCE_TIME tStart);
+  /**
+   * @brief Reads the next complete frame from the framing buffer.
+   */
+  bool readNextAudioFrame(REFERENCE_TIME& tStart, REFERENCE_TIME& tStop, uint8_t*& pFrame)
+  {
+    applyGovernorAdaptation();
+    if (visitAudioBuffer(*m_pAudioBuffer, m_eAudioBufferKind, [&](auto& buffer) { return buffer.readNextAudioFrame(tStart, tStop, pFrame); })) return true;
+    m_bFrameDurationHeld = false;
+    return false;
+  }
+  /**
+   * @brief Pads the partial frame at the end of the framing buffer with silence e.g. on end of stream, see
+   * IAudioBuffer::padPartialFrame. A pending frame duration change is applied first and no other one takes effect
+   * until the buffered frames have been read, so that the padded frame stays a whole frame.
+   * @return true if a partial frame was padded
+   */
+  bool padPartialFrame();
+  /**
+   * @brief Encodes one frame of getBytesPerFrame() bytes.
+   * @param pFrame The PCM frame
+   * @param pOut The destination buffer
+   * @param iOutSize The size of the destination buffer
+   * @return the compressed size in bytes or -1 on error. A size of 1 means nothing has to be transmitted.
+   * In CBR mode the size is always getConstantPacketSize().
+   */
+  int encodeFrame(uint8_t* pFrame, uint8_t* pOut, int iOutSize);
+  /**
+   * @brief Encodes one frame into a pooled packet and hands it to all subscribers of getPacketDistributor()
+   * @return the compressed size in bytes or -1 on error. Packets of size 1 are published too so that the subscribers
+   * see the timing of every frame, e.g. a file writer: a sender skips them since nothing has to be transmitted.
+   */
+  int encodeAndPublish(uint8_t* pFrame, REFERENCE_TIME tStart, REFERENCE_TIME tStop);
+  /**
+   * @brief the distributor for encodeAndPublish. Subscribers receive shared views on the packets without copies.
+   */
+  PacketDistributor& getPacketDistributor() { return m_distributor; }
+  /**
+   * @brief Sets how much audio the distributor retains for late joiners
+   */
+  void setPacketRetention(REFERENCE_TIME tRetain) { m_distributor.setRetention(tRetain); }
+  /**
+   * @brief Configures the maximum number of bytes the codec may produce per frame
+   */
+  void setMaxCompressedSize(int iSize);
+  /**
+   * @brief the controller of the in-band FEC and expected loss, applied to the codec before every frame
+   */
+  FecController& getFecController() { return m_fecController; }
+  const FecController& getFecController() const { return m_fecController; }
+  /**
+   * @brief Enables hard CBR: every packet is padded to exactly the size the link rate allows for its duration.
+   * If the codec exceeds the size regardless the packet is replaced by an empty one of the same size, which
+   * the decoder conceals like a lost packet. A rate of 0 disables the mode.
+   * @param uiLinkRateBps the rate of the link including the per-packet overhead
+   * @param uiOverheadBytes per-packet framing of the link that is not available to the Opus packet
+   */
+  void setConstantBitrate(uint32_t uiLinkRateBps, uint32_t uiOverheadBytes);
+  /**
+   * @brief the size of a packet of the current frame duration in CBR mode, 0 if the mode is disabled
+   */
+  int getConstantPacketSize() const;
+  /**
+   * @brief number of CBR packets that had to be replaced because the codec exceeded the size
+   */
+  uint64_t getConstantBitrateOverruns() const { return m_uiCbrOverruns; }
+  /**
+   * @brief Sets the configured frame duration. The governor may stretch it under load.
+   */
+  void setFrameDuration(OpusFrameDuration eFrameDuration);
+  /**
+   * @brief Enables the adaptation of the frame duration to the voice activity. The configured frame duration is
+   * then only the reference the savings are reported against. 16 bit PCM only.
+   */
+  void enableAdaptiveFrameDuration(bool bEnable);
+  /**
+   * @brief Sets the latency ceiling and packet rate budget of the adaptive frame duration
+   */
+  void setAdaptiveFrameDurationConfig(const FrameDurationController::Config& config);
+  /**
+   * @brief the frame duration controller or null if the adaptation is not enabled
+   */
+  const FrameDurationController* getFrameDurationController() const { return m_pFrameDurationController.get(); }
+  /**
+   * @brief Sets the priority of the stream for the EncoderGovernor. Higher priorities are degraded last.
+   */
+  void setPriority(uint32_t uiPriority);
+  /**
+   * @brief Sets the complexity of the codec. The EncoderGovernor lowers the complexity relative to it under load.
+   * @return false if the codec doesn't accept the complexity
+   */
+  bool setComplexity(uint32_t uiComplexity);
+  /**
+   * @brief Configures the timestamp gap handling of the audio buffer, see IAudioBuffer::setGapPolicy
+   */
+  void setGapPolicy(GapPolicy ePolicy, REFERENCE_TIME tTolerance, REFERENCE_TIME tMaxFill);
+  /**
+   * @brief Enables the loopback verification: every packet is decoded on a worker thread and compared with the input.
+   * @return false if the decoder could not be opened
+   */
+  bool enableQualityMonitor(bool bEnable);
+  /**
+   * @brief the quality monitor or null if the verification is not enabled
+   */
+  const QualityMonitor* getQualityMonitor() const { return m_pQualityMonitor.get(); }
+  /**
+   * @brief Enables the compensation of the drift between the source clock and the reference clock.
+   * Only 16 bit PCM is resampled: the setting has no effect for other formats.
+   * @param eMode The measurement steering the resampler
+   */
+  void enableDriftCompensation(bool bEnable, DriftCompensator::Mode eMode = DriftCompensator::Mode::DC_TIMESTAMPS);
+  /**
+   * @brief the current drift correction in ppm, 0 if the compensation is disabled
+   */
+  double getDriftCorrectionPpm() const { return m_pDriftCompensator ? m_pDriftCompensator->getCorrectionPpm() : 0.0; }
+  /**
+   * @brief Passes the occupancy of the framing buffer to the drift compensation in occupancy mode. Call after the
+   * frames that can be delivered have been read. The target is half a frame of the current frame duration, or half
+   * of the queue limit if the delivery keeps frames queued, see setMaxQueuedMs.
+   */
+  void measureDriftOccupancy();
+  /**
+   * @brief Sets the most audio the delivery keeps queued in the framing buffer before it drops audio, 0 if every
+   * complete frame is read as soon as it is available.
+   */
+  void setMaxQueuedMs(uint32_t uiMs) { m_uiMaxQueuedMs = uiMs; }
+  /**
+   * @brief Enables the loudness, true peak and RMS metering of the encoded frames. 16 bit PCM only.
+   */
+  void enableLoudnessMeter(bool bEnable);
+  /**
+   * @brief the loudness meter or null if the metering is not enabled
+   */
+  LoudnessMeter* getLoudnessMeter() const { return m_pLoudnessMeter.get(); }
+  /**
+   * @brief the smoothed time spent metering relative to the time spent encoding
+   */
+  double getMeteringOverheadPercent() const { return m_dMeteringOverhead * 100.0; }
+  /**
+   * @brief Configures the DC removal, high-pass and noise gate applied to the frames in place before they are
+   * encoded. 16 bit PCM only. All stages are disabled by default.
+   */
+  void setConditioningConfig(const InputConditioner::Config& config);
+  /**
+   * @brief the input conditioner or null if the format isn't 16 bit PCM
+   */
+  const InputConditioner* getInputConditioner() const { return m_pInputConditioner.get(); }
+  /**
+   * @brief the smoothed time spent conditioning relative to the time spent encoding
+   */
+  double getConditioningOverheadPercent() const { return m_dConditioningOverhead * 100.0; }
+  /**
+   * @brief the time taken by the last call to encodeFrame
+   */
+  double getLastEncodeMs() const { return m_dLastEncodeMs; }
+  /**
+   * @brief Completion times of the frames, measured from the arrival of the audio in addAudioData, and the
+   * number of frames that took longer than their duration
+   */
+  DeadlineTracker& getDeadlineTracker() { return m_deadlineTracker; }
+  const DeadlineTracker& getDeadlineTracker() const { return m_deadlineTracker; }
+  /**
+   * @brief Places the framing buffer and the packet buffers together in a NumaArena on the node of the thread
+   * that encodes, optionally on huge pages. Takes effect at open() and placeOnCurrentNode().
+   */
+  void setNumaPlacement(bool bEnable, bool bHugePages);
+  /**
+   * @brief Moves the buffers to the node of the calling thread if they are on another node, e.g. from the first
+   * Receive after the stream has been opened on the application thread. The buffered audio moves along.
+   * @return true if the buffers were moved
+   */
+  bool placeOnCurrentNode();
+  /**
+   * @brief Sets the capacity of the framing buffer, by default one second of 48 kHz stereo. An engine that is only
+   * handed whole frames through encodeFrame can do without it. Takes effect at open().
+   */
+  void setFramingBufferSize(int iBytes) { m_iFramingBufferSize = iBytes; }
+  /**
+   * @brief the arena the buffers are placed in or null if NUMA placement is disabled
+   */
+  const NumaArena* getArena() const { return m_pArena.get(); }
+  /**
+   * @brief Keeps the last uiMs of the encoded input so that the codec of a standby can be brought into step from a
+   * checkpoint. 0 disables the history and the checkpoints. Takes effect at open().
+   */
+  void setCheckpointHistory(uint32_t uiMs);
+  /**
+   * @brief Captures the framing buffer, its clock, the packet numbering and the input history, between two frames
+   * @return false if the history is disabled or the engine isn't open
+   */
+  bool saveCheckpoint(EncoderCheckpoint& checkpoint) const;
+  /**
+   * @brief Continues the stream of a checkpoint. The codec state cannot be transferred: the codec encodes the history
+   * instead, which brings its adaptive state into step with that of the codec that took the checkpoint, and the packets
+   * are discarded. Then the buffered audio, the clock and the packet numbering are restored. The engine must be open
+   * with the format of the checkpoint.
+   * @return false if the checkpoint doesn't match, see getLastError()
+   */
+  bool restoreCheckpoint(const EncoderCheckpoint& checkpoint);
+  /**
+   * @brief Closes and reopens the codec so that the next frame is encoded without the state of the earlier ones,
+   * e.g. when the engine takes over a stream that the decoder restarts on. The framing buffer is kept.
+   * @return false if the codec failed to open, see getLastError()
+   */
+  bool restartCodec();
+  /**
+   * @brief the number of frames encoded since the engine was created or restored
+   */
+  uint64_t getFramesEncoded() const { return m_uiFramesEncoded; }
+
+private:
+  OpusEncodeEngine(const OpusEncodeEngine&) = delete;
+  OpusEncodeEngine& operator=(const OpusEncodeEngine&) = delete;
+
+  /// applies the complexity and frame duration requested by the EncoderGovernor at a frame boundary
+  void applyGovernorAdaptation();
+  /// switches to a generic AudioBuffer if the current buffer is specialised for another frame duration
+  void applyFrameDuration(OpusFrameDuration eFrameDuration);
+  /// passes a changed FEC decision on to the codec
+  void applyFecDecision();
+  /// pads the packet to the CBR size, @return iConstantSize
+  int padToConstantSize(uint8_t* pOut, int iSize, int iConstantSize, int iOutSize);
+  /// (re)creates the arena, the audio buffer and the packet arena for the current format
+  void createBuffers(OpusFrameDuration eFrameDuration);
+  /// replaces the framing buffer and looks up its final class for the per frame calls
+  void setAudioBuffer(std::unique_ptr<IAudioBuffer> pBuffer);
+  /// m_iFramingBufferSize bytes from the arena or null for the heap
+  uint8_t* allocateAudioStorage();
+  /// (re)creates the drift compensator for the current format
+  void createDriftCompensator();
+  /// (re)creates the loudness meter for the current format
+  void createLoudnessMeter();
+  /// (re)creates the frame duration controller for the current format
+  void createFrameDurationController();
+  /// (re)creates the input conditioner for the current format
+  void createInputConditioner();
+  /// (re)creates the input decoder for the current format, @return false if the encoding is invalid
+  bool createInputDecoder();
+  /// (re)creates the channel mixer for the current format, @return false if the matrix is invalid
+  bool createChannelMixer();
+  /// adds PCM of the encoded channels, through the drift compensator if enabled
+  int bufferAudioData(uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop);
+  /// the number of complete frames in the framing buffer
+  int getCompleteFrames() const;
+  /// (re)creates the input history for the current format
+  void createCheckpointHistory();
+  /// appends the input of a frame to the history ring
+  void recordHistory(const uint8_t* pFrame, size_t uiSize);
+
+  /// Codec
+  ICodecv2* m_pCodec;
+  bool m_bOpen;
+  /// last max_compr_size passed to the codec so that we only update it on change
+  int m_iMaxComprSize;
+
+  int m_iSamplesPerSecond;
+  int m_iChannels;
+  int m_iBitsPerSample;
+  uint32_t m_uiTargetBitrateKbps;
+
+  /// configured frame duration
+  OpusFrameDuration m_eFrameDuration;
+  FecController m_fecController;
+  /// false if the codec does not support the in-band FEC settings
+  bool m_bFecSupported;
+  /// the settings last passed to the codec
+  bool m_bFecApplied;
+  uint32_t m_uiExpectedLossApplied;
+
+  /// hard CBR link rate, 0 if disabled
+  uint32_t m_uiCbrLinkRateBps;
+  uint32_t m_uiCbrOverheadBytes;
+  uint64_t m_uiCbrOverruns;
+
+  bool m_bAdaptiveFrameDuration;
+  FrameDurationController::Config m_adaptiveFrameDurationConfig;
+  std::unique_ptr<FrameDurationController> m_pFrameDurationController;
+  /// the duration chosen by the controller for the next frame
+  OpusFrameDuration m_eAdaptiveFrameDuration;
+  /// EncoderGovernor stream id
+  int m_iGovernorId;
+  /// the degradation level of the stream, polled at every frame
+  std::shared_ptr<const std::atomic<int>> m_pGovernorLevel;
+  /// complexity set with setComplexity, which the governor degrades from
+  uint32_t m_uiConfiguredComplexity;
+  /// complexity currently configured on the codec
+  uint32_t m_uiComplexity;
+  /// false if the codec does not support setting the complexity
+  bool m_bComplexitySupported;
+  /// set while padded frames are read, see padPartialFrame
+  bool m_bFrameDurationHeld;
+
+  double m_dLastEncodeMs;
+  /// when the audio of the frames being encoded arrived
+  std::chrono::steady_clock::time_point m_tAudioArrival;
+  DeadlineTracker m_deadlineTracker;
+  GapPolicy m_eGapPolicy;
+  REFERENCE_TIME m_tGapTolerance;
+  REFERENCE_TIME m_tMaxGapFill;
+
+  std::string m_sLastError;
+  bool m_bNumaPlacement;
+  bool m_bHugePages;
+  int m_iFramingBufferSize;
+  /// storage of m_pAudioBuffer and the packets of m_pPacketArena, which keeps it alive while packets are out
+  std::shared_ptr<NumaArena> m_pArena;
+  std::unique_ptr<IAudioBuffer> m_pAudioBuffer;
+  /// the final class of m_pAudioBuffer, see visitAudioBuffer
+  AudioBufferKind m_eAudioBufferKind;
+  std::unique_ptr<QualityMonitor> m_pQualityMonitor;
+
+  bool m_bDriftCompensation;
+  DriftCompensator::Mode m_eDriftMode;
+  std::unique_ptr<DriftCompensator> m_pDriftCompensator;
+  /// see setMaxQueuedMs
+  uint32_t m_uiMaxQueuedMs;
+  /// resampler output, kept to avoid reallocations
+  std::vector<int16_t> m_vResampled;
+
+  bool m_bLoudnessMeter;
+  std::unique_ptr<LoudnessMeter> m_pLoudnessMeter;
+  /// EWMA of the metering time over the encoding time
+  double m_dMeteringOverhead;
+
+  InputConditioner::Config m_conditioningConfig;
+  std::unique_ptr<InputConditioner> m_pInputConditioner;
+  /// EWMA of the conditioning time over the encoding time
+  double m_dConditioningOverhead;
+  InputDecoder::Config m_inputEncoding;
+  /// null for PCM input
+  std::unique_ptr<InputDecoder> m_pInputDecoder;
+  /// decoded input for the drift compensator or the channel mixer
+  std::vector<int16_t> m_vDecoded;
+  ChannelMixer::Config m_channelMix;
+  /// null if the input channels are encoded as they are
+  std::unique_ptr<ChannelMixer> m_pChannelMixer;
+  /// mixed input for the drift compensator
+  std::vector<int16_t> m_vMixed;
+
+  std::shared_ptr<PacketArena> m_pPacketArena;
+  PacketDistributor m_distributor;
+  uint64_t m_uiPacketSequenceNumber;
+  uint64_t m_uiFramesEncoded;
+
+  uint32_t m_uiCheckpointHistoryMs;
+  /// ring of the most recently encoded input, empty if the history is disabled
+  std::vector<uint8_t> m_vHistory;
+  /// where the next frame is written and how much of the ring holds input
+  size_t m_uiHistoryPos;
+  size_t m_uiHistoryFill;
+};
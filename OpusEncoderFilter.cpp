@@ -36,9 +36,67 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //Codec classes
 #include <OpusCodec/OpusFactory.h>
 #include <CodecUtils/ICodecv2.h>
+#include "EncoderGovernor.h"
+#include "FrameTracer.h"
+#include "OpusPacket.h"
 // #include "Conversion.h"
 #include <Mmreg.h>
 
+// about 5 s of packets at the maximum Opus bitrate
+static const uint32_t SHM_OUTPUT_CAPACITY = 1 << 20;
+// the pacer holds output samples: the allocator blocks the encoder before this is reached
+static const long PACER_MAX_QUEUED = 16;
+// the telephony wave formats as media subtypes (wave format tag + MEDIASUBTYPE_PCM's base GUID)
+static const GUID MEDIASUBTYPE_WAVE_MULAW = { WAVE_FORMAT_MULAW, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 } };
+static const GUID MEDIASUBTYPE_WAVE_ALAW = { WAVE_FORMAT_ALAW, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 } };
+static const GUID MEDIASUBTYPE_WAVE_IMA_ADPCM = { WAVE_FORMAT_IMA_ADPCM, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 } };
+
+// one table for the registration and the trace snapshot: a new parameter can't be left out of the trace
+const OpusEncoderFilter::NumericParameter OpusEncoderFilter::NUMERIC_PARAMETERS[] =
+{
+  { "target_bitrate_kbps", &OpusEncoderFilter::m_uiTargetBitrateKbps, 128 },
+  { FILTER_PARAM_STREAM_PRIORITY, &OpusEncoderFilter::m_uiStreamPriority, 0 },
+  { FILTER_PARAM_CPU_BUDGET_PERCENT, &OpusEncoderFilter::m_uiCpuBudgetPercent, 0 },
+  { FILTER_PARAM_QUALITY_MONITOR, &OpusEncoderFilter::m_uiQualityMonitor, 0 },
+  { FILTER_PARAM_FRAME_TRACING, &OpusEncoderFilter::m_uiFrameTracing, 0 },
+  { FILTER_PARAM_GAP_POLICY, &OpusEncoderFilter::m_uiGapPolicy, 0 },
+  { FILTER_PARAM_GAP_TOLERANCE_MS, &OpusEncoderFilter::m_uiGapToleranceMs, 10 },
+  { FILTER_PARAM_GAP_MAX_FILL_MS, &OpusEncoderFilter::m_uiGapMaxFillMs, 1000 },
+  { FILTER_PARAM_DRIFT_COMPENSATION, &OpusEncoderFilter::m_uiDriftCompensation, 0 },
+  { FILTER_PARAM_FEC_MODE, &OpusEncoderFilter::m_uiFecMode, 0 },
+  { FILTER_PARAM_FEC_EXPECTED_LOSS_PERCENT, &OpusEncoderFilter::m_uiFecExpectedLossPercent, 10 },
+  { FILTER_PARAM_CBR_LINK_RATE_BPS, &OpusEncoderFilter::m_uiCbrLinkRateBps, 0 },
+  { FILTER_PARAM_CBR_LINK_OVERHEAD_BYTES, &OpusEncoderFilter::m_uiCbrLinkOverheadBytes, 0 },
+  { FILTER_PARAM_PACED_OUTPUT, &OpusEncoderFilter::m_uiPacedOutput, 0 },
+  { FILTER_PARAM_PACER_PREBUFFER_MS, &OpusEncoderFilter::m_uiPacerPrebufferMs, 60 },
+  { FILTER_PARAM_PACER_SPIN_US, &OpusEncoderFilter::m_uiPacerSpinUs, 250 },
+  { FILTER_PARAM_ADAPTIVE_FRAME_DURATION, &OpusEncoderFilter::m_uiAdaptiveFrameDuration, 0 },
+  { FILTER_PARAM_MAX_FRAME_DURATION_MS, &OpusEncoderFilter::m_uiMaxFrameDurationMs, 60 },
+  { FILTER_PARAM_PACKET_RATE_BUDGET, &OpusEncoderFilter::m_uiPacketRateBudget, 0 },
+  { FILTER_PARAM_PACKET_HEADER_BYTES, &OpusEncoderFilter::m_uiPacketHeaderBytes, 40 },
+  { FILTER_PARAM_TRACE_RECORD_COMPRESS, &OpusEncoderFilter::m_uiTraceRecordCompress, 1 },
+  { FILTER_PARAM_LOUDNESS_METER, &OpusEncoderFilter::m_uiLoudnessMeter, 0 },
+  { FILTER_PARAM_REALTIME_SCHEDULING, &OpusEncoderFilter::m_uiRealtimeScheduling, 0 },
+  { FILTER_PARAM_NUMA_PLACEMENT, &OpusEncoderFilter::m_uiNumaPlacement, 0 },
+  { FILTER_PARAM_HUGE_PAGES, &OpusEncoderFilter::m_uiHugePages, 0 },
+  { FILTER_PARAM_DC_REMOVAL, &OpusEncoderFilter::m_uiDcRemoval, 0 },
+  { FILTER_PARAM_HIGHPASS_HZ, &OpusEncoderFilter::m_uiHighPassHz, 0 },
+  { FILTER_PARAM_NOISE_GATE_DB, &OpusEncoderFilter::m_uiNoiseGateDb, 0 },
+  { FILTER_PARAM_DELIVERY_POLICY, &OpusEncoderFilter::m_uiDeliveryPolicy, 0 },
+  { FILTER_PARAM_DELIVERY_MAX_QUEUED_MS, &OpusEncoderFilter::m_uiDeliveryMaxQueuedMs, 200 },
+  { FILTER_PARAM_ENCODE_CHANNELS, &OpusEncoderFilter::m_uiEncodeChannels, 0 },
+  { FILTER_PARAM_CHECKPOINT_INTERVAL_MS, &OpusEncoderFilter::m_uiCheckpointIntervalMs, 1000 },
+  { FILTER_PARAM_CHECKPOINT_HISTORY_MS, &OpusEncoderFilter::m_uiCheckpointHistoryMs, 100 }
+};
+
+void OpusEncoderFilter::initParameters()
+{
+  for (const NumericParameter& parameter : NUMERIC_PARAMETERS)
+  {
+    addParameter(parameter.szName, &(this->*parameter.pValue), parameter.uiDefault);
+  }
+}
+
 OpusEncoderFilter::OpusEncoderFilter()
 	: CCustomBaseFilter(NAME("CSIR VPP Opus Encoder"), 0, CLSID_VPP_OpusEncoder),
   m_pCodec(NULL), 
@@ -46,43 +104,78 @@ OpusEncoderFilter::OpusEncoderFilter()
   m_uiSamplesPerSecond(0),
   m_uiChannels(0),
   m_uiBitsPerSample(0),
-  m_uiMaxCompressedSize(0)
+  m_uiMaxCompressedSize(0),
+  m_uiStreamPriority(0),
+  m_uiCpuBudgetPercent(0),
+  m_uiQualityMonitor(0),
+  m_uiGapPolicy(0),
+  m_uiGapToleranceMs(10),
+  m_uiGapMaxFillMs(1000),
+  m_uiDriftCompensation(0),
+  m_uiFecMode(0),
+  m_uiFecExpectedLossPercent(10),
+  m_uiCbrLinkRateBps(0),
+  m_uiCbrLinkOverheadBytes(0),
+  m_uiPacedOutput(0),
+  m_uiPacerPrebufferMs(60),
+  m_uiPacerSpinUs(250),
+  m_hrPacedDelivery(S_OK),
+  m_uiLastToc(0),
+  m_iLastPacketSize(0),
+  m_tLastPacketStop(0),
+  m_uiAdaptiveFrameDuration(0),
+  m_uiMaxFrameDurationMs(60),
+  m_uiPacketRateBudget(0),
+  m_uiPacketHeaderBytes(40),
+  m_uiTraceRecordCompress(1),
+  m_uiLoudnessMeter(0),
+  m_uiFrameTracing(0),
+  m_uiTraceStreamId(FrameTracer::newStreamId()),
+  m_uiTraceFrame(0),
+  m_uiRealtimeScheduling(0),
+  m_dwStreamingThreadId(0),
+  m_bRealtimeActive(false),
+  m_uiNumaPlacement(0),
+  m_uiHugePages(0),
+  m_bPlaced(false),
+  m_uiDcRemoval(0),
+  m_uiHighPassHz(0),
+  m_uiNoiseGateDb(0),
+  m_uiDeliveryPolicy(0),
+  m_uiDeliveryMaxQueuedMs(200),
+  m_bDroppingNewest(false),
+  m_bDroppedOldest(false),
+  m_uiQueuedMs(0),
+  m_uiPeakQueuedMs(0),
+  m_uiDroppedBytes(0),
+  m_uiDropEvents(0),
+  m_inputEncoding(InputDecoder::getDefaultConfig()),
+  m_uiEncodeChannels(0),
+  m_uiInputChannels(0),
+  m_uiCheckpointIntervalMs(1000),
+  m_uiCheckpointHistoryMs(100),
+  m_tLastCheckpoint(std::chrono::steady_clock::now()),
+  m_bContinuesCheckpoint(false),
+  m_uiCheckpointUs(0)
 {
   //Call the initialise input method to load all acceptable input types for this filter
   InitialiseInputTypes();
   initParameters();
-  OpusFactory factory;
-  m_pCodec = factory.GetCodecInstance();
+  m_pEngine = std::make_unique<OpusEncodeEngine>();
+  m_pEngine->enableLoudnessMeter(m_uiLoudnessMeter != 0);
+  applyFrameDurationAdaptation();
+  applyFecMode();
+  applyConditioning();
+  m_pCodec = m_pEngine->getCodec();
   // Set default codec properties 
   if (!m_pCodec)
   {
-    SetLastError("Unable to create Opus Encoder from Factory.", true);
+    SetLastError(m_pEngine->getLastError().c_str(), true);
   }
-
-//#ifdef TEST_OPUS_ENCODE_DECODE
-//  m_pDecoder = factory.GetCodecInstance();
-//  ASSERT(m_pDecoder);
-//#endif
 }
 
 OpusEncoderFilter::~OpusEncoderFilter()
 {
-  if (m_pCodec)
-  {
-    m_pCodec->Close();
-    OpusFactory factory;
-    factory.ReleaseCodecInstance(m_pCodec);
-  }
-
-//#ifdef TEST_OPUS_ENCODE_DECODE
-//  if (m_pDecoder)
-//  {
-//    m_pDecoder->Close();
-//    OpusFactory factory;
-//    factory.ReleaseCodecInstance(m_pDecoder);
-//  }
-//
-//#endif
 }
 
 CUnknown * WINAPI OpusEncoderFilter::CreateInstance( LPUNKNOWN pUnk, HRESULT *pHr )
@@ -98,6 +191,10 @@ CUnknown * WINAPI OpusEncoderFilter::CreateInstance( LPUNKNOWN pUnk, HRESULT *pH
 void OpusEncoderFilter::InitialiseInputTypes()
 {
 	AddInputType(&MEDIATYPE_Audio, &MEDIASUBTYPE_PCM, &FORMAT_WaveFormatEx);
+  // expanded to 16 bit PCM in front of the encoder
+  AddInputType(&MEDIATYPE_Audio, &MEDIASUBTYPE_WAVE_MULAW, &FORMAT_WaveFormatEx);
+  AddInputType(&MEDIATYPE_Audio, &MEDIASUBTYPE_WAVE_ALAW, &FORMAT_WaveFormatEx);
+  AddInputType(&MEDIATYPE_Audio, &MEDIASUBTYPE_WAVE_IMA_ADPCM, &FORMAT_WaveFormatEx);
 }
 
 HRESULT OpusEncoderFilter::SetMediaType( PIN_DIRECTION direction, const CMediaType *pmt )
@@ -107,23 +204,47 @@ HRESULT OpusEncoderFilter::SetMediaType( PIN_DIRECTION direction, const CMediaTy
 	{
     if (pmt->majortype != MEDIATYPE_Audio)
       return E_FAIL;
-    if (pmt->subtype != MEDIASUBTYPE_PCM)
+    if (pmt->subtype != MEDIASUBTYPE_PCM && pmt->subtype != MEDIASUBTYPE_WAVE_MULAW &&
+      pmt->subtype != MEDIASUBTYPE_WAVE_ALAW && pmt->subtype != MEDIASUBTYPE_WAVE_IMA_ADPCM)
       return E_FAIL;
     if (pmt->formattype != FORMAT_WaveFormatEx)
       return E_FAIL;
 
     WAVEFORMATEX *pwfx = (WAVEFORMATEX *)pmt->pbFormat;
 
-    // only accept raw audio
-    if (pwfx->wFormatTag != WAVE_FORMAT_PCM)
-    {
-      return E_UNEXPECTED;
-    }
-    if (pwfx->wBitsPerSample != 16)
+    // 16 bit raw audio, or G.711 and IMA ADPCM which the engine expands to 16 bit
+    InputDecoder::Config inputEncoding = InputDecoder::getDefaultConfig();
+    uint32_t uiChannelMask = 0;
+    switch (pwfx->wFormatTag)
     {
+    case WAVE_FORMAT_PCM:
+      if (pwfx->wBitsPerSample != 16) return E_UNEXPECTED;
+      break;
+    case WAVE_FORMAT_EXTENSIBLE:
+      // multichannel PCM with its speaker positions: KSDATAFORMAT_SUBTYPE_PCM is the same GUID as MEDIASUBTYPE_PCM
+      if (pwfx->wBitsPerSample != 16 || pwfx->cbSize < sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX) ||
+        ((WAVEFORMATEXTENSIBLE*)pwfx)->SubFormat != MEDIASUBTYPE_PCM) return E_UNEXPECTED;
+      uiChannelMask = ((WAVEFORMATEXTENSIBLE*)pwfx)->dwChannelMask;
+      break;
+    case WAVE_FORMAT_MULAW:
+    case WAVE_FORMAT_ALAW:
+      if (pwfx->wBitsPerSample != 8) return E_UNEXPECTED;
+      inputEncoding.encoding = pwfx->wFormatTag == WAVE_FORMAT_MULAW ? InputEncoding::IE_MULAW : InputEncoding::IE_ALAW;
+      inputEncoding.blockAlign = pwfx->nChannels;
+      inputEncoding.samplesPerBlock = 1;
+      break;
+    case WAVE_FORMAT_IMA_ADPCM:
+      if (pwfx->wBitsPerSample != 4 || pwfx->cbSize < sizeof(WORD)) return E_UNEXPECTED;
+      inputEncoding.encoding = InputEncoding::IE_IMA_ADPCM;
+      inputEncoding.blockAlign = pwfx->nBlockAlign;
+      inputEncoding.samplesPerBlock = ((IMAADPCMWAVEFORMAT*)pwfx)->wSamplesPerBlock;
+      if (!InputDecoder::isValid(inputEncoding, pwfx->nChannels)) return E_UNEXPECTED;
+      break;
+    default:
       return E_UNEXPECTED;
     }
-    if (pwfx->nChannels < 0 || pwfx->nChannels > 2)
+    // more than 2 channels are mixed down before encoding
+    if (pwfx->nChannels == 0 || pwfx->nChannels > ChannelMixer::MAX_INPUT_CHANNELS)
     {
       return E_UNEXPECTED;
     }
@@ -143,36 +264,32 @@ HRESULT OpusEncoderFilter::SetMediaType( PIN_DIRECTION direction, const CMediaTy
     WAVEFORMATEX *pWfx = (WAVEFORMATEX*)pmt->pbFormat;
     // remember this for later
     m_uiSamplesPerSecond = pWfx->nSamplesPerSec;
-    m_uiChannels = pWfx->nChannels;
-    m_uiBitsPerSample = pWfx->wBitsPerSample;
-    m_pAudioBuffer = std::make_unique<AudioBuffer>(m_uiSamplesPerSecond, m_uiChannels, m_uiBitsPerSample);
-
-    m_pCodec->SetParameter("samples_per_second", std::to_string(m_uiSamplesPerSecond).c_str());
-    m_pCodec->SetParameter("channels", std::to_string(m_uiChannels).c_str());
-    m_pCodec->SetParameter("bits_per_sample", std::to_string(m_uiBitsPerSample).c_str());
-    m_pCodec->SetParameter("target_bitrate_kbps", std::to_string(m_uiTargetBitrateKbps).c_str());
+    m_uiInputChannels = pWfx->nChannels;
+    if (!applyChannelMix(m_uiInputChannels, uiChannelMask))
+    {
+      SetLastError("The channel mix doesn't fit the input channels", true);
+      return E_UNEXPECTED;
+    }
+    // what the encoder sees
+    m_uiBitsPerSample = 16;
+    m_inputEncoding = inputEncoding;
+    m_pEngine->setInputEncoding(inputEncoding);
+    m_pTraceDecoder.reset();
+    if (inputEncoding.encoding != InputEncoding::IE_PCM)
+    {
+      m_pTraceDecoder = std::make_unique<InputDecoder>(inputEncoding, m_uiInputChannels);
+    }
 
-    if (!m_pCodec->Open())
+    applyGapPolicy();
+    // a standby that has taken over checkpoints the stream in turn
+    m_pEngine->setCheckpointHistory(m_sCheckpointPath.empty() ? 0 : m_uiCheckpointHistoryMs);
+    if (!m_pEngine->open(m_uiSamplesPerSecond, m_uiChannels, m_uiBitsPerSample, m_uiTargetBitrateKbps))
     {
       //Houston: we have a failure
-      char* szErrorStr = m_pCodec->GetErrorStr();
+      const char* szErrorStr = m_pEngine->getLastError().c_str();
       printf("%s\n", szErrorStr);
       SetLastError(szErrorStr, true);
     }
-
-//#ifdef TEST_OPUS_ENCODE_DECODE
-//    m_pDecoder->SetParameter("samples_per_second", toString(m_uiSamplesPerSecond).c_str());
-//    m_pDecoder->SetParameter("channels", toString(m_uiChannels).c_str());
-//    m_pDecoder->SetParameter("bits_per_sample", toString(m_uiBitsPerSample).c_str());
-//
-//    if (!m_pDecoder->Open())
-//    {
-//      //Houston: we have a failure
-//      char* szErrorStr = m_pDecoder->GetErrorStr();
-//      printf("%s\n", szErrorStr);
-//      SetLastError(szErrorStr, true);
-//    }
-//#endif
 	}
 
 	return hr;
@@ -186,15 +303,6 @@ HRESULT OpusEncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
 	}
 	else if (iPosition == 0)
 	{
-#ifdef TEST_OPUS_ENCODE_DECODE
-    // Get the input pin's media type and return this as the output media type - we want to retain
-    // all the information about the image
-    HRESULT hr = m_pInput->ConnectionMediaType(pMediaType);
-    if (FAILED(hr))
-    {
-      return hr;
-    }
-#else
 		// there is only one type we can produce
 		pMediaType->majortype = MEDIATYPE_Audio;
 		pMediaType->subtype = MEDIASUBTYPE_OPUS;
@@ -207,13 +315,13 @@ HRESULT OpusEncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
     WAVEFORMATEX *pWfx = (WAVEFORMATEX*)pMediaType->AllocFormatBuffer(sizeof(WAVEFORMATEX));
     memset(pWfx, 0, sizeof(*pWfx));
     pWfx->wFormatTag = WAVE_FORMAT_EXTENSIBLE;
-    pWfx->wBitsPerSample = m_audioInHeader.wBitsPerSample;
-		pWfx->nChannels = m_audioInHeader.nChannels;
+    // G.711 and ADPCM input is encoded as 16 bit PCM, multichannel input as mono or stereo
+    pWfx->wBitsPerSample = m_uiBitsPerSample;
+		pWfx->nChannels = m_uiChannels;
 		pWfx->nSamplesPerSec = m_audioInHeader.nSamplesPerSec;
     pWfx->nBlockAlign = (pWfx->wBitsPerSample * pWfx->nChannels) / 8;
     pWfx->nAvgBytesPerSec = pWfx->nSamplesPerSec * pWfx->nBlockAlign;
     pWfx->cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
-#endif
 		return NOERROR;
 	}
 	return VFW_S_NO_MORE_ITEMS;
@@ -234,9 +342,11 @@ HRESULT OpusEncoderFilter::DecideBufferSize( IMemAllocator *pAlloc, ALLOCATOR_PR
   // decide the size
   // Use the buffer to be a seconds worth of data
   pProp->cBuffers = 5;
+  // the paced packets hold on to their samples
+  if (m_uiPacedOutput != 0) pProp->cBuffers += PACER_MAX_QUEUED;
   pProp->cbBuffer = pwfx->nSamplesPerSec * pwfx->wBitsPerSample * pwfx->nChannels / 8;
   // configure max compressed size
-  m_pCodec->SetParameter("max_compr_size", std::to_string(pProp->cbBuffer).c_str());
+  m_pEngine->setMaxCompressedSize(pProp->cbBuffer);
 
   pProp->cbAlign = pwfx->nBlockAlign;
   ASSERT(pProp->cbBuffer);
@@ -268,17 +378,134 @@ HRESULT OpusEncoderFilter::ApplyTransform( BYTE* ptr, long lInBufferSize, long s
 HRESULT OpusEncoderFilter::StartStreaming()
 {
 	has_start = false;
+  if (m_pEngine->getAudioBuffer())
+  {
+    m_pEngine->reset();
+  }
+  m_bContinuesCheckpoint = false;
+  if (!m_sCheckpointRestore.empty() && m_pEngine->getAudioBuffer() && !restoreCheckpoint())
+  {
+    return E_FAIL;
+  }
+  m_sSessionCheckpointPath = m_sCheckpointPath;
+  m_tLastCheckpoint = std::chrono::steady_clock::now();
+  m_uiCheckpointUs = 0;
+  if (!m_sSessionCheckpointPath.empty())
+  {
+    m_checkpointWriter.start(m_sSessionCheckpointPath);
+  }
+  if (!m_sShmOutputName.empty() && !m_shmOutput.isOpen() && !openSharedMemoryOutput())
+  {
+    SetLastError(m_shmOutput.getLastError().c_str(), true);
+    return E_FAIL;
+  }
+  if (!m_sTraceRecordPath.empty() && !m_traceRecorder.isOpen() && !openTraceRecorder())
+  {
+    SetLastError("Unable to create the trace file", true);
+    return E_FAIL;
+  }
+  m_realtimePolicy = RealtimePolicy();
+  m_realtimePolicy.eMode = m_uiRealtimeScheduling == 2 ? RealtimeMode::RM_DEADLINE :
+    m_uiRealtimeScheduling == 1 ? RealtimeMode::RM_REALTIME : RealtimeMode::RM_NONE;
+  // the core set was validated when it was set
+  parseCoreSet(m_sRealtimeCores, m_realtimePolicy.vCores);
+  if (m_pEngine->getAudioBuffer())
+  {
+    // a reservation of half of each frame period for the release of a packet
+    m_realtimePolicy.tPeriod = static_cast<REFERENCE_TIME>(m_pEngine->getAudioBuffer()->getFrameDurationMs() * 10000);
+    m_realtimePolicy.tRuntime = m_realtimePolicy.tPeriod / 2;
+  }
+  m_bPlaced = false;
+  m_pEngine->getDeadlineTracker().reset();
+  m_hrPacedDelivery = S_OK;
+  m_bDroppingNewest = false;
+  m_bDroppedOldest = false;
+  m_uiQueuedMs = 0;
+  m_uiPeakQueuedMs = 0;
+  m_uiDroppedBytes = 0;
+  m_uiDropEvents = 0;
+  m_pacer.setRealtimePolicy(m_realtimePolicy);
+  m_pacer.setSpinMargin(m_uiPacerSpinUs * 10LL);
+  if (m_uiPacedOutput != 0)
+  {
+    m_iLastPacketSize = 0;
+    // a constant-rate link must be fed even if the input stalls
+    PacketPacer::UnderrunHandler onUnderrun;
+    if (m_uiCbrLinkRateBps != 0)
+    {
+      onUnderrun = [this](REFERENCE_TIME tDuration) { deliverFiller(tDuration); };
+    }
+    m_pacer.start(m_uiPacerPrebufferMs * 10000LL, PACER_MAX_QUEUED, onUnderrun);
+  }
 
 	return __super::StartStreaming();
 }
 
+HRESULT OpusEncoderFilter::StopStreaming()
+{
+  m_pacer.stop();
+  // the checkpoint being written completes so that the standby finds the latest one
+  m_checkpointWriter.stop();
+  // restores the streaming thread, which is upstream's and may stream for others once we are stopped
+  m_pStreamingRealtime.reset();
+  m_dwStreamingThreadId = 0;
+  m_bRealtimeActive = false;
+  return __super::StopStreaming();
+}
+
+HRESULT OpusEncoderFilter::BeginFlush()
+{
+  // downstream is flushing first so that a delivery blocked on the pacer thread returns
+  HRESULT hr = __super::BeginFlush();
+  m_pacer.flush();
+  return hr;
+}
+
 HRESULT OpusEncoderFilter::EndFlush()
 {
 	has_start = false;
+  m_bDroppingNewest = false;
+  m_bDroppedOldest = false;
+  m_traceRecorder.recordEvent(TraceRecordType::TR_FLUSH);
+  // flushed audio must not be glued to the audio that follows
+  if (m_pEngine->getAudioBuffer())
+  {
+    m_pEngine->reset();
+  }
 
 	return __super::EndFlush();
 }
 
+HRESULT OpusEncoderFilter::NewSegment(REFERENCE_TIME tStart, REFERENCE_TIME tStop, double dRate)
+{
+  m_traceRecorder.recordNewSegment(tStart, tStop);
+  // a seek: the buffered audio belongs to the previous segment
+  if (m_pEngine->getAudioBuffer())
+  {
+    m_pEngine->reset();
+  }
+  return __super::NewSegment(tStart, tStop, dRate);
+}
+
+HRESULT OpusEncoderFilter::EndOfStream()
+{
+  m_traceRecorder.recordEvent(TraceRecordType::TR_END_OF_STREAM);
+  if (m_pEngine->getAudioBuffer() && m_pEngine->isOpen())
+  {
+    // the frames that the live delivery left queued, e.g. while downstream held all samples: no sample follows to
+    // deliver them, so they are delivered here waiting for the allocator
+    HRESULT hr = deliverQueuedFrames();
+    // zero-pad and encode the partial frame at the end of the stream so that the output is sample-accurate in length
+    if (SUCCEEDED(hr) && m_pEngine->padPartialFrame())
+    {
+      deliverQueuedFrames();
+    }
+  }
+  // the end of the stream must not overtake the paced packets
+  m_pacer.drain();
+  return __super::EndOfStream();
+}
+
 HRESULT OpusEncoderFilter::Receive(IMediaSample *pSample)
 {
   /*  Check for other streams and pass them on */
@@ -286,6 +513,7 @@ HRESULT OpusEncoderFilter::Receive(IMediaSample *pSample)
   if (pProps->dwStreamId != AM_STREAM_MEDIA) {
     return m_pOutput->Deliver(pSample);
   }
+  FRAME_TRACE(SampleArrival, m_uiTraceStreamId, m_uiTraceFrame);
   HRESULT hr;
 
   IMediaSample *pSource = pSample;
@@ -293,130 +521,344 @@ HRESULT OpusEncoderFilter::Receive(IMediaSample *pSample)
   long lSourceSize = pSource->GetActualDataLength();
   pSource->GetPointer(&pSourceBuffer);
 
-  AM_MEDIA_TYPE mt;
-  hr = m_pOutput->ConnectionMediaType(&mt);
-  if (FAILED(hr))
+  REFERENCE_TIME tStart, tStop;
+  hr = pSample->GetTime(&tStart, &tStop);
+  ASSERT(SUCCEEDED(hr));
+  ASSERT (m_pEngine->isOpen());
+  applyStreamingRealtime();
+  if (!m_bPlaced)
   {
-    return hr;
+    // the format was set on the application thread: follow the streaming thread, after it has been pinned
+    m_pEngine->placeOnCurrentNode();
+    m_bPlaced = true;
+  }
+  if ((pProps->dwSampleFlags & AM_SAMPLE_DATADISCONTINUITY) && !m_bContinuesCheckpoint)
+  {
+    // don't glue stale audio to the new audio
+    m_pEngine->startNewSegment(tStart);
+  }
+  // the first sample of the standby continues the stream of the checkpoint: a gap is handled by the gap policy
+  m_bContinuesCheckpoint = false;
+  // a sample after dropped samples starts a new segment in admitAudio
+  const DWORD dwAdmittedFlags = pProps->dwSampleFlags | (m_bDroppingNewest ? AM_SAMPLE_DATADISCONTINUITY : 0);
+  if (admitAudio(m_pEngine->getDecodedSize(lSourceSize), tStart))
+  {
+    // the trace replays what the engine was given: the dropped samples are left out
+    recordTraceSample(pSourceBuffer, lSourceSize, tStart, tStop, dwAdmittedFlags);
+    // G.711 and ADPCM are expanded and multichannel input is mixed straight into the audio buffer
+    int res = m_inputEncoding.encoding == InputEncoding::IE_PCM ? m_pEngine->addAudioData(pSourceBuffer, lSourceSize, tStart, tStop) :
+      m_pEngine->addEncodedAudioData(pSourceBuffer, lSourceSize, tStart, tStop);
+    ASSERT(res != - 1);
   }
-  //Make sure that the format type is our custom format
-  ASSERT(mt.formattype == FORMAT_WaveFormatEx);
-  WAVEFORMATEX* pwfx = (WAVEFORMATEX*)mt.pbFormat;
 
-  int iCurrentFrame = 0;
-  int iProcessedBytes = 0;
-  int iCompressedSize = 0;
-  int iCompressedBytes = 0;
+  hr = S_OK;
+  if (m_uiDeliveryPolicy != 0)
+  {
+    // live: never wait for downstream, the queue is bounded by admitAudio
+    hr = deliverAvailableFrames();
+  }
+  else
+  {
+    REFERENCE_TIME tStartSample, tStopSample;
+    // while there is data send it downstream
+    uint8_t* pStartOfSample = nullptr;
+    while (m_pEngine->readNextAudioFrame(tStartSample, tStopSample, pStartOfSample))
+    {
+      hr = deliverFrame(tStartSample, tStopSample, pStartOfSample);
+      // stop on errors or if downstream doesn't want any more data
+      if (hr != S_OK)
+      {
+        break;
+      }
+    } // while
+  }
+  // the drift compensation follows the occupancy once the frames that could be delivered are gone
+  m_pEngine->measureDriftOccupancy();
+  const uint32_t uiQueuedMs = getQueuedMs();
+  m_uiQueuedMs = uiQueuedMs;
+  if (uiQueuedMs > m_uiPeakQueuedMs) m_uiPeakQueuedMs = uiQueuedMs;
+  if (!m_sSessionCheckpointPath.empty())
+  {
+    writeCheckpointIfDue();
+  }
+  return hr;
+}
 
-  const LONGLONG TWENTY_MILLISECONDS = 200000;
-  REFERENCE_TIME tStart, tStop;
-  hr = pSample->GetTime(&tStart, &tStop);
+void OpusEncoderFilter::applyStreamingRealtime()
+{
+  if (m_realtimePolicy.eMode == RealtimeMode::RM_NONE && m_realtimePolicy.vCores.empty()) return;
+  const DWORD dwThreadId = GetCurrentThreadId();
+  if (dwThreadId == m_dwStreamingThreadId) return;
+  // the previous thread is restored first
+  m_pStreamingRealtime.reset();
+  m_pStreamingRealtime = std::make_unique<RealtimeScope>(m_realtimePolicy);
+  m_dwStreamingThreadId = dwThreadId;
+  m_bRealtimeActive = m_pStreamingRealtime->isRealtime();
+}
 
-  int res = m_pAudioBuffer->addAudioData(pSourceBuffer, lSourceSize, tStart, tStop);
+void OpusEncoderFilter::recordTraceSample(const BYTE* pData, long lSize, REFERENCE_TIME tStart, REFERENCE_TIME tStop, DWORD dwFlags)
+{
+  if (!m_pTraceDecoder && !m_pTraceMixer)
+  {
+    m_traceRecorder.recordSample(pData, lSize, tStart, tStop, dwFlags);
+  }
+  else if (m_traceRecorder.isOpen())
+  {
+    // the trace holds the expanded and mixed PCM so that it replays like PCM input, from a decoder and mixer of its own
+    const uint8_t* pPcm = pData;
+    uint32_t uiPcmSize = lSize;
+    if (m_pTraceDecoder)
+    {
+      if (dwFlags & AM_SAMPLE_DATADISCONTINUITY) m_pTraceDecoder->reset();
+      m_vTracePcm.resize(m_pTraceDecoder->getDecodedSize(uiPcmSize) / sizeof(int16_t) + 1);
+      uiPcmSize = m_pTraceDecoder->decode(pPcm, uiPcmSize, m_vTracePcm.data());
+      pPcm = reinterpret_cast<uint8_t*>(m_vTracePcm.data());
+    }
+    if (m_pTraceMixer)
+    {
+      if (dwFlags & AM_SAMPLE_DATADISCONTINUITY) m_pTraceMixer->reset();
+      m_vTraceMixed.resize(m_pTraceMixer->getMixedSize(uiPcmSize) / sizeof(int16_t) + 1);
+      uiPcmSize = m_pTraceMixer->process(pPcm, uiPcmSize, m_vTraceMixed.data());
+      pPcm = reinterpret_cast<uint8_t*>(m_vTraceMixed.data());
+    }
+    m_traceRecorder.recordSample(pPcm, uiPcmSize, tStart, tStop, dwFlags);
+  }
+}
 
-  ASSERT(SUCCEEDED(hr));
-  ASSERT (m_pCodec && m_pCodec->Ready());
-  ASSERT(res != - 1);
+void OpusEncoderFilter::writeCheckpointIfDue()
+{
+  auto tNow = std::chrono::steady_clock::now();
+  if (tNow - m_tLastCheckpoint < std::chrono::milliseconds(m_uiCheckpointIntervalMs)) return;
+  m_tLastCheckpoint = tNow;
+  // a disk slower than the interval drops checkpoints rather than stalling the stream
+  std::vector<uint8_t>* pBuffer = m_checkpointWriter.getSpareBuffer();
+  if (!pBuffer || !m_pEngine->saveCheckpoint(m_checkpoint)) return;
+  m_checkpoint.serialize(*pBuffer);
+  m_uiCheckpointUs = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tNow).count());
+  m_checkpointWriter.submit();
+}
+
+bool OpusEncoderFilter::restoreCheckpoint()
+{
+  std::vector<uint8_t> vData;
+  EncoderCheckpoint checkpoint;
+  std::string sError;
+  if (!EncoderCheckpoint::readFile(m_sCheckpointRestore, vData))
+  {
+    sError = "Unable to read the checkpoint " + m_sCheckpointRestore;
+  }
+  else if (checkpoint.parse(vData.data(), vData.size(), sError) && !m_pEngine->restoreCheckpoint(checkpoint))
+  {
+    sError = m_pEngine->getLastError();
+  }
+  if (!sError.empty())
+  {
+    SetLastError(sError.c_str(), true);
+    return false;
+  }
+  m_uiTraceFrame = static_cast<uint32_t>(checkpoint.framesEncoded);
+  m_bContinuesCheckpoint = true;
+  m_sCheckpointRestore.clear();
+  return true;
+}
+
+bool OpusEncoderFilter::admitAudio(long lSize, REFERENCE_TIME tStart)
+{
+  if (m_uiDeliveryPolicy == 0) return true;
+  IAudioBuffer* pBuffer = m_pEngine->getAudioBuffer();
+  const int iBytesPerFrame = pBuffer->getBytesPerFrame();
+  const long lMaxQueued = static_cast<long>(static_cast<int64_t>(m_uiDeliveryMaxQueuedMs) * pBuffer->getBytesPerSecond() / 1000);
+  uint8_t* pQueued = nullptr;
+  REFERENCE_TIME tQueued;
+  long lQueued = pBuffer->getBufferedData(pQueued, tQueued);
+  if (lQueued + lSize <= lMaxQueued)
+  {
+    if (m_bDroppingNewest)
+    {
+      // the timestamps of the sample skip the dropped audio: the decoder conceals it instead of playing silence
+      m_pEngine->startNewSegment(tStart);
+      m_bDroppingNewest = false;
+    }
+    return true;
+  }
+  if (m_uiDeliveryPolicy == 2)
+  {
+    if (!m_bDroppingNewest) ++m_uiDropEvents;
+    m_bDroppingNewest = true;
+    m_uiDroppedBytes += lSize;
+    m_bSampleSkipped = TRUE;
+    return false;
+  }
+  // drop the oldest whole frames to make room: the buffer clock skips over them
+  long lDropped = 0;
+  REFERENCE_TIME tFrameStart, tFrameStop;
+  uint8_t* pFrame = nullptr;
+  while (lQueued + lSize > lMaxQueued && pBuffer->readNextAudioFrame(tFrameStart, tFrameStop, pFrame))
+  {
+    lQueued -= iBytesPerFrame;
+    lDropped += iBytesPerFrame;
+  }
+  if (lDropped > 0)
+  {
+    if (!m_bDroppedOldest) ++m_uiDropEvents;
+    // a segment start among the dropped frames is signalled on the next delivered packet instead
+    pBuffer->takeDiscontinuity();
+    m_bDroppedOldest = true;
+    m_uiDroppedBytes += lDropped;
+    m_bSampleSkipped = TRUE;
+  }
+  return true;
+}
+
+HRESULT OpusEncoderFilter::deliverAvailableFrames()
+{
+  uint8_t* pQueued = nullptr;
+  REFERENCE_TIME tQueued;
+  HRESULT hr = S_OK;
+  for (;;)
+  {
+    // looked up on every pass: a frame duration change in readNextAudioFrame may replace the buffer
+    IAudioBuffer* pBuffer = m_pEngine->getAudioBuffer();
+    if (pBuffer->getBufferedData(pQueued, tQueued) < pBuffer->getBytesPerFrame()) break;
+    IMediaSample* pOutSample = NULL;
+    FRAME_TRACE(AllocatorWaitStart, m_uiTraceStreamId, m_uiTraceFrame);
+    hr = m_pOutput->GetDeliveryBuffer(&pOutSample, NULL, NULL, AM_GBF_NOWAIT | (m_bSampleSkipped ? AM_GBF_PREVFRAMESKIPPED : 0));
+    FRAME_TRACE(AllocatorWaitEnd, m_uiTraceStreamId, m_uiTraceFrame);
+    if (hr == VFW_E_TIMEOUT)
+    {
+      // downstream holds all output samples: the audio stays queued until the next sample arrives
+      return S_OK;
+    }
+    if (FAILED(hr)) return hr;
+    REFERENCE_TIME tStartSample, tStopSample;
+    uint8_t* pStartOfSample = nullptr;
+    if (!m_pEngine->readNextAudioFrame(tStartSample, tStopSample, pStartOfSample))
+    {
+      // the governor lengthened the frames
+      pOutSample->Release();
+      break;
+    }
+    hr = deliverFrame(tStartSample, tStopSample, pStartOfSample, pOutSample);
+    if (hr != S_OK) break;
+  }
+  return hr;
+}
 
+HRESULT OpusEncoderFilter::deliverQueuedFrames()
+{
+  HRESULT hr = S_OK;
   REFERENCE_TIME tStartSample, tStopSample;
-  // while there is data send it downstream
   uint8_t* pStartOfSample = nullptr;
-  while (m_pAudioBuffer->readNextAudioFrame(tStartSample, tStopSample, pStartOfSample))
+  while (m_pEngine->readNextAudioFrame(tStartSample, tStopSample, pStartOfSample))
+  {
+    hr = deliverFrame(tStartSample, tStopSample, pStartOfSample);
+    if (FAILED(hr)) break;
+  }
+  return hr;
+}
+
+uint32_t OpusEncoderFilter::getQueuedMs() const
+{
+  IAudioBuffer* pBuffer = m_pEngine->getAudioBuffer();
+  if (!pBuffer) return 0;
+  uint8_t* pQueued = nullptr;
+  REFERENCE_TIME tQueued;
+  return static_cast<uint32_t>(static_cast<int64_t>(pBuffer->getBufferedData(pQueued, tQueued)) * 1000 / pBuffer->getBytesPerSecond());
+}
+
+HRESULT OpusEncoderFilter::deliverFrame(REFERENCE_TIME tStartSample, REFERENCE_TIME tStopSample, uint8_t* pStartOfSample, IMediaSample* pOutSample)
+{
+  FRAME_TRACE(FrameCut, m_uiTraceStreamId, m_uiTraceFrame);
+  // If no output to deliver to then no point sending us data
+  ASSERT(m_pOutput != NULL);
+  HRESULT hr;
+  if (!pOutSample)
   {
-    ASSERT(pSample);
-    IMediaSample * pOutSample;
-    // If no output to deliver to then no point sending us data
-    ASSERT(m_pOutput != NULL);
     // Set up the output sample
-    hr = InitializeOutputSample(pSample, &pOutSample);
+    FRAME_TRACE(AllocatorWaitStart, m_uiTraceStreamId, m_uiTraceFrame);
+    hr = InitializeOutputSample(NULL, &pOutSample);
+    FRAME_TRACE(AllocatorWaitEnd, m_uiTraceStreamId, m_uiTraceFrame);
     if (FAILED(hr)) {
       return hr;
     }
-    hr = pOutSample->SetTime(&tStartSample, &tStopSample);
-    ASSERT(SUCCEEDED(hr));
+  }
+  hr = pOutSample->SetTime(&tStartSample, &tStopSample);
+  ASSERT(SUCCEEDED(hr));
+  const bool bDiscontinuity = m_pEngine->getAudioBuffer()->takeDiscontinuity() || m_bDroppedOldest;
+  m_bDroppedOldest = false;
+  pOutSample->SetDiscontinuity(bDiscontinuity ? TRUE : FALSE);
 
-    // Start timing the transform (if PERF is defined)
-    MSR_START(m_idTransform);
-    // have the derived class transform the data
+  // Start timing the transform (if PERF is defined)
+  MSR_START(m_idTransform);
 
-    // hr = Transform(pSample, pOutSample);
-    IMediaSample *pDest = pOutSample;
+  BYTE *pDestBuffer;
+  long lDestSize = pOutSample->GetSize();
+  pOutSample->GetPointer(&pDestBuffer);
 
-    BYTE *pDestBuffer;
-    long lDestSize = pDest->GetSize();
+  //////////////////////
+  FRAME_TRACE(EncodeStart, m_uiTraceStreamId, m_uiTraceFrame);
+  int iCompressedSize = m_pEngine->encodeFrame(pStartOfSample, pDestBuffer, lDestSize);
+  FRAME_TRACE(EncodeEnd, m_uiTraceStreamId, m_uiTraceFrame);
+  ++m_uiTraceFrame;
+  if (iCompressedSize >= 0)
+  {
+    //Encoding was successful
+    DbgLog((LOG_TRACE, 5, TEXT("Compressed %d %d"), iCompressedSize, m_pEngine->getBytesPerFrame()));
+    pOutSample->SetActualDataLength(iCompressedSize);
+  }
+  else
+  {
+    //An error has occurred
+    DbgLog((LOG_TRACE, 0, TEXT("Opus Codec Error: %s"), m_pEngine->getLastError().c_str()));
+    pOutSample->Release();
+    return E_FAIL;
+  }
 
-#ifdef DEBUG
-    ASSERT(lDestSize >= lSourceSize);
-#endif
-    pDest->GetPointer(&pDestBuffer);
+  // Stop the clock and log it (if PERF is defined)
+  MSR_STOP(m_idTransform);
 
-    //////////////////////
-    m_pCodec->SetParameter("max_compr_size", std::to_string(lDestSize).c_str());
-    int nResult = m_pCodec->Code(pStartOfSample, pDestBuffer, m_pAudioBuffer->getBytesPerFrame());
-    if (nResult)
-    {
-      //Encoding was successful
-      iCompressedSize = m_pCodec->GetCompressedByteLength();
-      DbgLog((LOG_TRACE, 5, TEXT("Compressed %d %d %d"), lSourceSize, iCompressedSize, m_pAudioBuffer->getBytesPerFrame()));
-      pOutSample->SetActualDataLength(iCompressedSize);
-    }
-    else
+  // a size of 1 means that it doesn't have to be transmitted
+  if (iCompressedSize > 1)
+  {
+    if (m_shmOutput.isOpen())
     {
-      //An error has occurred
-      DbgLog((LOG_TRACE, 0, TEXT("Opus Codec Error: %s"), m_pCodec->GetErrorStr()));
-      std::string sError = m_pCodec->GetErrorStr();
-      return E_FAIL;
+      // never blocks: if the reader is too slow the packet is counted as dropped
+      m_shmOutput.write(pDestBuffer, iCompressedSize, tStartSample, tStopSample, m_uiTraceFrame - 1);
     }
-
-    if (iCompressedSize > 1)
+    if (m_pacer.isRunning())
     {
-      // a size of 1 means that it doesn't have to be transmitted
-      iCompressedBytes += iCompressedSize;
-
-      // Stop the clock and log it (if PERF is defined)
-      MSR_STOP(m_idTransform);
-
-      if (FAILED(hr)) {
-        DbgLog((LOG_TRACE, 1, TEXT("Error from transform")));
-      }
-      else {
-        // the Transform() function can return S_FALSE to indicate that the
-        // sample should not be delivered; we only deliver the sample if it's
-        // really S_OK (same as NOERROR, of course.)
-        if (hr == NOERROR) {
-          hr = m_pOutput->Deliver(pOutSample);
-          m_bSampleSkipped = FALSE;	// last thing no longer dropped
-        }
-        else {
-          // S_FALSE returned from Transform is a PRIVATE agreement
-          // We should return NOERROR from Receive() in this cause because returning S_FALSE
-          // from Receive() means that this is the end of the stream and no more data should
-          // be sent.
-          if (S_FALSE == hr) {
-
-            //  Release the sample before calling notify to avoid
-            //  deadlocks if the sample holds a lock on the system
-            //  such as DirectDraw buffers do
-            pOutSample->Release();
-            m_bSampleSkipped = TRUE;
-            if (!m_bQualityChanged) {
-              NotifyEvent(EC_QUALITY_CHANGE, 0, 0);
-              m_bQualityChanged = TRUE;
-            }
-            return NOERROR;
-          }
+      // the pacer delivers and releases the sample when it is due
+      const uint32_t uiFrame = m_uiTraceFrame - 1;
+      m_pacer.push(tStopSample - tStartSample, [this, pOutSample, iCompressedSize, tStopSample, uiFrame](bool bDeliver)
+      {
+        if (bDeliver)
+        {
+          BYTE* pData = nullptr;
+          pOutSample->GetPointer(&pData);
+          m_uiLastToc = pData[0];
+          m_iLastPacketSize = iCompressedSize;
+          m_tLastPacketStop = tStopSample;
+          FRAME_TRACE(DeliverStart, m_uiTraceStreamId, uiFrame);
+          HRESULT hrDeliver = m_pOutput->Deliver(pOutSample);
+          FRAME_TRACE(DeliverEnd, m_uiTraceStreamId, uiFrame);
+          HRESULT hrExpected = S_OK;
+          if (hrDeliver != S_OK) m_hrPacedDelivery.compare_exchange_strong(hrExpected, hrDeliver);
         }
-      }
-
-      // release the output buffer. If the connected pin still needs it,
-      // it will have addrefed it itself.
-      pOutSample->Release();
+        pOutSample->Release();
+      });
+      m_bSampleSkipped = FALSE;
+      // report a failure of an earlier paced delivery to stop the upstream filter
+      return m_hrPacedDelivery.load();
     }
-    // iProcessedBytes += iBytesPerFrame;
-    
-    // end of transform
-    ++iCurrentFrame;
-  } // while
+    FRAME_TRACE(DeliverStart, m_uiTraceStreamId, m_uiTraceFrame - 1);
+    hr = m_pOutput->Deliver(pOutSample);
+    FRAME_TRACE(DeliverEnd, m_uiTraceStreamId, m_uiTraceFrame - 1);
+    m_bSampleSkipped = FALSE;	// last thing no longer dropped
+  }
+
+  // release the output buffer. If the connected pin still needs it,
+  // it will have addrefed it itself.
+  pOutSample->Release();
   return hr;
 }
 
@@ -441,6 +883,17 @@ HRESULT OpusEncoderFilter::CheckTransform( const CMediaType *mtIn, const CMediaT
 
 STDMETHODIMP OpusEncoderFilter::GetParameter( const char* szParamName, int nBufferSize, char* szValue, int* pLength )
 {
+  // read-only statistics
+  std::string sStatistic;
+  if (getStatistic(szParamName, sStatistic))
+  {
+    *pLength = sStatistic.length();
+    if (*pLength >= nBufferSize) return E_FAIL;
+    strcpy(szValue, sStatistic.c_str());
+    return S_OK;
+  }
+  // the budget is process-wide and may have been changed through another instance
+  m_uiCpuBudgetPercent = EncoderGovernor::instance().getBudgetPercent();
 	if (SUCCEEDED(CCustomBaseFilter::GetParameter(szParamName, nBufferSize, szValue, pLength)))
 	{
 		return S_OK;
@@ -458,12 +911,153 @@ STDMETHODIMP OpusEncoderFilter::GetParameter( const char* szParamName, int nBuff
 
 STDMETHODIMP OpusEncoderFilter::SetParameter( const char* type, const char* value )
 {
+  // actions that are not stored as parameters
+  if (strcmp(type, FILTER_PARAM_TRACE_EXPORT) == 0)
+  {
+    return FrameTracer::exportChromeTrace(value) ? S_OK : E_FAIL;
+  }
+  if (strcmp(type, FILTER_PARAM_LOUDNESS_RESET) == 0)
+  {
+    if (m_pEngine->getLoudnessMeter()) m_pEngine->getLoudnessMeter()->reset();
+    return S_OK;
+  }
+  if (strcmp(type, FILTER_PARAM_REALTIME_CORES) == 0)
+  {
+    std::vector<int> vCores;
+    if (!parseCoreSet(value, vCores)) return E_INVALIDARG;
+    // takes effect when streaming starts
+    m_sRealtimeCores = value;
+    return S_OK;
+  }
+  if (strcmp(type, FILTER_PARAM_CHANNEL_MATRIX) == 0 || strcmp(type, FILTER_PARAM_CHANNEL_SELECT) == 0)
+  {
+    // empty for the default downmix; the mix is part of the format, so it takes effect when the input is connected
+    const bool bMatrix = strcmp(type, FILTER_PARAM_CHANNEL_MATRIX) == 0;
+    std::vector<double> vMatrix;
+    std::vector<int> vSelected;
+    if (value[0] != '\0' && (bMatrix ? !ChannelMixer::parseMatrix(value, vMatrix) : !ChannelMixer::parseSelection(value, vSelected)))
+    {
+      return E_INVALIDARG;
+    }
+    (bMatrix ? m_sChannelMatrix : m_sChannelSelect) = value;
+    return S_OK;
+  }
+  if (strcmp(type, FILTER_PARAM_CHECKPOINT_PATH) == 0 || strcmp(type, FILTER_PARAM_CHECKPOINT_RESTORE) == 0)
+  {
+    // the history is sized when the input is connected, and the checkpoints start or are restored when streaming starts
+    (strcmp(type, FILTER_PARAM_CHECKPOINT_PATH) == 0 ? m_sCheckpointPath : m_sCheckpointRestore) = value;
+    return S_OK;
+  }
+  if (strcmp(type, FILTER_PARAM_TRACE_RECORD_PATH) == 0)
+  {
+    m_sTraceRecordPath = value;
+    // the trace header describes the format: the file is created once the format is known
+    if (m_uiSamplesPerSecond != 0 && !openTraceRecorder())
+    {
+      SetLastError("Unable to create the trace file", true);
+      return E_FAIL;
+    }
+    return S_OK;
+  }
+  // the replayer needs all settings that affect the encoder
+  m_traceRecorder.recordParameter(type, value);
+  if (strcmp(type, FILTER_PARAM_SHM_OUTPUT_NAME) == 0)
+  {
+    m_sShmOutputName = value;
+    // the segment describes the format: it is created once the format is known
+    if (m_uiSamplesPerSecond != 0 && !openSharedMemoryOutput())
+    {
+      SetLastError(m_shmOutput.getLastError().c_str(), true);
+      return E_FAIL;
+    }
+    return S_OK;
+  }
+  if (strcmp(type, FILTER_PARAM_LOSS_REPORT) == 0)
+  {
+    // "<loss percent>[,<mean burst length>]", e.g. from RTCP receiver and XR reports
+    char* szEnd = nullptr;
+    double dLossPercent = strtod(value, &szEnd);
+    if (szEnd == value) return E_INVALIDARG;
+    double dMeanBurstLength = *szEnd == ',' ? strtod(szEnd + 1, nullptr) : 1.0;
+    m_pEngine->getFecController().reportLoss(dLossPercent / 100.0, dMeanBurstLength);
+    return S_OK;
+  }
   if (SUCCEEDED(CCustomBaseFilter::SetParameter(type, value)))
 	{
+    if (strcmp(type, FILTER_PARAM_QUALITY_MONITOR) == 0)
+    {
+      if (!m_pEngine->enableQualityMonitor(m_uiQualityMonitor != 0))
+      {
+        SetLastError(m_pEngine->getLastError().c_str(), true);
+        return E_FAIL;
+      }
+    }
+    else if (strcmp(type, FILTER_PARAM_STREAM_PRIORITY) == 0)
+    {
+      m_pEngine->setPriority(m_uiStreamPriority);
+    }
+    else if (strncmp(type, "gap_", 4) == 0)
+    {
+      applyGapPolicy();
+    }
+    else if (strcmp(type, FILTER_PARAM_DELIVERY_POLICY) == 0 || strcmp(type, FILTER_PARAM_DELIVERY_MAX_QUEUED_MS) == 0)
+    {
+      // the drift compensation keeps a live queue half full
+      m_pEngine->setMaxQueuedMs(m_uiDeliveryPolicy != 0 ? m_uiDeliveryMaxQueuedMs : 0);
+    }
+    else if (strcmp(type, FILTER_PARAM_DRIFT_COMPENSATION) == 0)
+    {
+      m_pEngine->enableDriftCompensation(m_uiDriftCompensation != 0,
+        m_uiDriftCompensation == 2 ? DriftCompensator::Mode::DC_OCCUPANCY : DriftCompensator::Mode::DC_TIMESTAMPS);
+    }
+    else if (strncmp(type, "fec_", 4) == 0)
+    {
+      applyFecMode();
+    }
+    else if (strcmp(type, FILTER_PARAM_CBR_LINK_RATE_BPS) == 0 || strcmp(type, FILTER_PARAM_CBR_LINK_OVERHEAD_BYTES) == 0)
+    {
+      m_pEngine->setConstantBitrate(m_uiCbrLinkRateBps, m_uiCbrLinkOverheadBytes);
+    }
+    else if (strcmp(type, FILTER_PARAM_ADAPTIVE_FRAME_DURATION) == 0 ||
+      strcmp(type, FILTER_PARAM_MAX_FRAME_DURATION_MS) == 0 ||
+      strcmp(type, FILTER_PARAM_PACKET_RATE_BUDGET) == 0 ||
+      strcmp(type, FILTER_PARAM_PACKET_HEADER_BYTES) == 0)
+    {
+      applyFrameDurationAdaptation();
+    }
+    else if (strcmp(type, FILTER_PARAM_LOUDNESS_METER) == 0)
+    {
+      m_pEngine->enableLoudnessMeter(m_uiLoudnessMeter != 0);
+    }
+    else if (strcmp(type, FILTER_PARAM_DC_REMOVAL) == 0 || strcmp(type, FILTER_PARAM_HIGHPASS_HZ) == 0 ||
+      strcmp(type, FILTER_PARAM_NOISE_GATE_DB) == 0)
+    {
+      applyConditioning();
+    }
+    else if (strcmp(type, FILTER_PARAM_NUMA_PLACEMENT) == 0 || strcmp(type, FILTER_PARAM_HUGE_PAGES) == 0)
+    {
+      // the buffers move when streaming starts
+      m_pEngine->setNumaPlacement(m_uiNumaPlacement != 0, m_uiHugePages != 0);
+    }
+    else if (strcmp(type, FILTER_PARAM_FRAME_TRACING) == 0)
+    {
+      // a new tracing session doesn't export the events of the last one
+      if (m_uiFrameTracing != 0 && !FrameTracer::isEnabled()) FrameTracer::clear();
+      FrameTracer::setEnabled(m_uiFrameTracing != 0);
+    }
+    else if (strcmp(type, FILTER_PARAM_CPU_BUDGET_PERCENT) == 0)
+    {
+      EncoderGovernor::instance().setBudgetPercent(m_uiCpuBudgetPercent);
+    }
 		return S_OK;
 	}
 	else
 	{
+    if (strcmp(type, CODEC_PARAM_COMPLEXITY) == 0)
+    {
+      // the governor lowers the complexity relative to this one
+      return m_pEngine->setComplexity(static_cast<uint32_t>(atoi(value))) ? S_OK : E_FAIL;
+    }
 		// Check if it's a codec parameter
 		if (m_pCodec && m_pCodec->SetParameter(type, value))
 		{
@@ -486,6 +1080,336 @@ STDMETHODIMP OpusEncoderFilter::SetParameter( const char* type, const char* valu
 	}
 }
 
+void OpusEncoderFilter::applyGapPolicy()
+{
+  GapPolicy ePolicy = GapPolicy::GP_FILL_SILENCE;
+  if (m_uiGapPolicy == 0) ePolicy = GapPolicy::GP_IGNORE;
+  else if (m_uiGapPolicy == 2) ePolicy = GapPolicy::GP_SIGNAL_LOSS;
+  m_pEngine->setGapPolicy(ePolicy, m_uiGapToleranceMs * 10000LL, m_uiGapMaxFillMs * 10000LL);
+}
+
+void OpusEncoderFilter::applyFecMode()
+{
+  FecController::Mode eMode = FecController::Mode::FM_OFF;
+  if (m_uiFecMode == 1) eMode = FecController::Mode::FM_FIXED;
+  else if (m_uiFecMode == 2) eMode = FecController::Mode::FM_ADAPTIVE;
+  m_pEngine->getFecController().setMode(eMode, m_uiFecExpectedLossPercent);
+}
+
+void OpusEncoderFilter::deliverFiller(REFERENCE_TIME tDuration)
+{
+  // runs on the pacer thread, like the paced deliveries that set the last packet
+  if (m_iLastPacketSize == 0) return;
+  IMediaSample* pOutSample = nullptr;
+  if (FAILED(m_pOutput->GetDeliveryBuffer(&pOutSample, NULL, NULL, 0))) return;
+  BYTE* pData = nullptr;
+  pOutSample->GetPointer(&pData);
+  if (pOutSample->GetSize() >= m_iLastPacketSize && OpusPacket::writeEmpty(pData, m_uiLastToc, m_iLastPacketSize))
+  {
+    REFERENCE_TIME tStart = m_tLastPacketStop;
+    REFERENCE_TIME tStop = tStart + tDuration;
+    m_tLastPacketStop = tStop;
+    pOutSample->SetTime(&tStart, &tStop);
+    pOutSample->SetActualDataLength(m_iLastPacketSize);
+    m_pOutput->Deliver(pOutSample);
+  }
+  pOutSample->Release();
+}
+
+void OpusEncoderFilter::applyFrameDurationAdaptation()
+{
+  FrameDurationController::Config config = FrameDurationController::getDefaultConfig();
+  // the longest supported duration within the ceiling
+  config.maxFrameDuration = m_uiMaxFrameDurationMs >= 60 ? OpusFrameDuration::OFD_60_MS :
+    m_uiMaxFrameDurationMs >= 40 ? OpusFrameDuration::OFD_40_MS :
+    m_uiMaxFrameDurationMs >= 20 ? OpusFrameDuration::OFD_20_MS : OpusFrameDuration::OFD_10_MS;
+  config.packetRateBudget = m_uiPacketRateBudget;
+  config.headerBytes = m_uiPacketHeaderBytes;
+  m_pEngine->setAdaptiveFrameDurationConfig(config);
+  m_pEngine->enableAdaptiveFrameDuration(m_uiAdaptiveFrameDuration != 0);
+}
+
+void OpusEncoderFilter::applyConditioning()
+{
+  InputConditioner::Config config = InputConditioner::getDefaultConfig();
+  config.dcRemoval = m_uiDcRemoval != 0;
+  config.highPassHz = m_uiHighPassHz;
+  config.noiseGateDb = m_uiNoiseGateDb;
+  m_pEngine->setConditioningConfig(config);
+}
+
+bool OpusEncoderFilter::applyChannelMix(unsigned int uiInputChannels, uint32_t uiChannelMask)
+{
+  ChannelMixer::Config mix = ChannelMixer::getDefaultConfig();
+  // mono and stereo sources are encoded as they are unless encode_channels asks for mono
+  unsigned int uiChannels = std::min(m_uiEncodeChannels != 0 ? m_uiEncodeChannels : 2u, uiInputChannels);
+  std::vector<int> vSelected;
+  if (ChannelMixer::parseSelection(m_sChannelSelect, vSelected))
+  {
+    // one channel per selected channel, or the one selected channel on both sides if stereo is asked for
+    uiChannels = m_uiEncodeChannels == 2 ? 2 : static_cast<unsigned int>(vSelected.size());
+    if (vSelected.size() == 1 && uiChannels == 2) vSelected.push_back(vSelected.front());
+    if (vSelected.size() != uiChannels) return false;
+    mix.matrix = ChannelMixer::getSelectMatrix(vSelected, uiInputChannels);
+    if (mix.matrix.empty()) return false;
+  }
+  else if (ChannelMixer::parseMatrix(m_sChannelMatrix, mix.matrix))
+  {
+    // one row per encoded channel
+    if (mix.matrix.size() % uiInputChannels != 0) return false;
+    uiChannels = static_cast<unsigned int>(mix.matrix.size() / uiInputChannels);
+    if (m_uiEncodeChannels != 0 && m_uiEncodeChannels != uiChannels) return false;
+  }
+  else if (uiChannels != uiInputChannels)
+  {
+    mix.matrix = ChannelMixer::getDownmixMatrix(uiChannelMask, uiInputChannels, uiChannels);
+  }
+  m_pTraceMixer.reset();
+  if (!mix.matrix.empty())
+  {
+    if (!ChannelMixer::isValid(mix.matrix, uiInputChannels, uiChannels)) return false;
+    mix.inputChannels = uiInputChannels;
+    mix.channelMask = uiChannelMask;
+    m_pTraceMixer = std::make_unique<ChannelMixer>(mix.matrix, uiInputChannels, uiChannels);
+  }
+  m_uiChannels = uiChannels;
+  m_pEngine->setChannelMix(mix);
+  return true;
+}
+
+bool OpusEncoderFilter::openSharedMemoryOutput()
+{
+  m_shmOutput.close();
+  if (m_sShmOutputName.empty()) return true;
+  return m_shmOutput.open(m_sShmOutputName, SHM_OUTPUT_CAPACITY, m_uiSamplesPerSecond, m_uiChannels);
+}
+
+bool OpusEncoderFilter::openTraceRecorder()
+{
+  m_traceRecorder.close();
+  if (m_sTraceRecordPath.empty()) return true;
+  TraceFormat format = { m_uiSamplesPerSecond, m_uiChannels, m_uiBitsPerSample, m_uiTargetBitrateKbps };
+  if (!m_traceRecorder.open(m_sTraceRecordPath, format, m_uiTraceRecordCompress != 0)) return false;
+  // the settings made before the recording started: the filter parameters and the codec parameters they didn't cover
+  for (const NumericParameter& parameter : NUMERIC_PARAMETERS)
+  {
+    m_traceRecorder.recordParameter(parameter.szName, std::to_string(this->*parameter.pValue).c_str());
+  }
+  char szValue[10];
+  int nParamLength = 10;
+  if (m_pCodec->GetParameter("parameters", &nParamLength, szValue))
+  {
+    int nParamCount = atoi(szValue);
+    for (int i = 0; i < nParamCount; i++)
+    {
+      const char* szParamName = nullptr;
+      int nLenName = 0, nLenValue = 256;
+      char szParamValue[256] = { 0 };
+      m_pCodec->GetParameterName(i, &szParamName, &nLenName);
+      if (m_pCodec->GetParameter(szParamName, &nLenValue, szParamValue))
+      {
+        m_traceRecorder.recordParameter(szParamName, szParamValue);
+      }
+    }
+  }
+  return true;
+}
+
+bool OpusEncoderFilter::getStatistic(const char* szParamName, std::string& sValue)
+{
+  if (strcmp(szParamName, FILTER_PARAM_TRACE_RECORD_PATH) == 0)
+  {
+    sValue = m_sTraceRecordPath;
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_SHM_OUTPUT_NAME) == 0)
+  {
+    sValue = m_sShmOutputName;
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_REALTIME_CORES) == 0)
+  {
+    sValue = m_sRealtimeCores;
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_CHANNEL_MATRIX) == 0 || strcmp(szParamName, FILTER_PARAM_CHANNEL_SELECT) == 0)
+  {
+    sValue = strcmp(szParamName, FILTER_PARAM_CHANNEL_MATRIX) == 0 ? m_sChannelMatrix : m_sChannelSelect;
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_INPUT_CHANNELS) == 0)
+  {
+    sValue = std::to_string(m_uiInputChannels);
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_CHECKPOINT_PATH) == 0 || strcmp(szParamName, FILTER_PARAM_CHECKPOINT_RESTORE) == 0)
+  {
+    sValue = strcmp(szParamName, FILTER_PARAM_CHECKPOINT_PATH) == 0 ? m_sCheckpointPath : m_sCheckpointRestore;
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_CHECKPOINT_US) == 0)
+  {
+    sValue = std::to_string(m_uiCheckpointUs.load());
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_CHECKPOINT_COUNT) == 0 || strcmp(szParamName, FILTER_PARAM_CHECKPOINT_BYTES) == 0 ||
+    strcmp(szParamName, FILTER_PARAM_CHECKPOINT_WRITE_US) == 0 || strcmp(szParamName, FILTER_PARAM_CHECKPOINT_DROPPED) == 0)
+  {
+    const CheckpointWriter::Stats stats = m_checkpointWriter.getStats();
+    sValue = std::to_string(strcmp(szParamName, FILTER_PARAM_CHECKPOINT_COUNT) == 0 ? stats.written :
+      strcmp(szParamName, FILTER_PARAM_CHECKPOINT_BYTES) == 0 ? stats.bytes :
+      strcmp(szParamName, FILTER_PARAM_CHECKPOINT_WRITE_US) == 0 ? stats.writeUs : stats.dropped);
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_NUMA_NODE) == 0)
+  {
+    const NumaArena* pArena = m_pEngine->getArena();
+    sValue = std::to_string(pArena ? pArena->getNode() : -1);
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_REALTIME_ACTIVE) == 0)
+  {
+    sValue = m_bRealtimeActive ? "1" : "0";
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_DEADLINE_MISSES) == 0 || strncmp(szParamName, "encode_", 7) == 0)
+  {
+    DeadlineTracker::Stats stats = m_pEngine->getDeadlineTracker().getStats();
+    if (strcmp(szParamName, FILTER_PARAM_DEADLINE_MISSES) == 0) sValue = std::to_string(stats.misses);
+    else if (strcmp(szParamName, FILTER_PARAM_ENCODE_P99_MS) == 0) sValue = std::to_string(stats.p99Ms);
+    else if (strcmp(szParamName, FILTER_PARAM_ENCODE_P999_MS) == 0) sValue = std::to_string(stats.p999Ms);
+    else if (strcmp(szParamName, FILTER_PARAM_ENCODE_MAX_MS) == 0) sValue = std::to_string(stats.maxMs);
+    else return false;
+    return true;
+  }
+  if (strncmp(szParamName, "delivery_", 9) == 0 && strcmp(szParamName, FILTER_PARAM_DELIVERY_POLICY) != 0 &&
+    strcmp(szParamName, FILTER_PARAM_DELIVERY_MAX_QUEUED_MS) != 0)
+  {
+    const IAudioBuffer* pBuffer = m_pEngine->getAudioBuffer();
+    if (strcmp(szParamName, FILTER_PARAM_DELIVERY_QUEUED_MS) == 0) sValue = std::to_string(m_uiQueuedMs.load());
+    else if (strcmp(szParamName, FILTER_PARAM_DELIVERY_PEAK_QUEUED_MS) == 0) sValue = std::to_string(m_uiPeakQueuedMs.load());
+    else if (strcmp(szParamName, FILTER_PARAM_DELIVERY_DROP_EVENTS) == 0) sValue = std::to_string(m_uiDropEvents.load());
+    else if (strcmp(szParamName, FILTER_PARAM_DELIVERY_DROPPED_MS) == 0 && pBuffer) sValue = std::to_string(m_uiDroppedBytes * 1000 / pBuffer->getBytesPerSecond());
+    else return false;
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_SHM_DROPPED_PACKETS) == 0)
+  {
+    sValue = std::to_string(m_shmOutput.getDroppedCount());
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_CPU_LOAD_PERCENT) == 0)
+  {
+    sValue = std::to_string(EncoderGovernor::instance().getLoadPercent());
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_DRIFT_PPM) == 0)
+  {
+    sValue = std::to_string(m_pEngine->getDriftCorrectionPpm());
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_GAP_FILL_MS) == 0 || strcmp(szParamName, FILTER_PARAM_SEGMENT_COUNT) == 0)
+  {
+    IAudioBuffer* pBuffer = m_pEngine->getAudioBuffer();
+    if (!pBuffer) return false;
+    if (strcmp(szParamName, FILTER_PARAM_GAP_FILL_MS) == 0) sValue = std::to_string(pBuffer->getGapFillBytes() * 1000 / pBuffer->getBytesPerSecond());
+    else sValue = std::to_string(pBuffer->getSegmentCount());
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_FEC_ACTIVE) == 0 || strcmp(szParamName, FILTER_PARAM_FEC_APPLIED_LOSS_PERCENT) == 0 ||
+    strcmp(szParamName, FILTER_PARAM_FEC_KBPS) == 0 || strcmp(szParamName, FILTER_PARAM_PAYLOAD_KBPS) == 0 ||
+    strcmp(szParamName, FILTER_PARAM_REPORTED_LOSS_PERCENT) == 0)
+  {
+    FecController::Stats stats = m_pEngine->getFecController().getStats();
+    if (strcmp(szParamName, FILTER_PARAM_FEC_ACTIVE) == 0) sValue = stats.decision.fec ? "1" : "0";
+    else if (strcmp(szParamName, FILTER_PARAM_FEC_APPLIED_LOSS_PERCENT) == 0) sValue = std::to_string(stats.decision.expectedLossPercent);
+    else if (strcmp(szParamName, FILTER_PARAM_FEC_KBPS) == 0) sValue = std::to_string(stats.decision.fecKbps);
+    else if (strcmp(szParamName, FILTER_PARAM_PAYLOAD_KBPS) == 0) sValue = std::to_string(stats.decision.payloadKbps);
+    else sValue = std::to_string(stats.lossPercent);
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_CBR_PACKET_SIZE) == 0)
+  {
+    sValue = std::to_string(m_pEngine->getConstantPacketSize());
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_CBR_OVERRUNS) == 0)
+  {
+    sValue = std::to_string(m_pEngine->getConstantBitrateOverruns());
+    return true;
+  }
+  if (strncmp(szParamName, "pacer_", 6) == 0 && strcmp(szParamName, FILTER_PARAM_PACER_PREBUFFER_MS) != 0 &&
+    strcmp(szParamName, FILTER_PARAM_PACER_SPIN_US) != 0)
+  {
+    PacketPacer::Stats stats = m_pacer.getStats();
+    if (strcmp(szParamName, FILTER_PARAM_PACER_UNDERRUNS) == 0) sValue = std::to_string(stats.underruns);
+    else if (strcmp(szParamName, FILTER_PARAM_PACER_DROPPED_PACKETS) == 0) sValue = std::to_string(stats.dropped);
+    else if (strcmp(szParamName, FILTER_PARAM_PACER_MAX_LATENESS_US) == 0) sValue = std::to_string(stats.maxLatenessUs);
+    else return false;
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_FRAME_DURATION_MS) == 0)
+  {
+    const IAudioBuffer* pBuffer = m_pEngine->getAudioBuffer();
+    if (!pBuffer) return false;
+    sValue = std::to_string(pBuffer->getFrameDurationMs());
+    return true;
+  }
+  if (strcmp(szParamName, FILTER_PARAM_PACKET_RATE) == 0 || strcmp(szParamName, FILTER_PARAM_OVERHEAD_SAVED_BYTES) == 0)
+  {
+    const FrameDurationController* pController = m_pEngine->getFrameDurationController();
+    if (!pController) return false;
+    FrameDurationController::Stats stats = pController->getStats();
+    if (strcmp(szParamName, FILTER_PARAM_PACKET_RATE) == 0) sValue = std::to_string(stats.packetRate);
+    else sValue = std::to_string(stats.overheadSavedBytes);
+    return true;
+  }
+  if (strncmp(szParamName, "loudness_", 9) == 0)
+  {
+    const LoudnessMeter* pMeter = m_pEngine->getLoudnessMeter();
+    if (!pMeter) return false;
+    LoudnessMeter::Stats stats = pMeter->getStats();
+    if (strcmp(szParamName, FILTER_PARAM_LOUDNESS_MOMENTARY_LUFS) == 0) sValue = std::to_string(stats.momentaryLufs);
+    else if (strcmp(szParamName, FILTER_PARAM_LOUDNESS_SHORT_TERM_LUFS) == 0) sValue = std::to_string(stats.shortTermLufs);
+    else if (strcmp(szParamName, FILTER_PARAM_LOUDNESS_INTEGRATED_LUFS) == 0) sValue = std::to_string(stats.integratedLufs);
+    else if (strcmp(szParamName, FILTER_PARAM_LOUDNESS_TRUE_PEAK_DBTP) == 0) sValue = std::to_string(stats.truePeakDb);
+    else if (strcmp(szParamName, FILTER_PARAM_LOUDNESS_SAMPLE_PEAK_DBFS) == 0) sValue = std::to_string(stats.samplePeakDb);
+    else if (strcmp(szParamName, FILTER_PARAM_LOUDNESS_RMS_DBFS) == 0) sValue = std::to_string(stats.rmsDb);
+    else if (strcmp(szParamName, FILTER_PARAM_LOUDNESS_CLIPPED_SAMPLES) == 0) sValue = std::to_string(stats.clippedSamples);
+    else if (strcmp(szParamName, FILTER_PARAM_LOUDNESS_OVERHEAD_PERCENT) == 0) sValue = std::to_string(m_pEngine->getMeteringOverheadPercent());
+    else return false;
+    return true;
+  }
+  if (strncmp(szParamName, "conditioning_", 13) == 0)
+  {
+    const InputConditioner* pConditioner = m_pEngine->getInputConditioner();
+    if (!pConditioner) return false;
+    InputConditioner::Stats stats = pConditioner->getStats();
+    if (strcmp(szParamName, FILTER_PARAM_CONDITIONING_NOISE_FLOOR_DBFS) == 0) sValue = std::to_string(stats.noiseFloorDb);
+    else if (strcmp(szParamName, FILTER_PARAM_CONDITIONING_ATTENUATION_DB) == 0) sValue = std::to_string(stats.attenuationDb);
+    else if (strcmp(szParamName, FILTER_PARAM_CONDITIONING_LATENCY_MS) == 0) sValue = std::to_string(stats.latencySamples * 1000.0 / m_uiSamplesPerSecond);
+    else if (strcmp(szParamName, FILTER_PARAM_CONDITIONING_OVERHEAD_PERCENT) == 0) sValue = std::to_string(m_pEngine->getConditioningOverheadPercent());
+    else return false;
+    return true;
+  }
+  if (strncmp(szParamName, "quality_", 8) == 0)
+  {
+    const QualityMonitor* pMonitor = m_pEngine->getQualityMonitor();
+    if (!pMonitor) return false;
+    QualityMonitor::Stats stats = pMonitor->getStats();
+    if (strcmp(szParamName, FILTER_PARAM_QUALITY_FRAMES) == 0) sValue = std::to_string(stats.frames);
+    else if (strcmp(szParamName, FILTER_PARAM_QUALITY_DROPPED_FRAMES) == 0) sValue = std::to_string(stats.droppedFrames);
+    else if (strcmp(szParamName, FILTER_PARAM_QUALITY_SNR_DB) == 0) sValue = std::to_string(stats.snrDb);
+    else if (strcmp(szParamName, FILTER_PARAM_QUALITY_SEGMENTAL_SNR_DB) == 0) sValue = std::to_string(stats.segmentalSnrDb);
+    else if (strcmp(szParamName, FILTER_PARAM_QUALITY_SPECTRAL_DISTORTION_DB) == 0) sValue = std::to_string(stats.spectralDistortionDb);
+    else if (strcmp(szParamName, FILTER_PARAM_QUALITY_ENCODE_MS) == 0) sValue = std::to_string(stats.encodeMs);
+    else if (strcmp(szParamName, FILTER_PARAM_QUALITY_DELAY_SAMPLES) == 0) sValue = std::to_string(stats.delaySamples);
+    else return false;
+    return true;
+  }
+  return false;
+}
+
 STDMETHODIMP OpusEncoderFilter::GetParameterSettings( char* szResult, int nSize )
 {
   if (SUCCEEDED(CCustomBaseFilter::GetParameterSettings(szResult, nSize)))
@@ -32,15 +32,113 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ===========================================================================
 */
 #pragma once
+#include <atomic>
+#include <chrono>
 #include <DirectShowExt/CustomBaseFilter.h>
 #include <DirectShowExt/CustomMediaTypes.h>
 #include "VersionInfo.h"
-#include "AudioBuffer.h"
+#include "OpusEncodeEngine.h"
+#include "EncodeTrace.h"
+#include "PacketPacer.h"
+#include "SharedMemoryRing.h"
 #include "OpusEncoderProperties.h"
 
-// #define TEST_OPUS_ENCODE_DECODE
-
 #define FILTER_PARAM_TARGET_BITRATE_KBPS      "target_bitrate_kbps"
+#define FILTER_PARAM_STREAM_PRIORITY          "stream_priority"
+#define FILTER_PARAM_CPU_BUDGET_PERCENT       "cpu_budget_percent"
+#define FILTER_PARAM_CPU_LOAD_PERCENT         "cpu_load_percent"
+#define FILTER_PARAM_QUALITY_MONITOR          "quality_monitor"
+#define FILTER_PARAM_QUALITY_FRAMES           "quality_frames"
+#define FILTER_PARAM_QUALITY_DROPPED_FRAMES   "quality_dropped_frames"
+#define FILTER_PARAM_QUALITY_SNR_DB           "quality_snr_db"
+#define FILTER_PARAM_QUALITY_SEGMENTAL_SNR_DB "quality_segmental_snr_db"
+#define FILTER_PARAM_QUALITY_SPECTRAL_DISTORTION_DB "quality_spectral_distortion_db"
+#define FILTER_PARAM_QUALITY_ENCODE_MS        "quality_encode_ms"
+#define FILTER_PARAM_QUALITY_DELAY_SAMPLES    "quality_delay_samples"
+#define FILTER_PARAM_GAP_POLICY               "gap_policy"
+#define FILTER_PARAM_GAP_TOLERANCE_MS         "gap_tolerance_ms"
+#define FILTER_PARAM_GAP_MAX_FILL_MS          "gap_max_fill_ms"
+#define FILTER_PARAM_GAP_FILL_MS              "gap_fill_ms"
+#define FILTER_PARAM_SEGMENT_COUNT            "segment_count"
+#define FILTER_PARAM_ADAPTIVE_FRAME_DURATION  "adaptive_frame_duration"
+#define FILTER_PARAM_MAX_FRAME_DURATION_MS    "max_frame_duration_ms"
+#define FILTER_PARAM_PACKET_RATE_BUDGET       "packet_rate_budget"
+#define FILTER_PARAM_PACKET_HEADER_BYTES      "packet_header_bytes"
+#define FILTER_PARAM_FRAME_DURATION_MS        "frame_duration_ms"
+#define FILTER_PARAM_PACKET_RATE              "packet_rate"
+#define FILTER_PARAM_OVERHEAD_SAVED_BYTES     "overhead_saved_bytes"
+#define FILTER_PARAM_FEC_MODE                "fec_mode"
+#define FILTER_PARAM_FEC_EXPECTED_LOSS_PERCENT "fec_expected_loss_percent"
+#define FILTER_PARAM_LOSS_REPORT             "loss_report"
+#define FILTER_PARAM_FEC_ACTIVE              "fec_active"
+#define FILTER_PARAM_FEC_APPLIED_LOSS_PERCENT "fec_applied_loss_percent"
+#define FILTER_PARAM_FEC_KBPS                "fec_kbps"
+#define FILTER_PARAM_PAYLOAD_KBPS            "payload_kbps"
+#define FILTER_PARAM_REPORTED_LOSS_PERCENT   "reported_loss_percent"
+#define FILTER_PARAM_CBR_LINK_RATE_BPS       "cbr_link_rate_bps"
+#define FILTER_PARAM_CBR_LINK_OVERHEAD_BYTES  "cbr_link_overhead_bytes"
+#define FILTER_PARAM_CBR_PACKET_SIZE          "cbr_packet_size"
+#define FILTER_PARAM_CBR_OVERRUNS             "cbr_overruns"
+#define FILTER_PARAM_PACED_OUTPUT             "paced_output"
+#define FILTER_PARAM_PACER_PREBUFFER_MS       "pacer_prebuffer_ms"
+#define FILTER_PARAM_PACER_SPIN_US            "pacer_spin_us"
+#define FILTER_PARAM_PACER_UNDERRUNS          "pacer_underruns"
+#define FILTER_PARAM_PACER_DROPPED_PACKETS    "pacer_dropped_packets"
+#define FILTER_PARAM_PACER_MAX_LATENESS_US    "pacer_max_lateness_us"
+#define FILTER_PARAM_DRIFT_COMPENSATION       "drift_compensation"
+#define FILTER_PARAM_DRIFT_PPM                "drift_ppm"
+#define FILTER_PARAM_SHM_OUTPUT_NAME          "shm_output_name"
+#define FILTER_PARAM_SHM_DROPPED_PACKETS      "shm_dropped_packets"
+#define FILTER_PARAM_TRACE_RECORD_PATH        "trace_record_path"
+#define FILTER_PARAM_TRACE_RECORD_COMPRESS    "trace_record_compress"
+#define FILTER_PARAM_LOUDNESS_METER           "loudness_meter"
+#define FILTER_PARAM_LOUDNESS_RESET           "loudness_reset"
+#define FILTER_PARAM_LOUDNESS_MOMENTARY_LUFS  "loudness_momentary_lufs"
+#define FILTER_PARAM_LOUDNESS_SHORT_TERM_LUFS "loudness_short_term_lufs"
+#define FILTER_PARAM_LOUDNESS_INTEGRATED_LUFS "loudness_integrated_lufs"
+#define FILTER_PARAM_LOUDNESS_TRUE_PEAK_DBTP  "loudness_true_peak_dbtp"
+#define FILTER_PARAM_LOUDNESS_SAMPLE_PEAK_DBFS "loudness_sample_peak_dbfs"
+#define FILTER_PARAM_LOUDNESS_RMS_DBFS        "loudness_rms_dbfs"
+#define FILTER_PARAM_LOUDNESS_CLIPPED_SAMPLES "loudness_clipped_samples"
+#define FILTER_PARAM_LOUDNESS_OVERHEAD_PERCENT "loudness_overhead_percent"
+#define FILTER_PARAM_FRAME_TRACING            "frame_tracing"
+#define FILTER_PARAM_TRACE_EXPORT             "trace_export"
+#define FILTER_PARAM_REALTIME_SCHEDULING      "realtime_scheduling"
+#define FILTER_PARAM_REALTIME_CORES           "realtime_cores"
+#define FILTER_PARAM_REALTIME_ACTIVE          "realtime_active"
+#define FILTER_PARAM_DEADLINE_MISSES          "deadline_misses"
+#define FILTER_PARAM_ENCODE_P99_MS            "encode_p99_ms"
+#define FILTER_PARAM_ENCODE_P999_MS           "encode_p999_ms"
+#define FILTER_PARAM_ENCODE_MAX_MS            "encode_max_ms"
+#define FILTER_PARAM_NUMA_PLACEMENT           "numa_placement"
+#define FILTER_PARAM_HUGE_PAGES               "huge_pages"
+#define FILTER_PARAM_NUMA_NODE                "numa_node"
+#define FILTER_PARAM_DC_REMOVAL              "dc_removal"
+#define FILTER_PARAM_HIGHPASS_HZ             "highpass_hz"
+#define FILTER_PARAM_NOISE_GATE_DB           "noise_gate_db"
+#define FILTER_PARAM_CONDITIONING_NOISE_FLOOR_DBFS "conditioning_noise_floor_dbfs"
+#define FILTER_PARAM_CONDITIONING_ATTENUATION_DB "conditioning_attenuation_db"
+#define FILTER_PARAM_CONDITIONING_LATENCY_MS  "conditioning_latency_ms"
+#define FILTER_PARAM_CONDITIONING_OVERHEAD_PERCENT "conditioning_overhead_percent"
+#define FILTER_PARAM_DELIVERY_POLICY          "delivery_policy"
+#define FILTER_PARAM_DELIVERY_MAX_QUEUED_MS   "delivery_max_queued_ms"
+#define FILTER_PARAM_DELIVERY_QUEUED_MS       "delivery_queued_ms"
+#define FILTER_PARAM_DELIVERY_PEAK_QUEUED_MS  "delivery_peak_queued_ms"
+#define FILTER_PARAM_DELIVERY_DROPPED_MS      "delivery_dropped_ms"
+#define FILTER_PARAM_DELIVERY_DROP_EVENTS     "delivery_drop_events"
+#define FILTER_PARAM_ENCODE_CHANNELS          "encode_channels"
+#define FILTER_PARAM_CHANNEL_MATRIX           "channel_matrix"
+#define FILTER_PARAM_CHANNEL_SELECT           "channel_select"
+#define FILTER_PARAM_INPUT_CHANNELS           "input_channels"
+#define FILTER_PARAM_CHECKPOINT_PATH          "checkpoint_path"
+#define FILTER_PARAM_CHECKPOINT_INTERVAL_MS   "checkpoint_interval_ms"
+#define FILTER_PARAM_CHECKPOINT_HISTORY_MS    "checkpoint_history_ms"
+#define FILTER_PARAM_CHECKPOINT_RESTORE       "checkpoint_restore"
+#define FILTER_PARAM_CHECKPOINT_COUNT         "checkpoint_count"
+#define FILTER_PARAM_CHECKPOINT_BYTES         "checkpoint_bytes"
+#define FILTER_PARAM_CHECKPOINT_US            "checkpoint_us"
+#define FILTER_PARAM_CHECKPOINT_WRITE_US      "checkpoint_write_us"
+#define FILTER_PARAM_CHECKPOINT_DROPPED       "checkpoint_dropped"
 
 // Forward
 class ICodecv2;
@@ -97,7 +195,23 @@ public:
 	HRESULT CheckTransform(const CMediaType *mtIn, const CMediaType *mtOut);
    
   virtual HRESULT StartStreaming();
+  /**
+   * @brief Overridden to stop the pacer
+   */
+  virtual HRESULT StopStreaming();
+  /**
+   * @brief Overridden to discard the paced packets
+   */
+  virtual HRESULT BeginFlush();
 	virtual HRESULT EndFlush();
+  /**
+   * @brief Overridden to encode the partial frame at the end of the stream
+   */
+  virtual HRESULT EndOfStream();
+  /**
+   * @brief Overridden to discard buffered audio on a seek
+   */
+  virtual HRESULT NewSegment(REFERENCE_TIME tStart, REFERENCE_TIME tStop, double dRate);
 
   virtual void doGetVersion(std::string& sVersion)
   {
@@ -106,10 +220,7 @@ public:
 
 	/// Interface methods
 	///Overridden from CSettingsInterface
-	virtual void initParameters()
-	{
-    addParameter("target_bitrate_kbps", &m_uiTargetBitrateKbps, 128);
-	}
+	virtual void initParameters();
 
 	/// Overridden from SettingsInterface
 	STDMETHODIMP GetParameter( const char* szParamName, int nBufferSize, char* szValue, int* pLength );
@@ -152,17 +263,109 @@ private:
 	* @param pDest The destination buffer
 	*/
 	virtual HRESULT ApplyTransform(BYTE* pBufferIn, long lInBufferSize, long lActualDataLength, BYTE* pBufferOut, long lOutBufferSize, long& lOutActualDataLength);
+  /**
+   * @brief Encodes one frame and delivers it downstream
+   * @return S_OK, S_FALSE if downstream doesn't want any more data, or an error
+   */
+  HRESULT deliverFrame(REFERENCE_TIME tStartSample, REFERENCE_TIME tStopSample, uint8_t* pStartOfSample, IMediaSample* pOutSample = NULL);
+  /**
+   * @brief Encodes the buffered frames for as long as the allocator has free samples, without blocking.
+   * The frames that can't be delivered stay queued in the audio buffer.
+   */
+  HRESULT deliverAvailableFrames();
+  /**
+   * @brief Encodes and delivers all complete buffered frames, waiting for the allocator, e.g. at the end of the stream
+   * @return the result of the last delivery, e.g. the error that stopped it
+   */
+  HRESULT deliverQueuedFrames();
+  /**
+   * @brief Applies the delivery policy before lSize bytes are added to the audio buffer
+   * @return false if the sample has to be dropped
+   */
+  bool admitAudio(long lSize, REFERENCE_TIME tStart);
+  /**
+   * @brief the audio in the buffer that hasn't been encoded yet in ms
+   */
+  uint32_t getQueuedMs() const;
+  /**
+   * @brief Passes the gap_* parameters on to the engine
+   */
+  void applyGapPolicy();
+  /**
+   * @brief Passes the fec_* parameters on to the engine
+   */
+  void applyFecMode();
+  /**
+   * @brief Delivers a packet that the decoder conceals, in CBR mode when the pacer has nothing to send
+   */
+  void deliverFiller(REFERENCE_TIME tDuration);
+  /**
+   * @brief Passes the adaptive frame duration parameters on to the engine
+   */
+  void applyFrameDurationAdaptation();
+  /**
+   * @brief Passes the dc_removal, highpass_hz and noise_gate_db parameters on to the engine
+   */
+  void applyConditioning();
+  /**
+   * @brief Works out the encoded channels from the encode_channels, channel_matrix and channel_select parameters
+   * and passes the mix on to the engine
+   * @return false if the mix doesn't fit the input
+   */
+  bool applyChannelMix(unsigned int uiInputChannels, uint32_t uiChannelMask);
+  /**
+   * @brief (Re)creates the shared memory output named m_sShmOutputName, or closes it if the name is empty
+   * @return false if the segment could not be created
+   */
+  bool openSharedMemoryOutput();
+  /**
+   * @brief Starts recording the input to m_sTraceRecordPath, or stops recording if the path is empty
+   * @return false if the trace file could not be created
+   */
+  bool openTraceRecorder();
+  /**
+   * @brief Records an admitted sample, expanded and mixed to PCM if the engine expands or mixes the input
+   */
+  void recordTraceSample(const BYTE* pData, long lSize, REFERENCE_TIME tStart, REFERENCE_TIME tStop, DWORD dwFlags);
+  /**
+   * @brief Applies the real-time policy to the streaming thread on its first sample, once per streaming session and
+   * thread
+   */
+  void applyStreamingRealtime();
+  /**
+   * @brief A numeric filter parameter: registered in initParameters and recorded at the start of a trace
+   */
+  struct NumericParameter
+  {
+    const char* szName;
+    uint32_t OpusEncoderFilter::* pValue;
+    uint32_t uiDefault;
+  };
+  static const NumericParameter NUMERIC_PARAMETERS[];
+  /**
+   * @brief Replaces the checkpoint file of the session if checkpoint_interval_ms have passed since the last one
+   */
+  void writeCheckpointIfDue();
+  /**
+   * @brief Continues the stream of the checkpoint_restore file
+   * @return false if the checkpoint could not be read or doesn't match the stream
+   */
+  bool restoreCheckpoint();
+  /**
+   * @brief Looks up read-only statistics and other values that are not stored in CSettingsInterface
+   * @return true if szParamName is one of these values
+   */
+  bool getStatistic(const char* szParamName, std::string& sValue);
 
-  /// Codec
+  /// Encode engine: owns the codec and the audio buffer
+  std::unique_ptr<OpusEncodeEngine> m_pEngine;
+  /// Codec (owned by the engine)
 	ICodecv2* m_pCodec;
 
-//#ifdef TEST_OPUS_ENCODE_DECODE
-//  ICodecv2* m_pDecoder;
-//#endif
 
   /// samples per second of source
   unsigned int m_uiSamplesPerSecond;
-  /// number of channels of source
+  /// number of channels encoded: those of the source unless they are mixed down
   unsigned int m_uiChannels;
   /// bits per sample of source
   unsigned int m_uiBitsPerSample;
@@ -170,10 +373,141 @@ private:
   unsigned int m_uiMaxCompressedSize;
   /// kbps
   uint32_t m_uiTargetBitrateKbps;
+  /// priority of this stream for the process-wide EncoderGovernor: higher priorities are degraded last
+  uint32_t m_uiStreamPriority;
+  /// process-wide CPU budget in percent of a core: 0 disables the EncoderGovernor
+  uint32_t m_uiCpuBudgetPercent;
+  /// 1 to decode every packet on a worker thread and measure the quality against the input
+  uint32_t m_uiQualityMonitor;
+  /// timestamp gap handling: 0 = ignore, 1 = fill with silence, 2 = signal loss (new segment)
+  uint32_t m_uiGapPolicy;
+  /// timestamp deviations up to this are treated as jitter
+  uint32_t m_uiGapToleranceMs;
+  /// longer gaps start a new segment instead of being filled
+  uint32_t m_uiGapMaxFillMs;
+  /// resample to follow the reference clock: 0 = off, 1 = follow the upstream timestamps, 2 = follow the buffer occupancy
+  uint32_t m_uiDriftCompensation;
+  /// in-band FEC: 0 = off, 1 = always on with fec_expected_loss_percent, 2 = adapt to the loss_report of the receiver
+  uint32_t m_uiFecMode;
+  uint32_t m_uiFecExpectedLossPercent;
+  /// hard CBR: every packet is padded to the size this link rate allows, 0 to disable
+  uint32_t m_uiCbrLinkRateBps;
+  /// per-packet framing of the CBR link
+  uint32_t m_uiCbrLinkOverheadBytes;
+  /// 1 to release the packets at their cadence from a worker thread. Takes effect when streaming starts.
+  uint32_t m_uiPacedOutput;
+  /// how long the first paced packet is held back to absorb the burstiness of the input
+  uint32_t m_uiPacerPrebufferMs;
+  /// how long before a paced packet is due the pacer thread spins instead of sleeping, see PacketPacer::setSpinMargin
+  uint32_t m_uiPacerSpinUs;
+  PacketPacer m_pacer;
+  /// the first delivery failure on the pacer thread, returned from the next Receive
+  std::atomic<HRESULT> m_hrPacedDelivery;
+  /// TOC, size and end time of the last paced packet for the CBR filler
+  uint8_t m_uiLastToc;
+  int m_iLastPacketSize;
+  REFERENCE_TIME m_tLastPacketStop;
+  /// 1 to adapt the frame duration to the voice activity between 10 ms and max_frame_duration_ms
+  uint32_t m_uiAdaptiveFrameDuration;
+  /// latency ceiling of the adaptive frame duration
+  uint32_t m_uiMaxFrameDurationMs;
+  /// maximum packets per second of the adaptive frame duration, 0 for no limit
+  uint32_t m_uiPacketRateBudget;
+  /// IP/UDP/RTP header size used to report the overhead saved
+  uint32_t m_uiPacketHeaderBytes;
+  /// name of the shared memory segment the packets are published to in addition to the output pin. Empty if disabled.
+  std::string m_sShmOutputName;
+  SharedMemoryRingWriter m_shmOutput;
+  /// file the input samples and parameter changes are recorded to for replay. Empty if disabled.
+  std::string m_sTraceRecordPath;
+  /// 1 to delta encode the recorded PCM
+  uint32_t m_uiTraceRecordCompress;
+  /// 1 to meter the loudness, peaks and RMS of the encoded audio
+  uint32_t m_uiLoudnessMeter;
+  TraceRecorder m_traceRecorder;
+  /// 1 to record per-frame trace events (process-wide). Setting trace_export to a filename writes the Chrome trace.
+  uint32_t m_uiFrameTracing;
+  /// identifies this filter in the trace
+  uint32_t m_uiTraceStreamId;
+  /// number of frames cut so far, used to correlate trace events
+  uint32_t m_uiTraceFrame;
+  /// scheduling of the streaming thread and of the pacer thread of paced_output: 0 for normal scheduling, 1 for MMCSS
+  /// "Pro Audio"/SCHED_FIFO, 2 for SCHED_DEADLINE. Takes effect when streaming starts.
+  uint32_t m_uiRealtimeScheduling;
+  /// core set such as "0-3,6" the streaming and pacer threads are restricted to, empty for all cores
+  std::string m_sRealtimeCores;
+  /// the policy of the streaming session, applied once per thread
+  RealtimePolicy m_realtimePolicy;
+  /// the policy on the streaming thread from its first sample until streaming stops. Receive and StopStreaming are
+  /// serialised by the receive lock.
+  std::unique_ptr<RealtimeScope> m_pStreamingRealtime;
+  /// the thread m_pStreamingRealtime was applied to: upstream may deliver on a new thread after a restart
+  DWORD m_dwStreamingThreadId;
+  /// whether the policy took effect on the streaming thread, read by realtime_active
+  std::atomic<bool> m_bRealtimeActive;
+  /// 1 to place the buffers of the stream on the NUMA node of the streaming thread
+  uint32_t m_uiNumaPlacement;
+  /// 1 to back the NUMA arena with huge pages
+  uint32_t m_uiHugePages;
+  /// false until the buffers have been placed in this streaming session
+  bool m_bPlaced;
+  /// 1 to remove DC from the input before encoding
+  uint32_t m_uiDcRemoval;
+  /// cut-off of the high-pass applied before encoding, 0 to disable
+  uint32_t m_uiHighPassHz;
+  /// maximum attenuation of the spectral noise gate applied before encoding, 0 to disable. The gate adds about 10 ms of delay.
+  uint32_t m_uiNoiseGateDb;
+  /// 0 to block while downstream holds all output samples, 1 to drop the oldest or 2 to drop the newest audio beyond delivery_max_queued_ms
+  uint32_t m_uiDeliveryPolicy;
+  /// the most audio that may wait for an output sample when a drop policy is set
+  uint32_t m_uiDeliveryMaxQueuedMs;
+  /// the newest audio is being dropped: the next admitted sample starts a new segment
+  bool m_bDroppingNewest;
+  /// the oldest audio was dropped: the next delivered packet is flagged as a discontinuity
+  bool m_bDroppedOldest;
+  /// the audio waiting to be encoded after the last Receive, and its peak in this streaming session
+  std::atomic<uint32_t> m_uiQueuedMs;
+  std::atomic<uint32_t> m_uiPeakQueuedMs;
+  std::atomic<uint64_t> m_uiDroppedBytes;
+  /// number of times the policy started dropping
+  std::atomic<uint32_t> m_uiDropEvents;
+  /// G.711 or IMA ADPCM input is expanded to 16 bit PCM by the engine
+  InputDecoder::Config m_inputEncoding;
+  /// expands the input for the trace recorder, null for PCM input
+  std::unique_ptr<InputDecoder> m_pTraceDecoder;
+  std::vector<int16_t> m_vTracePcm;
+  /// 1 or 2 to encode that many channels, 0 for those of the source up to stereo. Takes effect when the input is connected.
+  uint32_t m_uiEncodeChannels;
+  /// gains from the source channels, one row per encoded channel; empty for the ITU-R BS.775 downmix
+  std::string m_sChannelMatrix;
+  /// source channels passed to the encoded channels, e.g. "1" for the second programme of a dual-mono feed
+  std::string m_sChannelSelect;
+  /// number of channels of source
+  unsigned int m_uiInputChannels;
+  /// mixes the input for the trace recorder, null if the source channels are encoded as they are
+  std::unique_ptr<ChannelMixer> m_pTraceMixer;
+  std::vector<int16_t> m_vTraceMixed;
+  /// file that a checkpoint of the stream replaces every checkpoint_interval_ms for a hot standby. Empty if disabled.
+  /// Takes effect when streaming starts.
+  std::string m_sCheckpointPath;
+  uint32_t m_uiCheckpointIntervalMs;
+  /// encoded input in the checkpoint that brings the codec of the standby into step. Takes effect when the input is connected.
+  uint32_t m_uiCheckpointHistoryMs;
+  /// checkpoint the stream continues from when streaming starts, e.g. on the standby once the primary failed. Cleared
+  /// once restored so that a restart doesn't rewind the stream.
+  std::string m_sCheckpointRestore;
+  /// the checkpoint path of this streaming session
+  std::string m_sSessionCheckpointPath;
+  std::chrono::steady_clock::time_point m_tLastCheckpoint;
+  EncoderCheckpoint m_checkpoint;
+  /// replaces the checkpoint file off the streaming thread, and counts the checkpoints written and dropped
+  CheckpointWriter m_checkpointWriter;
+  /// the stream continues a checkpoint: the discontinuity of the first sample isn't passed on
+  bool m_bContinuesCheckpoint;
+  /// time the streaming thread took to capture and serialize the last checkpoint
+  std::atomic<uint32_t> m_uiCheckpointUs;
 
 	REFERENCE_TIME		rtStart;
 	REFERENCE_TIME		rtInput;
 	bool				has_start;
-
-  std::unique_ptr<AudioBuffer> m_pAudioBuffer;
 };
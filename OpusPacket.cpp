@@ -0,0 +1,208 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: OpusPacket.cpp
+
+DESCRIPTION			: Opus packet parsing and padding to an exact size (RFC 6716 section 3)
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "OpusPacket.h"
+#include <cstring>
+
+/// @return the number of bytes used, or -1 if the length is truncated
+static int readFrameLength(const uint8_t* pData, int iSize, int& iLength)
+{
+  if (iSize < 1) return -1;
+  if (pData[0] < 252)
+  {
+    iLength = pData[0];
+    return 1;
+  }
+  if (iSize < 2) return -1;
+  iLength = 4 * pData[1] + pData[0];
+  return 2;
+}
+
+static int writeFrameLength(uint8_t* pData, int iLength)
+{
+  if (iLength < 252)
+  {
+    pData[0] = static_cast<uint8_t>(iLength);
+    return 1;
+  }
+  pData[0] = static_cast<uint8_t>(252 + (iLength & 3));
+  pData[1] = static_cast<uint8_t>((iLength - pData[0]) >> 2);
+  return 2;
+}
+
+int OpusPacket::parse(const uint8_t* pData, int iSize, int* pFrameSizes, const uint8_t** ppFrames)
+{
+  if (iSize < 1) return -1;
+  const uint8_t* p = pData + 1;
+  int iLeft = iSize - 1;
+  int iFrames = 0;
+  switch (pData[0] & 0x3)
+  {
+  case 0:
+  {
+    // one frame
+    iFrames = 1;
+    pFrameSizes[0] = iLeft;
+    break;
+  }
+  case 1:
+  {
+    // two frames of equal size
+    if (iLeft & 1) return -1;
+    iFrames = 2;
+    pFrameSizes[0] = pFrameSizes[1] = iLeft / 2;
+    break;
+  }
+  case 2:
+  {
+    // two frames, the size of the first is coded
+    int iBytes = readFrameLength(p, iLeft, pFrameSizes[0]);
+    if (iBytes < 0) return -1;
+    p += iBytes;
+    iLeft -= iBytes;
+    if (pFrameSizes[0] > iLeft) return -1;
+    iFrames = 2;
+    pFrameSizes[1] = iLeft - pFrameSizes[0];
+    break;
+  }
+  default:
+  {
+    // an arbitrary number of frames with optional padding
+    if (iLeft < 1) return -1;
+    const uint8_t uiCount = *p++;
+    --iLeft;
+    iFrames = uiCount & 0x3F;
+    if (iFrames == 0 || iFrames > MAX_FRAMES) return -1;
+    if (uiCount & 0x40)
+    {
+      // padding length: each 255 adds 254 bytes and continues
+      int iPadding = 0;
+      uint8_t uiByte;
+      do
+      {
+        if (iLeft < 1) return -1;
+        uiByte = *p++;
+        --iLeft;
+        iPadding += uiByte == 255 ? 254 : uiByte;
+      } while (uiByte == 255);
+      if (iPadding > iLeft) return -1;
+      iLeft -= iPadding;
+    }
+    if (uiCount & 0x80)
+    {
+      // VBR: all sizes but the last are coded
+      int iTotal = 0;
+      for (int i = 0; i < iFrames - 1; ++i)
+      {
+        int iBytes = readFrameLength(p, iLeft, pFrameSizes[i]);
+        if (iBytes < 0) return -1;
+        p += iBytes;
+        iLeft -= iBytes;
+        iTotal += pFrameSizes[i];
+      }
+      if (iTotal > iLeft) return -1;
+      pFrameSizes[iFrames - 1] = iLeft - iTotal;
+    }
+    else
+    {
+      if (iLeft % iFrames) return -1;
+      for (int i = 0; i < iFrames; ++i) pFrameSizes[i] = iLeft / iFrames;
+    }
+    break;
+  }
+  }
+  for (int i = 0; i < iFrames; ++i)
+  {
+    if (pFrameSizes[i] > MAX_FRAME_SIZE) return -1;
+    if (ppFrames) ppFrames[i] = p;
+    p += pFrameSizes[i];
+  }
+  return iFrames;
+}
+
+bool OpusPacket::pad(uint8_t* pData, int iSize, int iPaddedSize, int iCapacity)
+{
+  if (iPaddedSize > iCapacity) return false;
+  int vFrameSizes[MAX_FRAMES];
+  const uint8_t* vFrames[MAX_FRAMES];
+  const int iFrames = parse(pData, iSize, vFrameSizes, vFrames);
+  if (iFrames < 0) return false;
+
+  bool bVbr = false;
+  int iPayload = 0;
+  for (int i = 0; i < iFrames; ++i)
+  {
+    bVbr |= vFrameSizes[i] != vFrameSizes[0];
+    iPayload += vFrameSizes[i];
+  }
+  int iLengths = 0;
+  if (bVbr)
+  {
+    for (int i = 0; i < iFrames - 1; ++i) iLengths += vFrameSizes[i] < 252 ? 1 : 2;
+  }
+  // everything that is added: the padding length bytes and the padding itself
+  const int iPadding = iPaddedSize - 2 - iLengths - iPayload;
+  if (iPadding < 0) return false;
+  // a length byte of 255 stands for 254 bytes of padding and continues, the last byte for its value
+  const int iContinuations = iPadding > 0 ? (iPadding - 1) / 255 : 0;
+  const int iPaddingLengthBytes = iPadding > 0 ? iContinuations + 1 : 0;
+
+  // the frames are contiguous in any packet: move them in one go, the old header is read before it is overwritten
+  uint8_t vLengths[2 * MAX_FRAMES];
+  uint8_t* p = vLengths;
+  if (bVbr)
+  {
+    for (int i = 0; i < iFrames - 1; ++i) p += writeFrameLength(p, vFrameSizes[i]);
+  }
+  const int iFramesStart = 2 + iPaddingLengthBytes + iLengths;
+  memmove(pData + iFramesStart, vFrames[0], iPayload);
+
+  pData[0] = static_cast<uint8_t>(pData[0] | 0x3);
+  pData[1] = static_cast<uint8_t>(iFrames | (bVbr ? 0x80 : 0) | (iPadding > 0 ? 0x40 : 0));
+  if (iPadding > 0)
+  {
+    memset(pData + 2, 255, iContinuations);
+    pData[2 + iContinuations] = static_cast<uint8_t>(iPadding - 1 - 255 * iContinuations);
+  }
+  memcpy(pData + 2 + iPaddingLengthBytes, vLengths, iLengths);
+  memset(pData + iFramesStart + iPayload, 0, iPaddedSize - iFramesStart - iPayload);
+  return true;
+}
+
+bool OpusPacket::writeEmpty(uint8_t* pData, uint8_t uiToc, int iSize)
+{
+  if (iSize < 1) return false;
+  // a code 0 packet with a frame of zero bytes
+  pData[0] = static_cast<uint8_t>(uiToc & 0xFC);
+  return iSize == 1 || pad(pData, 1, iSize, iSize);
+}
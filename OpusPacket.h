@@ -0,0 +1,70 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: OpusPacket.h
+
+DESCRIPTION			: Opus packet parsing and padding to an exact size (RFC 6716 section 3)
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstdint>
+
+/**
+ * @brief Operations on the framing of Opus packets (RFC 6716 section 3) that don't need a decoder
+ */
+class OpusPacket
+{
+public:
+  /// an Opus packet carries at most 120 ms
+  static const int MAX_FRAMES = 48;
+  /// the largest frame
+  static const int MAX_FRAME_SIZE = 1275;
+  /// a code 3 header for up to three VBR frames: TOC, frame count and two two-byte lengths
+  static const int MAX_PADDING_HEADER = 6;
+
+  /**
+   * @brief Splits a packet into its frames
+   * @param pFrameSizes receives the size of each frame, must hold MAX_FRAMES entries
+   * @param ppFrames optionally receives a pointer to each frame
+   * @return the number of frames or -1 if the packet is malformed
+   */
+  static int parse(const uint8_t* pData, int iSize, int* pFrameSizes, const uint8_t** ppFrames = nullptr);
+  /**
+   * @brief Rewrites a packet as a code 3 packet with padding so that it is exactly iPaddedSize bytes.
+   * The decoded audio is unchanged.
+   * @param iCapacity the size of the buffer at pData
+   * @return false if the packet is malformed or doesn't fit, in which case pData is unchanged
+   */
+  static bool pad(uint8_t* pData, int iSize, int iPaddedSize, int iCapacity);
+  /**
+   * @brief Writes a packet of iSize bytes with the configuration of the TOC byte that contains no audio.
+   * The decoder conceals it like a lost packet.
+   * @return false if iSize is less than one byte
+   */
+  static bool writeEmpty(uint8_t* pData, uint8_t uiToc, int iSize);
+};
@@ -0,0 +1,256 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: PacketArena.cpp
+
+DESCRIPTION			: Pooled reference-counted packet buffers and fan-out distribution
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "PacketArena.h"
+#include <algorithm>
+#include <chrono>
+
+void PacketRef::reset()
+{
+  if (m_pPacket && --m_pPacket->m_iRefs == 0)
+  {
+    m_pPacket->m_pArena->release(m_pPacket);
+  }
+  m_pPacket = nullptr;
+}
+
+PacketArena::PacketArena(int iPacketCapacity, int iInitialPackets, std::shared_ptr<NumaArena> pStorage)
+  :m_iPacketCapacity(iPacketCapacity),
+  m_pStorage(pStorage)
+{
+  m_vPackets.reserve(iInitialPackets);
+  m_vFree.reserve(iInitialPackets);
+  for (int i = 0; i < iInitialPackets; ++i)
+  {
+    m_vFree.push_back(createPacket());
+  }
+}
+
+Packet* PacketArena::createPacket()
+{
+  uint8_t* pStorage = m_pStorage ? m_pStorage->allocate(m_iPacketCapacity) : nullptr;
+  m_vPackets.emplace_back(new Packet(m_iPacketCapacity, pStorage));
+  return m_vPackets.back().get();
+}
+
+PacketRef PacketArena::acquire()
+{
+  Packet* pPacket = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_vFree.empty())
+    {
+      pPacket = createPacket();
+    }
+    else
+    {
+      pPacket = m_vFree.back();
+      m_vFree.pop_back();
+    }
+  }
+  pPacket->m_iSize = 0;
+  pPacket->m_pArena = shared_from_this();
+  return PacketRef(pPacket);
+}
+
+int PacketArena::getAllocatedCount() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return static_cast<int>(m_vPackets.size());
+}
+
+void PacketArena::release(Packet* pPacket)
+{
+  // the packet may hold the last reference to the arena: drop it after unlocking
+  std::shared_ptr<PacketArena> pSelf = std::move(pPacket->m_pArena);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_vFree.push_back(pPacket);
+}
+
+PacketDistributor::Subscriber::Subscriber(size_t uiCapacity, DropPolicy ePolicy)
+  :m_ePolicy(ePolicy),
+  m_vRing(std::max<size_t>(uiCapacity, 1)),
+  m_uiHead(0),
+  m_uiCount(0),
+  m_uiDropped(0),
+  m_bClosed(false)
+{
+}
+
+void PacketDistributor::Subscriber::push(const PacketRef& packet)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_uiCount == m_vRing.size())
+    {
+      ++m_uiDropped;
+      if (m_ePolicy == DropPolicy::DP_DROP_NEWEST) return;
+      m_vRing[m_uiHead].reset();
+      m_uiHead = (m_uiHead + 1) % m_vRing.size();
+      --m_uiCount;
+    }
+    m_vRing[(m_uiHead + m_uiCount) % m_vRing.size()] = packet;
+    ++m_uiCount;
+  }
+  m_cvPacket.notify_one();
+}
+
+bool PacketDistributor::Subscriber::pop(PacketRef& packet)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_uiCount == 0) return false;
+  packet = std::move(m_vRing[m_uiHead]);
+  m_uiHead = (m_uiHead + 1) % m_vRing.size();
+  --m_uiCount;
+  return true;
+}
+
+bool PacketDistributor::Subscriber::waitPop(PacketRef& packet, uint32_t uiTimeoutMs)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  if (!m_cvPacket.wait_for(lock, std::chrono::milliseconds(uiTimeoutMs), [this]() { return m_uiCount > 0 || m_bClosed; }))
+  {
+    return false;
+  }
+  if (m_uiCount == 0) return false;
+  packet = std::move(m_vRing[m_uiHead]);
+  m_uiHead = (m_uiHead + 1) % m_vRing.size();
+  --m_uiCount;
+  return true;
+}
+
+size_t PacketDistributor::Subscriber::getQueuedCount() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_uiCount;
+}
+
+uint64_t PacketDistributor::Subscriber::getDroppedCount() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_uiDropped;
+}
+
+bool PacketDistributor::Subscriber::isClosed() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_bClosed;
+}
+
+void PacketDistributor::Subscriber::close()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bClosed = true;
+  }
+  m_cvPacket.notify_all();
+}
+
+PacketDistributor::PacketDistributor(REFERENCE_TIME tRetain)
+  :m_tRetain(tRetain)
+{
+}
+
+PacketDistributor::~PacketDistributor()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto& pSubscriber : m_vSubscribers)
+  {
+    pSubscriber->close();
+  }
+}
+
+std::shared_ptr<PacketDistributor::Subscriber> PacketDistributor::subscribe(size_t uiCapacity, DropPolicy ePolicy, REFERENCE_TIME tReplay)
+{
+  auto pSubscriber = std::make_shared<Subscriber>(uiCapacity, ePolicy);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (tReplay > 0 && !m_dqRetained.empty())
+  {
+    REFERENCE_TIME tFrom = m_dqRetained.back()->getStartTime() - tReplay;
+    for (const PacketRef& packet : m_dqRetained)
+    {
+      if (packet->getStartTime() >= tFrom) pSubscriber->push(packet);
+    }
+  }
+  m_vSubscribers.push_back(pSubscriber);
+  return pSubscriber;
+}
+
+void PacketDistributor::unsubscribe(const std::shared_ptr<Subscriber>& pSubscriber)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_vSubscribers.erase(std::remove(m_vSubscribers.begin(), m_vSubscribers.end(), pSubscriber), m_vSubscribers.end());
+  }
+  pSubscriber->close();
+}
+
+void PacketDistributor::publish(const PacketRef& packet)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto& pSubscriber : m_vSubscribers)
+  {
+    pSubscriber->push(packet);
+  }
+  if (m_tRetain > 0)
+  {
+    m_dqRetained.push_back(packet);
+    trimRetained();
+  }
+}
+
+size_t PacketDistributor::getSubscriberCount() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_vSubscribers.size();
+}
+
+void PacketDistributor::setRetention(REFERENCE_TIME tRetain)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_tRetain = tRetain;
+  trimRetained();
+}
+
+void PacketDistributor::trimRetained()
+{
+  if (m_tRetain <= 0)
+  {
+    m_dqRetained.clear();
+    return;
+  }
+  while (!m_dqRetained.empty() && m_dqRetained.back()->getStartTime() - m_dqRetained.front()->getStartTime() > m_tRetain)
+  {
+    m_dqRetained.pop_front();
+  }
+}
@@ -0,0 +1,231 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: PacketArena.h
+
+DESCRIPTION			: Pooled reference-counted packet buffers and fan-out distribution
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "AudioBuffer.h"
+#include "NumaArena.h"
+
+class PacketArena;
+
+/**
+ * @brief An encoded packet in a PacketArena. Packets are immutable once they have been shared.
+ */
+class Packet
+{
+  friend class PacketArena;
+  friend class PacketRef;
+public:
+  const uint8_t* getData() const { return m_pData; }
+  int getSize() const { return m_iSize; }
+  int getCapacity() const { return m_iCapacity; }
+  REFERENCE_TIME getStartTime() const { return m_tStart; }
+  REFERENCE_TIME getStopTime() const { return m_tStop; }
+  uint64_t getSequenceNumber() const { return m_uiSequenceNumber; }
+
+  /// writer interface: only valid while the packet has not been shared, see PacketRef::getWritable
+  uint8_t* getBuffer() { return m_pData; }
+  void setSize(int iSize) { m_iSize = iSize; }
+  void setTime(REFERENCE_TIME tStart, REFERENCE_TIME tStop) { m_tStart = tStart; m_tStop = tStop; }
+  void setSequenceNumber(uint64_t uiSequenceNumber) { m_uiSequenceNumber = uiSequenceNumber; }
+
+private:
+  /// @param pStorage iCapacity bytes owned by the arena's NumaArena, or null to allocate from the heap
+  Packet(int iCapacity, uint8_t* pStorage)
+    :m_pOwnedData(pStorage ? nullptr : new uint8_t[iCapacity]()), m_pData(pStorage ? pStorage : m_pOwnedData.get()), m_iCapacity(iCapacity),
+    m_iSize(0), m_tStart(0), m_tStop(0), m_uiSequenceNumber(0), m_iRefs(0)
+  {
+  }
+
+  std::unique_ptr<uint8_t[]> m_pOwnedData;
+  uint8_t* m_pData;
+  int m_iCapacity;
+  int m_iSize;
+  REFERENCE_TIME m_tStart;
+  REFERENCE_TIME m_tStop;
+  uint64_t m_uiSequenceNumber;
+  std::atomic<int> m_iRefs;
+  /// keeps the arena alive while the packet is in use
+  std::shared_ptr<PacketArena> m_pArena;
+};
+
+/**
+ * @brief Reference to a pooled packet. Copying shares the packet, the last reference returns it to the arena.
+ */
+class PacketRef
+{
+public:
+  PacketRef() :m_pPacket(nullptr) {}
+  explicit PacketRef(Packet* pPacket) :m_pPacket(pPacket) { if (m_pPacket) ++m_pPacket->m_iRefs; }
+  PacketRef(const PacketRef& other) :PacketRef(other.m_pPacket) {}
+  PacketRef(PacketRef&& other) :m_pPacket(other.m_pPacket) { other.m_pPacket = nullptr; }
+  ~PacketRef() { reset(); }
+  PacketRef& operator=(PacketRef other)
+  {
+    std::swap(m_pPacket, other.m_pPacket);
+    return *this;
+  }
+
+  void reset();
+  explicit operator bool() const { return m_pPacket != nullptr; }
+  const Packet* operator->() const { return m_pPacket; }
+  const Packet& operator*() const { return *m_pPacket; }
+  /**
+   * @brief the packet for writing or null if the packet is shared
+   */
+  Packet* getWritable() { return (m_pPacket && m_pPacket->m_iRefs.load() == 1) ? m_pPacket : nullptr; }
+
+private:
+  Packet* m_pPacket;
+};
+
+/**
+ * @brief Pool of fixed capacity packet buffers. The pool grows on demand and never shrinks.
+ *
+ * Create with std::make_shared: outstanding packets keep the arena alive.
+ */
+class PacketArena : public std::enable_shared_from_this<PacketArena>
+{
+  friend class PacketRef;
+public:
+  /**
+   * @param iPacketCapacity The capacity of each packet buffer in bytes
+   * @param iInitialPackets The number of packets to preallocate
+   * @param pStorage node-local storage for the packet buffers. Packets beyond its capacity come from the heap.
+   */
+  PacketArena(int iPacketCapacity, int iInitialPackets, std::shared_ptr<NumaArena> pStorage = nullptr);
+  /**
+   * @brief a packet with a reference count of one
+   */
+  PacketRef acquire();
+  int getPacketCapacity() const { return m_iPacketCapacity; }
+  /**
+   * @brief the number of packets allocated by the arena
+   */
+  int getAllocatedCount() const;
+
+private:
+  void release(Packet* pPacket);
+  /// a new packet, from m_pStorage if it has space. Called with the lock held or from the constructor.
+  Packet* createPacket();
+
+  int m_iPacketCapacity;
+  std::shared_ptr<NumaArena> m_pStorage;
+  mutable std::mutex m_mutex;
+  std::vector<std::unique_ptr<Packet>> m_vPackets;
+  std::vector<Packet*> m_vFree;
+};
+
+/**
+ * @brief Hands every published packet to all subscribers without copying.
+ *
+ * Each subscriber has its own bounded queue so that a slow consumer can only lose its own packets and
+ * never blocks the publisher or the other subscribers. The packets of the last tRetain 100ns units are kept
+ * so that late joiners can start with a replay.
+ */
+class PacketDistributor
+{
+public:
+  enum class DropPolicy
+  {
+    /// a full queue discards its oldest packet to make room
+    DP_DROP_OLDEST,
+    /// a full queue discards the incoming packet
+    DP_DROP_NEWEST
+  };
+
+  class Subscriber
+  {
+    friend class PacketDistributor;
+  public:
+    Subscriber(size_t uiCapacity, DropPolicy ePolicy);
+    /**
+     * @brief Takes the next packet without waiting
+     * @return false if the queue is empty
+     */
+    bool pop(PacketRef& packet);
+    /**
+     * @brief Takes the next packet, waiting up to uiTimeoutMs for one to arrive
+     * @return false on timeout or if the subscriber has been closed
+     */
+    bool waitPop(PacketRef& packet, uint32_t uiTimeoutMs);
+    size_t getQueuedCount() const;
+    uint64_t getDroppedCount() const;
+    bool isClosed() const;
+
+  private:
+    void push(const PacketRef& packet);
+    void close();
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cvPacket;
+    DropPolicy m_ePolicy;
+    /// fixed size ring of m_vRing.size() packets
+    std::vector<PacketRef> m_vRing;
+    size_t m_uiHead;
+    size_t m_uiCount;
+    uint64_t m_uiDropped;
+    bool m_bClosed;
+  };
+
+  explicit PacketDistributor(REFERENCE_TIME tRetain);
+  ~PacketDistributor();
+  /**
+   * @brief Adds a subscriber
+   * @param uiCapacity The maximum number of queued packets
+   * @param ePolicy What to do when the queue is full
+   * @param tReplay Queue the retained packets of this duration before the live packets
+   */
+  std::shared_ptr<Subscriber> subscribe(size_t uiCapacity, DropPolicy ePolicy, REFERENCE_TIME tReplay = 0);
+  /**
+   * @brief Removes a subscriber and wakes it up if it is waiting
+   */
+  void unsubscribe(const std::shared_ptr<Subscriber>& pSubscriber);
+  void publish(const PacketRef& packet);
+  size_t getSubscriberCount() const;
+  void setRetention(REFERENCE_TIME tRetain);
+
+private:
+  void trimRetained();
+
+  mutable std::mutex m_mutex;
+  std::vector<std::shared_ptr<Subscriber>> m_vSubscribers;
+  std::deque<PacketRef> m_dqRetained;
+  REFERENCE_TIME m_tRetain;
+};
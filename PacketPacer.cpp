@@ -0,0 +1,239 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: PacketPacer.cpp
+
+DESCRIPTION			: Releases packets on a fixed cadence from a worker thread
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "PacketPacer.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <mmsystem.h>
+#endif
+
+static std::chrono::steady_clock::duration toDuration(REFERENCE_TIME t)
+{
+  return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(t * 100));
+}
+
+PacketPacer::PacketPacer()
+  :m_bStop(false),
+  m_uiGeneration(0),
+  m_uiMaxQueued(0),
+  m_tPrebuffer(0),
+  m_tSpinMargin(toDuration(DEFAULT_SPIN_MARGIN)),
+  m_bRealtime(false),
+  m_bScheduled(false),
+  m_tLastDuration(0),
+  m_bDelivering(false),
+  m_stats(),
+  m_dTotalLatenessUs(0.0)
+{
+}
+
+PacketPacer::~PacketPacer()
+{
+  stop();
+}
+
+void PacketPacer::start(REFERENCE_TIME tPrebuffer, size_t uiMaxQueued, UnderrunHandler onUnderrun)
+{
+  stop();
+  m_bStop = false;
+  m_uiMaxQueued = uiMaxQueued;
+  m_tPrebuffer = toDuration(tPrebuffer);
+  m_onUnderrun = onUnderrun;
+  m_bScheduled = false;
+  m_tLastDuration = 0;
+  m_stats = Stats();
+  m_dTotalLatenessUs = 0.0;
+#ifdef _WIN32
+  // the default timer resolution of 15.6 ms is coarser than a frame
+  timeBeginPeriod(1);
+#endif
+  m_thread = std::thread(&PacketPacer::run, this);
+}
+
+void PacketPacer::setSpinMargin(REFERENCE_TIME tSpinMargin)
+{
+  m_tSpinMargin = toDuration(tSpinMargin);
+}
+
+void PacketPacer::stop()
+{
+  if (!m_thread.joinable()) return;
+  std::deque<Item> qDiscarded;
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_bStop = true;
+    qDiscarded = takeQueue();
+  }
+  m_cvWork.notify_all();
+  m_cvDrained.notify_all();
+  m_thread.join();
+  m_bRealtime = false;
+#ifdef _WIN32
+  timeEndPeriod(1);
+#endif
+  for (Item& item : qDiscarded) item.job(false);
+}
+
+void PacketPacer::push(REFERENCE_TIME tDuration, Job job)
+{
+  Item dropped;
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_bStop || !m_thread.joinable())
+    {
+      dropped.job = job;
+    }
+    else
+    {
+      if (!m_bScheduled)
+      {
+        m_bScheduled = true;
+        m_tNextDue = Clock::now() + m_tPrebuffer;
+      }
+      if (m_qPackets.size() >= m_uiMaxQueued)
+      {
+        dropped = std::move(m_qPackets.front());
+        m_qPackets.pop_front();
+        ++m_stats.dropped;
+      }
+      m_qPackets.push_back(Item{ tDuration, std::move(job) });
+    }
+  }
+  m_cvWork.notify_all();
+  if (dropped.job) dropped.job(false);
+}
+
+void PacketPacer::drain()
+{
+  std::unique_lock<std::mutex> lock(m_lock);
+  m_cvDrained.wait(lock, [this]() { return m_bStop || (m_qPackets.empty() && !m_bDelivering); });
+}
+
+void PacketPacer::flush()
+{
+  std::deque<Item> qDiscarded;
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    qDiscarded = takeQueue();
+    m_bScheduled = false;
+    ++m_uiGeneration;
+  }
+  m_cvWork.notify_all();
+  m_cvDrained.notify_all();
+  for (Item& item : qDiscarded) item.job(false);
+}
+
+PacketPacer::Stats PacketPacer::getStats() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  Stats stats = m_stats;
+  stats.meanLatenessUs = m_stats.packets > 0 ? m_dTotalLatenessUs / m_stats.packets : 0.0;
+  return stats;
+}
+
+std::deque<PacketPacer::Item> PacketPacer::takeQueue()
+{
+  std::deque<Item> qPackets;
+  qPackets.swap(m_qPackets);
+  return qPackets;
+}
+
+bool PacketPacer::waitUntil(std::unique_lock<std::mutex>& lock, Clock::time_point tDue)
+{
+  const uint64_t uiGeneration = m_uiGeneration;
+  auto interrupted = [this, uiGeneration]() { return m_bStop || m_uiGeneration != uiGeneration; };
+  if (m_cvWork.wait_until(lock, tDue - m_tSpinMargin, interrupted)) return false;
+  lock.unlock();
+  while (Clock::now() < tDue)
+  {
+    std::this_thread::yield();
+  }
+  lock.lock();
+  return !interrupted();
+}
+
+void PacketPacer::run()
+{
+  // the thread is ours: keep the policy for its lifetime
+  RealtimeScope realtime(m_realtimePolicy);
+  m_bRealtime = realtime.isRealtime();
+  std::unique_lock<std::mutex> lock(m_lock);
+  while (!m_bStop)
+  {
+    if (!m_bScheduled)
+    {
+      m_cvWork.wait(lock, [this]() { return m_bStop || m_bScheduled; });
+      continue;
+    }
+    if (!waitUntil(lock, m_tNextDue)) continue;
+
+    const double dLatenessUs = std::chrono::duration<double, std::micro>(Clock::now() - m_tNextDue).count();
+    if (!m_qPackets.empty())
+    {
+      Item item = std::move(m_qPackets.front());
+      m_qPackets.pop_front();
+      m_tLastDuration = item.tDuration;
+      m_tNextDue += toDuration(item.tDuration);
+      ++m_stats.packets;
+      m_dTotalLatenessUs += dLatenessUs;
+      if (dLatenessUs > m_stats.maxLatenessUs) m_stats.maxLatenessUs = dLatenessUs;
+      m_bDelivering = true;
+      lock.unlock();
+      item.job(true);
+      lock.lock();
+      m_bDelivering = false;
+      if (m_qPackets.empty()) m_cvDrained.notify_all();
+      // far behind, e.g. because downstream blocked: restart from now instead of bursting to catch up
+      if (Clock::now() - m_tNextDue > m_tPrebuffer) m_tNextDue = Clock::now();
+    }
+    else if (m_onUnderrun && m_tLastDuration > 0)
+    {
+      // keep the link fed at the same cadence
+      ++m_stats.underruns;
+      const REFERENCE_TIME tDuration = m_tLastDuration;
+      m_tNextDue += toDuration(tDuration);
+      m_bDelivering = true;
+      lock.unlock();
+      m_onUnderrun(tDuration);
+      lock.lock();
+      m_bDelivering = false;
+      m_cvDrained.notify_all();
+    }
+    else
+    {
+      // nothing to pace: start a new schedule with the next packet
+      ++m_stats.underruns;
+      m_bScheduled = false;
+    }
+  }
+}
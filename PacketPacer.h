@@ -0,0 +1,166 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: PacketPacer.h
+
+DESCRIPTION			: Releases packets on a fixed cadence from a worker thread
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "AudioBuffer.h"
+#include "RealtimeScheduling.h"
+
+/**
+ * @brief Releases packets at the cadence of their durations instead of in bursts.
+ *
+ * The encoder produces several packets at once whenever a large input buffer arrives. The pacer queues them and
+ * a worker thread releases one packet per packet duration against an absolute schedule, so timer jitter does
+ * not accumulate. The first packet after start() or flush() is held back by the prebuffer to absorb the
+ * burstiness of the input. If the schedule falls behind by more than the prebuffer, e.g. because downstream
+ * blocked, it restarts from the current time rather than releasing the backlog in a burst.
+ *
+ * If the queue runs dry the optional underrun handler is called in place of the packet so that a constant-rate
+ * link can be fed filler; without a handler the schedule restarts with the next packet.
+ */
+class PacketPacer
+{
+public:
+  /**
+   * @brief Releases or discards a queued packet. It is called exactly once: with true on the worker thread when
+   * the packet is due, or with false if the packet is discarded.
+   */
+  typedef std::function<void(bool bDeliver)> Job;
+  /**
+   * @brief Called on the worker thread when a packet is due but none is queued
+   */
+  typedef std::function<void(REFERENCE_TIME tDuration)> UnderrunHandler;
+
+  struct Stats
+  {
+    uint64_t packets;
+    uint64_t underruns;
+    /// packets discarded because the queue was full
+    uint64_t dropped;
+    /// how late packets were released relative to the schedule
+    double meanLatenessUs;
+    double maxLatenessUs;
+  };
+
+  PacketPacer();
+  ~PacketPacer();
+  /**
+   * @brief Starts the worker thread
+   * @param tPrebuffer how long the first packet is held back
+   * @param uiMaxQueued packets beyond this are discarded oldest first
+   */
+  void start(REFERENCE_TIME tPrebuffer, size_t uiMaxQueued, UnderrunHandler onUnderrun = UnderrunHandler());
+  /**
+   * @brief Stops the worker thread and discards the queued packets
+   */
+  void stop();
+  /**
+   * @brief Sets the scheduling of the worker thread from the next start()
+   */
+  void setRealtimePolicy(const RealtimePolicy& policy) { m_realtimePolicy = policy; }
+  /**
+   * @brief Sets how long before a packet is due the worker stops trusting the sleep and spins. Call it while the pacer
+   * is stopped. A wider margin releases packets closer to the schedule where sleeps overshoot more, at the cost of a
+   * core spinning for that long per packet, e.g. 5% of a core for 1 ms at 20 ms packets.
+   */
+  void setSpinMargin(REFERENCE_TIME tSpinMargin);
+  /**
+   * @brief whether the policy could be applied to the running worker thread
+   */
+  bool isRealtime() const { return m_bRealtime; }
+  bool isRunning() const { return m_thread.joinable(); }
+  /**
+   * @brief Queues a packet
+   * @param tDuration the duration of the packet, i.e. the time until the next packet is due
+   */
+  void push(REFERENCE_TIME tDuration, Job job);
+  /**
+   * @brief Waits until all queued packets have been released, e.g. before the end of the stream is signalled
+   */
+  void drain();
+  /**
+   * @brief Discards the queued packets and restarts the schedule
+   */
+  void flush();
+  Stats getStats() const;
+
+  /// enough for the overshoot of a sleep at a 1 ms timer resolution or on an idle Linux core
+  static const REFERENCE_TIME DEFAULT_SPIN_MARGIN = 2500;
+
+private:
+  struct Item
+  {
+    REFERENCE_TIME tDuration;
+    Job job;
+  };
+  typedef std::chrono::steady_clock Clock;
+
+  void run();
+  /// sleeps until tDue, spinning for the last stretch because sleeps overshoot. Called with the lock held.
+  /// @return false if the wait was interrupted by stop() or flush()
+  bool waitUntil(std::unique_lock<std::mutex>& lock, Clock::time_point tDue);
+  /// discards the queue. Called with the lock held, the jobs are run after the lock is released.
+  std::deque<Item> takeQueue();
+
+  mutable std::mutex m_lock;
+  std::condition_variable m_cvWork;
+  std::condition_variable m_cvDrained;
+  std::thread m_thread;
+  bool m_bStop;
+  /// incremented by flush() to interrupt the schedule
+  uint64_t m_uiGeneration;
+
+  std::deque<Item> m_qPackets;
+  size_t m_uiMaxQueued;
+  Clock::duration m_tPrebuffer;
+  Clock::duration m_tSpinMargin;
+  UnderrunHandler m_onUnderrun;
+  RealtimePolicy m_realtimePolicy;
+  std::atomic<bool> m_bRealtime;
+  /// false until the first packet of the schedule has been queued
+  bool m_bScheduled;
+  Clock::time_point m_tNextDue;
+  REFERENCE_TIME m_tLastDuration;
+  /// true while a job is being run outside the lock
+  bool m_bDelivering;
+
+  Stats m_stats;
+  double m_dTotalLatenessUs;
+};
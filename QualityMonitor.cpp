@@ -0,0 +1,398 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: QualityMonitor.cpp
+
+DESCRIPTION			: Loopback encode-decode verification with quality metrics
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "QualityMonitor.h"
+#include <algorithm>
+#include <cmath>
+
+//Codec classes
+#include <OpusCodec/OpusFactory.h>
+#include <CodecUtils/ICodecv2.h>
+
+// number of frames that can be queued for the worker
+static const int JOB_QUEUE_SIZE = 50;
+// largest PCM frame: 60ms at 48kHz stereo
+static const int MAX_PCM_FRAME_BYTES = 48000 * 60 / 1000 * 2 * 2;
+// maximum decoder delay that is searched for
+static const int MAX_DELAY_MS = 20;
+// amount of audio used to estimate the decoder delay
+static const int DELAY_ESTIMATION_MS = 1000;
+// input history: must hold the delay plus the largest frame
+static const int INPUT_HISTORY_MS = 200;
+// frames that are excluded after the decoder has been restarted
+static const int WARMUP_FRAMES = 5;
+// windows below this mean power (-60 dBFS) are silent and excluded from the segmental metrics
+static const double SILENCE_POWER = 1e-6;
+static const double MIN_SEGMENT_SNR_DB = -10.0;
+static const double MAX_SEGMENT_SNR_DB = 35.0;
+
+QualityMonitor::QualityMonitor()
+  :m_pDecoder(nullptr),
+  m_iSamplesPerSecond(0),
+  m_iChannels(0),
+  m_vJobs(JOB_QUEUE_SIZE),
+  m_iReadPos(0),
+  m_iJobCount(0),
+  m_bRunning(false),
+  m_bResync(false),
+  m_iSamplePos(0),
+  m_iDelay(0),
+  m_bDelayEstimated(false),
+  m_stats(),
+  m_dSignalEnergy(0.0),
+  m_dNoiseEnergy(0.0),
+  m_dSegmentalSnrSum(0.0),
+  m_uiSegments(0),
+  m_dSpectralDistortionSum(0.0),
+  m_dEncodeMsSum(0.0),
+  m_uiProcessed(0)
+{
+}
+
+QualityMonitor::~QualityMonitor()
+{
+  close();
+}
+
+bool QualityMonitor::open(int samplesPerSecond, int channels)
+{
+  close();
+  m_iSamplesPerSecond = samplesPerSecond;
+  m_iChannels = channels;
+
+  OpusFactory factory;
+  m_pDecoder = factory.GetCodecInstance();
+  if (!m_pDecoder)
+  {
+    m_sLastError = "Unable to create Opus Decoder from Factory.";
+    return false;
+  }
+  m_pDecoder->SetParameter("samples_per_second", std::to_string(samplesPerSecond).c_str());
+  m_pDecoder->SetParameter("channels", std::to_string(channels).c_str());
+  m_pDecoder->SetParameter("bits_per_sample", "16");
+  if (!m_pDecoder->Open())
+  {
+    m_sLastError = m_pDecoder->GetErrorStr();
+    factory.ReleaseCodecInstance(m_pDecoder);
+    m_pDecoder = nullptr;
+    return false;
+  }
+
+  for (Job& job : m_vJobs)
+  {
+    job.pcm.reserve(MAX_PCM_FRAME_BYTES);
+    job.packet.reserve(MAX_PCM_FRAME_BYTES);
+  }
+  m_vDecoded.resize(MAX_PCM_FRAME_BYTES);
+  m_vInputHistory.assign(samplesPerSecond * INPUT_HISTORY_MS / 1000, 0.0f);
+  m_vDecodedHistory.clear();
+  m_vDecodedHistory.reserve(samplesPerSecond * DELAY_ESTIMATION_MS / 1000 + MAX_PCM_FRAME_BYTES);
+  m_iSamplePos = 0;
+  m_bDelayEstimated = false;
+  // until it has been estimated assume the default Opus lookahead of 6.5ms
+  m_iDelay = samplesPerSecond * 65 / 10000;
+
+  m_stats = Stats();
+  m_dSignalEnergy = m_dNoiseEnergy = m_dSegmentalSnrSum = m_dSpectralDistortionSum = m_dEncodeMsSum = 0.0;
+  m_uiSegments = m_uiProcessed = 0;
+  m_iReadPos = m_iJobCount = 0;
+  m_bResync = false;
+  m_bRunning = true;
+  m_worker = std::thread(&QualityMonitor::run, this);
+  return true;
+}
+
+void QualityMonitor::close()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_bRunning = false;
+  }
+  m_cond.notify_all();
+  if (m_worker.joinable()) m_worker.join();
+
+  if (m_pDecoder)
+  {
+    m_pDecoder->Close();
+    OpusFactory factory;
+    factory.ReleaseCodecInstance(m_pDecoder);
+    m_pDecoder = nullptr;
+  }
+}
+
+void QualityMonitor::submit(const uint8_t* pPcm, int iPcmBytes, const uint8_t* pPacket, int iPacketBytes, double dEncodeMs)
+{
+  if (iPcmBytes > MAX_PCM_FRAME_BYTES || iPacketBytes > MAX_PCM_FRAME_BYTES) return;
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_bRunning) return;
+    if (m_iJobCount == JOB_QUEUE_SIZE)
+    {
+      // the worker is behind: the decoder misses this packet and has to be resynchronised
+      ++m_stats.droppedFrames;
+      m_bResync = true;
+      return;
+    }
+    // the buffers have been reserved in open() so this does not allocate
+    Job& job = m_vJobs[(m_iReadPos + m_iJobCount) % JOB_QUEUE_SIZE];
+    job.pcm.assign(pPcm, pPcm + iPcmBytes);
+    job.packet.assign(pPacket, pPacket + iPacketBytes);
+    job.encodeMs = dEncodeMs;
+    ++m_iJobCount;
+  }
+  m_cond.notify_one();
+}
+
+QualityMonitor::Stats QualityMonitor::getStats() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  return m_stats;
+}
+
+void QualityMonitor::run()
+{
+  std::unique_lock<std::mutex> lock(m_lock);
+  while (true)
+  {
+    m_cond.wait(lock, [this] { return !m_bRunning || m_iJobCount > 0; });
+    if (!m_bRunning) break;
+    if (m_bResync)
+    {
+      m_bResync = false;
+      // drop what is queued: it no longer follows on from the decoder state
+      m_iReadPos = m_iJobCount = 0;
+      lock.unlock();
+      resync();
+      lock.lock();
+      continue;
+    }
+    Job& job = m_vJobs[m_iReadPos];
+    // the slot is not reused by submit() until m_iJobCount is decremented
+    lock.unlock();
+    process(job);
+    lock.lock();
+    m_iReadPos = (m_iReadPos + 1) % JOB_QUEUE_SIZE;
+    --m_iJobCount;
+  }
+}
+
+void QualityMonitor::resync()
+{
+  m_pDecoder->Close();
+  m_pDecoder->Open();
+  m_iSamplePos = 0;
+  std::fill(m_vInputHistory.begin(), m_vInputHistory.end(), 0.0f);
+  m_vDecodedHistory.clear();
+}
+
+void QualityMonitor::process(Job& job)
+{
+  const int iSamples = static_cast<int>(job.pcm.size()) / (2 * m_iChannels);
+  if (!m_pDecoder->Decode(job.packet.data(), static_cast<int>(job.packet.size()) * 8, m_vDecoded.data()))
+  {
+    return;
+  }
+
+  // downmix input and decoded audio to mono floats
+  const int16_t* pIn = reinterpret_cast<const int16_t*>(job.pcm.data());
+  const int16_t* pOut = reinterpret_cast<const int16_t*>(m_vDecoded.data());
+  m_vRef.resize(iSamples);
+  m_vDec.resize(iSamples);
+  const float scale = 1.0f / (32768.0f * m_iChannels);
+  const int iHistory = static_cast<int>(m_vInputHistory.size());
+  for (int i = 0; i < iSamples; ++i)
+  {
+    float in = 0.0f, out = 0.0f;
+    for (int c = 0; c < m_iChannels; ++c)
+    {
+      in += pIn[i * m_iChannels + c];
+      out += pOut[i * m_iChannels + c];
+    }
+    m_vInputHistory[(m_iSamplePos + i) % iHistory] = in * scale;
+    m_vDec[i] = out * scale;
+  }
+
+  if (!m_bDelayEstimated)
+  {
+    m_vDecodedHistory.insert(m_vDecodedHistory.end(), m_vDec.begin(), m_vDec.end());
+    if (static_cast<int>(m_vDecodedHistory.size()) >= m_iSamplesPerSecond * DELAY_ESTIMATION_MS / 1000)
+    {
+      estimateDelay();
+    }
+  }
+
+  // align: the decoded sample at position p corresponds to the input sample at p - delay
+  const int64_t iFirst = m_iSamplePos - m_iDelay;
+  const bool bWarmup = m_iSamplePos < static_cast<int64_t>(iSamples) * WARMUP_FRAMES;
+  if (m_bDelayEstimated && !bWarmup && iFirst >= 0)
+  {
+    for (int i = 0; i < iSamples; ++i)
+    {
+      m_vRef[i] = m_vInputHistory[(iFirst + i) % iHistory];
+    }
+    compareFrame(m_vRef.data(), m_vDec.data(), iSamples);
+  }
+  m_iSamplePos += iSamples;
+
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_dEncodeMsSum += job.encodeMs;
+  ++m_uiProcessed;
+  m_stats.encodeMs = m_dEncodeMsSum / m_uiProcessed;
+}
+
+void QualityMonitor::estimateDelay()
+{
+  // The input history only holds INPUT_HISTORY_MS, so correlate the most recent part of it against the
+  // decoded audio at the same positions. The current frame has been added to both histories.
+  const int iHistory = static_cast<int>(m_vInputHistory.size());
+  const int iMaxDelay = m_iSamplesPerSecond * MAX_DELAY_MS / 1000;
+  const int iDecoded = static_cast<int>(m_vDecodedHistory.size());
+  const int iLength = iHistory - iMaxDelay;
+  // absolute position of the oldest input sample in the history
+  const int64_t iStart = m_iSamplePos + static_cast<int64_t>(m_vDec.size()) - iHistory;
+
+  double dEnergy = 0.0;
+  for (int i = 0; i < iLength; ++i)
+  {
+    float in = m_vInputHistory[(iStart + i) % iHistory];
+    dEnergy += in * in;
+  }
+  // not enough signal to correlate: try again with the next second of audio
+  if (dEnergy < SILENCE_POWER * iLength)
+  {
+    m_vDecodedHistory.clear();
+    return;
+  }
+
+  double dBest = -1.0;
+  int iBestDelay = m_iDelay;
+  // index of the decoded sample at absolute position iStart
+  const int iOffset = iDecoded - iHistory;
+  for (int d = 0; d <= iMaxDelay; ++d)
+  {
+    double dCorr = 0.0, dDecEnergy = 0.0;
+    for (int i = 0; i < iLength; ++i)
+    {
+      // decoded sample at absolute position iStart + i + d matches input at iStart + i
+      float in = m_vInputHistory[(iStart + i) % iHistory];
+      float dec = m_vDecodedHistory[iOffset + i + d];
+      dCorr += in * dec;
+      dDecEnergy += dec * dec;
+    }
+    double dNormalised = (dDecEnergy > 0.0) ? dCorr / std::sqrt(dEnergy * dDecEnergy) : 0.0;
+    if (dNormalised > dBest)
+    {
+      dBest = dNormalised;
+      iBestDelay = d;
+    }
+  }
+  m_iDelay = iBestDelay;
+  m_bDelayEstimated = true;
+  m_vDecodedHistory.clear();
+  m_vDecodedHistory.shrink_to_fit();
+
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_stats.delaySamples = m_iDelay;
+}
+
+void QualityMonitor::compareFrame(const float* pRef, const float* pDec, int iSamples)
+{
+  double dSignal = 0.0, dNoise = 0.0;
+  for (int i = 0; i < iSamples; ++i)
+  {
+    double e = pRef[i] - pDec[i];
+    dSignal += pRef[i] * pRef[i];
+    dNoise += e * e;
+  }
+
+  bool bSilent = dSignal < SILENCE_POWER * iSamples;
+  double dSegmentSnr = 0.0, dDistortion = 0.0;
+  if (!bSilent)
+  {
+    dSegmentSnr = 10.0 * std::log10(dSignal / std::max(dNoise, 1e-12));
+    dSegmentSnr = std::min(std::max(dSegmentSnr, MIN_SEGMENT_SNR_DB), MAX_SEGMENT_SNR_DB);
+
+    // log-spectral distance over a Hann windowed, zero-padded window
+    int iFftSize = 2;
+    while (iFftSize < iSamples) iFftSize <<= 1;
+    if (!m_pFft || m_pFft->getSize() != iFftSize || static_cast<int>(m_vWindow.size()) != iSamples)
+    {
+      m_pFft = std::make_unique<Fft>(iFftSize);
+      m_vSpectrumRef.resize(iFftSize);
+      m_vSpectrumDec.resize(iFftSize);
+      m_vWindow.resize(iSamples);
+      const double PI = 3.14159265358979323846;
+      for (int i = 0; i < iSamples; ++i)
+      {
+        m_vWindow[i] = static_cast<float>(0.5 - 0.5 * std::cos(2.0 * PI * i / (iSamples - 1)));
+      }
+    }
+    std::fill(m_vSpectrumRef.begin(), m_vSpectrumRef.end(), std::complex<float>());
+    std::fill(m_vSpectrumDec.begin(), m_vSpectrumDec.end(), std::complex<float>());
+    for (int i = 0; i < iSamples; ++i)
+    {
+      m_vSpectrumRef[i] = pRef[i] * m_vWindow[i];
+      m_vSpectrumDec[i] = pDec[i] * m_vWindow[i];
+    }
+    m_pFft->forward(m_vSpectrumRef.data());
+    m_pFft->forward(m_vSpectrumDec.data());
+    // floor both spectra 60dB below the reference peak so that empty bins do not dominate the distance
+    double dPeak = 0.0;
+    for (int k = 1; k < iFftSize / 2; ++k)
+    {
+      dPeak = std::max(dPeak, static_cast<double>(std::norm(m_vSpectrumRef[k])));
+    }
+    const double dFloor = std::max(dPeak * 1e-6, 1e-20);
+    double dSum = 0.0;
+    for (int k = 1; k < iFftSize / 2; ++k)
+    {
+      double d = 10.0 * std::log10((std::norm(m_vSpectrumRef[k]) + dFloor) / (std::norm(m_vSpectrumDec[k]) + dFloor));
+      dSum += d * d;
+    }
+    dDistortion = std::sqrt(dSum / (iFftSize / 2 - 1));
+  }
+
+  std::lock_guard<std::mutex> lock(m_lock);
+  ++m_stats.frames;
+  m_dSignalEnergy += dSignal;
+  m_dNoiseEnergy += dNoise;
+  m_stats.snrDb = 10.0 * std::log10(std::max(m_dSignalEnergy, 1e-12) / std::max(m_dNoiseEnergy, 1e-12));
+  if (!bSilent)
+  {
+    ++m_uiSegments;
+    m_dSegmentalSnrSum += dSegmentSnr;
+    m_dSpectralDistortionSum += dDistortion;
+    m_stats.segmentalSnrDb = m_dSegmentalSnrSum / m_uiSegments;
+    m_stats.spectralDistortionDb = m_dSpectralDistortionSum / m_uiSegments;
+  }
+}
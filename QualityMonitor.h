@@ -0,0 +1,155 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: QualityMonitor.h
+
+DESCRIPTION			: Loopback encode-decode verification with quality metrics
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Fft.h"
+
+// Forward
+class ICodecv2;
+
+/**
+ * @brief Decodes every encoded packet on a worker thread and compares the decoded audio with the encoder input.
+ *
+ * The decoded audio lags the input by the encoder lookahead (pre-skip). The lag is estimated once by
+ * cross-correlation and then kept. Per window the monitor computes the SNR, the segmental SNR and the
+ * log-spectral distortion, and reports them together with the encode cost.
+ * submit() never blocks the encoder: if the worker falls behind frames are dropped and the decoder
+ * and alignment are resynchronised.
+ */
+class QualityMonitor
+{
+public:
+  struct Stats
+  {
+    /// number of frames that were compared
+    uint64_t frames;
+    /// number of frames that could not be queued
+    uint64_t droppedFrames;
+    double snrDb;
+    double segmentalSnrDb;
+    /// mean log-spectral distance in dB
+    double spectralDistortionDb;
+    /// mean encode time per frame
+    double encodeMs;
+    /// estimated decoder delay in samples
+    int delaySamples;
+  };
+
+  QualityMonitor();
+  ~QualityMonitor();
+  /**
+   * @brief opens the decoder and starts the worker thread
+   */
+  bool open(int samplesPerSecond, int channels);
+  /**
+   * @brief stops the worker thread and closes the decoder
+   */
+  void close();
+  bool isOpen() const { return m_bRunning; }
+  /**
+   * @brief queues one frame for verification
+   * @param pPcm The 16 bit PCM that was encoded
+   * @param iPcmBytes The size of the PCM frame
+   * @param pPacket The encoded packet
+   * @param iPacketBytes The size of the encoded packet
+   * @param dEncodeMs The time taken to encode the frame
+   */
+  void submit(const uint8_t* pPcm, int iPcmBytes, const uint8_t* pPacket, int iPacketBytes, double dEncodeMs);
+  Stats getStats() const;
+  const std::string& getLastError() const { return m_sLastError; }
+
+private:
+  struct Job
+  {
+    std::vector<uint8_t> pcm;
+    std::vector<uint8_t> packet;
+    double encodeMs;
+  };
+
+  QualityMonitor(const QualityMonitor&) = delete;
+  QualityMonitor& operator=(const QualityMonitor&) = delete;
+
+  void run();
+  void process(Job& job);
+  void estimateDelay();
+  void compareFrame(const float* pRef, const float* pDec, int iSamples);
+  void resync();
+
+  ICodecv2* m_pDecoder;
+  int m_iSamplesPerSecond;
+  int m_iChannels;
+  std::string m_sLastError;
+
+  // job ring shared with the worker
+  mutable std::mutex m_lock;
+  std::condition_variable m_cond;
+  std::vector<Job> m_vJobs;
+  int m_iReadPos;
+  int m_iJobCount;
+  bool m_bRunning;
+  bool m_bResync;
+  std::thread m_worker;
+
+  // worker state
+  std::vector<uint8_t> m_vDecoded;
+  /// mono input history indexed by absolute sample position modulo its size
+  std::vector<float> m_vInputHistory;
+  /// mono decoded audio used for the delay estimation
+  std::vector<float> m_vDecodedHistory;
+  int64_t m_iSamplePos;
+  int m_iDelay;
+  bool m_bDelayEstimated;
+  std::unique_ptr<Fft> m_pFft;
+  std::vector<std::complex<float>> m_vSpectrumRef;
+  std::vector<std::complex<float>> m_vSpectrumDec;
+  std::vector<float> m_vWindow;
+  std::vector<float> m_vRef;
+  std::vector<float> m_vDec;
+
+  // accumulated metrics, guarded by m_lock
+  Stats m_stats;
+  double m_dSignalEnergy;
+  double m_dNoiseEnergy;
+  double m_dSegmentalSnrSum;
+  uint64_t m_uiSegments;
+  double m_dSpectralDistortionSum;
+  double m_dEncodeMsSum;
+  uint64_t m_uiProcessed;
+};
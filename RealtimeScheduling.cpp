@@ -0,0 +1,356 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: RealtimeScheduling.cpp
+
+DESCRIPTION			: Real-time priority and CPU affinity for the encoding threads, deadline-miss tracking
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "RealtimeScheduling.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#include <avrt.h>
+#else
+#include <cerrno>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+/// priority of the SCHED_FIFO threads: above the default of most audio servers' clients, below the kernel's
+static const int FIFO_PRIORITY = 10;
+static const double HISTOGRAM_BIN_MS = 0.05;
+static const size_t HISTOGRAM_BINS = 4001;
+
+bool parseCoreSet(const std::string& sCores, std::vector<int>& vCores)
+{
+  std::vector<int> vResult;
+  size_t uiPos = 0;
+  while (uiPos < sCores.length())
+  {
+    size_t uiEnd = sCores.find(',', uiPos);
+    if (uiEnd == std::string::npos) uiEnd = sCores.length();
+    std::string sRange = sCores.substr(uiPos, uiEnd - uiPos);
+    uiPos = uiEnd + 1;
+    if (sRange.empty()) continue;
+
+    const char* szStart = sRange.c_str();
+    char* szNext = nullptr;
+    long lFirst = strtol(szStart, &szNext, 10);
+    if (szNext == szStart || lFirst < 0) return false;
+    long lLast = lFirst;
+    if (*szNext == '-')
+    {
+      const char* szLast = szNext + 1;
+      lLast = strtol(szLast, &szNext, 10);
+      if (szNext == szLast || lLast < lFirst) return false;
+    }
+    if (*szNext != '\0' || lLast >= 1024) return false;
+    for (long lCore = lFirst; lCore <= lLast; ++lCore)
+      vResult.push_back(static_cast<int>(lCore));
+  }
+  std::sort(vResult.begin(), vResult.end());
+  vResult.erase(std::unique(vResult.begin(), vResult.end()), vResult.end());
+  vCores = vResult;
+  return true;
+}
+
+#if defined(__linux__)
+/// glibc only wraps sched_setattr from 2.41 on
+struct SchedAttr
+{
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+};
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+static bool setDeadline(REFERENCE_TIME tRuntime, REFERENCE_TIME tPeriod)
+{
+  SchedAttr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.sched_policy = SCHED_DEADLINE;
+  attr.sched_runtime = static_cast<uint64_t>(tRuntime) * 100;
+  attr.sched_deadline = static_cast<uint64_t>(tPeriod) * 100;
+  attr.sched_period = attr.sched_deadline;
+  return syscall(SYS_sched_setattr, 0, &attr, 0) == 0;
+}
+#endif
+
+#ifndef _WIN32
+// Linux schedules threads: the sched_* calls act on the calling thread and, unlike the pthread_* calls whose
+// values glibc caches, see the policy set through sched_setattr
+static bool getSchedule(int& iPolicy, int& iPriority)
+{
+  sched_param param;
+  memset(&param, 0, sizeof(param));
+#if defined(__linux__)
+  iPolicy = sched_getscheduler(0);
+  if (iPolicy == -1 || sched_getparam(0, &param) != 0) return false;
+#else
+  if (pthread_getschedparam(pthread_self(), &iPolicy, &param) != 0) return false;
+#endif
+  iPriority = param.sched_priority;
+  return true;
+}
+
+/// identifies the calling thread to setSchedule from any thread
+static uint64_t getCurrentThread()
+{
+#if defined(__linux__)
+  return static_cast<uint64_t>(syscall(SYS_gettid));
+#else
+  return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(pthread_self()));
+#endif
+}
+
+/// @return 0 or the error number
+static int setSchedule(uint64_t uiThread, int iPolicy, int iPriority)
+{
+  sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = iPriority;
+#if defined(__linux__)
+  return sched_setscheduler(static_cast<pid_t>(uiThread), iPolicy, &param) == 0 ? 0 : errno;
+#else
+  return pthread_setschedparam(reinterpret_cast<pthread_t>(static_cast<uintptr_t>(uiThread)), iPolicy, &param);
+#endif
+}
+#endif
+
+#ifdef _WIN32
+RealtimeScope::RealtimeScope(const RealtimePolicy& policy)
+  :m_bRealtime(false),
+  m_bAffinity(false),
+  m_hThread(nullptr),
+  m_hMmcss(nullptr),
+  m_uiPreviousMask(0)
+{
+  // GetCurrentThread() is a pseudo handle that means the calling thread wherever it is used
+  HANDLE hThread = nullptr;
+  if (DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &hThread, 0, FALSE, DUPLICATE_SAME_ACCESS))
+    m_hThread = hThread;
+  else
+    m_sLastError = "DuplicateHandle failed";
+
+  if (!policy.vCores.empty() && m_hThread)
+  {
+    DWORD_PTR uiMask = 0;
+    for (int iCore : policy.vCores)
+    {
+      if (iCore < static_cast<int>(sizeof(DWORD_PTR) * 8))
+        uiMask |= static_cast<DWORD_PTR>(1) << iCore;
+    }
+    DWORD_PTR uiPrevious = uiMask ? SetThreadAffinityMask(GetCurrentThread(), uiMask) : 0;
+    if (uiPrevious)
+    {
+      m_uiPreviousMask = uiPrevious;
+      m_bAffinity = true;
+    }
+    else
+    {
+      m_sLastError = "SetThreadAffinityMask failed";
+    }
+  }
+
+  if (policy.eMode != RealtimeMode::RM_NONE)
+  {
+    DWORD dwTaskIndex = 0;
+    HANDLE hTask = AvSetMmThreadCharacteristicsW(L"Pro Audio", &dwTaskIndex);
+    if (hTask)
+    {
+      AvSetMmThreadPriority(hTask, AVRT_PRIORITY_HIGH);
+      m_hMmcss = hTask;
+      m_bRealtime = true;
+    }
+    else
+    {
+      m_sLastError = "AvSetMmThreadCharacteristics failed";
+    }
+  }
+}
+
+RealtimeScope::~RealtimeScope()
+{
+  if (m_hMmcss)
+    AvRevertMmThreadCharacteristics(m_hMmcss);
+  if (m_bAffinity)
+    SetThreadAffinityMask(m_hThread, static_cast<DWORD_PTR>(m_uiPreviousMask));
+  if (m_hThread)
+    CloseHandle(m_hThread);
+}
+#else
+RealtimeScope::RealtimeScope(const RealtimePolicy& policy)
+  :m_bRealtime(false),
+  m_bAffinity(false),
+  m_uiThread(getCurrentThread()),
+  m_iPreviousPolicy(SCHED_OTHER),
+  m_iPreviousPriority(0)
+{
+  bool bDeadline = false;
+#if defined(__linux__)
+  bDeadline = policy.eMode == RealtimeMode::RM_DEADLINE;
+
+  if (!policy.vCores.empty() && !bDeadline)
+  {
+    cpu_set_t previous;
+    CPU_ZERO(&previous);
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    for (int iCore : policy.vCores)
+    {
+      if (iCore < CPU_SETSIZE)
+        CPU_SET(iCore, &cores);
+    }
+    if (pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) == 0 &&
+      pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores) == 0)
+    {
+      const uint8_t* pPrevious = reinterpret_cast<const uint8_t*>(&previous);
+      m_vPreviousAffinity.assign(pPrevious, pPrevious + sizeof(previous));
+      m_bAffinity = true;
+    }
+    else
+    {
+      m_sLastError = "pthread_setaffinity_np failed";
+    }
+  }
+#endif
+
+  if (policy.eMode == RealtimeMode::RM_NONE)
+    return;
+
+  if (!getSchedule(m_iPreviousPolicy, m_iPreviousPriority))
+  {
+    m_sLastError = "Unable to query the scheduling policy";
+    return;
+  }
+
+#if defined(__linux__)
+  if (bDeadline)
+  {
+    if (setDeadline(policy.tRuntime, policy.tPeriod))
+    {
+      m_bRealtime = true;
+      return;
+    }
+    // fall back to SCHED_FIFO, e.g. when the kernel's admission control rejects the reservation
+    m_sLastError = std::string("sched_setattr failed: ") + strerror(errno);
+  }
+#endif
+
+  int iResult = setSchedule(m_uiThread, SCHED_FIFO, FIFO_PRIORITY);
+  if (iResult == 0)
+    m_bRealtime = true;
+  else
+    m_sLastError = std::string("Unable to set SCHED_FIFO: ") + strerror(iResult);
+}
+
+RealtimeScope::~RealtimeScope()
+{
+  if (m_bRealtime)
+    setSchedule(m_uiThread, m_iPreviousPolicy, m_iPreviousPriority);
+#if defined(__linux__)
+  if (m_bAffinity)
+  {
+    cpu_set_t previous;
+    memcpy(&previous, m_vPreviousAffinity.data(), sizeof(previous));
+    sched_setaffinity(static_cast<pid_t>(m_uiThread), sizeof(previous), &previous);
+  }
+#endif
+}
+#endif
+
+DeadlineTracker::DeadlineTracker()
+  :m_vHistogram(HISTOGRAM_BINS, 0),
+  m_uiFrames(0),
+  m_uiMisses(0),
+  m_dMaxMs(0.0)
+{
+}
+
+void DeadlineTracker::record(double dCompletionMs, double dDeadlineMs)
+{
+  size_t uiBin = std::min(static_cast<size_t>(std::max(dCompletionMs, 0.0) / HISTOGRAM_BIN_MS), HISTOGRAM_BINS - 1);
+  std::lock_guard<std::mutex> lock(m_lock);
+  ++m_vHistogram[uiBin];
+  ++m_uiFrames;
+  if (dCompletionMs > dDeadlineMs)
+    ++m_uiMisses;
+  m_dMaxMs = std::max(m_dMaxMs, dCompletionMs);
+}
+
+void DeadlineTracker::reset()
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  std::fill(m_vHistogram.begin(), m_vHistogram.end(), 0);
+  m_uiFrames = 0;
+  m_uiMisses = 0;
+  m_dMaxMs = 0.0;
+}
+
+DeadlineTracker::Stats DeadlineTracker::getStats() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  Stats stats;
+  stats.frames = m_uiFrames;
+  stats.misses = m_uiMisses;
+  stats.p99Ms = percentile(0.99);
+  stats.p999Ms = percentile(0.999);
+  stats.maxMs = m_dMaxMs;
+  return stats;
+}
+
+double DeadlineTracker::percentile(double dFraction) const
+{
+  if (m_uiFrames == 0) return 0.0;
+  uint64_t uiRank = static_cast<uint64_t>(dFraction * (m_uiFrames - 1)) + 1;
+  uint64_t uiCount = 0;
+  for (size_t i = 0; i < m_vHistogram.size(); ++i)
+  {
+    uiCount += m_vHistogram[i];
+    if (uiCount >= uiRank)
+    {
+      // upper edge of the bin, capped by the worst case for the overflow bin and sparse histograms
+      return std::min((i + 1) * HISTOGRAM_BIN_MS, m_dMaxMs);
+    }
+  }
+  return m_dMaxMs;
+}
@@ -0,0 +1,142 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: RealtimeScheduling.h
+
+DESCRIPTION			: Real-time priority and CPU affinity for the encoding threads, deadline-miss tracking
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "AudioBuffer.h"
+
+enum class RealtimeMode
+{
+  /// leave the thread as it is
+  RM_NONE,
+  /// MMCSS "Pro Audio" on Windows, SCHED_FIFO elsewhere
+  RM_REALTIME,
+  /// SCHED_DEADLINE on Linux with the frame duration as period, RM_REALTIME elsewhere
+  RM_DEADLINE
+};
+
+struct RealtimePolicy
+{
+  RealtimePolicy() :eMode(RealtimeMode::RM_NONE), tPeriod(200000), tRuntime(50000) {}
+  RealtimeMode eMode;
+  /// cores the thread may run on, empty for all
+  std::vector<int> vCores;
+  /// SCHED_DEADLINE period and runtime budget
+  REFERENCE_TIME tPeriod;
+  REFERENCE_TIME tRuntime;
+};
+
+/**
+ * @brief Parses a core set such as "0-3,6"
+ * @return false if the string is malformed
+ */
+bool parseCoreSet(const std::string& sCores, std::vector<int>& vCores);
+
+/**
+ * @brief Raises the scheduling of the current thread for the lifetime of the object and restores it afterwards.
+ *
+ * Meant to be held for as long as the thread streams, e.g. for the life of the pacer thread or from the first sample
+ * on the DirectShow streaming thread until streaming stops: the scheduling calls are made once per thread rather
+ * than per sample. The thread is restored when the object is destroyed, which may happen on another thread.
+ * Failures, e.g. missing privileges for SCHED_FIFO, leave the thread as it was and are reported by getLastError().
+ * SCHED_DEADLINE threads cannot be restricted to a subset of the cores: the core set is ignored in that mode.
+ */
+class RealtimeScope
+{
+public:
+  explicit RealtimeScope(const RealtimePolicy& policy);
+  ~RealtimeScope();
+  /// true if the priority was raised
+  bool isRealtime() const { return m_bRealtime; }
+  const std::string& getLastError() const { return m_sLastError; }
+
+private:
+  RealtimeScope(const RealtimeScope&) = delete;
+  RealtimeScope& operator=(const RealtimeScope&) = delete;
+
+  bool m_bRealtime;
+  bool m_bAffinity;
+  std::string m_sLastError;
+#ifdef _WIN32
+  /// the thread the policy was applied to
+  void* m_hThread;
+  void* m_hMmcss;
+  uint64_t m_uiPreviousMask;
+#else
+  /// the thread the policy was applied to: the thread id on Linux, the pthread_t elsewhere
+  uint64_t m_uiThread;
+  int m_iPreviousPolicy;
+  int m_iPreviousPriority;
+  /// cpu_set_t, kept opaque to keep <sched.h> out of the header
+  std::vector<uint8_t> m_vPreviousAffinity;
+#endif
+};
+
+/**
+ * @brief Counts the frames that were not encoded within their deadline and keeps a histogram of the
+ * completion times for percentiles.
+ */
+class DeadlineTracker
+{
+public:
+  struct Stats
+  {
+    uint64_t frames;
+    uint64_t misses;
+    double p99Ms;
+    double p999Ms;
+    double maxMs;
+  };
+
+  DeadlineTracker();
+  /**
+   * @param dCompletionMs time from the arrival of the audio until the frame was encoded
+   * @param dDeadlineMs the frame duration
+   */
+  void record(double dCompletionMs, double dDeadlineMs);
+  void reset();
+  Stats getStats() const;
+
+private:
+  double percentile(double dFraction) const;
+
+  mutable std::mutex m_lock;
+  /// 50 us bins, the last one collects everything beyond
+  std::vector<uint32_t> m_vHistogram;
+  uint64_t m_uiFrames;
+  uint64_t m_uiMisses;
+  double m_dMaxMs;
+};
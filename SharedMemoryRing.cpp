@@ -0,0 +1,345 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: SharedMemoryRing.cpp
+
+DESCRIPTION			: Lock-free packet ring in shared memory for handing packets to another process
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "SharedMemoryRing.h"
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+static_assert(sizeof(ShmRingHeader) == 256, "The shared memory header layout is part of the IPC protocol");
+static_assert(sizeof(ShmRecordHeader) == 32, "The record header layout is part of the IPC protocol");
+static_assert(sizeof(std::atomic<uint64_t>) == 8 && sizeof(std::atomic<uint32_t>) == 4, "Shared memory atomics must have the size of the plain integers");
+
+static const uint32_t RECORD_ALIGNMENT = sizeof(ShmRecordHeader);
+
+SharedMemorySegment::SharedMemorySegment()
+  :m_pData(nullptr),
+  m_uiSize(0),
+  m_bOwner(false)
+#ifdef _WIN32
+  , m_hMapping(NULL),
+  m_hEvent(NULL)
+#endif
+{
+}
+
+SharedMemorySegment::~SharedMemorySegment()
+{
+  unmap();
+}
+
+#ifdef _WIN32
+bool SharedMemorySegment::map(const std::string& sName, size_t uiSize, bool bCreate)
+{
+  unmap();
+  if (bCreate)
+  {
+    m_hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(uiSize) >> 32),
+      static_cast<DWORD>(uiSize), sName.c_str());
+    m_hEvent = CreateEventA(NULL, FALSE, FALSE, (sName + "_ready").c_str());
+  }
+  else
+  {
+    m_hMapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, sName.c_str());
+    m_hEvent = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (sName + "_ready").c_str());
+  }
+  if (m_hMapping == NULL || m_hEvent == NULL)
+  {
+    m_sLastError = "Unable to " + std::string(bCreate ? "create" : "open") + " shared memory " + sName;
+    unmap();
+    return false;
+  }
+  m_pData = static_cast<uint8_t*>(MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, bCreate ? uiSize : 0));
+  if (!m_pData)
+  {
+    m_sLastError = "Unable to map shared memory " + sName;
+    unmap();
+    return false;
+  }
+  if (!bCreate)
+  {
+    MEMORY_BASIC_INFORMATION info;
+    VirtualQuery(m_pData, &info, sizeof(info));
+    uiSize = info.RegionSize;
+  }
+  m_uiSize = uiSize;
+  m_sName = sName;
+  m_bOwner = bCreate;
+  return true;
+}
+
+void SharedMemorySegment::unmap()
+{
+  if (m_pData) UnmapViewOfFile(m_pData);
+  if (m_hMapping) CloseHandle(m_hMapping);
+  if (m_hEvent) CloseHandle(m_hEvent);
+  m_pData = nullptr;
+  m_hMapping = NULL;
+  m_hEvent = NULL;
+  m_uiSize = 0;
+}
+
+void SharedMemorySegment::signal(std::atomic<uint32_t>& sequence)
+{
+  SetEvent(m_hEvent);
+}
+
+void SharedMemorySegment::wait(std::atomic<uint32_t>& sequence, uint32_t uiSeen, uint32_t uiTimeoutMs)
+{
+  if (sequence.load() != uiSeen) return;
+  WaitForSingleObject(m_hEvent, uiTimeoutMs);
+}
+#else
+bool SharedMemorySegment::map(const std::string& sName, size_t uiSize, bool bCreate)
+{
+  unmap();
+  std::string sPath = "/" + sName;
+  int fd = shm_open(sPath.c_str(), bCreate ? (O_RDWR | O_CREAT) : O_RDWR, 0600);
+  if (fd == -1)
+  {
+    m_sLastError = "Unable to " + std::string(bCreate ? "create" : "open") + " shared memory " + sName;
+    return false;
+  }
+  struct stat st;
+  if (bCreate ? ftruncate(fd, uiSize) != 0 : fstat(fd, &st) != 0)
+  {
+    m_sLastError = "Unable to size shared memory " + sName;
+    ::close(fd);
+    return false;
+  }
+  if (!bCreate) uiSize = st.st_size;
+  void* pData = mmap(nullptr, uiSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (pData == MAP_FAILED)
+  {
+    m_sLastError = "Unable to map shared memory " + sName;
+    return false;
+  }
+  m_pData = static_cast<uint8_t*>(pData);
+  m_uiSize = uiSize;
+  m_sName = sPath;
+  m_bOwner = bCreate;
+  return true;
+}
+
+void SharedMemorySegment::unmap()
+{
+  if (m_pData)
+  {
+    munmap(m_pData, m_uiSize);
+    if (m_bOwner) shm_unlink(m_sName.c_str());
+  }
+  m_pData = nullptr;
+  m_uiSize = 0;
+}
+
+void SharedMemorySegment::signal(std::atomic<uint32_t>& sequence)
+{
+#ifdef __linux__
+  // not FUTEX_PRIVATE_FLAG: the waiter is in another process
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+void SharedMemorySegment::wait(std::atomic<uint32_t>& sequence, uint32_t uiSeen, uint32_t uiTimeoutMs)
+{
+#ifdef __linux__
+  struct timespec timeout;
+  timeout.tv_sec = uiTimeoutMs / 1000;
+  timeout.tv_nsec = (uiTimeoutMs % 1000) * 1000000L;
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAIT, uiSeen, &timeout, nullptr, 0);
+#else
+  // no portable cross-process wait: poll
+  auto tEnd = std::chrono::steady_clock::now() + std::chrono::milliseconds(uiTimeoutMs);
+  while (sequence.load() == uiSeen && std::chrono::steady_clock::now() < tEnd)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+#endif
+}
+#endif
+
+bool SharedMemoryRingWriter::open(const std::string& sName, uint32_t uiCapacity, uint32_t uiSamplesPerSecond, uint32_t uiChannels)
+{
+  uint32_t uiPowerOfTwo = 4096;
+  while (uiPowerOfTwo < uiCapacity) uiPowerOfTwo <<= 1;
+  if (!m_segment.map(sName, sizeof(ShmRingHeader) + uiPowerOfTwo, true)) return false;
+
+  ShmRingHeader* pHeader = getHeader();
+  std::memset(static_cast<void*>(pHeader), 0, sizeof(ShmRingHeader));
+  pHeader->headerSize = sizeof(ShmRingHeader);
+  pHeader->capacity = uiPowerOfTwo;
+  pHeader->samplesPerSecond = uiSamplesPerSecond;
+  pHeader->channels = uiChannels;
+  pHeader->writerEpoch = std::chrono::steady_clock::now().time_since_epoch().count();
+  pHeader->version = SHM_RING_VERSION;
+  // readers check the magic last
+  std::atomic_thread_fence(std::memory_order_release);
+  pHeader->magic = SHM_RING_MAGIC;
+  return true;
+}
+
+bool SharedMemoryRingWriter::write(const uint8_t* pData, uint32_t uiSize, int64_t tStart, int64_t tStop, uint64_t uiSequenceNumber)
+{
+  ShmRingHeader* pHeader = getHeader();
+  const uint64_t uiCapacity = pHeader->capacity;
+  const uint64_t uiRecord = (sizeof(ShmRecordHeader) + uiSize + RECORD_ALIGNMENT - 1) & ~static_cast<uint64_t>(RECORD_ALIGNMENT - 1);
+  uint64_t uiWritePos = pHeader->writePos.load(std::memory_order_relaxed);
+  uint64_t uiReadPos = pHeader->readPos.load(std::memory_order_acquire);
+  uint64_t uiOffset = uiWritePos & (uiCapacity - 1);
+  uint64_t uiToEnd = uiCapacity - uiOffset;
+  uint64_t uiNeeded = uiRecord + (uiToEnd < uiRecord ? uiToEnd : 0);
+  if (uiRecord > uiCapacity / 2 || uiWritePos + uiNeeded - uiReadPos > uiCapacity)
+  {
+    pHeader->droppedPackets.fetch_add(1);
+    return false;
+  }
+  uint8_t* pRing = m_segment.getData() + pHeader->headerSize;
+  if (uiToEnd < uiRecord)
+  {
+    ShmRecordHeader padding = { 0, SHM_RECORD_PADDING, 0, 0, 0 };
+    std::memcpy(pRing + uiOffset, &padding, sizeof(padding));
+    uiOffset = 0;
+  }
+  ShmRecordHeader record = { uiSize, 0, tStart, tStop, uiSequenceNumber };
+  std::memcpy(pRing + uiOffset, &record, sizeof(record));
+  std::memcpy(pRing + uiOffset + sizeof(record), pData, uiSize);
+  pHeader->writePos.store(uiWritePos + uiNeeded, std::memory_order_release);
+
+  pHeader->sequence.fetch_add(1);
+  // only pay for the system call if the reader is asleep
+  if (pHeader->readerWaiting.exchange(0) != 0)
+  {
+    m_segment.signal(pHeader->sequence);
+  }
+  return true;
+}
+
+uint64_t SharedMemoryRingWriter::getDroppedCount() const
+{
+  return isOpen() ? getHeader()->droppedPackets.load() : 0;
+}
+
+SharedMemoryRingReader::SharedMemoryRingReader()
+  :m_uiReadPos(0),
+  m_uiPeeked(0)
+{
+}
+
+bool SharedMemoryRingReader::open(const std::string& sName)
+{
+  if (!m_segment.map(sName, 0, false)) return false;
+  ShmRingHeader* pHeader = getHeader();
+  if (m_segment.getSize() < sizeof(ShmRingHeader) || pHeader->magic != SHM_RING_MAGIC || pHeader->version != SHM_RING_VERSION ||
+    m_segment.getSize() < static_cast<size_t>(pHeader->headerSize) + pHeader->capacity)
+  {
+    m_segment.unmap();
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  m_uiReadPos = pHeader->writePos.load(std::memory_order_acquire);
+  pHeader->readPos.store(m_uiReadPos, std::memory_order_release);
+  m_uiPeeked = 0;
+  return true;
+}
+
+bool SharedMemoryRingReader::peek(PacketView& packet)
+{
+  ShmRingHeader* pHeader = getHeader();
+  const uint64_t uiCapacity = pHeader->capacity;
+  const uint8_t* pRing = m_segment.getData() + pHeader->headerSize;
+  for (;;)
+  {
+    if (m_uiReadPos == pHeader->writePos.load(std::memory_order_acquire)) return false;
+    uint64_t uiOffset = m_uiReadPos & (uiCapacity - 1);
+    ShmRecordHeader record;
+    std::memcpy(&record, pRing + uiOffset, sizeof(record));
+    if (record.flags & SHM_RECORD_PADDING)
+    {
+      m_uiReadPos += uiCapacity - uiOffset;
+      pHeader->readPos.store(m_uiReadPos, std::memory_order_release);
+      continue;
+    }
+    packet.pData = pRing + uiOffset + sizeof(record);
+    packet.uiSize = record.size;
+    packet.tStart = record.startTime;
+    packet.tStop = record.stopTime;
+    packet.uiSequenceNumber = record.sequenceNumber;
+    m_uiPeeked = (sizeof(ShmRecordHeader) + record.size + RECORD_ALIGNMENT - 1) & ~static_cast<uint64_t>(RECORD_ALIGNMENT - 1);
+    return true;
+  }
+}
+
+void SharedMemoryRingReader::consume()
+{
+  m_uiReadPos += m_uiPeeked;
+  m_uiPeeked = 0;
+  getHeader()->readPos.store(m_uiReadPos, std::memory_order_release);
+}
+
+bool SharedMemoryRingReader::wait(uint32_t uiTimeoutMs)
+{
+  ShmRingHeader* pHeader = getHeader();
+  const auto tEnd = std::chrono::steady_clock::now() + std::chrono::milliseconds(uiTimeoutMs);
+  for (;;)
+  {
+    if (m_uiReadPos != pHeader->writePos.load(std::memory_order_acquire)) return true;
+    const auto tNow = std::chrono::steady_clock::now();
+    if (tNow >= tEnd) return false;
+    uint32_t uiSeen = pHeader->sequence.load();
+    pHeader->readerWaiting.store(1);
+    // re-check after announcing the wait: the writer may have published in between
+    if (m_uiReadPos == pHeader->writePos.load())
+    {
+      // the wake of an earlier packet may arrive late: sleep again until the timeout has really elapsed
+      const auto uiRemainingMs = std::chrono::duration_cast<std::chrono::milliseconds>(tEnd - tNow).count() + 1;
+      m_segment.wait(pHeader->sequence, uiSeen, static_cast<uint32_t>(uiRemainingMs));
+    }
+    pHeader->readerWaiting.store(0);
+  }
+}
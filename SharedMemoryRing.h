@@ -0,0 +1,219 @@
+/** @file
+
+MODULE				: OpusEncoderFilter
+
+FILE NAME			: SharedMemoryRing.h
+
+DESCRIPTION			: Lock-free packet ring in shared memory for handing packets to another process
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * Shared memory layout, version 1. All integers are little endian, all offsets in bytes.
+ *
+ * The segment is named "<name>" (Win32 file mapping in the session namespace; POSIX shm object "/<name>").
+ * On Windows the writer additionally creates the auto-reset event "<name>_ready".
+ *
+ * Offset 0: ShmRingHeader (256 bytes)
+ *   0   uint32 magic            'OPSR' (0x5253504F)
+ *   4   uint32 version          1
+ *   8   uint32 headerSize       256: the data area starts here
+ *   12  uint32 capacity         size of the data area, a power of two
+ *   16  uint32 samplesPerSecond of the encoded stream
+ *   20  uint32 channels
+ *   24  uint64 writerEpoch      changes whenever a writer (re)initialises the segment
+ *   64  uint64 writePos         total bytes written, published after the record is complete (release)
+ *   128 uint64 readPos          total bytes consumed, updated by the single reader (release)
+ *   136 uint64 droppedPackets   packets the writer discarded because the reader was too slow
+ *   192 uint32 sequence         incremented by the writer after every record: the futex word on Linux
+ *   196 uint32 readerWaiting    set by the reader before it sleeps so that the writer only signals when needed
+ *
+ * Offset headerSize: data area of capacity bytes holding records at (pos % capacity). Each record is
+ *   0   uint32 size             payload size in bytes
+ *   4   uint32 flags            SHM_RECORD_PADDING: skip to the start of the data area
+ *   8   int64  startTime        100ns units
+ *   16  int64  stopTime         100ns units
+ *   24  uint64 sequenceNumber   of the packet
+ *   32  payload, padded so that the record size is a multiple of 32 bytes
+ * A record never wraps: if it does not fit before the end of the data area, a padding record fills the rest.
+ * A reader that finds writerEpoch changed must reopen the segment.
+ */
+#define SHM_RING_MAGIC 0x5253504F
+#define SHM_RING_VERSION 1
+#define SHM_RECORD_PADDING 1
+
+struct ShmRingHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t headerSize;
+  uint32_t capacity;
+  uint32_t samplesPerSecond;
+  uint32_t channels;
+  uint64_t writerEpoch;
+  uint8_t reserved0[32];
+  alignas(64) std::atomic<uint64_t> writePos;
+  uint8_t reserved1[56];
+  alignas(64) std::atomic<uint64_t> readPos;
+  std::atomic<uint64_t> droppedPackets;
+  uint8_t reserved2[48];
+  alignas(64) std::atomic<uint32_t> sequence;
+  std::atomic<uint32_t> readerWaiting;
+  uint8_t reserved3[56];
+};
+
+struct ShmRecordHeader
+{
+  uint32_t size;
+  uint32_t flags;
+  int64_t startTime;
+  int64_t stopTime;
+  uint64_t sequenceNumber;
+};
+
+/**
+ * @brief Maps a named shared memory segment and signals readiness across processes
+ */
+class SharedMemorySegment
+{
+public:
+  SharedMemorySegment();
+  ~SharedMemorySegment();
+  /**
+   * @brief Creates (bCreate) or opens the segment
+   * @return false on error in which case getLastError() describes the error
+   */
+  bool map(const std::string& sName, size_t uiSize, bool bCreate);
+  void unmap();
+  bool isMapped() const { return m_pData != nullptr; }
+  uint8_t* getData() const { return m_pData; }
+  size_t getSize() const { return m_uiSize; }
+  const std::string& getLastError() const { return m_sLastError; }
+  /**
+   * @brief Wakes a reader that is sleeping on the sequence word
+   */
+  void signal(std::atomic<uint32_t>& sequence);
+  /**
+   * @brief Sleeps until the sequence word differs from uiSeen or the timeout elapses
+   */
+  void wait(std::atomic<uint32_t>& sequence, uint32_t uiSeen, uint32_t uiTimeoutMs);
+
+private:
+  SharedMemorySegment(const SharedMemorySegment&) = delete;
+  SharedMemorySegment& operator=(const SharedMemorySegment&) = delete;
+
+  uint8_t* m_pData;
+  size_t m_uiSize;
+  std::string m_sName;
+  bool m_bOwner;
+  std::string m_sLastError;
+#ifdef _WIN32
+  void* m_hMapping;
+  void* m_hEvent;
+#endif
+};
+
+/**
+ * @brief Single producer side of the ring. Never blocks: packets that don't fit are dropped and counted.
+ */
+class SharedMemoryRingWriter
+{
+public:
+  /**
+   * @brief Creates the segment
+   * @param uiCapacity The size of the data area, rounded up to a power of two
+   */
+  bool open(const std::string& sName, uint32_t uiCapacity, uint32_t uiSamplesPerSecond, uint32_t uiChannels);
+  void close() { m_segment.unmap(); }
+  bool isOpen() const { return m_segment.isMapped(); }
+  const std::string& getLastError() const { return m_segment.getLastError(); }
+  /**
+   * @brief Copies a packet into the ring and wakes the reader if it is waiting
+   * @return false if the packet was dropped because the ring is full
+   */
+  bool write(const uint8_t* pData, uint32_t uiSize, int64_t tStart, int64_t tStop, uint64_t uiSequenceNumber);
+  uint64_t getDroppedCount() const;
+
+private:
+  ShmRingHeader* getHeader() const { return reinterpret_cast<ShmRingHeader*>(m_segment.getData()); }
+
+  SharedMemorySegment m_segment;
+};
+
+/**
+ * @brief Single consumer side of the ring. Packets are read in place without copying.
+ */
+class SharedMemoryRingReader
+{
+public:
+  struct PacketView
+  {
+    const uint8_t* pData;
+    uint32_t uiSize;
+    int64_t tStart;
+    int64_t tStop;
+    uint64_t uiSequenceNumber;
+  };
+
+  SharedMemoryRingReader();
+  /**
+   * @brief Opens an existing segment and skips any packets that are already in the ring
+   * @return false if the segment does not exist or has an unsupported layout
+   */
+  bool open(const std::string& sName);
+  void close() { m_segment.unmap(); }
+  const std::string& getLastError() const { return m_segment.getLastError(); }
+  /**
+   * @brief Looks at the next packet without consuming it
+   * @return false if the ring is empty
+   */
+  bool peek(PacketView& packet);
+  /**
+   * @brief Releases the packet returned by peek so that the writer can reuse its space
+   */
+  void consume();
+  /**
+   * @brief Waits up to uiTimeoutMs for a packet
+   * @return false on timeout
+   */
+  bool wait(uint32_t uiTimeoutMs);
+  uint32_t getSamplesPerSecond() const { return getHeader()->samplesPerSecond; }
+  uint32_t getChannels() const { return getHeader()->channels; }
+  uint64_t getDroppedCount() const { return getHeader()->droppedPackets.load(); }
+
+private:
+  ShmRingHeader* getHeader() const { return reinterpret_cast<ShmRingHeader*>(m_segment.getData()); }
+
+  SharedMemorySegment m_segment;
+  uint64_t m_uiReadPos;
+  /// size of the record returned by peek
+  uint64_t m_uiPeeked;
+};
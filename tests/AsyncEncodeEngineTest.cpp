@@ -0,0 +1,176 @@
+/** @file
+
+MODULE				: tests
+
+FILE NAME			: AsyncEncodeEngineTest.cpp
+
+DESCRIPTION			: Tests of the coroutine interface of the encode engine
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "AsyncEncodeEngine.h"
+#include "TestCheck.h"
+
+#ifdef OPUS_ENCODER_HAS_COROUTINES
+#include <deque>
+#include <memory>
+
+static const int SAMPLES_PER_SECOND = 48000;
+// mono 16 bit
+static const int BYTES_PER_FRAME = SAMPLES_PER_SECOND / 50 * 2;
+static const REFERENCE_TIME FRAME_DURATION = 200000;
+
+/**
+ * @brief Single-threaded executor: the posted coroutines run when the test drains the queue
+ */
+struct QueueExecutor
+{
+  std::deque<std::coroutine_handle<>>* pQueue;
+  void post(std::coroutine_handle<> h) { pQueue->push_back(h); }
+};
+
+static void runQueue(std::deque<std::coroutine_handle<>>& dqQueue)
+{
+  while (!dqQueue.empty())
+  {
+    std::coroutine_handle<> h = dqQueue.front();
+    dqQueue.pop_front();
+    h.resume();
+  }
+}
+
+typedef AsyncEncodeEngine<QueueExecutor> Engine;
+
+static AsyncTask produce(Engine& engine, const std::vector<uint8_t>& vData, int iFrames, int& iAccepted)
+{
+  for (int i = 0; i < iFrames; ++i)
+  {
+    const REFERENCE_TIME tStart = i * FRAME_DURATION;
+    if (co_await engine.push(vData.data(), BYTES_PER_FRAME, tStart, tStart + FRAME_DURATION)) ++iAccepted;
+  }
+}
+
+static AsyncTask consume(Engine& engine, int iPackets, std::vector<AsyncPacket>& vPackets)
+{
+  for (int i = 0; i < iPackets; ++i)
+  {
+    AsyncPacket packet = co_await engine.next_packet();
+    vPackets.push_back(packet);
+    if (packet.eStatus != AsyncPacket::Status::AP_OK) break;
+  }
+}
+
+/**
+ * @brief Every pushed frame comes out as a packet in order, although the producer is suspended by the backpressure
+ */
+static void testPushAndNextPacket()
+{
+  std::deque<std::coroutine_handle<>> dqQueue;
+  Engine engine(QueueExecutor{ &dqQueue }, 2, 2);
+  CHECK(engine.open(SAMPLES_PER_SECOND, 1, 16, 64));
+  std::vector<uint8_t> vData(BYTES_PER_FRAME, 1);
+  int iAccepted = 0;
+  std::vector<AsyncPacket> vPackets;
+  produce(engine, vData, 10, iAccepted);
+  consume(engine, 10, vPackets);
+  runQueue(dqQueue);
+  CHECK(iAccepted == 10);
+  CHECK(vPackets.size() == 10);
+  for (size_t i = 0; i < vPackets.size(); ++i)
+  {
+    CHECK(vPackets[i].eStatus == AsyncPacket::Status::AP_OK && vPackets[i].iSize > 1);
+    CHECK(vPackets[i].tStart == static_cast<REFERENCE_TIME>(i) * FRAME_DURATION);
+  }
+}
+
+/**
+ * @brief cancel() resumes the waiting consumer with a cancelled result and later pushes are refused
+ */
+static void testCancel()
+{
+  std::deque<std::coroutine_handle<>> dqQueue;
+  Engine engine(QueueExecutor{ &dqQueue });
+  CHECK(engine.open(SAMPLES_PER_SECOND, 1, 16, 64));
+  std::vector<AsyncPacket> vPackets;
+  consume(engine, 1, vPackets);
+  runQueue(dqQueue);
+  CHECK(vPackets.empty());
+  engine.cancel();
+  runQueue(dqQueue);
+  CHECK(vPackets.size() == 1 && vPackets[0].eStatus == AsyncPacket::Status::AP_CANCELLED);
+  std::vector<uint8_t> vData(BYTES_PER_FRAME, 1);
+  int iAccepted = 0;
+  produce(engine, vData, 1, iAccepted);
+  runQueue(dqQueue);
+  CHECK(iAccepted == 0);
+}
+
+/**
+ * @brief The engine can be destroyed on the thread of a single-threaded executor while an encoding pass is queued
+ * on it: the pass ends without touching the engine once it runs
+ */
+static void testDestroyWhilePassQueued()
+{
+  std::deque<std::coroutine_handle<>> dqQueue;
+  auto pEngine = std::make_unique<Engine>(QueueExecutor{ &dqQueue });
+  CHECK(pEngine->open(SAMPLES_PER_SECOND, 1, 16, 64));
+  std::vector<uint8_t> vData(BYTES_PER_FRAME, 1);
+  int iAccepted = 0;
+  produce(*pEngine, vData, 1, iAccepted);
+  CHECK(iAccepted == 1);
+  // the frame has queued the encoding pass
+  CHECK(dqQueue.size() == 1);
+  pEngine.reset();
+  runQueue(dqQueue);
+}
+
+/**
+ * @brief An idle encoder is destroyed with the engine
+ */
+static void testDestroyIdle()
+{
+  std::deque<std::coroutine_handle<>> dqQueue;
+  auto pEngine = std::make_unique<Engine>(QueueExecutor{ &dqQueue });
+  CHECK(pEngine->open(SAMPLES_PER_SECOND, 1, 16, 64));
+  pEngine.reset();
+  CHECK(dqQueue.empty());
+}
+
+int main()
+{
+  RUN_TEST(testPushAndNextPacket);
+  RUN_TEST(testCancel);
+  RUN_TEST(testDestroyWhilePassQueued);
+  RUN_TEST(testDestroyIdle);
+  return failedChecks() == 0 ? 0 : 1;
+}
+#else
+int main()
+{
+  printf("AsyncEncodeEngine requires C++20 coroutines\n");
+  return 1;
+}
+#endif
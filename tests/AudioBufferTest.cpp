@@ -0,0 +1,140 @@
+/** @file
+
+MODULE				: tests
+
+FILE NAME			: AudioBufferTest.cpp
+
+DESCRIPTION			: Tests of the framing buffers
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include "AudioBuffer.h"
+#include "TestCheck.h"
+
+// 48 kHz mono 16 bit: 1920 bytes per 20 ms frame
+static const int SAMPLES_PER_SECOND = 48000;
+static const int BYTES_PER_FRAME = 1920;
+// written after the storage of the buffer to catch writes past its end
+static const int GUARD_BYTES = 4096;
+static const uint8_t GUARD = 0xAB;
+
+static REFERENCE_TIME bytesTo100ns(int iBytes)
+{
+  return static_cast<REFERENCE_TIME>(iBytes) * 10000000 / (SAMPLES_PER_SECOND * 2);
+}
+
+static bool isGuardIntact(const std::vector<uint8_t>& vStorage, int iCapacity)
+{
+  for (size_t i = iCapacity; i < vStorage.size(); ++i)
+  {
+    if (vStorage[i] != GUARD) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief A discontinuous sample that fits the free space, but not after the partial frame has been padded for the new
+ * segment, must be rejected instead of being written past the end of the buffer
+ */
+static void testGapPaddingDoesNotOverflow()
+{
+  const int iCapacity = 2 * BYTES_PER_FRAME + 160;
+  std::vector<uint8_t> vStorage(iCapacity + GUARD_BYTES, GUARD);
+  AudioBuffer buffer(SAMPLES_PER_SECOND, 1, 16, vStorage.data(), iCapacity);
+  buffer.setGapPolicy(GapPolicy::GP_SIGNAL_LOSS, 10 * 10000LL, 1000 * 10000LL);
+  // a frame and 100 bytes: within one frame of full once the partial frame is padded
+  std::vector<uint8_t> vData(BYTES_PER_FRAME + 100, 1);
+  CHECK(buffer.addAudioData(vData.data(), static_cast<uint32_t>(vData.size()), 0, bytesTo100ns(static_cast<int>(vData.size()))) == 1);
+  // fits the 2140 free bytes, but the new segment pads 1820 bytes first
+  std::vector<uint8_t> vLate(300, 2);
+  const REFERENCE_TIME tLate = 10000000;
+  CHECK(buffer.addAudioData(vLate.data(), static_cast<uint32_t>(vLate.size()), tLate, tLate + bytesTo100ns(300)) == -1);
+  CHECK(isGuardIntact(vStorage, iCapacity));
+  CHECK(buffer.reserveAudioData(300, tLate) == nullptr);
+  CHECK(isGuardIntact(vStorage, iCapacity));
+
+  // the buffered segment is intact and the new one starts once there is room
+  REFERENCE_TIME tStart, tStop;
+  uint8_t* pFrame = nullptr;
+  CHECK(buffer.readNextAudioFrame(tStart, tStop, pFrame) && tStart == 0);
+  CHECK(buffer.readNextAudioFrame(tStart, tStop, pFrame) && tStart == bytesTo100ns(BYTES_PER_FRAME) && pFrame[99] == 1 && pFrame[100] == 0);
+  CHECK(!buffer.readNextAudioFrame(tStart, tStop, pFrame));
+  std::vector<uint8_t> vNext(BYTES_PER_FRAME, 3);
+  CHECK(buffer.addAudioData(vNext.data(), BYTES_PER_FRAME, tLate, tLate + bytesTo100ns(BYTES_PER_FRAME)) == 1);
+  CHECK(buffer.readNextAudioFrame(tStart, tStop, pFrame) && tStart == tLate && pFrame[0] == 3);
+  CHECK(buffer.takeDiscontinuity());
+  CHECK(isGuardIntact(vStorage, iCapacity));
+}
+
+/**
+ * @brief The same with the silence fill: a gap that is too long to fill starts a new segment as well
+ */
+static void testSilenceFillDoesNotOverflow()
+{
+  const int iCapacity = 2 * BYTES_PER_FRAME + 160;
+  std::vector<uint8_t> vStorage(iCapacity + GUARD_BYTES, GUARD);
+  AudioBuffer buffer(SAMPLES_PER_SECOND, 1, 16, vStorage.data(), iCapacity);
+  buffer.setGapPolicy(GapPolicy::GP_FILL_SILENCE, 10 * 10000LL, 1000 * 10000LL);
+  std::vector<uint8_t> vData(BYTES_PER_FRAME + 100, 1);
+  buffer.addAudioData(vData.data(), static_cast<uint32_t>(vData.size()), 0, bytesTo100ns(static_cast<int>(vData.size())));
+  // 500 ms doesn't fit as silence
+  std::vector<uint8_t> vLate(300, 2);
+  const REFERENCE_TIME tLate = bytesTo100ns(static_cast<int>(vData.size())) + 5000000;
+  CHECK(buffer.addAudioData(vLate.data(), static_cast<uint32_t>(vLate.size()), tLate, tLate + bytesTo100ns(300)) == -1);
+  CHECK(isGuardIntact(vStorage, iCapacity));
+}
+
+/**
+ * @brief createAudioBuffer picks the final class for the format and visitAudioBuffer reaches it, also after a generic
+ * buffer has taken over another frame duration
+ */
+static void testVisitReachesFinalClass()
+{
+  std::unique_ptr<IAudioBuffer> pStereo = createAudioBuffer(48000, 2, 16, OpusFrameDuration::OFD_20_MS);
+  CHECK(pStereo->getKind() == AudioBufferKind::ABK_48000_2_20_MS);
+  CHECK(visitAudioBuffer(*pStereo, pStereo->getKind(), [](auto& buffer) { return std::is_same<std::decay_t<decltype(buffer)>, StereoAudioBuffer48k>::value; }));
+  CHECK(!pStereo->setFrameDuration(OpusFrameDuration::OFD_40_MS));
+
+  std::unique_ptr<IAudioBuffer> pMono = createAudioBuffer(16000, 1, 16, OpusFrameDuration::OFD_20_MS);
+  CHECK(pMono->getKind() == AudioBufferKind::ABK_16000_1_20_MS);
+  CHECK(visitAudioBuffer(*pMono, pMono->getKind(), [](auto& buffer) { return buffer.getBytesPerFrame(); }) == 320 * 2);
+
+  std::unique_ptr<IAudioBuffer> pGeneric = createAudioBuffer(48000, 2, 16, OpusFrameDuration::OFD_40_MS);
+  CHECK(pGeneric->getKind() == AudioBufferKind::ABK_GENERIC);
+  CHECK(visitAudioBuffer(*pGeneric, pGeneric->getKind(), [](auto& buffer) { return std::is_same<std::decay_t<decltype(buffer)>, AudioBuffer>::value; }));
+  CHECK(visitAudioBuffer(*pGeneric, pGeneric->getKind(), [](auto& buffer) { return buffer.getBytesPerFrame(); }) == 1920 * 2 * 2);
+}
+
+int main()
+{
+  RUN_TEST(testGapPaddingDoesNotOverflow);
+  RUN_TEST(testSilenceFillDoesNotOverflow);
+  RUN_TEST(testVisitReachesFinalClass);
+  return failedChecks() == 0 ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+/** @file
+
+MODULE				: tests
+
+FILE NAME			: CheckpointWriterTest.cpp
+
+DESCRIPTION			: Tests of the checkpoint writer
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <cstdio>
+#include <vector>
+#include "EncoderCheckpoint.h"
+#include "TestCheck.h"
+
+static const char* CHECKPOINT_PATH = "CheckpointWriterTest.ckpt";
+
+/**
+ * @brief The checkpoint submitted last is in the file once the writer has stopped
+ */
+static void testLastSubmittedIsWritten()
+{
+  std::remove(CHECKPOINT_PATH);
+  CheckpointWriter writer;
+  writer.start(CHECKPOINT_PATH);
+  std::vector<uint8_t>* pBuffer = writer.getSpareBuffer();
+  CHECK(pBuffer != nullptr && pBuffer->empty());
+  pBuffer->assign(100, 1);
+  writer.submit();
+  writer.stop();
+  CHECK(!writer.isRunning());
+  std::vector<uint8_t> vData;
+  CHECK(EncoderCheckpoint::readFile(CHECKPOINT_PATH, vData));
+  CHECK(vData == std::vector<uint8_t>(100, 1));
+  const CheckpointWriter::Stats stats = writer.getStats();
+  CHECK(stats.written == 1 && stats.dropped == 0 && stats.failed == 0);
+  CHECK(stats.bytes == 100);
+  std::remove(CHECKPOINT_PATH);
+}
+
+/**
+ * @brief Every checkpoint is either written or dropped while the previous one is still being written, and the
+ * spare buffer never holds the checkpoint being written
+ */
+static void testWrittenOrDropped()
+{
+  const uint32_t CHECKPOINTS = 200;
+  std::remove(CHECKPOINT_PATH);
+  CheckpointWriter writer;
+  writer.start(CHECKPOINT_PATH);
+  uint8_t uiLast = 0;
+  for (uint32_t i = 0; i < CHECKPOINTS; ++i)
+  {
+    std::vector<uint8_t>* pBuffer = writer.getSpareBuffer();
+    if (!pBuffer) continue;
+    CHECK(pBuffer->empty());
+    uiLast = static_cast<uint8_t>(i);
+    pBuffer->assign(4096, uiLast);
+    writer.submit();
+  }
+  writer.stop();
+  const CheckpointWriter::Stats stats = writer.getStats();
+  CHECK(stats.written + stats.dropped == CHECKPOINTS);
+  CHECK(stats.failed == 0);
+  std::vector<uint8_t> vData;
+  CHECK(EncoderCheckpoint::readFile(CHECKPOINT_PATH, vData));
+  CHECK(vData == std::vector<uint8_t>(4096, uiLast));
+  std::remove(CHECKPOINT_PATH);
+}
+
+/**
+ * @brief A checkpoint that can't be written is counted as failed, and a restart resets the counts
+ */
+static void testFailedWrite()
+{
+  CheckpointWriter writer;
+  writer.start("no/such/directory/checkpoint");
+  writer.getSpareBuffer()->assign(10, 0);
+  writer.submit();
+  writer.stop();
+  CheckpointWriter::Stats stats = writer.getStats();
+  CHECK(stats.written == 0 && stats.failed == 1);
+  writer.start(CHECKPOINT_PATH);
+  stats = writer.getStats();
+  CHECK(stats.written == 0 && stats.failed == 0 && stats.dropped == 0);
+  writer.stop();
+}
+
+int main()
+{
+  RUN_TEST(testLastSubmittedIsWritten);
+  RUN_TEST(testWrittenOrDropped);
+  RUN_TEST(testFailedWrite);
+  return failedChecks() == 0 ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/** @file
+
+MODULE				: tests
+
+FILE NAME			: EncodeEngineTest.cpp
+
+DESCRIPTION			: Tests of the encode engine
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <cstring>
+#include <vector>
+#include "OpusEncodeEngine.h"
+#include "TestCheck.h"
+
+static const int SAMPLES_PER_SECOND = 48000;
+static const REFERENCE_TIME MS = 10000;
+
+/// mono 16 bit audio of ms milliseconds in which every sample is iValue
+static std::vector<uint8_t> constantAudio(int ms, int16_t iValue)
+{
+  std::vector<int16_t> vSamples(SAMPLES_PER_SECOND / 1000 * ms, iValue);
+  std::vector<uint8_t> vData(vSamples.size() * sizeof(int16_t));
+  memcpy(vData.data(), vSamples.data(), vData.size());
+  return vData;
+}
+
+/// the value of every sample of the frame or -1 if the frame mixes values
+static int frameValue(const uint8_t* pFrame, int iBytes)
+{
+  int16_t iFirst;
+  memcpy(&iFirst, pFrame, sizeof(int16_t));
+  for (int i = 0; i < iBytes; i += sizeof(int16_t))
+  {
+    int16_t iSample;
+    memcpy(&iSample, pFrame + i, sizeof(int16_t));
+    if (iSample != iFirst) return -1;
+  }
+  return iFirst;
+}
+
+/**
+ * @brief A frame duration switch while a queued segment starts off the frame boundaries of the new duration waits
+ * until the segment has been read: 60 ms can't be cut into 40 ms frames
+ */
+static void testFrameDurationSwitchWaitsForSegment()
+{
+  OpusEncodeEngine engine;
+  CHECK(engine.open(SAMPLES_PER_SECOND, 1, 16, 64));
+  engine.setGapPolicy(GapPolicy::GP_SIGNAL_LOSS, 10 * MS, 1000 * MS);
+  std::vector<uint8_t> vFirst = constantAudio(60, 1);
+  engine.addAudioData(vFirst.data(), static_cast<uint32_t>(vFirst.size()), 0, 60 * MS);
+  engine.startNewSegment(10000 * MS);
+  engine.setFrameDuration(OpusFrameDuration::OFD_40_MS);
+  std::vector<uint8_t> vSecond = constantAudio(80, 2);
+  engine.addAudioData(vSecond.data(), static_cast<uint32_t>(vSecond.size()), 10000 * MS, 10080 * MS);
+
+  REFERENCE_TIME tStart, tStop;
+  uint8_t* pFrame = nullptr;
+  REFERENCE_TIME tExpected = 0;
+  int iSecondFrames = 0;
+  while (engine.readNextAudioFrame(tStart, tStop, pFrame))
+  {
+    const int iValue = frameValue(pFrame, engine.getBytesPerFrame());
+    CHECK(iValue == 1 || iValue == 2);
+    if (iValue == 2 && iSecondFrames++ == 0)
+    {
+      // the old segment ends in whole frames
+      CHECK(tExpected == 60 * MS);
+      CHECK(engine.getAudioBuffer()->takeDiscontinuity());
+      tExpected = 10000 * MS;
+    }
+    CHECK(tStart == tExpected);
+    tExpected = tStop;
+  }
+  // the switch takes effect once the rest of the old segment is a whole 40 ms frame
+  CHECK(iSecondFrames == 2);
+  CHECK(engine.getAudioBuffer()->getFrameDurationMsEnum() == OpusFrameDuration::OFD_40_MS);
+  CHECK(tExpected == 10080 * MS);
+}
+
+/**
+ * @brief A queued segment on the frame boundaries of the new duration doesn't hold the switch up
+ */
+static void testFrameDurationSwitchOnSegmentBoundary()
+{
+  OpusEncodeEngine engine;
+  CHECK(engine.open(SAMPLES_PER_SECOND, 1, 16, 64));
+  engine.setGapPolicy(GapPolicy::GP_SIGNAL_LOSS, 10 * MS, 1000 * MS);
+  std::vector<uint8_t> vFirst = constantAudio(40, 1);
+  engine.addAudioData(vFirst.data(), static_cast<uint32_t>(vFirst.size()), 0, 40 * MS);
+  engine.startNewSegment(10000 * MS);
+  engine.setFrameDuration(OpusFrameDuration::OFD_40_MS);
+  CHECK(engine.getAudioBuffer()->getFrameDurationMsEnum() == OpusFrameDuration::OFD_40_MS);
+}
+
+int main()
+{
+  RUN_TEST(testFrameDurationSwitchWaitsForSegment);
+  RUN_TEST(testFrameDurationSwitchOnSegmentBoundary);
+  return failedChecks() == 0 ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+/** @file
+
+MODULE				: tests
+
+FILE NAME			: PacketDistributorTest.cpp
+
+DESCRIPTION			: Tests of the packet pool and the distribution of the packets to the subscribers
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <memory>
+#include <vector>
+#include "PacketArena.h"
+#include "TestCheck.h"
+
+static const int PACKET_CAPACITY = 1500;
+static const REFERENCE_TIME FRAME_DURATION = 200000;
+
+/// a packet of the frame with the sequence number uiFrame
+static PacketRef makePacket(PacketArena& arena, uint64_t uiFrame)
+{
+  PacketRef packet = arena.acquire();
+  Packet* pPacket = packet.getWritable();
+  pPacket->getBuffer()[0] = static_cast<uint8_t>(uiFrame);
+  pPacket->setSize(1);
+  pPacket->setTime(uiFrame * FRAME_DURATION, (uiFrame + 1) * FRAME_DURATION);
+  pPacket->setSequenceNumber(uiFrame);
+  return packet;
+}
+
+/// the sequence numbers of the queued packets
+static std::vector<uint64_t> popAll(PacketDistributor::Subscriber& subscriber)
+{
+  std::vector<uint64_t> vSequenceNumbers;
+  PacketRef packet;
+  while (subscriber.pop(packet)) vSequenceNumbers.push_back(packet->getSequenceNumber());
+  return vSequenceNumbers;
+}
+
+/**
+ * @brief A published packet returns to the arena once the last subscriber has released it and is reused
+ */
+static void testReleaseToArena()
+{
+  auto pArena = std::make_shared<PacketArena>(PACKET_CAPACITY, 1);
+  PacketDistributor distributor(0);
+  auto pFirst = distributor.subscribe(4, PacketDistributor::DropPolicy::DP_DROP_OLDEST);
+  auto pSecond = distributor.subscribe(4, PacketDistributor::DropPolicy::DP_DROP_OLDEST);
+  const uint8_t* pData = nullptr;
+  {
+    PacketRef packet = makePacket(*pArena, 0);
+    pData = packet->getData();
+    distributor.publish(packet);
+    // shared: no longer writable
+    CHECK(packet.getWritable() == nullptr);
+  }
+  PacketRef first, second;
+  CHECK(pFirst->pop(first) && first->getData() == pData);
+  CHECK(pSecond->pop(second) && second->getData() == pData);
+  first.reset();
+  // still held by the second subscriber: a new packet is allocated
+  PacketRef other = pArena->acquire();
+  CHECK(other->getData() != pData);
+  CHECK(pArena->getAllocatedCount() == 2);
+  other.reset();
+  second.reset();
+  // both are free again
+  PacketRef reused = pArena->acquire();
+  PacketRef reused2 = pArena->acquire();
+  CHECK(pArena->getAllocatedCount() == 2);
+  CHECK(reused->getData() == pData || reused2->getData() == pData);
+}
+
+/**
+ * @brief Outstanding packets keep the arena alive
+ */
+static void testPacketOutlivesArena()
+{
+  auto pArena = std::make_shared<PacketArena>(PACKET_CAPACITY, 1);
+  PacketRef packet = makePacket(*pArena, 7);
+  std::weak_ptr<PacketArena> pWeak = pArena;
+  pArena.reset();
+  CHECK(!pWeak.expired());
+  CHECK(packet->getSequenceNumber() == 7);
+  packet.reset();
+  CHECK(pWeak.expired());
+}
+
+/**
+ * @brief A full queue drops the oldest or the incoming packet depending on the policy of its subscriber
+ */
+static void testDropPolicies()
+{
+  auto pArena = std::make_shared<PacketArena>(PACKET_CAPACITY, 4);
+  PacketDistributor distributor(0);
+  auto pOldest = distributor.subscribe(2, PacketDistributor::DropPolicy::DP_DROP_OLDEST);
+  auto pNewest = distributor.subscribe(2, PacketDistributor::DropPolicy::DP_DROP_NEWEST);
+  for (uint64_t i = 0; i < 3; ++i) distributor.publish(makePacket(*pArena, i));
+  CHECK(pOldest->getDroppedCount() == 1);
+  CHECK(pNewest->getDroppedCount() == 1);
+  CHECK((popAll(*pOldest) == std::vector<uint64_t>{ 1, 2 }));
+  CHECK((popAll(*pNewest) == std::vector<uint64_t>{ 0, 1 }));
+}
+
+/**
+ * @brief A subscriber that doesn't keep up only loses its own packets
+ */
+static void testSlowSubscriberIsolation()
+{
+  auto pArena = std::make_shared<PacketArena>(PACKET_CAPACITY, 4);
+  PacketDistributor distributor(0);
+  auto pSlow = distributor.subscribe(1, PacketDistributor::DropPolicy::DP_DROP_OLDEST);
+  auto pFast = distributor.subscribe(4, PacketDistributor::DropPolicy::DP_DROP_NEWEST);
+  std::vector<uint64_t> vReceived;
+  for (uint64_t i = 0; i < 100; ++i)
+  {
+    distributor.publish(makePacket(*pArena, i));
+    std::vector<uint64_t> vPopped = popAll(*pFast);
+    vReceived.insert(vReceived.end(), vPopped.begin(), vPopped.end());
+  }
+  CHECK(vReceived.size() == 100 && vReceived.back() == 99);
+  CHECK(pFast->getDroppedCount() == 0);
+  CHECK(pSlow->getDroppedCount() == 99);
+  CHECK((popAll(*pSlow) == std::vector<uint64_t>{ 99 }));
+  // the slow subscriber held one packet at a time: the pool didn't grow with the backlog
+  CHECK(pArena->getAllocatedCount() == 4);
+}
+
+/**
+ * @brief A late joiner starts with the retained packets of the requested duration, followed by the live packets
+ */
+static void testLateJoinReplay()
+{
+  auto pArena = std::make_shared<PacketArena>(PACKET_CAPACITY, 16);
+  PacketDistributor distributor(5 * FRAME_DURATION);
+  for (uint64_t i = 0; i < 10; ++i) distributor.publish(makePacket(*pArena, i));
+  // the last 3 frame durations before the newest packet
+  auto pLate = distributor.subscribe(8, PacketDistributor::DropPolicy::DP_DROP_OLDEST, 3 * FRAME_DURATION);
+  distributor.publish(makePacket(*pArena, 10));
+  CHECK((popAll(*pLate) == std::vector<uint64_t>{ 6, 7, 8, 9, 10 }));
+  // more than is retained: the retention bounds the replay
+  auto pLater = distributor.subscribe(16, PacketDistributor::DropPolicy::DP_DROP_OLDEST, 100 * FRAME_DURATION);
+  CHECK((popAll(*pLater) == std::vector<uint64_t>{ 5, 6, 7, 8, 9, 10 }));
+  distributor.unsubscribe(pLate);
+  CHECK(pLate->isClosed());
+  CHECK(distributor.getSubscriberCount() == 1);
+}
+
+int main()
+{
+  RUN_TEST(testReleaseToArena);
+  RUN_TEST(testPacketOutlivesArena);
+  RUN_TEST(testDropPolicies);
+  RUN_TEST(testSlowSubscriberIsolation);
+  RUN_TEST(testLateJoinReplay);
+  return failedChecks() == 0 ? 0 : 1;
+}
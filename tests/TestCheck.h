@@ -0,0 +1,64 @@
+/** @file
+
+MODULE				: tests
+
+FILE NAME			: TestCheck.h
+
+DESCRIPTION			: Minimal checks for the self-checking test executables
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#pragma once
+#include <cstdio>
+
+/**
+ * @brief The number of failed checks of the test executable, which returns non-zero if there are any
+ */
+inline int& failedChecks()
+{
+  static int iFailed = 0;
+  return iFailed;
+}
+
+/// reports a failed condition with its location and carries on with the test
+#define CHECK(condition) \
+  do \
+  { \
+    if (!(condition)) \
+    { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      ++failedChecks(); \
+    } \
+  } while (0)
+
+/// runs one test function and reports it by name
+#define RUN_TEST(test) \
+  do \
+  { \
+    const int iFailedBefore = failedChecks(); \
+    test(); \
+    printf("%-48s %s\n", #test, failedChecks() == iFailedBefore ? "ok" : "FAILED"); \
+  } while (0)
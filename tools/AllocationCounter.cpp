@@ -0,0 +1,80 @@
+/** @file
+
+MODULE				: tools
+
+FILE NAME			: AllocationCounter.cpp
+
+DESCRIPTION			: Counts the heap allocations of a tool through a replacement of the global operator new
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include "AllocationCounter.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> g_uiAllocations(0);
+static std::atomic<uint64_t> g_uiAllocatedBytes(0);
+
+uint64_t AllocationCounter::getAllocations()
+{
+  return g_uiAllocations.load(std::memory_order_relaxed);
+}
+
+uint64_t AllocationCounter::getAllocatedBytes()
+{
+  return g_uiAllocatedBytes.load(std::memory_order_relaxed);
+}
+
+void* operator new(size_t uiSize, const std::nothrow_t&) noexcept
+{
+  g_uiAllocations.fetch_add(1, std::memory_order_relaxed);
+  g_uiAllocatedBytes.fetch_add(uiSize, std::memory_order_relaxed);
+  return malloc(uiSize ? uiSize : 1);
+}
+
+void* operator new[](size_t uiSize, const std::nothrow_t& tag) noexcept
+{
+  return operator new(uiSize, tag);
+}
+
+void* operator new(size_t uiSize)
+{
+  if (void* p = operator new(uiSize, std::nothrow)) return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](size_t uiSize)
+{
+  return operator new(uiSize);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
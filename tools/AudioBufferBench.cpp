@@ -0,0 +1,313 @@
+/** @file
+
+MODULE				: AudioBufferBench
+
+FILE NAME			: AudioBufferBench.cpp
+
+DESCRIPTION			: Benchmark of the framing buffers against the original runtime-format AudioBuffer
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "AudioBuffer.h"
+
+// seconds of audio framed per run
+static const int BENCH_SECONDS = 60;
+// the time is the best of this many runs
+static const int BENCH_RUNS = 5;
+
+/**
+ * @brief The AudioBuffer as it was before the framing buffers were specialised for the format: the frame duration in a
+ * double, a switch on every read and floating point arithmetic on every add. Kept here as the reference.
+ */
+class LegacyAudioBuffer
+{
+public:
+  LegacyAudioBuffer(int samplesPerSecond, int channels, int bitsPerSample, OpusFrameDuration eFrameDuration)
+    :m_eFrameDurationMs(eFrameDuration),
+    m_inputFrameDurationMs(0.0),
+    m_samplesPerSecond(samplesPerSecond),
+    m_channels(channels),
+    m_bitsPerSample(bitsPerSample),
+    m_numberOfFrames(0),
+    m_currentBufferSize(AUDIO_BUFFER_SIZE),
+    m_currentSize(0),
+    m_startPos(0),
+    m_pDataBuffer(new uint8_t[AUDIO_BUFFER_SIZE]),
+    m_tStart(-1),
+    m_tStop(0)
+  {
+    init();
+  }
+
+  int getBytesPerFrame() const { return m_bytesPerFrame; }
+
+  int addAudioData(uint8_t* pData, uint32_t size, REFERENCE_TIME tStart, REFERENCE_TIME tStop)
+  {
+    if (freeSpace() < static_cast<int>(size)) { return -1; }
+    if (m_startPos > 0 && m_currentSize > 0)
+    {
+      memmove(m_pDataBuffer.get(), m_pDataBuffer.get() + m_startPos, m_currentSize);
+    }
+    m_startPos = 0;
+    memcpy(m_pDataBuffer.get() + m_currentSize, pData, size);
+    m_currentSize += size;
+    if (m_tStart == -1) m_tStart = tStart;
+    m_tStop = tStop;
+    m_sampleBufferDurationInMs = m_currentSize * 1000 / m_bytesPerSecond;
+    m_numberOfFrames = static_cast<int>(m_sampleBufferDurationInMs / m_inputFrameDurationMs);
+    m_additionalDataInMs = std::fmod(m_sampleBufferDurationInMs, m_inputFrameDurationMs);
+    return m_numberOfFrames;
+  }
+
+  bool readNextAudioFrame(REFERENCE_TIME& tStart, REFERENCE_TIME& tStop, uint8_t*& p)
+  {
+    if (m_numberOfFrames > 0)
+    {
+      p = m_pDataBuffer.get() + m_startPos;
+      m_startPos += m_bytesPerFrame;
+      m_currentSize -= m_bytesPerFrame;
+      m_numberOfFrames--;
+      tStart = m_tStart;
+      m_tStart += static_cast<REFERENCE_TIME>(getFrameDurationMs() * 10000);
+      tStop = m_tStart;
+      m_sampleBufferDurationInMs -= static_cast<int>(getFrameDurationMs());
+      return true;
+    }
+    return false;
+  }
+
+private:
+  void init()
+  {
+    m_inputFrameDurationMs = getFrameDurationMs();
+    m_bytesPerSecond = m_samplesPerSecond * m_channels * (m_bitsPerSample / 8);
+    m_bytesPerFrame = static_cast<int>(m_bytesPerSecond / (1000 / m_inputFrameDurationMs));
+  }
+
+  int freeSpace() const { return m_currentBufferSize - m_currentSize; }
+
+  double getFrameDurationMs() const
+  {
+    switch (m_eFrameDurationMs)
+    {
+    case OpusFrameDuration::OFD_2_5_MS: return 2.5;
+    case OpusFrameDuration::OFD_5_MS: return 5;
+    case OpusFrameDuration::OFD_10_MS: return 10;
+    case OpusFrameDuration::OFD_20_MS: return 20;
+    case OpusFrameDuration::OFD_40_MS: return 40;
+    case OpusFrameDuration::OFD_60_MS: return 60;
+    }
+    return 20;
+  }
+
+  OpusFrameDuration m_eFrameDurationMs;
+  double m_inputFrameDurationMs;
+  int m_samplesPerSecond;
+  int m_channels;
+  int m_bitsPerSample;
+  int m_bytesPerSecond;
+  int m_bytesPerFrame;
+  int m_sampleBufferDurationInMs;
+  int m_numberOfFrames;
+  double m_additionalDataInMs;
+  int m_currentBufferSize;
+  int m_currentSize;
+  int m_startPos;
+  std::unique_ptr<uint8_t[]> m_pDataBuffer;
+  REFERENCE_TIME m_tStart;
+  REFERENCE_TIME m_tStop;
+};
+
+/**
+ * @brief One format of the benchmark
+ */
+struct BenchCase
+{
+  int iSamplesPerSecond;
+  int iChannels;
+  OpusFrameDuration eFrameDuration;
+  const char* szName;
+};
+
+/**
+ * @brief What a run read from the buffer: a checksum over the frames and their timestamps so that the buffers can be
+ * compared and the reads are not optimised away
+ */
+struct RunResult
+{
+  uint64_t uiFrames;
+  uint64_t uiChecksum;
+  double dSeconds;
+};
+
+/// 32 bit linear congruential generator so that the input is the same on every platform
+static uint32_t nextRandom(uint32_t& uiState)
+{
+  uiState = uiState * 1664525u + 1013904223u;
+  return uiState;
+}
+
+/// the sizes of the blocks delivered by a capture device with a jittery period, 1 to 30 ms
+static std::vector<uint32_t> getBlockSizes(const BenchCase& c, size_t uiTotalBytes)
+{
+  const uint32_t uiBlockAlign = c.iChannels * sizeof(int16_t);
+  std::vector<uint32_t> vBlocks;
+  uint32_t uiSeed = 0xC0FFEEu;
+  for (size_t uiPos = 0; uiPos < uiTotalBytes;)
+  {
+    const uint32_t uiBlock = std::min<uint32_t>(c.iSamplesPerSecond / 1000 * (1 + nextRandom(uiSeed) % 30) * uiBlockAlign,
+      static_cast<uint32_t>(uiTotalBytes - uiPos));
+    vBlocks.push_back(uiBlock);
+    uiPos += uiBlock;
+  }
+  return vBlocks;
+}
+
+/**
+ * @brief Frames the input with the buffer the way the encode loop does: every block is followed by reads until no
+ * complete frame is left
+ */
+template <class Buffer>
+static RunResult frameInput(Buffer& buffer, const BenchCase& c, std::vector<uint8_t>& vInput, const std::vector<uint32_t>& vBlocks)
+{
+  RunResult result = { 0, 0, 0.0 };
+  const int iBytesPerSecond = c.iSamplesPerSecond * c.iChannels * static_cast<int>(sizeof(int16_t));
+  size_t uiPos = 0;
+  auto tBegin = std::chrono::steady_clock::now();
+  for (uint32_t uiBlock : vBlocks)
+  {
+    const REFERENCE_TIME tStart = static_cast<REFERENCE_TIME>(uiPos) * 10000000 / iBytesPerSecond;
+    const REFERENCE_TIME tStop = static_cast<REFERENCE_TIME>(uiPos + uiBlock) * 10000000 / iBytesPerSecond;
+    if (buffer.addAudioData(vInput.data() + uiPos, uiBlock, tStart, tStop) == -1) break;
+    uiPos += uiBlock;
+    REFERENCE_TIME tFrameStart, tFrameStop;
+    uint8_t* pFrame = nullptr;
+    while (buffer.readNextAudioFrame(tFrameStart, tFrameStop, pFrame))
+    {
+      // touch both ends of the frame as the encoder would
+      result.uiChecksum = result.uiChecksum * 31 + pFrame[0] + pFrame[buffer.getBytesPerFrame() - 1] + static_cast<uint64_t>(tFrameStart) +
+        static_cast<uint64_t>(tFrameStop);
+      ++result.uiFrames;
+    }
+  }
+  result.dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tBegin).count();
+  return result;
+}
+
+/// the best of BENCH_RUNS runs, each with a fresh buffer from createBuffer
+template <class CreateBuffer>
+static RunResult benchmark(const BenchCase& c, std::vector<uint8_t>& vInput, const std::vector<uint32_t>& vBlocks, CreateBuffer createBuffer)
+{
+  RunResult best = { 0, 0, 0.0 };
+  for (int r = 0; r < BENCH_RUNS; ++r)
+  {
+    auto pBuffer = createBuffer();
+    RunResult result = frameInput(*pBuffer, c, vInput, vBlocks);
+    if (r == 0 || result.dSeconds < best.dSeconds) best = result;
+  }
+  return best;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1)
+  {
+    printf("Usage: %s\n", argv[0]);
+    printf("Frames %d s of audio, fed in blocks of 1 to 30 ms, with the original AudioBuffer, the generic AudioBuffer and the\n", BENCH_SECONDS);
+    printf("buffer that createAudioBuffer picks for the format, called through IAudioBuffer and dispatched to its final class\n");
+    printf("with visitAudioBuffer, and checks that all of them cut the same frames.\n");
+    return 1;
+  }
+  static const BenchCase vCases[] =
+  {
+    { 48000, 2, OpusFrameDuration::OFD_20_MS, "48000_2_20ms" },
+    { 16000, 1, OpusFrameDuration::OFD_20_MS, "16000_1_20ms" },
+    // no specialisation: createAudioBuffer falls back to the generic buffer
+    { 24000, 1, OpusFrameDuration::OFD_10_MS, "24000_1_10ms" }
+  };
+  int iFailures = 0;
+  printf("%-14s %-10s %12s %12s %10s  %s\n", "case", "buffer", "ns/frame", "frames/s", "speed-up", "result");
+  for (const BenchCase& c : vCases)
+  {
+    const size_t uiBytes = static_cast<size_t>(c.iSamplesPerSecond) * c.iChannels * sizeof(int16_t) * BENCH_SECONDS;
+    std::vector<uint8_t> vInput(uiBytes);
+    uint32_t uiSeed = 0x1234567u;
+    for (auto& byte : vInput) byte = static_cast<uint8_t>(nextRandom(uiSeed) >> 24);
+    const std::vector<uint32_t> vBlocks = getBlockSizes(c, uiBytes);
+
+    const RunResult legacy = benchmark(c, vInput, vBlocks, [&]()
+    {
+      return std::make_unique<LegacyAudioBuffer>(c.iSamplesPerSecond, c.iChannels, 16, c.eFrameDuration);
+    });
+    const RunResult generic = benchmark(c, vInput, vBlocks, [&]()
+    {
+      std::unique_ptr<IAudioBuffer> pBuffer = std::make_unique<AudioBuffer>(c.iSamplesPerSecond, c.iChannels, 16);
+      pBuffer->setFrameDuration(c.eFrameDuration);
+      return pBuffer;
+    });
+    // through the interface
+    const RunResult selected = benchmark(c, vInput, vBlocks, [&]()
+    {
+      return createAudioBuffer(c.iSamplesPerSecond, c.iChannels, 16, c.eFrameDuration);
+    });
+    // dispatched to the final class once per run as the encode engine does
+    RunResult dispatched = { 0, 0, 0.0 };
+    for (int r = 0; r < BENCH_RUNS; ++r)
+    {
+      std::unique_ptr<IAudioBuffer> pBuffer = createAudioBuffer(c.iSamplesPerSecond, c.iChannels, 16, c.eFrameDuration);
+      RunResult result = visitAudioBuffer(*pBuffer, pBuffer->getKind(), [&](auto& buffer) { return frameInput(buffer, c, vInput, vBlocks); });
+      if (r == 0 || result.dSeconds < dispatched.dSeconds) dispatched = result;
+    }
+
+    const struct
+    {
+      const char* szName;
+      const RunResult& result;
+    } vRows[] = { { "original", legacy }, { "generic", generic }, { "selected", selected }, { "dispatched", dispatched } };
+    for (const auto& row : vRows)
+    {
+      std::string sVerdict = "ok";
+      if (row.result.uiFrames != legacy.uiFrames || row.result.uiChecksum != legacy.uiChecksum)
+      {
+        sVerdict = "frames differ from the original";
+        ++iFailures;
+      }
+      const double dNs = row.result.uiFrames ? row.result.dSeconds * 1e9 / row.result.uiFrames : 0.0;
+      printf("%-14s %-10s %12.1f %12.0f %9.2fx  %s\n", c.szName, row.szName, dNs, row.result.dSeconds > 0.0 ? row.result.uiFrames / row.result.dSeconds : 0.0,
+        row.result.dSeconds > 0.0 ? legacy.dSeconds / row.result.dSeconds : 0.0, sVerdict.c_str());
+    }
+  }
+  return iFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,283 @@
+/** @file
+
+MODULE				: BatchPreprocessBench
+
+FILE NAME			: BatchPreprocessBench.cpp
+
+DESCRIPTION			: Batched against per-stream preprocessing of many mono streams
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "BatchPreprocessor.h"
+
+// 20 ms at 16 kHz
+static const int SAMPLES_PER_FRAME = 320;
+// distinct input frames per stream, cycled through so that the input of 512 streams stays a few MB
+static const int INPUT_FRAMES = 16;
+// the time is the best of this many runs
+static const int BENCH_RUNS = 5;
+
+/**
+ * @brief The kernels of the BatchPreprocessor applied to one stream at a time, as each encoder would on its own frames
+ */
+class StreamPreprocessor
+{
+public:
+  StreamPreprocessor()
+    :m_fGain(1.0f),
+    m_fX1(0.0f),
+    m_fY1(0.0f),
+    m_fPeak(0.0f),
+    m_fSumSquares(0.0f)
+  {
+  }
+
+  void setGain(float fGain) { m_fGain = fGain; }
+  float getPeak() const { return m_fPeak / 32768.0f; }
+  float getRms() const { return std::sqrt(m_fSumSquares / SAMPLES_PER_FRAME) / 32768.0f; }
+
+  void process(const int16_t* pIn, int16_t* pOut)
+  {
+    float x1 = m_fX1, y1 = m_fY1, peak = 0.0f, sum = 0.0f;
+    for (int i = 0; i < SAMPLES_PER_FRAME; ++i)
+    {
+      const float x = pIn[i] * m_fGain;
+      const float y = x - x1 + DC_POLE * y1;
+      x1 = x;
+      y1 = y;
+      peak = std::max(peak, std::fabs(y));
+      sum += y * y;
+      const long lSample = std::lround(y);
+      pOut[i] = static_cast<int16_t>(std::min(std::max(lSample, -32768L), 32767L));
+    }
+    m_fX1 = x1;
+    m_fY1 = y1;
+    m_fPeak = peak;
+    m_fSumSquares = sum;
+  }
+
+private:
+  /// the pole of the BatchPreprocessor
+  static constexpr float DC_POLE = 0.992f;
+
+  float m_fGain;
+  float m_fX1;
+  float m_fY1;
+  float m_fPeak;
+  float m_fSumSquares;
+};
+
+/// 32 bit linear congruential generator so that the input is the same on every platform
+static uint32_t nextRandom(uint32_t& uiState)
+{
+  uiState = uiState * 1664525u + 1013904223u;
+  return uiState;
+}
+
+/**
+ * @brief What a run produced: the last output frame and meters of every stream so that both paths can be compared
+ */
+struct RunResult
+{
+  double dSeconds;
+  std::vector<int16_t> vOutput;
+  std::vector<float> vPeak;
+  std::vector<float> vRms;
+};
+
+static const char* getKernels()
+{
+#if defined(BATCH_PREPROCESSOR_AVX2)
+  return "AVX2";
+#elif defined(BATCH_PREPROCESSOR_SSE2)
+  return "SSE2";
+#else
+  return "scalar";
+#endif
+}
+
+/// gain and offset per stream so that every lane has work of its own
+static float getGain(int iStream)
+{
+  return 0.5f + (iStream % 7) * 0.125f;
+}
+
+static RunResult runPerStream(int iStreams, int iFrames, const std::vector<int16_t>& vInput)
+{
+  RunResult best = { 0.0, {}, {}, {} };
+  for (int r = 0; r < BENCH_RUNS; ++r)
+  {
+    std::vector<StreamPreprocessor> vStreams(iStreams);
+    for (int k = 0; k < iStreams; ++k) vStreams[k].setGain(getGain(k));
+    std::vector<int16_t> vOutput(static_cast<size_t>(iStreams) * SAMPLES_PER_FRAME);
+    auto tBegin = std::chrono::steady_clock::now();
+    for (int f = 0; f < iFrames; ++f)
+    {
+      const int16_t* pFrames = vInput.data() + static_cast<size_t>(f % INPUT_FRAMES) * iStreams * SAMPLES_PER_FRAME;
+      for (int k = 0; k < iStreams; ++k)
+      {
+        vStreams[k].process(pFrames + static_cast<size_t>(k) * SAMPLES_PER_FRAME, vOutput.data() + static_cast<size_t>(k) * SAMPLES_PER_FRAME);
+      }
+    }
+    const double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tBegin).count();
+    if (r == 0 || dSeconds < best.dSeconds)
+    {
+      best.dSeconds = dSeconds;
+      best.vOutput = vOutput;
+      best.vPeak.resize(iStreams);
+      best.vRms.resize(iStreams);
+      for (int k = 0; k < iStreams; ++k)
+      {
+        best.vPeak[k] = vStreams[k].getPeak();
+        best.vRms[k] = vStreams[k].getRms();
+      }
+    }
+  }
+  return best;
+}
+
+static RunResult runBatched(int iStreams, int iFrames, const std::vector<int16_t>& vInput)
+{
+  RunResult best = { 0.0, {}, {}, {} };
+  for (int r = 0; r < BENCH_RUNS; ++r)
+  {
+    BatchPreprocessor preprocessor(iStreams, SAMPLES_PER_FRAME);
+    for (int k = 0; k < iStreams; ++k) preprocessor.setGain(k, getGain(k));
+    std::vector<int16_t> vOutput(static_cast<size_t>(iStreams) * SAMPLES_PER_FRAME);
+    std::vector<const int16_t*> vIn(iStreams);
+    std::vector<int16_t*> vOut(iStreams);
+    for (int k = 0; k < iStreams; ++k) vOut[k] = vOutput.data() + static_cast<size_t>(k) * SAMPLES_PER_FRAME;
+    auto tBegin = std::chrono::steady_clock::now();
+    for (int f = 0; f < iFrames; ++f)
+    {
+      // the frames of the streams are apart as they are in the buffers of separate engines
+      const int16_t* pFrames = vInput.data() + static_cast<size_t>(f % INPUT_FRAMES) * iStreams * SAMPLES_PER_FRAME;
+      for (int k = 0; k < iStreams; ++k) vIn[k] = pFrames + static_cast<size_t>(k) * SAMPLES_PER_FRAME;
+      preprocessor.process(vIn.data(), vOut.data());
+    }
+    const double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tBegin).count();
+    if (r == 0 || dSeconds < best.dSeconds)
+    {
+      best.dSeconds = dSeconds;
+      best.vOutput = vOutput;
+      best.vPeak.resize(iStreams);
+      best.vRms.resize(iStreams);
+      for (int k = 0; k < iStreams; ++k)
+      {
+        best.vPeak[k] = preprocessor.getPeak(k);
+        best.vRms[k] = preprocessor.getRms(k);
+      }
+    }
+  }
+  return best;
+}
+
+/// the largest difference between the two paths, in samples and in relative meter readings
+static bool compare(const RunResult& perStream, const RunResult& batched, int& iMaxSampleDiff)
+{
+  iMaxSampleDiff = 0;
+  for (size_t i = 0; i < perStream.vOutput.size(); ++i)
+  {
+    iMaxSampleDiff = std::max(iMaxSampleDiff, std::abs(perStream.vOutput[i] - batched.vOutput[i]));
+  }
+  bool bMetersMatch = true;
+  for (size_t k = 0; k < perStream.vPeak.size(); ++k)
+  {
+    // the sums are accumulated in the same order in both paths: only rounding at the output may differ
+    bMetersMatch &= std::fabs(perStream.vPeak[k] - batched.vPeak[k]) <= 1e-4f * std::max(perStream.vPeak[k], 1e-3f);
+    bMetersMatch &= std::fabs(perStream.vRms[k] - batched.vRms[k]) <= 1e-4f * std::max(perStream.vRms[k], 1e-3f);
+  }
+  // round half to even in the vector conversion against round half away from zero in lround
+  return iMaxSampleDiff <= 1 && bMetersMatch;
+}
+
+int main(int argc, char** argv)
+{
+  int iStreamFrames = 200000;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "--stream-frames=", 16) == 0) iStreamFrames = atoi(argv[i] + 16);
+    else
+    {
+      printf("Usage: %s [--stream-frames=<n>]\n", argv[0]);
+      printf("Applies gain, DC removal and level metering to 20 ms frames of K = 8, 64 and 512 mono 16 kHz streams, one\n");
+      printf("stream at a time and with the BatchPreprocessor, and checks that both produce the same frames.\n");
+      printf("  --stream-frames  frames processed per run over all streams, 200000 by default\n");
+      return 1;
+    }
+  }
+  if (iStreamFrames <= 0)
+  {
+    printf("--stream-frames must be positive\n");
+    return 1;
+  }
+  printf("batch kernels: %s\n", getKernels());
+  printf("%6s %-11s %14s %16s %10s  %s\n", "K", "path", "ns/frame", "streams/core", "speed-up", "result");
+  static const int vStreamCounts[] = { 8, 64, 512 };
+  int iFailures = 0;
+  for (int iStreams : vStreamCounts)
+  {
+    // noise with a DC offset of its own per stream
+    std::vector<int16_t> vInput(static_cast<size_t>(INPUT_FRAMES) * iStreams * SAMPLES_PER_FRAME);
+    uint32_t uiSeed = 0xC0FFEEu;
+    for (size_t i = 0; i < vInput.size(); ++i)
+    {
+      const int iStream = static_cast<int>(i / SAMPLES_PER_FRAME % iStreams);
+      vInput[i] = static_cast<int16_t>(static_cast<int>(nextRandom(uiSeed) >> 20) - 2048 + (iStream % 11) * 500);
+    }
+    const int iFrames = std::max(1, iStreamFrames / iStreams);
+    const RunResult perStream = runPerStream(iStreams, iFrames, vInput);
+    const RunResult batched = runBatched(iStreams, iFrames, vInput);
+    int iMaxSampleDiff = 0;
+    const bool bMatch = compare(perStream, batched, iMaxSampleDiff);
+    if (!bMatch) ++iFailures;
+
+    const double dStreamFrames = static_cast<double>(iFrames) * iStreams;
+    const struct
+    {
+      const char* szName;
+      const RunResult& result;
+    } vRows[] = { { "per-stream", perStream }, { "batched", batched } };
+    for (const auto& row : vRows)
+    {
+      const double dNs = row.result.dSeconds * 1e9 / dStreamFrames;
+      // streams whose preprocessing one core keeps up with in real time, 50 frames per second each
+      printf("%6d %-11s %14.1f %16.0f %9.2fx  ", iStreams, row.szName, dNs, dNs > 0.0 ? 1e9 / (dNs * 50) : 0.0,
+        row.result.dSeconds > 0.0 ? perStream.dSeconds / row.result.dSeconds : 0.0);
+      if (&row.result == &perStream) printf("\n");
+      else if (bMatch) printf("ok, max sample difference %d\n", iMaxSampleDiff);
+      else printf("differs from per-stream, max sample difference %d\n", iMaxSampleDiff);
+    }
+  }
+  return iFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,326 @@
+/** @file
+
+MODULE				: CheckpointFailover
+
+FILE NAME			: CheckpointFailover.cpp
+
+DESCRIPTION			: Hot-standby failover from encoder checkpoints: snapshot size and cost and the failover gap
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "EncoderCheckpoint.h"
+#include "OpusEncodeEngine.h"
+
+// an Opus packet of 120 ms
+static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+
+/**
+ * @brief A packet of the primary or the standby
+ */
+struct EncodedPacket
+{
+  REFERENCE_TIME tStart;
+  REFERENCE_TIME tStop;
+  std::vector<uint8_t> vData;
+};
+
+/// 32 bit linear congruential generator so that the input is the same on every platform
+static uint32_t nextRandom(uint32_t& uiState)
+{
+  uiState = uiState * 1664525u + 1013904223u;
+  return uiState;
+}
+
+/**
+ * @brief A tone gliding between 200 Hz and 2 kHz every second under noise at about -30 dBFS, decorrelated between
+ * the channels, so that the adaptive state of the codec keeps changing
+ */
+static std::vector<int16_t> generateInput(int iSamplesPerSecond, int iChannels, int iMs)
+{
+  const size_t uiFrames = static_cast<size_t>(iSamplesPerSecond) * iMs / 1000;
+  std::vector<int16_t> vInput(uiFrames * iChannels);
+  uint32_t uiSeed = 0x5EED5u;
+  double dPhase = 0.0;
+  for (size_t i = 0; i < uiFrames; ++i)
+  {
+    const double dPosition = static_cast<double>(i % iSamplesPerSecond) / iSamplesPerSecond;
+    const double dFrequency = 200.0 + 1800.0 * (dPosition < 0.5 ? dPosition * 2.0 : 2.0 - dPosition * 2.0);
+    dPhase += 2.0 * 3.14159265358979 * dFrequency / iSamplesPerSecond;
+    for (int c = 0; c < iChannels; ++c)
+    {
+      const int32_t iNoise = static_cast<int32_t>(nextRandom(uiSeed) >> 22) - 512;
+      vInput[i * iChannels + c] = static_cast<int16_t>(8000.0 * sin(dPhase + c) + iNoise);
+    }
+  }
+  return vInput;
+}
+
+static bool parseFrameDuration(int iMs, OpusFrameDuration& eFrameDuration)
+{
+  switch (iMs)
+  {
+  case 10: eFrameDuration = OpusFrameDuration::OFD_10_MS; return true;
+  case 20: eFrameDuration = OpusFrameDuration::OFD_20_MS; return true;
+  case 40: eFrameDuration = OpusFrameDuration::OFD_40_MS; return true;
+  case 60: eFrameDuration = OpusFrameDuration::OFD_60_MS; return true;
+  default: return false;
+  }
+}
+
+static double elapsedUs(std::chrono::steady_clock::time_point tFrom)
+{
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - tFrom).count();
+}
+
+/**
+ * @brief min, mean and max of a series of measurements
+ */
+struct Summary
+{
+  double dMin = 0.0;
+  double dMean = 0.0;
+  double dMax = 0.0;
+
+  explicit Summary(const std::vector<double>& vValues)
+  {
+    if (vValues.empty()) return;
+    dMin = *std::min_element(vValues.begin(), vValues.end());
+    dMax = *std::max_element(vValues.begin(), vValues.end());
+    for (double d : vValues) dMean += d;
+    dMean /= vValues.size();
+  }
+};
+
+int main(int argc, char** argv)
+{
+  int iSamplesPerSecond = 48000;
+  int iChannels = 2;
+  uint32_t uiKbps = 64;
+  int iFrameMs = 20;
+  int iHistoryMs = 100;
+  int iIntervalMs = 1000;
+  int iSeconds = 10;
+  int iCrashMs = 7350;
+  std::string sPath = "failover.opck";
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "--rate=", 7) == 0)
+      iSamplesPerSecond = atoi(argv[i] + 7);
+    else if (strncmp(argv[i], "--channels=", 11) == 0)
+      iChannels = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--bitrate=", 10) == 0)
+      uiKbps = static_cast<uint32_t>(atoi(argv[i] + 10));
+    else if (strncmp(argv[i], "--frame-ms=", 11) == 0)
+      iFrameMs = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--history-ms=", 13) == 0)
+      iHistoryMs = atoi(argv[i] + 13);
+    else if (strncmp(argv[i], "--interval-ms=", 14) == 0)
+      iIntervalMs = atoi(argv[i] + 14);
+    else if (strncmp(argv[i], "--seconds=", 10) == 0)
+      iSeconds = atoi(argv[i] + 10);
+    else if (strncmp(argv[i], "--crash-ms=", 11) == 0)
+      iCrashMs = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--path=", 7) == 0)
+      sPath = argv[i] + 7;
+    else
+    {
+      printf("Usage: %s [--rate=48000] [--channels=2] [--bitrate=64] [--frame-ms=20] [--history-ms=100] [--interval-ms=1000]\n", argv[0]);
+      printf("       [--seconds=10] [--crash-ms=7350] [--path=failover.opck]\n");
+      printf("A primary engine encodes a synthetic input and replaces the checkpoint file every interval. At the crash a hot standby,\n");
+      printf("which only sees the file, restores the last checkpoint and encodes the input from there on as a source that\n");
+      printf("replays its output would deliver it. Reports the checkpoint size and cost, the failover gap and how the packets\n");
+      printf("of the standby compare with those the primary would have sent.\n");
+      return 1;
+    }
+  }
+  OpusFrameDuration eFrameDuration;
+  if (!parseFrameDuration(iFrameMs, eFrameDuration) || iChannels < 1 || iChannels > 2 || iHistoryMs <= 0 || iIntervalMs <= 0 ||
+    iCrashMs <= iIntervalMs || iCrashMs >= iSeconds * 1000)
+  {
+    printf("Invalid options: the frame duration must be 10, 20, 40 or 60 ms, the history positive and the crash after the first checkpoint\n");
+    return 1;
+  }
+
+  const std::vector<int16_t> vInput = generateInput(iSamplesPerSecond, iChannels, iSeconds * 1000);
+  const size_t uiInputFrames = vInput.size() / iChannels;
+  const size_t uiCrashPos = static_cast<size_t>(iSamplesPerSecond) * iCrashMs / 1000;
+  const size_t uiIntervalFrames = static_cast<size_t>(iSamplesPerSecond) * iIntervalMs / 1000;
+
+  auto openEngine = [&](OpusEncodeEngine& engine)
+  {
+    engine.setFrameDuration(eFrameDuration);
+    engine.setGapPolicy(GapPolicy::GP_FILL_SILENCE, 10 * 10000LL, 1000 * 10000LL);
+    engine.setCheckpointHistory(static_cast<uint32_t>(iHistoryMs));
+    if (!engine.open(iSamplesPerSecond, iChannels, 16, uiKbps))
+    {
+      printf("Unable to open the engine: %s\n", engine.getLastError().c_str());
+      return false;
+    }
+    return true;
+  };
+  std::vector<uint8_t> vPacket(MAX_PACKET_SIZE);
+  auto encodeAvailable = [&](OpusEncodeEngine& engine, std::vector<EncodedPacket>& vPackets)
+  {
+    REFERENCE_TIME tStart, tStop;
+    uint8_t* pFrame = nullptr;
+    while (engine.readNextAudioFrame(tStart, tStop, pFrame))
+    {
+      int iSize = engine.encodeFrame(pFrame, vPacket.data(), static_cast<int>(vPacket.size()));
+      if (iSize < 0)
+      {
+        printf("Encoding failed: %s\n", engine.getLastError().c_str());
+        return false;
+      }
+      vPackets.push_back({ tStart, tStop, std::vector<uint8_t>(vPacket.begin(), vPacket.begin() + iSize) });
+    }
+    return true;
+  };
+  auto addInput = [&](OpusEncodeEngine& engine, size_t uiPos, size_t uiBlock)
+  {
+    const REFERENCE_TIME tStart = static_cast<REFERENCE_TIME>(uiPos) * 10000000 / iSamplesPerSecond;
+    const REFERENCE_TIME tStop = static_cast<REFERENCE_TIME>(uiPos + uiBlock) * 10000000 / iSamplesPerSecond;
+    return engine.addAudioData(const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(vInput.data() + uiPos * iChannels)),
+      static_cast<uint32_t>(uiBlock * iChannels * sizeof(int16_t)), tStart, tStop) != -1;
+  };
+
+  // the primary: its packets after the crash are what the receiver would have got without the failure
+  OpusEncodeEngine primary;
+  if (!openEngine(primary)) return 1;
+  std::vector<EncodedPacket> vPrimaryPackets;
+  std::vector<double> vSizes, vRawSizes, vCaptureUs, vWriteUs;
+  EncoderCheckpoint checkpoint;
+  std::vector<uint8_t> vSerialized;
+  size_t uiCheckpointPos = 0;
+  size_t uiNextCheckpoint = uiIntervalFrames;
+  // blocks of 1 to 30 ms from a fixed seed as a capture device with a jittery period would deliver them
+  uint32_t uiSeed = 0xC0FFEEu;
+  for (size_t uiPos = 0; uiPos < uiInputFrames;)
+  {
+    const size_t uiBlock = std::min(static_cast<size_t>(iSamplesPerSecond / 1000 * (1 + nextRandom(uiSeed) % 30)), uiInputFrames - uiPos);
+    if (!addInput(primary, uiPos, uiBlock) || !encodeAvailable(primary, vPrimaryPackets)) return 1;
+    uiPos += uiBlock;
+    if (uiPos >= uiNextCheckpoint && uiPos <= uiCrashPos)
+    {
+      auto tCapture = std::chrono::steady_clock::now();
+      vSerialized.clear();
+      if (!primary.saveCheckpoint(checkpoint)) return 1;
+      checkpoint.serialize(vSerialized);
+      vCaptureUs.push_back(elapsedUs(tCapture));
+      auto tWrite = std::chrono::steady_clock::now();
+      if (!EncoderCheckpoint::writeFile(sPath, vSerialized))
+      {
+        printf("Unable to write %s\n", sPath.c_str());
+        return 1;
+      }
+      vWriteUs.push_back(elapsedUs(tWrite));
+      vSizes.push_back(static_cast<double>(vSerialized.size()));
+      vRawSizes.push_back(static_cast<double>(checkpoint.vHistory.size() + checkpoint.vBuffered.size()));
+      uiCheckpointPos = uiPos;
+      uiNextCheckpoint += uiIntervalFrames;
+    }
+  }
+
+  // the standby is opened ahead of the failure and only sees the checkpoint file
+  OpusEncodeEngine standby;
+  if (!openEngine(standby)) return 1;
+  auto tFailover = std::chrono::steady_clock::now();
+  std::vector<uint8_t> vFile;
+  EncoderCheckpoint restored;
+  std::string sError;
+  if (!EncoderCheckpoint::readFile(sPath, vFile) || !restored.parse(vFile.data(), vFile.size(), sError))
+  {
+    printf("Unable to read the checkpoint: %s\n", sError.c_str());
+    return 1;
+  }
+  const double dReadUs = elapsedUs(tFailover);
+  auto tRestore = std::chrono::steady_clock::now();
+  if (!standby.restoreCheckpoint(restored))
+  {
+    printf("Unable to restore the checkpoint: %s\n", standby.getLastError().c_str());
+    return 1;
+  }
+  const double dRestoreUs = elapsedUs(tRestore);
+  std::vector<EncodedPacket> vStandbyPackets;
+  double dFirstPacketUs = 0.0;
+  for (size_t uiPos = uiCheckpointPos; uiPos < uiInputFrames;)
+  {
+    const size_t uiBlock = std::min(static_cast<size_t>(iSamplesPerSecond / 1000 * (1 + nextRandom(uiSeed) % 30)), uiInputFrames - uiPos);
+    if (!addInput(standby, uiPos, uiBlock) || !encodeAvailable(standby, vStandbyPackets)) return 1;
+    if (dFirstPacketUs == 0.0 && !vStandbyPackets.empty()) dFirstPacketUs = elapsedUs(tFailover);
+    uiPos += uiBlock;
+  }
+  remove(sPath.c_str());
+
+  // the packets of the standby continue the numbering of the primary
+  const size_t uiFirst = static_cast<size_t>(restored.framesEncoded);
+  size_t uiCompared = 0, uiIdentical = 0, uiTimestampErrors = 0;
+  size_t uiConverged = vStandbyPackets.size();
+  for (size_t i = 0; i < vStandbyPackets.size() && uiFirst + i < vPrimaryPackets.size(); ++i)
+  {
+    const EncodedPacket& expected = vPrimaryPackets[uiFirst + i];
+    const EncodedPacket& actual = vStandbyPackets[i];
+    ++uiCompared;
+    if (actual.tStart != expected.tStart || actual.tStop != expected.tStop) ++uiTimestampErrors;
+    if (actual.vData == expected.vData)
+    {
+      ++uiIdentical;
+      if (uiConverged == vStandbyPackets.size()) uiConverged = i;
+    }
+    else
+    {
+      uiConverged = vStandbyPackets.size();
+    }
+  }
+
+  const Summary sizes(vSizes), rawSizes(vRawSizes), capture(vCaptureUs), write(vWriteUs);
+  printf("%d Hz, %d channels, %u kbps, %d ms frames, history %d ms, a checkpoint every %d ms\n", iSamplesPerSecond, iChannels, uiKbps,
+    iFrameMs, iHistoryMs, iIntervalMs);
+  printf("checkpoints            %zu\n", vSizes.size());
+  printf("checkpoint size        %.0f / %.0f / %.0f bytes (min/mean/max) for %.0f bytes of history and buffered PCM on average\n",
+    sizes.dMin, sizes.dMean, sizes.dMax, rawSizes.dMean);
+  printf("capture + serialize    %.1f / %.1f us (mean/max), %.4f%% of the interval\n", capture.dMean, capture.dMax,
+    capture.dMean / (iIntervalMs * 10.0));
+  printf("file replacement       %.1f / %.1f us (mean/max)\n", write.dMean, write.dMax);
+  printf("crash at               %d ms, last checkpoint at %.0f ms: the source replays %.0f ms\n", iCrashMs,
+    uiCheckpointPos * 1000.0 / iSamplesPerSecond, (uiCrashPos - uiCheckpointPos) * 1000.0 / iSamplesPerSecond);
+  printf("read + parse           %.1f us\n", dReadUs);
+  printf("restore                %.1f us including %zu priming frames\n", dRestoreUs, restored.vHistory.size() / standby.getBytesPerFrame());
+  printf("failover gap           %.1f us to the first packet of the standby\n", dFirstPacketUs);
+  printf("first packet           #%zu at %lld, expected #%zu at %lld\n", uiFirst, vStandbyPackets.empty() ? -1LL : static_cast<long long>(vStandbyPackets[0].tStart),
+    uiFirst, uiFirst < vPrimaryPackets.size() ? static_cast<long long>(vPrimaryPackets[uiFirst].tStart) : -1LL);
+  printf("timestamp errors       %zu of %zu packets\n", uiTimestampErrors, uiCompared);
+  printf("identical packets      %zu of %zu", uiIdentical, uiCompared);
+  if (uiConverged < vStandbyPackets.size()) printf(", all from packet %zu on", uiConverged);
+  printf("\n");
+  return uiTimestampErrors == 0 && uiCompared > 0 ? 0 : 1;
+}
@@ -0,0 +1,394 @@
+/** @file
+
+MODULE				: ConferenceBench
+
+FILE NAME			: ConferenceBench.cpp
+
+DESCRIPTION			: Checks and benchmark of the mix-minus conference encoder against a mix and an encode per receiver
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ConferenceEncoder.h"
+#include "AllocationCounter.h"
+
+// an Opus packet of 120 ms
+static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+// a speaker talks for TALK_FRAMES out of every SPURT_FRAMES frames and pauses briefly within its talk spurt
+static const int SPURT_FRAMES = 250;
+static const int TALK_FRAMES = 150;
+static const int PAUSE_EVERY_FRAMES = 40;
+static const int PAUSE_FRAMES = 10;
+
+/// 32 bit linear congruential generator so that the input is the same on every platform
+static uint32_t nextRandom(uint32_t& uiState)
+{
+  uiState = uiState * 1664525u + 1013904223u;
+  return uiState;
+}
+
+/**
+ * @brief The input of the participants: the first speakers talk in staggered spurts with short pauses of digital
+ * silence, the others are listen-only and marked inactive with a low noise floor on their microphones
+ */
+class ConferenceInput
+{
+public:
+  ConferenceInput(int iParticipants, int iSpeakers, int iSamplesPerFrame)
+    :m_iParticipants(iParticipants),
+    m_iSpeakers(iSpeakers),
+    m_iSamplesPerFrame(iSamplesPerFrame),
+    m_vSamples(static_cast<size_t>(iParticipants) * iSamplesPerFrame),
+    m_vInputs(iParticipants),
+    m_uiSeed(0xC0FFEEu)
+  {
+    for (int i = 0; i < iParticipants; ++i) m_vInputs[i] = m_vSamples.data() + static_cast<size_t>(i) * iSamplesPerFrame;
+  }
+
+  bool isSpeaker(int iParticipant) const { return iParticipant < m_iSpeakers; }
+  bool isTalking(int iParticipant, int iFrame) const
+  {
+    if (!isSpeaker(iParticipant)) return false;
+    const int iPos = (iFrame + iParticipant * SPURT_FRAMES / std::max(m_iSpeakers, 1)) % SPURT_FRAMES;
+    return iPos < TALK_FRAMES && iPos % PAUSE_EVERY_FRAMES < PAUSE_EVERY_FRAMES - PAUSE_FRAMES;
+  }
+  /// the number of talk spurts started in iFrames frames, counting the pauses within them as part of the spurt
+  int getSpurts(int iParticipant, int iFrames) const
+  {
+    int iSpurts = 0;
+    for (int f = 0; f < iFrames; ++f)
+    {
+      const int iPos = (f + iParticipant * SPURT_FRAMES / std::max(m_iSpeakers, 1)) % SPURT_FRAMES;
+      if (isSpeaker(iParticipant) && iPos == 0) ++iSpurts;
+    }
+    return iSpurts + (isSpeaker(iParticipant) && isTalking(iParticipant, 0) ? 1 : 0);
+  }
+  const int16_t* const* generate(int iFrame)
+  {
+    for (int i = 0; i < m_iParticipants; ++i)
+    {
+      const int32_t iScale = isTalking(i, iFrame) ? 8000 : (isSpeaker(i) ? 0 : 30);
+      for (int s = 0; s < m_iSamplesPerFrame; ++s)
+      {
+        m_vInputs[i][s] = static_cast<int16_t>((static_cast<int32_t>(nextRandom(m_uiSeed) >> 16) - 32768) * iScale / 32768);
+      }
+    }
+    return m_vInputs.data();
+  }
+  void setActivity(MixMinusMixer& mixer) const
+  {
+    for (int i = 0; i < m_iParticipants; ++i) mixer.setActive(i, isSpeaker(i));
+  }
+
+private:
+  int m_iParticipants;
+  int m_iSpeakers;
+  int m_iSamplesPerFrame;
+  std::vector<int16_t> m_vSamples;
+  std::vector<int16_t*> m_vInputs;
+  uint32_t m_uiSeed;
+};
+
+/// what every receiver should hear: the saturated sum of the other participants that contribute
+static void mixForReceiver(const ConferenceInput& input, const int16_t* const* ppInputs, int iParticipants, int iSamples, int iReceiver,
+  std::vector<int32_t>& vSum, int16_t* pOut)
+{
+  std::fill(vSum.begin(), vSum.end(), 0);
+  for (int j = 0; j < iParticipants; ++j)
+  {
+    if (j == iReceiver || !input.isSpeaker(j)) continue;
+    for (int s = 0; s < iSamples; ++s) vSum[s] += ppInputs[j][s];
+  }
+  for (int s = 0; s < iSamples; ++s)
+  {
+    pOut[s] = static_cast<int16_t>(std::min<int32_t>(INT16_MAX, std::max<int32_t>(INT16_MIN, vSum[s])));
+  }
+}
+
+/**
+ * @brief The results of a run of the conference encoder
+ */
+struct ConferenceRun
+{
+  int iMixMismatches;
+  int iShareMismatches;
+  int iFlagMismatches;
+  uint64_t uiEncodes;
+  uint64_t uiSwitches;
+};
+
+/**
+ * @brief Runs the conference encoder and compares every mix with the mix built for the receiver alone, checks that the
+ * receivers of the full mix share the packet and that a receiver's packets are flagged exactly when they come from
+ * another encoder
+ */
+static bool runConference(int iParticipants, int iSpeakers, int iSamplesPerSecond, int iChannels, uint32_t uiKbps,
+  OpusFrameDuration eFrameDuration, int iHoldFrames, int iFrames, ConferenceRun& run)
+{
+  ConferenceEncoder conference(iParticipants, iSamplesPerSecond, iChannels, uiKbps, eFrameDuration);
+  conference.getMixer().setHoldFrames(iHoldFrames);
+  if (!conference.open())
+  {
+    printf("Unable to open the conference encoder\n");
+    return false;
+  }
+  const int iSamples = conference.getMixer().getSamplesPerFrame();
+  ConferenceInput input(iParticipants, iSpeakers, iSamples);
+  input.setActivity(conference.getMixer());
+  std::vector<int32_t> vSum(iSamples);
+  std::vector<int16_t> vExpected(iSamples);
+  std::vector<const uint8_t*> vLastPacket(iParticipants, nullptr);
+  run = ConferenceRun();
+  for (int f = 0; f < iFrames; ++f)
+  {
+    const int16_t* const* ppInputs = input.generate(f);
+    const int iEncodes = conference.encode(ppInputs);
+    if (iEncodes < 0)
+    {
+      printf("Encoding failed\n");
+      return false;
+    }
+    run.uiEncodes += iEncodes;
+    const MixMinusMixer& mixer = conference.getMixer();
+    if (iEncodes != mixer.getMixCount()) ++run.iShareMismatches;
+    const uint8_t* pFullMix = nullptr;
+    for (int i = 0; i < iParticipants; ++i)
+    {
+      mixForReceiver(input, ppInputs, iParticipants, iSamples, i, vSum, vExpected.data());
+      if (memcmp(mixer.getMix(mixer.getMixIndex(i)), vExpected.data(), iSamples * sizeof(int16_t)) != 0) ++run.iMixMismatches;
+      const ConferenceEncoder::Packet packet = conference.getPacket(i);
+      if (mixer.getMixIndex(i) == MixMinusMixer::FULL_MIX)
+      {
+        if (!pFullMix) pFullMix = packet.pData;
+        if (packet.pData != pFullMix) ++run.iShareMismatches;
+      }
+      // every encoder has a packet buffer of its own
+      if (packet.bDiscontinuity != (vLastPacket[i] != nullptr && packet.pData != vLastPacket[i])) ++run.iFlagMismatches;
+      vLastPacket[i] = packet.pData;
+    }
+  }
+  run.uiSwitches = conference.getEncoderSwitches();
+  return true;
+}
+
+static int check(int iSamplesPerSecond, int iChannels, uint32_t uiKbps, OpusFrameDuration eFrameDuration)
+{
+  const int iParticipants = 12;
+  const int iSpeakers = 4;
+  const int iFrames = 1000;
+  int iFailures = 0;
+  printf("%-28s %10s %10s %10s %10s %10s  %s\n", "case", "encodes", "switches", "mix diff", "share diff", "flag diff", "result");
+  for (int iHoldFrames : { 0, MixMinusMixer::DEFAULT_HOLD_FRAMES })
+  {
+    ConferenceRun run;
+    if (!runConference(iParticipants, iSpeakers, iSamplesPerSecond, iChannels, uiKbps, eFrameDuration, iHoldFrames, iFrames, run)) return 1;
+    // with a hold time longer than the pauses a speaker moves to its own encoder and back once per talk spurt
+    ConferenceInput input(iParticipants, iSpeakers, 1);
+    uint64_t uiMaxSwitches = 0;
+    for (int i = 0; i < iSpeakers; ++i) uiMaxSwitches += 2 * input.getSpurts(i, iFrames);
+    std::string sVerdict = "ok";
+    if (run.iMixMismatches > 0)
+      sVerdict = "mix-minus differs from the mix of the receiver";
+    else if (run.iShareMismatches > 0)
+      sVerdict = "full mix receivers don't share the encode";
+    else if (run.iFlagMismatches > 0)
+      sVerdict = "encoder switches not flagged";
+    else if (iHoldFrames >= PAUSE_FRAMES && run.uiSwitches > uiMaxSwitches)
+      sVerdict = "more than " + std::to_string(uiMaxSwitches) + " switches";
+    if (sVerdict != "ok") ++iFailures;
+    const std::string sName = "hold " + std::to_string(iHoldFrames) + " frames";
+    printf("%-28s %10llu %10llu %10d %10d %10d  %s\n", sName.c_str(), static_cast<unsigned long long>(run.uiEncodes),
+      static_cast<unsigned long long>(run.uiSwitches), run.iMixMismatches, run.iShareMismatches, run.iFlagMismatches, sVerdict.c_str());
+  }
+
+  // the engines only encode whole mixes: none of them should have allocated a framing buffer
+  const uint64_t uiBefore = AllocationCounter::getAllocatedBytes();
+  {
+    ConferenceEncoder conference(iParticipants, iSamplesPerSecond, iChannels, uiKbps, eFrameDuration);
+    if (!conference.open()) return 1;
+  }
+  const uint64_t uiPerEngine = (AllocationCounter::getAllocatedBytes() - uiBefore) / (iParticipants + 1);
+  const bool bSmall = uiPerEngine < static_cast<uint64_t>(AUDIO_BUFFER_SIZE) / 4;
+  if (!bSmall) ++iFailures;
+  printf("%-28s %10llu bytes allocated per engine  %s\n", "engine footprint", static_cast<unsigned long long>(uiPerEngine),
+    bSmall ? "ok" : "framing buffer allocated");
+  printf("%d failures\n", iFailures);
+  return iFailures == 0 ? 0 : 1;
+}
+
+static int bench(int iParticipants, int iSpeakers, int iSamplesPerSecond, int iChannels, uint32_t uiKbps,
+  OpusFrameDuration eFrameDuration, int iSeconds)
+{
+  const REFERENCE_TIME tFrameDuration = frameDurationTo100ns(eFrameDuration);
+  const int iFrames = static_cast<int>(iSeconds * 10000000LL / tFrameDuration);
+  const int iSamples = static_cast<int>(iSamplesPerSecond * tFrameDuration / 10000000) * iChannels;
+
+  // a mix and an encoder per receiver, as with an OpusEncoderFilter per mix-minus output
+  std::vector<std::unique_ptr<OpusEncodeEngine>> vEngines;
+  for (int i = 0; i < iParticipants; ++i)
+  {
+    vEngines.push_back(std::make_unique<OpusEncodeEngine>());
+    vEngines.back()->setFrameDuration(eFrameDuration);
+    if (!vEngines.back()->open(iSamplesPerSecond, iChannels, 16, uiKbps))
+    {
+      printf("Unable to open the encoder: %s\n", vEngines.back()->getLastError().c_str());
+      return 1;
+    }
+  }
+  ConferenceInput perReceiverInput(iParticipants, iSpeakers, iSamples);
+  std::vector<int32_t> vSum(iSamples);
+  std::vector<int16_t> vMix(iSamples);
+  std::vector<uint8_t> vPacket(MAX_PACKET_SIZE);
+  auto tBegin = std::chrono::steady_clock::now();
+  for (int f = 0; f < iFrames; ++f)
+  {
+    const int16_t* const* ppInputs = perReceiverInput.generate(f);
+    for (int i = 0; i < iParticipants; ++i)
+    {
+      mixForReceiver(perReceiverInput, ppInputs, iParticipants, iSamples, i, vSum, vMix.data());
+      if (vEngines[i]->encodeFrame(reinterpret_cast<uint8_t*>(vMix.data()), vPacket.data(), MAX_PACKET_SIZE) < 0)
+      {
+        printf("Encoding failed: %s\n", vEngines[i]->getLastError().c_str());
+        return 1;
+      }
+    }
+  }
+  const double dPerReceiverSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tBegin).count();
+  vEngines.clear();
+
+  ConferenceEncoder conference(iParticipants, iSamplesPerSecond, iChannels, uiKbps, eFrameDuration);
+  if (!conference.open())
+  {
+    printf("Unable to open the conference encoder\n");
+    return 1;
+  }
+  ConferenceInput input(iParticipants, iSpeakers, iSamples);
+  input.setActivity(conference.getMixer());
+  uint64_t uiEncodes = 0;
+  tBegin = std::chrono::steady_clock::now();
+  for (int f = 0; f < iFrames; ++f)
+  {
+    const int iEncodes = conference.encode(input.generate(f));
+    if (iEncodes < 0)
+    {
+      printf("Encoding failed\n");
+      return 1;
+    }
+    uiEncodes += iEncodes;
+  }
+  const double dConferenceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tBegin).count();
+
+  printf("%d participants, %d speakers, %d Hz, %d channels, %u kbps, %d s\n", iParticipants, iSpeakers, iSamplesPerSecond, iChannels, uiKbps, iSeconds);
+  printf("%-24s %14s %14s %10s\n", "", "encodes/frame", "us/frame", "realtime");
+  printf("%-24s %14.2f %14.1f %9.1fx\n", "mix+encode per receiver", static_cast<double>(iParticipants), dPerReceiverSeconds * 1e6 / iFrames,
+    dPerReceiverSeconds > 0.0 ? iSeconds / dPerReceiverSeconds : 0.0);
+  printf("%-24s %14.2f %14.1f %9.1fx\n", "mix-minus, shared", static_cast<double>(uiEncodes) / iFrames, dConferenceSeconds * 1e6 / iFrames,
+    dConferenceSeconds > 0.0 ? iSeconds / dConferenceSeconds : 0.0);
+  printf("speed-up %.2fx, %llu encoder switches\n", dConferenceSeconds > 0.0 ? dPerReceiverSeconds / dConferenceSeconds : 0.0,
+    static_cast<unsigned long long>(conference.getEncoderSwitches()));
+  return 0;
+}
+
+static bool parseFrameDuration(const char* szMs, OpusFrameDuration& eFrameDuration)
+{
+  static const struct
+  {
+    const char* szMs;
+    OpusFrameDuration eFrameDuration;
+  } vDurations[] = { { "2.5", OpusFrameDuration::OFD_2_5_MS }, { "5", OpusFrameDuration::OFD_5_MS }, { "10", OpusFrameDuration::OFD_10_MS },
+    { "20", OpusFrameDuration::OFD_20_MS }, { "40", OpusFrameDuration::OFD_40_MS }, { "60", OpusFrameDuration::OFD_60_MS } };
+  for (const auto& duration : vDurations)
+  {
+    if (strcmp(szMs, duration.szMs) == 0)
+    {
+      eFrameDuration = duration.eFrameDuration;
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2 || (strcmp(argv[1], "check") != 0 && strcmp(argv[1], "bench") != 0))
+  {
+    printf("Usage: %s check|bench [--participants=n] [--speakers=n] [--rate=Hz] [--channels=n] [--bitrate=kbps]\n", argv[0]);
+    printf("       [--frame-ms=2.5|5|10|20|40|60] [--seconds=s]\n");
+    printf("check compares every mix-minus with the mix built for the receiver alone, checks that the receivers of the full\n");
+    printf("mix share one encode, that encoder switches are flagged and limited by the hold time, and the engine footprint.\n");
+    printf("bench compares the conference encoder with a mix and an encode per receiver.\n");
+    return 1;
+  }
+  int iParticipants = 32;
+  int iSpeakers = 3;
+  int iSamplesPerSecond = 48000;
+  int iChannels = 1;
+  uint32_t uiKbps = 32;
+  OpusFrameDuration eFrameDuration = OpusFrameDuration::OFD_20_MS;
+  int iSeconds = 20;
+  for (int i = 2; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "--participants=", 15) == 0)
+      iParticipants = atoi(argv[i] + 15);
+    else if (strncmp(argv[i], "--speakers=", 11) == 0)
+      iSpeakers = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--rate=", 7) == 0)
+      iSamplesPerSecond = atoi(argv[i] + 7);
+    else if (strncmp(argv[i], "--channels=", 11) == 0)
+      iChannels = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--bitrate=", 10) == 0)
+      uiKbps = static_cast<uint32_t>(atoi(argv[i] + 10));
+    else if (strncmp(argv[i], "--frame-ms=", 11) == 0)
+    {
+      if (!parseFrameDuration(argv[i] + 11, eFrameDuration))
+      {
+        printf("Invalid frame duration %s\n", argv[i] + 11);
+        return 1;
+      }
+    }
+    else if (strncmp(argv[i], "--seconds=", 10) == 0)
+      iSeconds = atoi(argv[i] + 10);
+    else
+    {
+      printf("Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (iParticipants < 1 || iSpeakers < 0 || iSpeakers > iParticipants || iSeconds < 1)
+  {
+    printf("Invalid conference\n");
+    return 1;
+  }
+  if (strcmp(argv[1], "check") == 0) return check(iSamplesPerSecond, iChannels, uiKbps, eFrameDuration);
+  return bench(iParticipants, iSpeakers, iSamplesPerSecond, iChannels, uiKbps, eFrameDuration, iSeconds);
+}
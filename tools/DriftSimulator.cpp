@@ -0,0 +1,256 @@
+/** @file
+
+MODULE				: DriftSimulator
+
+FILE NAME			: DriftSimulator.cpp
+
+DESCRIPTION			: Simulates a day of a drifting live source feeding a clocked sink through the drift compensation
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "OpusEncodeEngine.h"
+
+static const double PI = 3.14159265358979323846;
+
+/// 32 bit linear congruential generator so that the simulation is the same on every platform
+static uint32_t nextRandom(uint32_t& uiState)
+{
+  uiState = uiState * 1664525u + 1013904223u;
+  return uiState;
+}
+
+/// statistics of one hour of simulated time
+struct HourStats
+{
+  double dOccupancySum;
+  uint64_t uiMeasurements;
+  int iMinOccupancy;
+  int iMaxOccupancy;
+  uint64_t uiDroppedFrames;
+  uint64_t uiUnderruns;
+  double dMaxErrorPpm;
+};
+
+/**
+ * A live source whose clock drifts against the reference clock delivers blocks to the engine as the filter's
+ * Receive does with a live delivery_policy: the audio is added, the frames downstream accepts are read and then the
+ * occupancy is measured. Downstream is a sink clocked by the reference that accepts one frame per frame duration,
+ * e.g. a renderer or a network sender. Audio that exceeds the queue limit is dropped oldest first as admitAudio does.
+ * Without compensation the queue fills up or runs dry at the drift rate; with it the queue has to stay put for the
+ * whole run while the drift wanders. The encoder isn't run: only the framing buffer and the drift compensation are
+ * simulated, which keeps a day of audio to a few minutes.
+ */
+int main(int argc, char** argv)
+{
+  int iSamplesPerSecond = 48000;
+  int iChannels = 1;
+  double dHours = 24.0;
+  double dDriftPpm = 100.0;
+  double dWanderPpm = 20.0;
+  double dWanderPeriodS = 3600.0;
+  double dJitterMs = 2.0;
+  int iBlockMs = 10;
+  int iFrameMs = 20;
+  uint32_t uiMaxQueuedMs = 200;
+  DriftCompensator::Mode eMode = DriftCompensator::Mode::DC_OCCUPANCY;
+  bool bCompensate = true;
+  double dSettleHours = 1.0;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "--rate=", 7) == 0)
+      iSamplesPerSecond = atoi(argv[i] + 7);
+    else if (strncmp(argv[i], "--channels=", 11) == 0)
+      iChannels = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--hours=", 8) == 0)
+      dHours = atof(argv[i] + 8);
+    else if (strncmp(argv[i], "--drift-ppm=", 12) == 0)
+      dDriftPpm = atof(argv[i] + 12);
+    else if (strncmp(argv[i], "--wander-ppm=", 13) == 0)
+      dWanderPpm = atof(argv[i] + 13);
+    else if (strncmp(argv[i], "--wander-period=", 16) == 0)
+      dWanderPeriodS = atof(argv[i] + 16);
+    else if (strncmp(argv[i], "--jitter-ms=", 12) == 0)
+      dJitterMs = atof(argv[i] + 12);
+    else if (strncmp(argv[i], "--block-ms=", 11) == 0)
+      iBlockMs = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--frame-ms=", 11) == 0)
+      iFrameMs = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--max-queued-ms=", 16) == 0)
+      uiMaxQueuedMs = static_cast<uint32_t>(atoi(argv[i] + 16));
+    else if (strncmp(argv[i], "--settle-hours=", 15) == 0)
+      dSettleHours = atof(argv[i] + 15);
+    else if (strcmp(argv[i], "--mode=occupancy") == 0)
+      eMode = DriftCompensator::Mode::DC_OCCUPANCY;
+    else if (strcmp(argv[i], "--mode=timestamps") == 0)
+      eMode = DriftCompensator::Mode::DC_TIMESTAMPS;
+    else if (strcmp(argv[i], "--mode=off") == 0)
+      bCompensate = false;
+    else
+    {
+      printf("Usage: %s [--rate=Hz] [--channels=n] [--hours=h] [--drift-ppm=ppm] [--wander-ppm=ppm] [--wander-period=s]\n", argv[0]);
+      printf("  [--jitter-ms=ms] [--block-ms=ms] [--frame-ms=10|20|40|60] [--max-queued-ms=ms] [--settle-hours=h]\n");
+      printf("  [--mode=occupancy|timestamps|off]\n");
+      printf("Simulates a source whose clock runs drift-ppm fast, wandering sinusoidally by wander-ppm, feeding a sink clocked\n");
+      printf("by the reference through a live queue. Fails if the queue drops audio or runs dry after the settling time.\n");
+      return 1;
+    }
+  }
+  OpusFrameDuration eFrameDuration;
+  switch (iFrameMs)
+  {
+  case 10: eFrameDuration = OpusFrameDuration::OFD_10_MS; break;
+  case 20: eFrameDuration = OpusFrameDuration::OFD_20_MS; break;
+  case 40: eFrameDuration = OpusFrameDuration::OFD_40_MS; break;
+  case 60: eFrameDuration = OpusFrameDuration::OFD_60_MS; break;
+  default:
+    printf("Unsupported frame duration %d ms\n", iFrameMs);
+    return 1;
+  }
+  if (iBlockMs < 1 || dJitterMs < 0.0 || dJitterMs >= iBlockMs || uiMaxQueuedMs < static_cast<uint32_t>(2 * (iFrameMs + iBlockMs)))
+  {
+    printf("The jitter must be shorter than a block and the queue must hold two frames and two blocks\n");
+    return 1;
+  }
+
+  OpusEncodeEngine engine;
+  engine.enableDriftCompensation(bCompensate, eMode);
+  engine.setMaxQueuedMs(uiMaxQueuedMs);
+  if (!engine.open(iSamplesPerSecond, iChannels, 16, 64))
+  {
+    printf("Unable to open the encoder: %s\n", engine.getLastError().c_str());
+    return 1;
+  }
+  engine.setFrameDuration(eFrameDuration);
+  IAudioBuffer* pBuffer = engine.getAudioBuffer();
+  const int iBytesPerSecond = pBuffer->getBytesPerSecond();
+  const int iBytesPerFrame = pBuffer->getBytesPerFrame();
+  const int iBlockSamples = iSamplesPerSecond * iBlockMs / 1000;
+  const long lMaxQueued = static_cast<long>(static_cast<int64_t>(uiMaxQueuedMs) * iBytesPerSecond / 1000);
+
+  // a 997 Hz tone so that the resampler works on real signal
+  std::vector<int16_t> vBlock(static_cast<size_t>(iBlockSamples) * iChannels);
+  uint64_t uiSourceSamples = 0;
+
+  const double dEnd = dHours * 3600.0;
+  const double dFrameS = iFrameMs / 1000.0;
+  // the sink starts once the queue is half full, where the compensation keeps it
+  double dNextArrival = 0.0;
+  double dNextTick = uiMaxQueuedMs / 2000.0;
+  // the source clock: the position of the next block in source seconds
+  double dSourceS = 0.0;
+  uint32_t uiSeed = 0xC0FFEEu;
+  double dJitter = 0.0;
+
+  printf("%d Hz, %d channels, %d ms blocks, %d ms frames, queue %u ms, drift %.1f ppm wandering %.1f ppm over %.0f s, jitter %.1f ms, %s\n",
+    iSamplesPerSecond, iChannels, iBlockMs, iFrameMs, uiMaxQueuedMs, dDriftPpm, dWanderPpm, dWanderPeriodS, dJitterMs,
+    !bCompensate ? "uncompensated" : (eMode == DriftCompensator::Mode::DC_OCCUPANCY ? "occupancy mode" : "timestamps mode"));
+  printf("%6s %10s %12s %12s %10s %10s %10s %10s %12s\n", "hour", "drift ppm", "correction", "max err ppm", "avg ms", "min ms", "max ms",
+    "dropped", "underruns");
+
+  HourStats hour = { 0.0, 0, static_cast<int>(lMaxQueued), 0, 0, 0, 0.0 };
+  uint64_t uiDroppedAfterSettling = 0, uiUnderrunsAfterSettling = 0;
+  double dMaxErrorAfterSettling = 0.0;
+  int iHour = 0;
+  REFERENCE_TIME tFrameStart, tFrameStop;
+  uint8_t* pFrame = nullptr;
+  while (std::min(dNextArrival + dJitter, dNextTick) < dEnd)
+  {
+    const bool bSettled = dNextTick >= dSettleHours * 3600.0;
+    if (dNextArrival + dJitter <= dNextTick)
+    {
+      // the source delivers a block: timestamps are stamped by the reference clock on arrival
+      const double dNow = dNextArrival + dJitter;
+      for (int i = 0; i < iBlockSamples; ++i, ++uiSourceSamples)
+      {
+        const int16_t iSample = static_cast<int16_t>(8000.0 * std::sin(2.0 * PI * 997.0 * uiSourceSamples / iSamplesPerSecond));
+        for (int c = 0; c < iChannels; ++c) vBlock[static_cast<size_t>(i) * iChannels + c] = iSample;
+      }
+      uint8_t* pQueued = nullptr;
+      REFERENCE_TIME tQueued;
+      long lQueued = pBuffer->getBufferedData(pQueued, tQueued);
+      const long lBlock = static_cast<long>(vBlock.size() * sizeof(int16_t));
+      while (lQueued + lBlock > lMaxQueued && engine.readNextAudioFrame(tFrameStart, tFrameStop, pFrame))
+      {
+        lQueued -= iBytesPerFrame;
+        ++hour.uiDroppedFrames;
+        if (bSettled) ++uiDroppedAfterSettling;
+      }
+      const REFERENCE_TIME tStart = static_cast<REFERENCE_TIME>(dNow * 1e7);
+      if (engine.addAudioData(reinterpret_cast<uint8_t*>(vBlock.data()), static_cast<uint32_t>(lBlock), tStart, tStart + iBlockMs * 10000LL) == -1)
+      {
+        printf("Audio buffer overflow\n");
+        return 1;
+      }
+      // downstream accepts no frame before it is due: the occupancy is measured with the rest still queued
+      engine.measureDriftOccupancy();
+      const int iOccupancy = pBuffer->getBufferedData(pQueued, tQueued);
+      hour.dOccupancySum += iOccupancy;
+      ++hour.uiMeasurements;
+      hour.iMinOccupancy = std::min(hour.iMinOccupancy, iOccupancy);
+      hour.iMaxOccupancy = std::max(hour.iMaxOccupancy, iOccupancy);
+
+      // the next block after iBlockMs of the source clock, which runs fast by the drift
+      const double dDriftPpmNow = dDriftPpm + dWanderPpm * std::sin(2.0 * PI * dNextArrival / dWanderPeriodS);
+      dSourceS += iBlockMs / 1000.0;
+      dNextArrival += iBlockMs / 1000.0 / (1.0 + dDriftPpmNow * 1e-6);
+      dJitter = dJitterMs / 1000.0 * (nextRandom(uiSeed) >> 8) / 16777216.0;
+    }
+    else
+    {
+      // the sink takes one frame per frame duration of the reference clock
+      if (!engine.readNextAudioFrame(tFrameStart, tFrameStop, pFrame))
+      {
+        ++hour.uiUnderruns;
+        if (bSettled) ++uiUnderrunsAfterSettling;
+      }
+      const double dDriftPpmNow = dDriftPpm + dWanderPpm * std::sin(2.0 * PI * dNextTick / dWanderPeriodS);
+      // the compensation produces fewer samples when the source is fast
+      const double dErrorPpm = std::fabs(engine.getDriftCorrectionPpm() + dDriftPpmNow);
+      hour.dMaxErrorPpm = std::max(hour.dMaxErrorPpm, dErrorPpm);
+      if (bSettled) dMaxErrorAfterSettling = std::max(dMaxErrorAfterSettling, dErrorPpm);
+      dNextTick += dFrameS;
+      if (dNextTick >= (iHour + 1) * 3600.0 || dNextTick >= dEnd)
+      {
+        const double dToMs = 1000.0 / iBytesPerSecond;
+        printf("%6d %10.1f %12.1f %12.1f %10.1f %10.1f %10.1f %10llu %12llu\n", iHour + 1, dDriftPpmNow, engine.getDriftCorrectionPpm(),
+          hour.dMaxErrorPpm, hour.uiMeasurements ? hour.dOccupancySum / hour.uiMeasurements * dToMs : 0.0, hour.iMinOccupancy * dToMs,
+          hour.iMaxOccupancy * dToMs, static_cast<unsigned long long>(hour.uiDroppedFrames), static_cast<unsigned long long>(hour.uiUnderruns));
+        fflush(stdout);
+        hour = { 0.0, 0, static_cast<int>(lMaxQueued), 0, 0, 0, 0.0 };
+        ++iHour;
+      }
+    }
+  }
+  printf("after %.1f h of settling: %llu frames dropped, %llu underruns, correction within %.1f ppm of the drift\n", dSettleHours,
+    static_cast<unsigned long long>(uiDroppedAfterSettling), static_cast<unsigned long long>(uiUnderrunsAfterSettling), dMaxErrorAfterSettling);
+  return (uiDroppedAfterSettling == 0 && uiUnderrunsAfterSettling == 0) ? 0 : 1;
+}
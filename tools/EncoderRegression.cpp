@@ -0,0 +1,459 @@
+/** @file
+
+MODULE				: EncoderRegression
+
+FILE NAME			: EncoderRegression.cpp
+
+DESCRIPTION			: Bit-exact golden output and performance regression checks of the encode engine over a synthetic corpus
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "OpusEncodeEngine.h"
+#include "AllocationCounter.h"
+#include <CodecUtils/ICodecv2.h>
+
+// an Opus packet of 120 ms
+static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+// length of the synthetic input of every case
+static const int CORPUS_MS = 4000;
+// the timestamps jump forward by this much at GAP_AT_MS to exercise the silence fill
+static const int GAP_AT_MS = 2000;
+static const int GAP_MS = 50;
+// frames that are excluded from the allocation count while the engine warms up
+static const int WARMUP_FRAMES = 50;
+// the throughput is the best of this many runs
+static const int PERF_RUNS = 5;
+// the leading fields of a packet line that the engine alone determines: sequence number, timestamps and frame CRC
+static const int FRAMING_FIELDS = 4;
+
+/**
+ * @brief One format and frame duration of the corpus
+ */
+struct RegressionCase
+{
+  int iSamplesPerSecond;
+  int iChannels;
+  OpusFrameDuration eFrameDuration;
+  const char* szFrameDuration;
+
+  std::string getName() const
+  {
+    return std::to_string(iSamplesPerSecond) + "_" + std::to_string(iChannels) + "_" + szFrameDuration;
+  }
+};
+
+/**
+ * @brief The encoded output of one case and how long it took
+ */
+struct CaseResult
+{
+  std::vector<std::string> vPackets;
+  double dSeconds;
+  uint64_t uiFrames;
+  uint64_t uiSteadyFrames;
+  uint64_t uiSteadyAllocations;
+};
+
+/// every format the filter accepts with every frame duration
+static std::vector<RegressionCase> getCases()
+{
+  static const int vRates[] = { 48000, 24000, 16000, 12000, 8000 };
+  static const struct
+  {
+    OpusFrameDuration eFrameDuration;
+    const char* szName;
+  } vDurations[] = { { OpusFrameDuration::OFD_2_5_MS, "2.5ms" }, { OpusFrameDuration::OFD_5_MS, "5ms" },
+    { OpusFrameDuration::OFD_10_MS, "10ms" }, { OpusFrameDuration::OFD_20_MS, "20ms" },
+    { OpusFrameDuration::OFD_40_MS, "40ms" }, { OpusFrameDuration::OFD_60_MS, "60ms" } };
+  std::vector<RegressionCase> vCases;
+  for (int iRate : vRates)
+    for (int iChannels = 1; iChannels <= 2; ++iChannels)
+      for (const auto& duration : vDurations)
+        vCases.push_back({ iRate, iChannels, duration.eFrameDuration, duration.szName });
+  return vCases;
+}
+
+/// 32 bit linear congruential generator so that the corpus is the same on every platform
+static uint32_t nextRandom(uint32_t& uiState)
+{
+  uiState = uiState * 1664525u + 1013904223u;
+  return uiState;
+}
+
+/// integer sine approximation of a 32 bit phase, full scale +-32767
+static int32_t integerSine(uint32_t uiPhase)
+{
+  // parabola per half period, exact at the zero crossings and peaks
+  const int32_t x = static_cast<int32_t>((uiPhase >> 16) & 0x7fff);
+  const int32_t y = static_cast<int32_t>((4LL * x * (0x8000 - x)) >> 15);
+  return (uiPhase & 0x80000000u) ? -y : y;
+}
+
+/**
+ * @brief Generates the corpus with integer arithmetic only: a logarithmic-ish sweep at -12 dBFS
+ * followed by amplitude-modulated noise at -20 dBFS and a quiet tail, decorrelated between the channels.
+ */
+static std::vector<int16_t> generateInput(int iSamplesPerSecond, int iChannels)
+{
+  const int iFrames = iSamplesPerSecond / 1000 * CORPUS_MS;
+  std::vector<int16_t> vInput(static_cast<size_t>(iFrames) * iChannels);
+  uint32_t uiSeed = 0x1234567u + static_cast<uint32_t>(iSamplesPerSecond) * 31u + static_cast<uint32_t>(iChannels);
+  uint32_t uiPhase = 0;
+  // 50 Hz rising to about 0.45 of the sampling rate over the first half
+  const uint64_t uiStartIncrement = (50ULL << 32) / iSamplesPerSecond;
+  const uint64_t uiEndIncrement = (1ULL << 32) / 100 * 45;
+  for (int i = 0; i < iFrames; ++i)
+  {
+    int32_t vSample[2];
+    if (i < iFrames / 2)
+    {
+      const uint64_t uiIncrement = uiStartIncrement + (uiEndIncrement - uiStartIncrement) * i / (iFrames / 2) * i / (iFrames / 2);
+      uiPhase += static_cast<uint32_t>(uiIncrement);
+      vSample[0] = integerSine(uiPhase) / 4;
+      vSample[1] = integerSine(uiPhase + 0x40000000u) / 4;
+    }
+    else
+    {
+      // 4 Hz syllable-rate envelope, decaying in the last quarter
+      const int32_t iEnvelope = (integerSine(static_cast<uint32_t>((4ULL << 32) / iSamplesPerSecond * i)) + 32768) / 2;
+      const int32_t iScale = i < iFrames * 3 / 4 ? 3277 : 100;
+      for (int c = 0; c < 2; ++c)
+      {
+        const int32_t iNoise = static_cast<int32_t>(nextRandom(uiSeed) >> 16) - 32768;
+        vSample[c] = static_cast<int32_t>(static_cast<int64_t>(iNoise) * iEnvelope / 32768 * iScale / 32768);
+      }
+    }
+    for (int c = 0; c < iChannels; ++c) vInput[static_cast<size_t>(i) * iChannels + c] = static_cast<int16_t>(vSample[c]);
+  }
+  return vInput;
+}
+
+/// CRC-32 (IEEE 802.3) of the packet payload
+static uint32_t crc32(const uint8_t* pData, size_t uiSize)
+{
+  static uint32_t vTable[256] = { 0 };
+  if (vTable[1] == 0)
+  {
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      vTable[i] = c;
+    }
+  }
+  uint32_t uiCrc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < uiSize; ++i) uiCrc = vTable[(uiCrc ^ pData[i]) & 0xff] ^ (uiCrc >> 8);
+  return uiCrc ^ 0xFFFFFFFFu;
+}
+
+/**
+ * @brief Whether a packet line matches a golden line. A golden line of the framing only (the sequence number, the
+ * timestamps and the CRC of the frame handed to the codec) matches the packet lines of any Opus build.
+ */
+static bool matchesGolden(const std::string& sLine, const std::string& sGolden)
+{
+  if (sLine == sGolden) return true;
+  return std::count(sGolden.begin(), sGolden.end(), ' ') == FRAMING_FIELDS - 1 && sLine.size() > sGolden.size() &&
+    sLine.compare(0, sGolden.size(), sGolden) == 0 && sLine[sGolden.size()] == ' ';
+}
+
+/**
+ * @brief Encodes the corpus of one case, fed in irregular blocks as a capture device with a jittery period would,
+ * with a timestamp gap that is filled with silence.
+ * @param bRecord whether the packet lines are kept for the golden output
+ * @param bFramingOnly whether the packet lines end after the framing fields
+ */
+static bool runCase(const RegressionCase& c, const std::vector<int16_t>& vInput, bool bRecord, bool bFramingOnly, CaseResult& result)
+{
+  const uint32_t uiKbps = c.iChannels == 1 ? 32 : 64;
+  OpusEncodeEngine engine;
+  engine.setFrameDuration(c.eFrameDuration);
+  engine.setGapPolicy(GapPolicy::GP_FILL_SILENCE, 10 * 10000LL, 1000 * 10000LL);
+  if (!engine.open(c.iSamplesPerSecond, c.iChannels, 16, uiKbps))
+  {
+    printf("%s: %s\n", c.getName().c_str(), engine.getLastError().c_str());
+    return false;
+  }
+  result.vPackets.clear();
+  result.uiFrames = 0;
+  result.uiSteadyFrames = 0;
+  result.uiSteadyAllocations = 0;
+  uint64_t uiAllocationsAtWarmup = 0;
+
+  std::vector<uint8_t> vPacket(MAX_PACKET_SIZE);
+  char szLine[128];
+  auto encodeAvailable = [&]()
+  {
+    REFERENCE_TIME tStart, tStop;
+    uint8_t* pFrame = nullptr;
+    while (engine.readNextAudioFrame(tStart, tStop, pFrame))
+    {
+      const uint32_t uiFrameCrc = bRecord ? crc32(pFrame, engine.getBytesPerFrame()) : 0;
+      int iSize = engine.encodeFrame(pFrame, vPacket.data(), static_cast<int>(vPacket.size()));
+      if (iSize < 0)
+      {
+        printf("%s: encoding failed: %s\n", c.getName().c_str(), engine.getLastError().c_str());
+        return false;
+      }
+      if (bRecord)
+      {
+        int iLength = snprintf(szLine, sizeof(szLine), "%llu %lld %lld %08x", static_cast<unsigned long long>(result.uiFrames),
+          static_cast<long long>(tStart), static_cast<long long>(tStop), uiFrameCrc);
+        if (!bFramingOnly) snprintf(szLine + iLength, sizeof(szLine) - iLength, " %d %08x", iSize, crc32(vPacket.data(), iSize));
+        result.vPackets.push_back(szLine);
+      }
+      if (++result.uiFrames == WARMUP_FRAMES) uiAllocationsAtWarmup = AllocationCounter::getAllocations();
+    }
+    return true;
+  };
+
+  // blocks of 1 to 30 ms from a fixed seed
+  uint32_t uiSeed = 0xC0FFEEu;
+  const int64_t iGapAt = static_cast<int64_t>(c.iSamplesPerSecond) * GAP_AT_MS / 1000;
+  const REFERENCE_TIME tGap = GAP_MS * 10000LL;
+  const size_t uiFrames = vInput.size() / c.iChannels;
+  auto tBegin = std::chrono::steady_clock::now();
+  for (size_t uiPos = 0; uiPos < uiFrames;)
+  {
+    const size_t uiBlock = std::min(static_cast<size_t>(c.iSamplesPerSecond / 1000 * (1 + nextRandom(uiSeed) % 30)), uiFrames - uiPos);
+    const REFERENCE_TIME tOffset = static_cast<int64_t>(uiPos) >= iGapAt ? tGap : 0;
+    const REFERENCE_TIME tStart = static_cast<REFERENCE_TIME>(uiPos) * 10000000 / c.iSamplesPerSecond + tOffset;
+    const REFERENCE_TIME tStop = static_cast<REFERENCE_TIME>(uiPos + uiBlock) * 10000000 / c.iSamplesPerSecond + tOffset;
+    if (engine.addAudioData(const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(vInput.data() + uiPos * c.iChannels)),
+      static_cast<uint32_t>(uiBlock * c.iChannels * sizeof(int16_t)), tStart, tStop) == -1)
+    {
+      printf("%s: audio buffer overflow\n", c.getName().c_str());
+      return false;
+    }
+    if (!encodeAvailable()) return false;
+    uiPos += uiBlock;
+  }
+  if (engine.padPartialFrame() && !encodeAvailable()) return false;
+  result.dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tBegin).count();
+  if (result.uiFrames > WARMUP_FRAMES)
+  {
+    result.uiSteadyFrames = result.uiFrames - WARMUP_FRAMES;
+    result.uiSteadyAllocations = AllocationCounter::getAllocations() - uiAllocationsAtWarmup;
+  }
+  engine.close();
+  return true;
+}
+
+/**
+ * @brief Reads a file of "case <name>" headers each followed by the lines of that case
+ */
+static bool readSections(const char* szFile, std::map<std::string, std::vector<std::string>>& sections)
+{
+  FILE* pFile = fopen(szFile, "r");
+  if (!pFile)
+  {
+    printf("Unable to open %s\n", szFile);
+    return false;
+  }
+  char szLine[256];
+  std::vector<std::string>* pSection = nullptr;
+  while (fgets(szLine, sizeof(szLine), pFile))
+  {
+    std::string sLine(szLine);
+    while (!sLine.empty() && (sLine.back() == '\n' || sLine.back() == '\r')) sLine.pop_back();
+    if (sLine.empty()) continue;
+    if (sLine.compare(0, 5, "case ") == 0)
+      pSection = &sections[sLine.substr(5)];
+    else if (pSection)
+      pSection->push_back(sLine);
+  }
+  fclose(pFile);
+  return true;
+}
+
+static bool writeSections(const char* szFile, const std::vector<std::pair<std::string, std::vector<std::string>>>& vSections)
+{
+  FILE* pFile = fopen(szFile, "w");
+  if (!pFile)
+  {
+    printf("Unable to create %s\n", szFile);
+    return false;
+  }
+  for (const auto& section : vSections)
+  {
+    fprintf(pFile, "case %s\n", section.first.c_str());
+    for (const auto& sLine : section.second) fprintf(pFile, "%s\n", sLine.c_str());
+  }
+  fclose(pFile);
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3 || (strcmp(argv[1], "record") != 0 && strcmp(argv[1], "check") != 0))
+  {
+    printf("Usage: %s record|check <golden file> [<baseline file>] [--fps-tolerance=percent] [--alloc-tolerance=allocations per frame]\n", argv[0]);
+    printf("       [--case=<name>]... [--framing-only]\n");
+    printf("Encodes a synthetic corpus in every accepted format and frame duration. record writes the timestamps and CRC of\n");
+    printf("every frame handed to the codec, the packet sizes and CRCs and optionally the frames per second and allocations\n");
+    printf("per frame; check compares against them and fails on any output difference or a performance regression beyond\n");
+    printf("the tolerances.\n");
+    printf("  --case          only the named case, e.g. 48000_2_20ms. May be repeated.\n");
+    printf("  --framing-only  record without the packets: the golden output then holds for any Opus build\n");
+    printf("The baseline is specific to the machine: record it where it is checked. Without one only the output is checked.\n");
+    return 1;
+  }
+  const bool bRecord = strcmp(argv[1], "record") == 0;
+  const char* szGolden = argv[2];
+  const char* szBaseline = nullptr;
+  double dFpsTolerance = 10.0;
+  double dAllocTolerance = 0.0;
+  bool bFramingOnly = false;
+  std::vector<std::string> vSelected;
+  for (int i = 3; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "--fps-tolerance=", 16) == 0)
+      dFpsTolerance = atof(argv[i] + 16);
+    else if (strncmp(argv[i], "--alloc-tolerance=", 18) == 0)
+      dAllocTolerance = atof(argv[i] + 18);
+    else if (strncmp(argv[i], "--case=", 7) == 0)
+      vSelected.push_back(argv[i] + 7);
+    else if (strcmp(argv[i], "--framing-only") == 0)
+      bFramingOnly = true;
+    else if (!szBaseline)
+      szBaseline = argv[i];
+    else
+    {
+      printf("Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  std::map<std::string, std::vector<std::string>> golden, baseline;
+  if (!bRecord)
+  {
+    if (!readSections(szGolden, golden)) return 1;
+    if (szBaseline && !readSections(szBaseline, baseline)) return 1;
+  }
+
+  std::vector<RegressionCase> vCases = getCases();
+  if (!vSelected.empty())
+  {
+    for (const std::string& sSelected : vSelected)
+    {
+      if (std::none_of(vCases.begin(), vCases.end(), [&sSelected](const RegressionCase& c) { return c.getName() == sSelected; }))
+      {
+        printf("Unknown case %s\n", sSelected.c_str());
+        return 1;
+      }
+    }
+    vCases.erase(std::remove_if(vCases.begin(), vCases.end(), [&vSelected](const RegressionCase& c)
+    {
+      return std::find(vSelected.begin(), vSelected.end(), c.getName()) == vSelected.end();
+    }), vCases.end());
+  }
+
+  std::vector<std::pair<std::string, std::vector<std::string>>> vGoldenOut, vBaselineOut;
+  int iFailures = 0;
+  printf("%-16s %8s %12s %14s  %s\n", "case", "frames", "frames/s", "allocs/frame", "result");
+  for (const RegressionCase& c : vCases)
+  {
+    const std::string sName = c.getName();
+    const std::vector<int16_t> vInput = generateInput(c.iSamplesPerSecond, c.iChannels);
+    CaseResult result;
+    if (!runCase(c, vInput, true, bFramingOnly, result)) return 1;
+    std::vector<std::string> vPackets;
+    vPackets.swap(result.vPackets);
+
+    // the best of several runs, without building the packet lines
+    double dBestSeconds = result.dSeconds;
+    for (int r = 1; r < PERF_RUNS; ++r)
+    {
+      if (!runCase(c, vInput, false, false, result)) return 1;
+      dBestSeconds = std::min(dBestSeconds, result.dSeconds);
+    }
+    const double dFps = dBestSeconds > 0.0 ? result.uiFrames / dBestSeconds : 0.0;
+    const double dAllocsPerFrame = result.uiSteadyFrames > 0 ? static_cast<double>(result.uiSteadyAllocations) / result.uiSteadyFrames : 0.0;
+
+    std::string sVerdict = "ok";
+    if (bRecord)
+    {
+      vGoldenOut.emplace_back(sName, vPackets);
+      char szLine[64];
+      snprintf(szLine, sizeof(szLine), "%.1f %.3f", dFps, dAllocsPerFrame);
+      vBaselineOut.emplace_back(sName, std::vector<std::string>(1, szLine));
+      sVerdict = "recorded";
+    }
+    else
+    {
+      auto it = golden.find(sName);
+      if (it == golden.end())
+        sVerdict = "no golden output";
+      else if (it->second.size() != vPackets.size() || !std::equal(vPackets.begin(), vPackets.end(), it->second.begin(), matchesGolden))
+      {
+        size_t uiFirst = 0;
+        while (uiFirst < vPackets.size() && uiFirst < it->second.size() && matchesGolden(vPackets[uiFirst], it->second[uiFirst])) ++uiFirst;
+        sVerdict = "output differs at packet " + std::to_string(uiFirst) + " (" + std::to_string(vPackets.size()) + " packets, golden " +
+          std::to_string(it->second.size()) + ")";
+      }
+      auto itBase = baseline.find(sName);
+      if (sVerdict == "ok" && szBaseline)
+      {
+        double dBaseFps = 0.0, dBaseAllocs = 0.0;
+        if (itBase == baseline.end() || itBase->second.empty() || sscanf(itBase->second[0].c_str(), "%lf %lf", &dBaseFps, &dBaseAllocs) != 2)
+          sVerdict = "no baseline";
+        else if (dBaseFps <= 0.0)
+          sVerdict = "the baseline has no throughput: record it on this machine";
+        else if (dFps < dBaseFps * (1.0 - dFpsTolerance / 100.0))
+        {
+          char szVerdict[96];
+          snprintf(szVerdict, sizeof(szVerdict), "frames/s regressed from %.1f", dBaseFps);
+          sVerdict = szVerdict;
+        }
+        else if (dAllocsPerFrame > dBaseAllocs + dAllocTolerance)
+        {
+          char szVerdict[96];
+          snprintf(szVerdict, sizeof(szVerdict), "allocations per frame regressed from %.3f", dBaseAllocs);
+          sVerdict = szVerdict;
+        }
+      }
+      if (sVerdict != "ok") ++iFailures;
+    }
+    printf("%-16s %8llu %12.1f %14.3f  %s\n", sName.c_str(), static_cast<unsigned long long>(result.uiFrames), dFps, dAllocsPerFrame, sVerdict.c_str());
+  }
+
+  if (bRecord)
+  {
+    if (!writeSections(szGolden, vGoldenOut)) return 1;
+    if (szBaseline && !writeSections(szBaseline, vBaselineOut)) return 1;
+    return 0;
+  }
+  printf("%d of %d cases failed\n", iFailures, static_cast<int>(vCases.size()));
+  return iFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,259 @@
+/** @file
+
+MODULE				: GovernorLoadTest
+
+FILE NAME			: GovernorLoadTest.cpp
+
+DESCRIPTION			: Ramps real-time encode streams until the deadline-miss rate exceeds a threshold, with and without the EncoderGovernor
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "EncoderGovernor.h"
+#include "OpusEncodeEngine.h"
+
+// an Opus packet of 120 ms
+static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+// the capture period of every stream
+static const int BLOCK_MS = 20;
+// streams are degraded lowest priority first: spread them over a few priorities
+static const uint32_t PRIORITIES = 3;
+
+/// 32 bit linear congruential generator so that the input is the same on every platform
+static uint32_t nextRandom(uint32_t& uiState)
+{
+  uiState = uiState * 1664525u + 1013904223u;
+  return uiState;
+}
+
+/**
+ * @brief One stream: a thread that is handed a block of audio every BLOCK_MS as a capture device would and encodes
+ * the frames that are complete. A frame misses its deadline if it is encoded later than one frame duration after the
+ * block that completed it was due.
+ */
+class LoadStream
+{
+public:
+  LoadStream(int iIndex, int iSamplesPerSecond, int iChannels)
+    :m_iIndex(iIndex),
+    m_iSamplesPerSecond(iSamplesPerSecond),
+    m_iChannels(iChannels),
+    m_vInput(static_cast<size_t>(iSamplesPerSecond) * iChannels),
+    m_bStop(false),
+    m_uiFrames(0),
+    m_uiMisses(0),
+    m_bFailed(false)
+  {
+    // a second of noise at about -20 dBFS, different for every stream
+    uint32_t uiSeed = 0xC0FFEEu + static_cast<uint32_t>(iIndex);
+    for (auto& sample : m_vInput) sample = static_cast<int16_t>((static_cast<int32_t>(nextRandom(uiSeed) >> 16) - 32768) / 10);
+  }
+
+  ~LoadStream() { stop(); }
+
+  bool start(uint32_t uiKbps)
+  {
+    if (!m_engine.open(m_iSamplesPerSecond, m_iChannels, 16, uiKbps))
+    {
+      printf("Unable to open the encoder: %s\n", m_engine.getLastError().c_str());
+      return false;
+    }
+    m_engine.setPriority(static_cast<uint32_t>(m_iIndex) % PRIORITIES);
+    m_thread = std::thread(&LoadStream::run, this);
+    return true;
+  }
+
+  void stop()
+  {
+    m_bStop = true;
+    if (m_thread.joinable()) m_thread.join();
+  }
+
+  uint64_t getFrames() const { return m_uiFrames.load(); }
+  uint64_t getMisses() const { return m_uiMisses.load(); }
+  bool hasFailed() const { return m_bFailed.load(); }
+
+private:
+  void run()
+  {
+    const size_t uiBlockSamples = static_cast<size_t>(m_iSamplesPerSecond) * BLOCK_MS / 1000;
+    const size_t uiInputSamples = m_vInput.size() / m_iChannels;
+    std::vector<uint8_t> vPacket(MAX_PACKET_SIZE);
+    // the streams are staggered over the capture period as independent devices would be
+    auto tDue = std::chrono::steady_clock::now() + std::chrono::microseconds((m_iIndex * 7919) % (BLOCK_MS * 1000));
+    size_t uiPos = 0;
+    REFERENCE_TIME tStart = 0;
+    while (!m_bStop)
+    {
+      std::this_thread::sleep_until(tDue);
+      const REFERENCE_TIME tStop = tStart + BLOCK_MS * 10000LL;
+      if (m_engine.addAudioData(reinterpret_cast<uint8_t*>(m_vInput.data() + uiPos * m_iChannels),
+        static_cast<uint32_t>(uiBlockSamples * m_iChannels * sizeof(int16_t)), tStart, tStop) == -1)
+      {
+        m_bFailed = true;
+        return;
+      }
+      REFERENCE_TIME tFrameStart, tFrameStop;
+      uint8_t* pFrame = nullptr;
+      while (m_engine.readNextAudioFrame(tFrameStart, tFrameStop, pFrame))
+      {
+        if (m_engine.encodeFrame(pFrame, vPacket.data(), MAX_PACKET_SIZE) < 0)
+        {
+          m_bFailed = true;
+          return;
+        }
+        const double dLateMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tDue).count();
+        if (dLateMs > (tFrameStop - tFrameStart) / 10000.0) ++m_uiMisses;
+        ++m_uiFrames;
+      }
+      uiPos = (uiPos + uiBlockSamples) % (uiInputSamples - uiInputSamples % uiBlockSamples);
+      tStart = tStop;
+      tDue += std::chrono::milliseconds(BLOCK_MS);
+    }
+  }
+
+  int m_iIndex;
+  int m_iSamplesPerSecond;
+  int m_iChannels;
+  std::vector<int16_t> m_vInput;
+  OpusEncodeEngine m_engine;
+  std::thread m_thread;
+  std::atomic<bool> m_bStop;
+  std::atomic<uint64_t> m_uiFrames;
+  std::atomic<uint64_t> m_uiMisses;
+  std::atomic<bool> m_bFailed;
+};
+
+int main(int argc, char** argv)
+{
+  const unsigned uiCores = std::max(1u, std::thread::hardware_concurrency());
+  uint32_t uiBudgetPercent = 80 * uiCores;
+  int iSamplesPerSecond = 48000;
+  int iChannels = 1;
+  uint32_t uiKbps = 32;
+  int iStartStreams = 1;
+  int iStepStreams = 1;
+  int iMaxStreams = 1000;
+  int iStepSeconds = 5;
+  double dMissThresholdPercent = 0.1;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "--budget=", 9) == 0)
+      uiBudgetPercent = static_cast<uint32_t>(atoi(argv[i] + 9));
+    else if (strncmp(argv[i], "--rate=", 7) == 0)
+      iSamplesPerSecond = atoi(argv[i] + 7);
+    else if (strncmp(argv[i], "--channels=", 11) == 0)
+      iChannels = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--bitrate=", 10) == 0)
+      uiKbps = static_cast<uint32_t>(atoi(argv[i] + 10));
+    else if (strncmp(argv[i], "--start-streams=", 16) == 0)
+      iStartStreams = atoi(argv[i] + 16);
+    else if (strncmp(argv[i], "--step-streams=", 15) == 0)
+      iStepStreams = atoi(argv[i] + 15);
+    else if (strncmp(argv[i], "--max-streams=", 14) == 0)
+      iMaxStreams = atoi(argv[i] + 14);
+    else if (strncmp(argv[i], "--step-seconds=", 15) == 0)
+      iStepSeconds = atoi(argv[i] + 15);
+    else if (strncmp(argv[i], "--miss-threshold=", 17) == 0)
+      dMissThresholdPercent = atof(argv[i] + 17);
+    else
+    {
+      printf("Usage: %s [--budget=percent of a core] [--rate=Hz] [--channels=n] [--bitrate=kbps] [--start-streams=n]\n", argv[0]);
+      printf("  [--step-streams=n] [--max-streams=n] [--step-seconds=s] [--miss-threshold=percent]\n");
+      printf("Adds real-time streams step by step until more than the threshold of the frames of a step miss their deadline.\n");
+      printf("The governor is enabled with the budget, by default 80%% of each core; --budget=0 measures without it.\n");
+      return 1;
+    }
+  }
+  if (iStartStreams < 1 || iStepStreams < 1 || iStepSeconds < 2 || iMaxStreams < iStartStreams)
+  {
+    printf("Invalid ramp\n");
+    return 1;
+  }
+
+  EncoderGovernor& governor = EncoderGovernor::instance();
+  governor.setBudgetPercent(uiBudgetPercent);
+  printf("%u cores, governor %s", uiCores, uiBudgetPercent ? "budget " : "disabled");
+  if (uiBudgetPercent) printf("%u%%", uiBudgetPercent);
+  printf(", %d Hz, %d channels, %u kbps, miss threshold %.3f%%\n", iSamplesPerSecond, iChannels, uiKbps, dMissThresholdPercent);
+  printf("%8s %12s %12s %12s %12s\n", "streams", "frames", "misses", "miss %", "load %");
+
+  std::vector<std::unique_ptr<LoadStream>> vStreams;
+  int iSustained = 0;
+  int iStreams = iStartStreams;
+  for (;;)
+  {
+    while (static_cast<int>(vStreams.size()) < iStreams)
+    {
+      vStreams.push_back(std::make_unique<LoadStream>(static_cast<int>(vStreams.size()), iSamplesPerSecond, iChannels));
+      if (!vStreams.back()->start(uiKbps)) return 1;
+    }
+    // the first second of a step lets the governor and the new streams settle
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    uint64_t uiFrames = 0, uiMisses = 0;
+    for (const auto& pStream : vStreams)
+    {
+      uiFrames -= pStream->getFrames();
+      uiMisses -= pStream->getMisses();
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(iStepSeconds - 1));
+    bool bFailed = false;
+    for (const auto& pStream : vStreams)
+    {
+      uiFrames += pStream->getFrames();
+      uiMisses += pStream->getMisses();
+      bFailed = bFailed || pStream->hasFailed();
+    }
+    if (bFailed)
+    {
+      printf("A stream failed to encode\n");
+      return 1;
+    }
+    const double dMissPercent = uiFrames ? 100.0 * uiMisses / uiFrames : 100.0;
+    printf("%8d %12llu %12llu %12.3f %12.1f\n", iStreams, static_cast<unsigned long long>(uiFrames), static_cast<unsigned long long>(uiMisses),
+      dMissPercent, governor.getLoadPercent());
+    fflush(stdout);
+    if (dMissPercent > dMissThresholdPercent) break;
+    iSustained = iStreams;
+    if (iStreams >= iMaxStreams) break;
+    iStreams = std::min(iStreams + iStepStreams, iMaxStreams);
+  }
+  for (auto& pStream : vStreams) pStream->stop();
+  if (iSustained == iStreams)
+    printf("%d streams sustained without reaching the threshold\n", iSustained);
+  else
+    printf("%d streams sustained, the threshold was crossed at %d\n", iSustained, iStreams);
+  return 0;
+}
@@ -0,0 +1,328 @@
+/** @file
+
+MODULE				: LossSimulator
+
+FILE NAME			: LossSimulator.cpp
+
+DESCRIPTION			: Measures the FEC modes of the encode engine under simulated Gilbert-Elliott packet loss
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "FilterParameters.h"
+#include "OpusEncodeEngine.h"
+#include <OpusCodec/OpusFactory.h>
+#include <CodecUtils/ICodecv2.h>
+
+// an Opus packet of 120 ms
+static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+// the receiver reports the loss once a second, as RTCP would
+static const int REPORT_INTERVAL_MS = 1000;
+// decoder delay that is searched for when aligning the decoded audio
+static const int MAX_DELAY_MS = 30;
+// segmental SNR limits per 20 ms segment so that silence and perfect segments don't dominate
+static const int SEGMENT_MS = 20;
+static const double MIN_SEGMENT_SNR_DB = -10.0;
+static const double MAX_SEGMENT_SNR_DB = 35.0;
+
+/**
+ * @brief Two-state Markov loss model: every packet is lost in the bad state and delivered in the good state.
+ * The transition probabilities follow from the mean loss and the mean burst length.
+ */
+class GilbertElliottChannel
+{
+public:
+  GilbertElliottChannel(double dLoss, double dMeanBurstLength, unsigned uiSeed)
+    :m_dBadToGood(1.0 / std::max(dMeanBurstLength, 1.0)),
+    m_dGoodToBad(dLoss < 1.0 ? dLoss * m_dBadToGood / (1.0 - dLoss) : 1.0),
+    m_bBad(false),
+    m_rng(uiSeed)
+  {
+  }
+  /// @return true if the next packet is lost
+  bool next()
+  {
+    m_bBad = m_uniform(m_rng) < (m_bBad ? 1.0 - m_dBadToGood : m_dGoodToBad);
+    return m_bBad;
+  }
+
+private:
+  double m_dBadToGood;
+  double m_dGoodToBad;
+  bool m_bBad;
+  std::mt19937 m_rng;
+  std::uniform_real_distribution<double> m_uniform;
+};
+
+struct RunResult
+{
+  double kbps;
+  uint64_t lost;
+  uint64_t recovered;
+  double segmentalSnrDb;
+};
+
+/// the loss and mean burst length of a window of the loss pattern
+static void measureLoss(const std::vector<bool>& vLost, size_t uiFirst, size_t uiLast, double& dLoss, double& dMeanBurst)
+{
+  size_t uiLost = 0, uiBursts = 0;
+  for (size_t i = uiFirst; i < uiLast; ++i)
+  {
+    if (!vLost[i]) continue;
+    ++uiLost;
+    if (i == uiFirst || !vLost[i - 1]) ++uiBursts;
+  }
+  dLoss = uiLast > uiFirst ? static_cast<double>(uiLost) / (uiLast - uiFirst) : 0.0;
+  dMeanBurst = uiBursts > 0 ? static_cast<double>(uiLost) / uiBursts : 1.0;
+}
+
+/// mono downmix
+static std::vector<float> toMono(const int16_t* pSamples, size_t uiFrames, int iChannels)
+{
+  std::vector<float> vMono(uiFrames);
+  for (size_t i = 0; i < uiFrames; ++i)
+  {
+    float f = 0.0f;
+    for (int c = 0; c < iChannels; ++c) f += pSamples[i * iChannels + c];
+    vMono[i] = f / iChannels;
+  }
+  return vMono;
+}
+
+/// segmental SNR of the decoded audio after compensating the decoder delay
+static double segmentalSnr(const std::vector<float>& vRef, const std::vector<float>& vDec, int iSamplesPerSecond)
+{
+  const int iMaxDelay = iSamplesPerSecond * MAX_DELAY_MS / 1000;
+  const size_t uiLength = std::min(vRef.size(), static_cast<size_t>(iSamplesPerSecond));
+  int iDelay = 0;
+  double dBest = -1.0;
+  for (int d = 0; d < iMaxDelay; ++d)
+  {
+    double dCorrelation = 0.0;
+    for (size_t i = 0; i + d < std::min(uiLength, vDec.size()); ++i) dCorrelation += vRef[i] * vDec[i + d];
+    if (dCorrelation > dBest)
+    {
+      dBest = dCorrelation;
+      iDelay = d;
+    }
+  }
+  const size_t uiSegment = static_cast<size_t>(iSamplesPerSecond * SEGMENT_MS / 1000);
+  double dSum = 0.0;
+  size_t uiSegments = 0;
+  for (size_t s = 0; (s + 1) * uiSegment + iDelay <= vDec.size() && (s + 1) * uiSegment <= vRef.size(); ++s)
+  {
+    double dSignal = 0.0, dNoise = 0.0;
+    for (size_t i = s * uiSegment; i < (s + 1) * uiSegment; ++i)
+    {
+      const double dError = vRef[i] - vDec[i + iDelay];
+      dSignal += vRef[i] * vRef[i];
+      dNoise += dError * dError;
+    }
+    // skip segments below -60 dBFS
+    if (dSignal < uiSegment * 32.768 * 32.768) continue;
+    double dSnr = 10.0 * std::log10((dSignal + 1e-9) / (dNoise + 1e-9));
+    dSum += std::min(std::max(dSnr, MIN_SEGMENT_SNR_DB), MAX_SEGMENT_SNR_DB);
+    ++uiSegments;
+  }
+  return uiSegments > 0 ? dSum / uiSegments : 0.0;
+}
+
+/**
+ * @brief Encodes the input with one FEC mode, drops the packets of the loss pattern and decodes the rest,
+ * recovering lost packets from the in-band FEC of the next packet where the decoder supports it.
+ */
+static bool run(const std::vector<int16_t>& vInput, int iSamplesPerSecond, int iChannels, uint32_t uiKbps,
+  FecController::Mode eMode, uint32_t uiFixedLossPercent, const std::vector<bool>& vLost, RunResult& result)
+{
+  OpusEncodeEngine engine;
+  engine.getFecController().setMode(eMode, uiFixedLossPercent);
+  if (!engine.open(iSamplesPerSecond, iChannels, 16, uiKbps))
+  {
+    printf("%s\n", engine.getLastError().c_str());
+    return false;
+  }
+  const int iBlockAlign = iChannels * static_cast<int>(sizeof(int16_t));
+  const int iBytesPerFrame = engine.getBytesPerFrame();
+  const int iPacketsPerReport = REPORT_INTERVAL_MS * iSamplesPerSecond * iBlockAlign / (1000 * iBytesPerFrame);
+
+  // encode, feeding back the loss of the previous report interval
+  std::vector<std::vector<uint8_t>> vPackets;
+  /// whether the packet carries FEC for the one before it
+  std::vector<bool> vFec;
+  std::vector<uint8_t> vPacket(MAX_PACKET_SIZE);
+  uint64_t uiBytes = 0;
+  auto encodeAvailable = [&]()
+  {
+    REFERENCE_TIME tStart, tStop;
+    uint8_t* pFrame = nullptr;
+    while (vPackets.size() < vLost.size() && engine.readNextAudioFrame(tStart, tStop, pFrame))
+    {
+      const size_t uiPacket = vPackets.size();
+      if (uiPacket >= static_cast<size_t>(iPacketsPerReport) && uiPacket % iPacketsPerReport == 0)
+      {
+        double dLoss, dMeanBurst;
+        measureLoss(vLost, uiPacket - iPacketsPerReport, uiPacket, dLoss, dMeanBurst);
+        engine.getFecController().reportLoss(dLoss, dMeanBurst);
+      }
+      int iSize = engine.encodeFrame(pFrame, vPacket.data(), static_cast<int>(vPacket.size()));
+      if (iSize < 0)
+      {
+        printf("Encoding failed: %s\n", engine.getLastError().c_str());
+        return false;
+      }
+      vPackets.emplace_back(vPacket.begin(), vPacket.begin() + iSize);
+      vFec.push_back(engine.getFecController().getStats().decision.fec);
+      uiBytes += iSize;
+    }
+    return true;
+  };
+  // feed the input in 10 ms blocks as a capture device would
+  const size_t uiBlock = static_cast<size_t>(iSamplesPerSecond / 100 * iChannels);
+  for (size_t uiPos = 0; uiPos < vInput.size(); uiPos += uiBlock)
+  {
+    const size_t uiSamples = std::min(uiBlock, vInput.size() - uiPos);
+    const REFERENCE_TIME tBlockStart = static_cast<REFERENCE_TIME>(uiPos / iChannels) * 10000000 / iSamplesPerSecond;
+    const REFERENCE_TIME tBlockStop = static_cast<REFERENCE_TIME>((uiPos + uiSamples) / iChannels) * 10000000 / iSamplesPerSecond;
+    engine.addAudioData(const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(vInput.data() + uiPos)),
+      static_cast<uint32_t>(uiSamples * sizeof(int16_t)), tBlockStart, tBlockStop);
+    if (!encodeAvailable()) return false;
+  }
+  if (engine.padPartialFrame() && !encodeAvailable()) return false;
+
+  OpusFactory factory;
+  ICodecv2* pDecoder = factory.GetCodecInstance();
+  pDecoder->SetParameter("samples_per_second", std::to_string(iSamplesPerSecond).c_str());
+  pDecoder->SetParameter("channels", std::to_string(iChannels).c_str());
+  pDecoder->SetParameter("bits_per_sample", "16");
+  if (!pDecoder->Open())
+  {
+    printf("%s\n", pDecoder->GetErrorStr());
+    factory.ReleaseCodecInstance(pDecoder);
+    return false;
+  }
+  bool bFecDecoding = pDecoder->SetParameter(CODEC_PARAM_DECODE_FEC, "0") != 0;
+  std::vector<int16_t> vDecoded(vPackets.size() * iBytesPerFrame / sizeof(int16_t));
+  result.lost = result.recovered = 0;
+  for (size_t i = 0; i < vPackets.size(); ++i)
+  {
+    uint8_t* pOut = reinterpret_cast<uint8_t*>(vDecoded.data()) + i * iBytesPerFrame;
+    if (!vLost[i])
+    {
+      if (!pDecoder->Decode(vPackets[i].data(), static_cast<int>(vPackets[i].size()) * 8, pOut)) memset(pOut, 0, iBytesPerFrame);
+      continue;
+    }
+    ++result.lost;
+    if (bFecDecoding && i + 1 < vPackets.size() && !vLost[i + 1] && vFec[i + 1])
+    {
+      // the LBRR data of the next packet describes this one
+      pDecoder->SetParameter(CODEC_PARAM_DECODE_FEC, "1");
+      bool bRecovered = pDecoder->Decode(vPackets[i + 1].data(), static_cast<int>(vPackets[i + 1].size()) * 8, pOut) != 0;
+      pDecoder->SetParameter(CODEC_PARAM_DECODE_FEC, "0");
+      if (bRecovered)
+      {
+        ++result.recovered;
+        continue;
+      }
+    }
+    // packet loss concealment
+    if (!pDecoder->Decode(nullptr, 0, pOut)) memset(pOut, 0, iBytesPerFrame);
+  }
+  pDecoder->Close();
+  factory.ReleaseCodecInstance(pDecoder);
+
+  const double dSeconds = static_cast<double>(vPackets.size()) * iBytesPerFrame / (iSamplesPerSecond * iBlockAlign);
+  result.kbps = uiBytes * 8.0 / dSeconds / 1000.0;
+  std::vector<float> vRef = toMono(vInput.data(), vInput.size() / iChannels, iChannels);
+  std::vector<float> vDec = toMono(vDecoded.data(), vDecoded.size() / iChannels, iChannels);
+  result.segmentalSnrDb = segmentalSnr(vRef, vDec, iSamplesPerSecond);
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 5)
+  {
+    printf("Usage: %s <pcm file> <samples per second> <channels> <kbps> [loss percent] [mean burst length] [seed]\n", argv[0]);
+    printf("Encodes 16 bit PCM with the FEC off, fixed and adaptive, drops packets with a Gilbert-Elliott model,\n");
+    printf("decodes with FEC recovery and concealment and reports the quality per kbps.\n");
+    return 1;
+  }
+  const int iSamplesPerSecond = atoi(argv[2]);
+  const int iChannels = atoi(argv[3]);
+  const uint32_t uiKbps = static_cast<uint32_t>(atoi(argv[4]));
+  const double dLossPercent = argc > 5 ? atof(argv[5]) : 5.0;
+  const double dMeanBurst = argc > 6 ? atof(argv[6]) : 1.5;
+  const unsigned uiSeed = argc > 7 ? static_cast<unsigned>(atoi(argv[7])) : 1;
+
+  FILE* pFile = fopen(argv[1], "rb");
+  if (!pFile)
+  {
+    printf("Unable to open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<int16_t> vInput;
+  int16_t vBlock[4096];
+  size_t uiRead;
+  while ((uiRead = fread(vBlock, sizeof(int16_t), 4096, pFile)) > 0) vInput.insert(vInput.end(), vBlock, vBlock + uiRead);
+  fclose(pFile);
+  vInput.resize(vInput.size() - vInput.size() % iChannels);
+  if (vInput.empty() || iSamplesPerSecond <= 0 || iChannels <= 0)
+  {
+    printf("No audio\n");
+    return 1;
+  }
+
+  // the same loss pattern for every mode, for the 20 ms frames of the engine
+  const size_t uiMaxPackets = vInput.size() / iChannels / (iSamplesPerSecond / 50) + 1;
+  GilbertElliottChannel channel(dLossPercent / 100.0, dMeanBurst, uiSeed);
+  std::vector<bool> vLost(uiMaxPackets);
+  for (size_t i = 0; i < uiMaxPackets; ++i) vLost[i] = channel.next();
+  double dLoss, dBurst;
+  measureLoss(vLost, 0, vLost.size(), dLoss, dBurst);
+  printf("%d Hz, %d channels, %u kbps, loss %.2f%%, mean burst %.2f\n", iSamplesPerSecond, iChannels, uiKbps, dLoss * 100.0, dBurst);
+
+  struct
+  {
+    const char* szName;
+    FecController::Mode eMode;
+  } vModes[] = { { "off", FecController::Mode::FM_OFF }, { "fixed", FecController::Mode::FM_FIXED }, { "adaptive", FecController::Mode::FM_ADAPTIVE } };
+  printf("%-10s %8s %8s %10s %10s %12s\n", "fec", "kbps", "lost", "recovered", "segSNR dB", "dB per kbps");
+  for (const auto& mode : vModes)
+  {
+    RunResult result;
+    // the fixed mode protects against the configured average loss
+    if (!run(vInput, iSamplesPerSecond, iChannels, uiKbps, mode.eMode, static_cast<uint32_t>(std::ceil(dLossPercent)), vLost, result)) return 1;
+    printf("%-10s %8.1f %8llu %10llu %10.2f %12.3f\n", mode.szName, result.kbps, static_cast<unsigned long long>(result.lost),
+      static_cast<unsigned long long>(result.recovered), result.segmentalSnrDb, result.segmentalSnrDb / result.kbps);
+  }
+  return 0;
+}
@@ -0,0 +1,199 @@
+/** @file
+
+MODULE				: LoudnessOverhead
+
+FILE NAME			: LoudnessOverhead.cpp
+
+DESCRIPTION			: Measures the cost of the loudness, true peak and RMS metering relative to the encode
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "OpusEncodeEngine.h"
+
+// an Opus packet of 120 ms
+static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+// the size of the blocks handed to the engine, as a capture device would
+static const int BLOCK_MS = 10;
+
+/// 32 bit linear congruential generator so that the input is the same on every platform
+static uint32_t nextRandom(uint32_t& uiState)
+{
+  uiState = uiState * 1664525u + 1013904223u;
+  return uiState;
+}
+
+/**
+ * @brief Feeds the input through the engine as OpusEncoderFilter::Receive does
+ * @return the time taken in seconds or a negative value if encoding failed
+ */
+static double encodeLoop(OpusEncodeEngine& engine, const std::vector<int16_t>& vInput, int iSamplesPerSecond, int iChannels, int iBlocks)
+{
+  const size_t uiBlockSamples = static_cast<size_t>(iSamplesPerSecond) * BLOCK_MS / 1000;
+  const size_t uiInputBlocks = vInput.size() / iChannels / uiBlockSamples;
+  std::vector<uint8_t> vPacket(MAX_PACKET_SIZE);
+  REFERENCE_TIME tStart = 0;
+  const auto tBegin = std::chrono::steady_clock::now();
+  for (int i = 0; i < iBlocks; ++i)
+  {
+    const REFERENCE_TIME tStop = tStart + BLOCK_MS * 10000LL;
+    const int16_t* pBlock = vInput.data() + (i % uiInputBlocks) * uiBlockSamples * iChannels;
+    if (engine.addAudioData(reinterpret_cast<uint8_t*>(const_cast<int16_t*>(pBlock)),
+      static_cast<uint32_t>(uiBlockSamples * iChannels * sizeof(int16_t)), tStart, tStop) == -1) return -1.0;
+    REFERENCE_TIME tFrameStart, tFrameStop;
+    uint8_t* pFrame = nullptr;
+    while (engine.readNextAudioFrame(tFrameStart, tFrameStop, pFrame))
+    {
+      if (engine.encodeFrame(pFrame, vPacket.data(), MAX_PACKET_SIZE) < 0) return -1.0;
+    }
+    tStart = tStop;
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - tBegin).count();
+}
+
+/**
+ * @brief the overhead of the metering on the encode loop
+ */
+struct Overhead
+{
+  double dOff;
+  double dOn;
+  /// the difference of the encode loops, within the noise of a loaded machine
+  double dPercent;
+  /// the metering of the engine timed against its encodes, as reported by loudness_overhead_percent
+  double dEnginePercent;
+};
+
+/**
+ * @brief Encodes the same audio with the metering disabled and enabled in turns so that frequency scaling and other
+ * load affect them alike. The fastest round of each counts.
+ */
+static bool measure(const std::vector<int16_t>& vInput, int iSamplesPerSecond, int iChannels, uint32_t uiKbps, int iBlocks, int iRounds,
+  Overhead& overhead)
+{
+  OpusEncodeEngine engine;
+  if (!engine.open(iSamplesPerSecond, iChannels, 16, uiKbps))
+  {
+    printf("Unable to open the encoder: %s\n", engine.getLastError().c_str());
+    return false;
+  }
+  overhead.dOff = overhead.dOn = 1e9;
+  overhead.dEnginePercent = 0.0;
+  encodeLoop(engine, vInput, iSamplesPerSecond, iChannels, iBlocks / 10);
+  for (int i = 0; i < iRounds; ++i)
+  {
+    engine.enableLoudnessMeter(false);
+    const double dRoundOff = encodeLoop(engine, vInput, iSamplesPerSecond, iChannels, iBlocks);
+    engine.enableLoudnessMeter(true);
+    const double dRoundOn = encodeLoop(engine, vInput, iSamplesPerSecond, iChannels, iBlocks);
+    if (dRoundOff < 0.0 || dRoundOn < 0.0 || !engine.getLoudnessMeter())
+    {
+      printf("Encoding failed: %s\n", engine.getLastError().c_str());
+      return false;
+    }
+    overhead.dOff = std::min(overhead.dOff, dRoundOff);
+    if (dRoundOn < overhead.dOn)
+    {
+      overhead.dOn = dRoundOn;
+      overhead.dEnginePercent = engine.getMeteringOverheadPercent();
+    }
+  }
+  overhead.dPercent = 100.0 * (overhead.dOn - overhead.dOff) / overhead.dOff;
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  int iSamplesPerSecond = 48000;
+  int iChannels = 2;
+  uint32_t uiKbps = 64;
+  int iSeconds = 30;
+  int iRounds = 5;
+  double dMaxOverheadPercent = 3.0;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "--rate=", 7) == 0)
+      iSamplesPerSecond = atoi(argv[i] + 7);
+    else if (strncmp(argv[i], "--channels=", 11) == 0)
+      iChannels = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--bitrate=", 10) == 0)
+      uiKbps = static_cast<uint32_t>(atoi(argv[i] + 10));
+    else if (strncmp(argv[i], "--seconds=", 10) == 0)
+      iSeconds = atoi(argv[i] + 10);
+    else if (strncmp(argv[i], "--rounds=", 9) == 0)
+      iRounds = atoi(argv[i] + 9);
+    else if (strncmp(argv[i], "--max-overhead=", 15) == 0)
+      dMaxOverheadPercent = atof(argv[i] + 15);
+    else
+    {
+      printf("Usage: %s [--rate=Hz] [--channels=n] [--bitrate=kbps] [--seconds=s of audio per round] [--rounds=n]\n", argv[0]);
+      printf("  [--max-overhead=percent]\n");
+      printf("Encodes the same audio with the loudness metering disabled and enabled and fails if the metering of noise at\n");
+      printf("a speech level costs the engine more than the maximum overhead of its encodes, by default 3%%. Noise near full\n");
+      printf("scale, most of whose frames have their true peak oversampled, is reported as the worst case.\n");
+      return 1;
+    }
+  }
+  if (iSeconds < 1 || iRounds < 1)
+  {
+    printf("Invalid duration\n");
+    return 1;
+  }
+
+  static const struct
+  {
+    const char* szName;
+    int iDivisor;
+    /// checked against the maximum overhead
+    bool bChecked;
+  } vLevels[] = { { "noise at -20 dBFS", 10, true }, { "noise near full scale", 1, false } };
+  const int iBlocks = iSeconds * 1000 / BLOCK_MS;
+  printf("%d Hz, %d channels, %u kbps, %d s of audio, best of %d rounds\n", iSamplesPerSecond, iChannels, uiKbps, iSeconds, iRounds);
+  printf("%-24s %10s %10s %10s %12s\n", "input", "off", "on", "loop", "engine");
+  bool bFailed = false;
+  for (const auto& level : vLevels)
+  {
+    // a second of noise
+    std::vector<int16_t> vInput(static_cast<size_t>(iSamplesPerSecond) * iChannels);
+    uint32_t uiSeed = 0xC0FFEEu;
+    for (auto& sample : vInput) sample = static_cast<int16_t>((static_cast<int32_t>(nextRandom(uiSeed) >> 16) - 32768) / level.iDivisor);
+    Overhead overhead;
+    if (!measure(vInput, iSamplesPerSecond, iChannels, uiKbps, iBlocks, iRounds, overhead)) return 1;
+    printf("%-24s %9.3fs %9.3fs %+9.3f%% %+11.3f%%\n", level.szName, overhead.dOff, overhead.dOn, overhead.dPercent, overhead.dEnginePercent);
+    if (level.bChecked && overhead.dEnginePercent > dMaxOverheadPercent) bFailed = true;
+  }
+  if (bFailed)
+  {
+    printf("Metering exceeds the maximum overhead of %.3f%%\n", dMaxOverheadPercent);
+    return 1;
+  }
+  return 0;
+}
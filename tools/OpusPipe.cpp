@@ -0,0 +1,682 @@
+/** @file
+
+MODULE				: OpusPipe
+
+FILE NAME			: OpusPipe.cpp
+
+DESCRIPTION			: Streams raw PCM or WAV from stdin to Ogg Opus or length-prefixed Opus packets on stdout
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "OpusEncodeEngine.h"
+
+// an Opus packet of 120 ms
+static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+// the most that is read at once: the pipe holds the rest
+static const uint32_t READ_SIZE = 64 * 1024;
+// the output is written once this much has been buffered, unless every frame is flushed
+static const size_t WRITE_SIZE = 64 * 1024;
+// kernel-side buffering of the pipes, so that bursts don't stall the producer or the encoder
+static const int PIPE_SIZE = 1024 * 1024;
+// packets queued for the output between two frames: the output is drained after every frame
+static const size_t OUTPUT_QUEUED_PACKETS = 4;
+// Ogg pages of the buffered output carry at most this many packets
+static const int PACKETS_PER_PAGE = 50;
+// the encoder lookahead of libopus at 48 kHz, which the decoder skips
+static const uint16_t PRE_SKIP = 312;
+static const uint16_t WAVE_FORMAT_TAG_PCM = 0x0001;
+static const uint16_t WAVE_FORMAT_TAG_ALAW = 0x0006;
+static const uint16_t WAVE_FORMAT_TAG_MULAW = 0x0007;
+static const uint16_t WAVE_FORMAT_TAG_IMA_ADPCM = 0x0011;
+static const uint16_t WAVE_FORMAT_TAG_EXTENSIBLE = 0xFFFE;
+
+/// reads until size bytes have been read or the end of the input, @return the number of bytes read or -1 on error
+static long readFully(uint8_t* pData, uint32_t size)
+{
+  uint32_t uiRead = 0;
+  while (uiRead < size)
+  {
+#ifdef _WIN32
+    int n = _read(0, pData + uiRead, size - uiRead);
+#else
+    ssize_t n = read(0, pData + uiRead, size - uiRead);
+    if (n < 0 && errno == EINTR) continue;
+#endif
+    if (n < 0) return -1;
+    if (n == 0) break;
+    uiRead += static_cast<uint32_t>(n);
+  }
+  return static_cast<long>(uiRead);
+}
+
+/// reads what is available, blocking only until there is some input, @return 0 at the end of the input or -1 on error
+static long readSome(uint8_t* pData, uint32_t size)
+{
+  for (;;)
+  {
+#ifdef _WIN32
+    return _read(0, pData, size);
+#else
+    ssize_t n = read(0, pData, size);
+    if (n < 0 && errno == EINTR) continue;
+    return static_cast<long>(n);
+#endif
+  }
+}
+
+static bool writeFully(const uint8_t* pData, size_t size)
+{
+  while (size > 0)
+  {
+#ifdef _WIN32
+    int n = _write(1, pData, static_cast<unsigned>(size));
+#else
+    ssize_t n = write(1, pData, size);
+    if (n < 0 && errno == EINTR) continue;
+#endif
+    if (n <= 0) return false;
+    pData += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+static void putLe16(std::vector<uint8_t>& v, uint16_t u) { v.push_back(u & 0xff); v.push_back(u >> 8); }
+static void putLe32(std::vector<uint8_t>& v, uint32_t u) { for (int i = 0; i < 4; ++i) v.push_back((u >> (8 * i)) & 0xff); }
+static uint16_t getLe16(const uint8_t* p) { return static_cast<uint16_t>(p[0] | (p[1] << 8)); }
+static uint32_t getLe32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); }
+
+/**
+ * @brief Buffers the output and writes it when enough has accumulated or on flush()
+ */
+class OutputBuffer
+{
+public:
+  OutputBuffer() { m_vData.reserve(WRITE_SIZE + MAX_PACKET_SIZE); }
+  std::vector<uint8_t>& data() { return m_vData; }
+  bool commit(bool bFlush)
+  {
+    if (!bFlush && m_vData.size() < WRITE_SIZE) return true;
+    bool bOk = writeFully(m_vData.data(), m_vData.size());
+    m_vData.clear();
+    return bOk;
+  }
+
+private:
+  std::vector<uint8_t> m_vData;
+};
+
+/**
+ * @brief Writes an Ogg Opus stream (RFC 7845): the ID and comment headers on pages of their own, then the packets
+ * on pages of up to PACKETS_PER_PAGE packets, or one page per packet when every frame is flushed.
+ */
+class OggOpusWriter
+{
+public:
+  OggOpusWriter(OutputBuffer& output, uint32_t uiSerial)
+    :m_output(output),
+    m_uiSerial(uiSerial),
+    m_uiPageSequence(0),
+    m_iGranule(PRE_SKIP),
+    m_iPagePackets(0)
+  {
+    // CRC-32 with the polynomial 0x04c11db7, not reflected, as Ogg uses it
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+      uint32_t r = i << 24;
+      for (int k = 0; k < 8; ++k) r = (r & 0x80000000u) ? (r << 1) ^ 0x04c11db7u : r << 1;
+      m_vCrcTable[i] = r;
+    }
+  }
+
+  bool writeHeaders(int iChannels, int iSamplesPerSecond)
+  {
+    std::vector<uint8_t> vHead = { 'O', 'p', 'u', 's', 'H', 'e', 'a', 'd', 1, static_cast<uint8_t>(iChannels) };
+    putLe16(vHead, PRE_SKIP);
+    putLe32(vHead, static_cast<uint32_t>(iSamplesPerSecond));
+    // output gain and channel mapping family 0: mono or stereo
+    putLe16(vHead, 0);
+    vHead.push_back(0);
+    addPacket(vHead.data(), vHead.size());
+    writePage(0x02, 0);
+
+    static const char szVendor[] = "CSIR VPP Opus Encoder";
+    std::vector<uint8_t> vTags = { 'O', 'p', 'u', 's', 'T', 'a', 'g', 's' };
+    putLe32(vTags, static_cast<uint32_t>(strlen(szVendor)));
+    vTags.insert(vTags.end(), szVendor, szVendor + strlen(szVendor));
+    putLe32(vTags, 0);
+    addPacket(vTags.data(), vTags.size());
+    writePage(0x00, 0);
+    return m_output.commit(true);
+  }
+
+  /**
+   * @param iSamples48k the duration of the packet at 48 kHz
+   */
+  bool writePacket(const uint8_t* pPacket, int iSize, int iSamples48k, bool bFlush)
+  {
+    m_iGranule += iSamples48k;
+    // a page holds at most 255 lacing values
+    if (m_iPagePackets > 0 && m_vLacing.size() + iSize / 255 + 1 > 255) writePage(0x00, m_iPageGranule);
+    addPacket(pPacket, iSize);
+    m_iPageGranule = m_iGranule;
+    if (bFlush || m_iPagePackets >= PACKETS_PER_PAGE) writePage(0x00, m_iGranule);
+    return m_output.commit(bFlush);
+  }
+
+  /**
+   * @brief Writes the last page. The granule position of the end of the stream trims the padding of the last frame.
+   * @param iEndGranule pre-skip plus the number of input samples at 48 kHz
+   */
+  bool finish(int64_t iEndGranule)
+  {
+    // a stream that ends on a frame boundary whose last page has been written gets an empty last page
+    writePage(0x04, m_iPagePackets > 0 ? std::min(iEndGranule, m_iGranule) : -1);
+    return m_output.commit(true);
+  }
+
+private:
+  void addPacket(const uint8_t* pPacket, size_t uiSize)
+  {
+    for (size_t uiLeft = uiSize; ; uiLeft -= 255)
+    {
+      m_vLacing.push_back(static_cast<uint8_t>(std::min<size_t>(uiLeft, 255)));
+      if (uiLeft < 255) break;
+    }
+    m_vBody.insert(m_vBody.end(), pPacket, pPacket + uiSize);
+    ++m_iPagePackets;
+  }
+
+  void writePage(uint8_t uiHeaderType, int64_t iGranule)
+  {
+    std::vector<uint8_t>& vOut = m_output.data();
+    const size_t uiStart = vOut.size();
+    static const uint8_t vCapture[] = { 'O', 'g', 'g', 'S', 0 };
+    vOut.insert(vOut.end(), vCapture, vCapture + sizeof(vCapture));
+    vOut.push_back(uiHeaderType);
+    putLe32(vOut, static_cast<uint32_t>(static_cast<uint64_t>(iGranule)));
+    putLe32(vOut, static_cast<uint32_t>(static_cast<uint64_t>(iGranule) >> 32));
+    putLe32(vOut, m_uiSerial);
+    putLe32(vOut, m_uiPageSequence++);
+    // the CRC is computed with its own field zeroed
+    putLe32(vOut, 0);
+    vOut.push_back(static_cast<uint8_t>(m_vLacing.size()));
+    vOut.insert(vOut.end(), m_vLacing.begin(), m_vLacing.end());
+    vOut.insert(vOut.end(), m_vBody.begin(), m_vBody.end());
+    uint32_t uiCrc = 0;
+    for (size_t i = uiStart; i < vOut.size(); ++i) uiCrc = (uiCrc << 8) ^ m_vCrcTable[((uiCrc >> 24) ^ vOut[i]) & 0xff];
+    for (int i = 0; i < 4; ++i) vOut[uiStart + 22 + i] = (uiCrc >> (8 * i)) & 0xff;
+    m_vLacing.clear();
+    m_vBody.clear();
+    m_iPagePackets = 0;
+  }
+
+  OutputBuffer& m_output;
+  uint32_t m_vCrcTable[256];
+  uint32_t m_uiSerial;
+  uint32_t m_uiPageSequence;
+  /// pre-skip plus the samples of the packets so far, at 48 kHz
+  int64_t m_iGranule;
+  /// the granule position of the last packet on the current page
+  int64_t m_iPageGranule;
+  int m_iPagePackets;
+  std::vector<uint8_t> m_vLacing;
+  std::vector<uint8_t> m_vBody;
+};
+
+/**
+ * @brief The input format, given on the command line or read from the WAV header
+ */
+struct InputFormat
+{
+  int iSamplesPerSecond;
+  int iChannels;
+  /// WAVE_FORMAT_EXTENSIBLE speaker positions, 0 for the default layout of the channel count
+  uint32_t channelMask;
+  InputDecoder::Config encoding;
+};
+
+/**
+ * @brief Parses the RIFF header up to the data chunk. The data size is ignored since streaming producers
+ * don't know it.
+ */
+static bool readWavHeader(const uint8_t* pRiff, InputFormat& format)
+{
+  if (memcmp(pRiff, "RIFF", 4) != 0 || memcmp(pRiff + 8, "WAVE", 4) != 0) return false;
+  bool bFormat = false;
+  uint8_t vChunk[8];
+  while (readFully(vChunk, 8) == 8)
+  {
+    const uint32_t uiChunkSize = getLe32(vChunk + 4);
+    if (memcmp(vChunk, "data", 4) == 0) return bFormat;
+    std::vector<uint8_t> vBody(uiChunkSize + (uiChunkSize & 1));
+    if (readFully(vBody.data(), static_cast<uint32_t>(vBody.size())) != static_cast<long>(vBody.size())) return false;
+    if (memcmp(vChunk, "fmt ", 4) != 0 || uiChunkSize < 16) continue;
+    uint16_t uiTag = getLe16(&vBody[0]);
+    format.iChannels = getLe16(&vBody[2]);
+    format.iSamplesPerSecond = static_cast<int>(getLe32(&vBody[4]));
+    const uint16_t uiBlockAlign = getLe16(&vBody[12]);
+    const uint16_t uiBitsPerSample = getLe16(&vBody[14]);
+    // WAVE_FORMAT_EXTENSIBLE: the format tag is the first two bytes of the sub-format GUID
+    format.channelMask = 0;
+    if (uiTag == WAVE_FORMAT_TAG_EXTENSIBLE && uiChunkSize >= 26)
+    {
+      format.channelMask = getLe32(&vBody[20]);
+      uiTag = getLe16(&vBody[24]);
+    }
+    format.encoding = InputDecoder::getDefaultConfig();
+    if (uiTag == WAVE_FORMAT_TAG_PCM && uiBitsPerSample == 16) bFormat = true;
+    else if ((uiTag == WAVE_FORMAT_TAG_MULAW || uiTag == WAVE_FORMAT_TAG_ALAW) && uiBitsPerSample == 8)
+    {
+      format.encoding.encoding = uiTag == WAVE_FORMAT_TAG_MULAW ? InputEncoding::IE_MULAW : InputEncoding::IE_ALAW;
+      format.encoding.blockAlign = format.iChannels;
+      format.encoding.samplesPerBlock = 1;
+      bFormat = true;
+    }
+    else if (uiTag == WAVE_FORMAT_TAG_IMA_ADPCM && uiBitsPerSample == 4 && uiChunkSize >= 20)
+    {
+      format.encoding.encoding = InputEncoding::IE_IMA_ADPCM;
+      format.encoding.blockAlign = uiBlockAlign;
+      format.encoding.samplesPerBlock = getLe16(&vBody[18]);
+      bFormat = InputDecoder::isValid(format.encoding, format.iChannels);
+    }
+    else
+    {
+      fprintf(stderr, "Unsupported WAV format %#x with %u bits per sample\n", uiTag, uiBitsPerSample);
+      return false;
+    }
+  }
+  return false;
+}
+
+static bool parseFrameDuration(const char* szMs, OpusFrameDuration& eFrameDuration)
+{
+  static const struct
+  {
+    const char* szMs;
+    OpusFrameDuration eFrameDuration;
+  } vDurations[] = { { "2.5", OpusFrameDuration::OFD_2_5_MS }, { "5", OpusFrameDuration::OFD_5_MS }, { "10", OpusFrameDuration::OFD_10_MS },
+    { "20", OpusFrameDuration::OFD_20_MS }, { "40", OpusFrameDuration::OFD_40_MS }, { "60", OpusFrameDuration::OFD_60_MS } };
+  for (const auto& duration : vDurations)
+  {
+    if (strcmp(szMs, duration.szMs) == 0)
+    {
+      eFrameDuration = duration.eFrameDuration;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// the peak resident set of the process in KB, 0 if unknown
+static long getPeakRssKb()
+{
+#ifdef _WIN32
+  return 0;
+#else
+  FILE* pStatus = fopen("/proc/self/status", "r");
+  if (!pStatus) return 0;
+  char szLine[256];
+  long lKb = 0;
+  while (fgets(szLine, sizeof(szLine), pStatus))
+  {
+    if (strncmp(szLine, "VmHWM:", 6) == 0) lKb = atol(szLine + 6);
+  }
+  fclose(pStatus);
+  return lKb;
+#endif
+}
+
+static void usage(const char* szName)
+{
+  fprintf(stderr, "Usage: %s [options] < input > output\n", szName);
+  fprintf(stderr, "Encodes PCM or WAV from stdin to Opus on stdout.\n");
+  fprintf(stderr, "  --input=auto|wav|s16le|mulaw|alaw  auto detects a RIFF header, otherwise s16le (default auto)\n");
+  fprintf(stderr, "  --rate=<Hz>                        rate of headerless input: 48000, 24000, 16000, 12000 or 8000 (default 48000)\n");
+  fprintf(stderr, "  --channels=<1-8>                   channels of headerless input (default 2)\n");
+  fprintf(stderr, "  --encode-channels=<1|2>            channels to encode: more input channels are mixed down (default up to 2)\n");
+  fprintf(stderr, "  --channel-matrix=<gains>           gains from the input channels, one row per encoded channel\n");
+  fprintf(stderr, "                                     (default ITU-R BS.775 downmix), e.g. 1,0,.707,0,.707,0;0,1,.707,0,0,.707\n");
+  fprintf(stderr, "  --channel-select=<a>[,<b>]         encode the selected input channels, e.g. 1 for the second of dual mono\n");
+  fprintf(stderr, "  --bitrate=<kbps>                   target bitrate (default 64)\n");
+  fprintf(stderr, "  --frame-ms=<2.5|5|10|20|40|60>     frame duration (default 20)\n");
+  fprintf(stderr, "  --output=ogg|raw                   Ogg Opus, or each packet prefixed with its 32 bit big-endian size (default ogg)\n");
+  fprintf(stderr, "  --flush                            write every packet as soon as it is encoded, one Ogg page per packet\n");
+  fprintf(stderr, "  --serial=<n>                       Ogg stream serial number (default from the time and process id)\n");
+  fprintf(stderr, "  --stats                            print the frames, encoding time and peak RSS to stderr at the end\n");
+}
+
+int main(int argc, char** argv)
+{
+  std::string sInput = "auto", sOutput = "ogg";
+  InputFormat format = { 48000, 2, 0, InputDecoder::getDefaultConfig() };
+  int iEncodeChannelsArg = 0;
+  std::string sChannelMatrix, sChannelSelect;
+  uint32_t uiKbps = 64;
+  OpusFrameDuration eFrameDuration = OpusFrameDuration::OFD_20_MS;
+  bool bFlush = false, bStats = false;
+#ifdef _WIN32
+  uint32_t uiSerial = static_cast<uint32_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#else
+  uint32_t uiSerial = static_cast<uint32_t>(std::chrono::steady_clock::now().time_since_epoch().count()) ^ (static_cast<uint32_t>(getpid()) << 16);
+#endif
+  for (int i = 1; i < argc; ++i)
+  {
+    const char* szArg = argv[i];
+    const char* szValue = strchr(szArg, '=');
+    szValue = szValue ? szValue + 1 : "";
+    if (strncmp(szArg, "--input=", 8) == 0) sInput = szValue;
+    else if (strncmp(szArg, "--rate=", 7) == 0) format.iSamplesPerSecond = atoi(szValue);
+    else if (strncmp(szArg, "--channels=", 11) == 0) format.iChannels = atoi(szValue);
+    else if (strncmp(szArg, "--encode-channels=", 18) == 0) iEncodeChannelsArg = atoi(szValue);
+    else if (strncmp(szArg, "--channel-matrix=", 17) == 0) sChannelMatrix = szValue;
+    else if (strncmp(szArg, "--channel-select=", 17) == 0) sChannelSelect = szValue;
+    else if (strncmp(szArg, "--bitrate=", 10) == 0) uiKbps = static_cast<uint32_t>(atoi(szValue));
+    else if (strncmp(szArg, "--frame-ms=", 11) == 0)
+    {
+      if (!parseFrameDuration(szValue, eFrameDuration))
+      {
+        fprintf(stderr, "Unsupported frame duration %s\n", szValue);
+        return 1;
+      }
+    }
+    else if (strncmp(szArg, "--output=", 9) == 0) sOutput = szValue;
+    else if (strcmp(szArg, "--flush") == 0) bFlush = true;
+    else if (strncmp(szArg, "--serial=", 9) == 0) uiSerial = static_cast<uint32_t>(strtoul(szValue, nullptr, 0));
+    else if (strcmp(szArg, "--stats") == 0) bStats = true;
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (sOutput != "ogg" && sOutput != "raw")
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#else
+  // a closed reader ends the stream with a write error instead of killing the process
+  signal(SIGPIPE, SIG_IGN);
+#ifdef F_SETPIPE_SZ
+  // fails on files and terminals and beyond fs.pipe-max-size, which leaves the default
+  fcntl(0, F_SETPIPE_SZ, PIPE_SIZE);
+  fcntl(1, F_SETPIPE_SZ, PIPE_SIZE);
+#endif
+#endif
+
+  // the first 12 bytes tell a RIFF header from headerless PCM
+  uint8_t vPrefix[12];
+  long lPrefix = 0;
+  if (sInput == "auto" || sInput == "wav")
+  {
+    lPrefix = readFully(vPrefix, sizeof(vPrefix));
+    if (lPrefix == static_cast<long>(sizeof(vPrefix)) && memcmp(vPrefix, "RIFF", 4) == 0)
+    {
+      if (!readWavHeader(vPrefix, format))
+      {
+        fprintf(stderr, "Invalid WAV header\n");
+        return 1;
+      }
+      lPrefix = 0;
+    }
+    else if (sInput == "wav")
+    {
+      fprintf(stderr, "The input is not a WAV file\n");
+      return 1;
+    }
+  }
+  else if (sInput == "mulaw" || sInput == "alaw")
+  {
+    format.encoding.encoding = sInput == "mulaw" ? InputEncoding::IE_MULAW : InputEncoding::IE_ALAW;
+    format.encoding.blockAlign = format.iChannels;
+    format.encoding.samplesPerBlock = 1;
+  }
+  else if (sInput != "s16le")
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  switch (format.iSamplesPerSecond)
+  {
+  case 48000:
+  case 24000:
+  case 16000:
+  case 12000:
+  case 8000:
+    break;
+  default:
+    fprintf(stderr, "Unsupported sampling rate %d: Opus takes 48000, 24000, 16000, 12000 or 8000 Hz\n", format.iSamplesPerSecond);
+    return 1;
+  }
+  if (format.iChannels < 1 || format.iChannels > ChannelMixer::MAX_INPUT_CHANNELS)
+  {
+    fprintf(stderr, "Unsupported channel count %d\n", format.iChannels);
+    return 1;
+  }
+
+  // mono and stereo are encoded as they are, more channels are mixed down to stereo unless asked otherwise
+  ChannelMixer::Config mix = ChannelMixer::getDefaultConfig();
+  int iEncodeChannels = std::min(iEncodeChannelsArg != 0 ? iEncodeChannelsArg : 2, format.iChannels);
+  if (!sChannelSelect.empty())
+  {
+    std::vector<int> vSelected;
+    if (!ChannelMixer::parseSelection(sChannelSelect, vSelected))
+    {
+      fprintf(stderr, "Invalid channel selection %s\n", sChannelSelect.c_str());
+      return 1;
+    }
+    if (vSelected.size() == 1 && iEncodeChannelsArg == 2) vSelected.push_back(vSelected.front());
+    iEncodeChannels = static_cast<int>(vSelected.size());
+    mix.matrix = ChannelMixer::getSelectMatrix(vSelected, format.iChannels);
+    if (mix.matrix.empty())
+    {
+      fprintf(stderr, "The input has %d channels\n", format.iChannels);
+      return 1;
+    }
+  }
+  else if (!sChannelMatrix.empty())
+  {
+    if (!ChannelMixer::parseMatrix(sChannelMatrix, mix.matrix) || mix.matrix.size() % format.iChannels != 0)
+    {
+      fprintf(stderr, "The channel matrix needs %d gains per encoded channel\n", format.iChannels);
+      return 1;
+    }
+    iEncodeChannels = static_cast<int>(mix.matrix.size()) / format.iChannels;
+  }
+  else if (iEncodeChannels != format.iChannels)
+  {
+    mix.matrix = ChannelMixer::getDownmixMatrix(format.channelMask, format.iChannels, iEncodeChannels);
+  }
+
+  OpusEncodeEngine engine;
+  engine.setFrameDuration(eFrameDuration);
+  engine.setInputEncoding(format.encoding);
+  if (!mix.matrix.empty())
+  {
+    // gains out of range fail open()
+    mix.inputChannels = format.iChannels;
+    mix.channelMask = format.channelMask;
+    engine.setChannelMix(mix);
+  }
+  // the timestamps are counted from the input, so there are no gaps
+  engine.setGapPolicy(GapPolicy::GP_IGNORE, 0, 0);
+  if (!engine.open(format.iSamplesPerSecond, iEncodeChannels, 16, uiKbps))
+  {
+    fprintf(stderr, "%s\n", engine.getLastError().empty() ? "Unable to open the encoder" : engine.getLastError().c_str());
+    return 1;
+  }
+
+  OutputBuffer output;
+  OggOpusWriter ogg(output, uiSerial);
+  const bool bOgg = sOutput == "ogg";
+  if (bOgg && !ogg.writeHeaders(iEncodeChannels, format.iSamplesPerSecond)) return 1;
+
+  // PCM that is encoded as it is gets read straight into the framing buffer
+  const bool bDirect = format.encoding.encoding == InputEncoding::IE_PCM && mix.inputChannels == 0;
+  const int iBlockAlign = format.iChannels * static_cast<int>(sizeof(int16_t));
+  const int iEncodedBlockAlign = iEncodeChannels * static_cast<int>(sizeof(int16_t));
+  // the output subscribes to the packets like any other consumer of the engine, e.g. a sender: the packets are
+  // written from the pooled buffers they were encoded into
+  std::shared_ptr<PacketDistributor::Subscriber> pOutput =
+    engine.getPacketDistributor().subscribe(OUTPUT_QUEUED_PACKETS, PacketDistributor::DropPolicy::DP_DROP_NEWEST);
+  // other input is read here and expanded and mixed into the framing buffer
+  std::vector<uint8_t> vEncoded(bDirect ? 0 : READ_SIZE);
+  uint64_t uiInputBytes = 0, uiInputSamples = 0, uiFrames = 0, uiOutputBytes = 0;
+  double dEncodeMs = 0.0;
+  bool bOk = true;
+
+  auto encodeAvailable = [&]()
+  {
+    REFERENCE_TIME tStart, tStop;
+    uint8_t* pFrame = nullptr;
+    while (engine.readNextAudioFrame(tStart, tStop, pFrame))
+    {
+      auto tEncodeStart = std::chrono::steady_clock::now();
+      int iSize = engine.encodeAndPublish(pFrame, tStart, tStop);
+      dEncodeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tEncodeStart).count();
+      if (iSize < 0)
+      {
+        fprintf(stderr, "Encoding failed: %s\n", engine.getLastError().c_str());
+        return false;
+      }
+      ++uiFrames;
+      uiOutputBytes += iSize;
+      PacketRef packet;
+      while (pOutput->pop(packet))
+      {
+        const int iPacketSize = packet->getSize();
+        // a size of 1 is the TOC byte of a frame that needn't be transmitted: it keeps the timing in the stream
+        if (bOgg)
+        {
+          const int iSamples48k = static_cast<int>((packet->getStopTime() - packet->getStartTime()) * 48000 / 10000000);
+          if (!ogg.writePacket(packet->getData(), iPacketSize, iSamples48k, bFlush)) return false;
+        }
+        else
+        {
+          std::vector<uint8_t>& vOut = output.data();
+          for (int i = 3; i >= 0; --i) vOut.push_back((static_cast<uint32_t>(iPacketSize) >> (8 * i)) & 0xff);
+          vOut.insert(vOut.end(), packet->getData(), packet->getData() + iPacketSize);
+          if (!output.commit(bFlush)) return false;
+        }
+      }
+    }
+    return true;
+  };
+
+  for (;;)
+  {
+    const REFERENCE_TIME tStart = static_cast<REFERENCE_TIME>(uiInputSamples) * 10000000 / format.iSamplesPerSecond;
+    long lRead;
+    if (bDirect)
+    {
+      uint8_t* pDest = engine.reserveAudioData(READ_SIZE, tStart);
+      if (!pDest)
+      {
+        fprintf(stderr, "Audio buffer overflow\n");
+        bOk = false;
+        break;
+      }
+      long lPrefixed = lPrefix;
+      if (lPrefix > 0)
+      {
+        memcpy(pDest, vPrefix, lPrefix);
+        lPrefix = 0;
+      }
+      lRead = readSome(pDest + lPrefixed, READ_SIZE - static_cast<uint32_t>(lPrefixed));
+      if (lRead < 0) break;
+      lRead += lPrefixed;
+      if (lRead == 0) break;
+      // a sample split across reads is completed by the next read: the buffer cuts frames by bytes
+      uiInputBytes += lRead;
+      uiInputSamples = uiInputBytes / iBlockAlign;
+      engine.commitAudioData(static_cast<uint32_t>(lRead), tStart, static_cast<REFERENCE_TIME>(uiInputSamples) * 10000000 / format.iSamplesPerSecond);
+    }
+    else
+    {
+      long lPrefixed = lPrefix;
+      if (lPrefix > 0)
+      {
+        memcpy(vEncoded.data(), vPrefix, lPrefix);
+        lPrefix = 0;
+      }
+      lRead = readSome(vEncoded.data() + lPrefixed, READ_SIZE - static_cast<uint32_t>(lPrefixed));
+      if (lRead < 0) break;
+      lRead += lPrefixed;
+      if (lRead == 0) break;
+      uiInputBytes += lRead;
+      uiInputSamples += engine.getDecodedSize(static_cast<uint32_t>(lRead)) / iEncodedBlockAlign;
+      if (engine.addEncodedAudioData(vEncoded.data(), static_cast<uint32_t>(lRead), tStart,
+        static_cast<REFERENCE_TIME>(uiInputSamples) * 10000000 / format.iSamplesPerSecond) < 0)
+      {
+        fprintf(stderr, "Audio buffer overflow\n");
+        bOk = false;
+        break;
+      }
+    }
+    if (!encodeAvailable())
+    {
+      bOk = false;
+      break;
+    }
+  }
+  if (bOk)
+  {
+    // the last frame is padded with silence, which the end granule position trims again: it goes on the last page
+    // even when flushing, since that page carries the end granule position
+    bFlush = false;
+    bOk = (!engine.padPartialFrame() || encodeAvailable()) &&
+      (bOgg ? ogg.finish(PRE_SKIP + static_cast<int64_t>(uiInputSamples) * 48000 / format.iSamplesPerSecond) : output.commit(true));
+  }
+  if (bStats)
+  {
+    fprintf(stderr, "%llu frames, %llu bytes in, %llu bytes out, %.3f ms encoding per frame, peak RSS %ld KB\n",
+      static_cast<unsigned long long>(uiFrames), static_cast<unsigned long long>(uiInputBytes), static_cast<unsigned long long>(uiOutputBytes),
+      uiFrames > 0 ? dEncodeMs / uiFrames : 0.0, getPeakRssKb());
+  }
+  return bOk ? 0 : 1;
+}
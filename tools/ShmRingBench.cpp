@@ -0,0 +1,386 @@
+/** @file
+
+MODULE				: ShmRingBench
+
+FILE NAME			: ShmRingBench.cpp
+
+DESCRIPTION			: Compares the throughput and latency of the shared memory packet ring with a local socket
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SharedMemoryRing.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+#define closeSocket closesocket
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define closeSocket ::close
+#endif
+
+/// the size of a 64 kbps packet of 20 ms
+static const uint32_t DEFAULT_PACKET_SIZE = 160;
+
+static int64_t nowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief One way of handing packets from the encoder to the network sender
+ */
+class Transport
+{
+public:
+  virtual ~Transport() {}
+  virtual const char* getName() const = 0;
+  /**
+   * @return false if the packet could not be sent right now
+   */
+  virtual bool send(const uint8_t* pData, uint32_t uiSize, int64_t tStart, uint64_t uiSequenceNumber) = 0;
+  /**
+   * @brief Waits up to uiTimeoutMs for the next packet
+   * @return false on timeout or error
+   */
+  virtual bool receive(int64_t& tStart, uint64_t& uiSequenceNumber, uint32_t& uiSize, uint32_t uiTimeoutMs) = 0;
+};
+
+/**
+ * @brief The shm_output_name ring: the packet is copied once into shared memory and read in place. The reader only
+ * needs a system call to sleep, and the writer only to wake it.
+ */
+class ShmTransport : public Transport
+{
+public:
+  bool open(uint32_t uiCapacity)
+  {
+    // unique per process so that concurrent runs don't meet
+    const std::string sName = "ShmRingBench" + std::to_string(nowNs());
+    if (!m_writer.open(sName, uiCapacity, 48000, 2))
+    {
+      printf("%s\n", m_writer.getLastError().c_str());
+      return false;
+    }
+    if (!m_reader.open(sName))
+    {
+      printf("Unable to open the ring for reading: %s\n", m_reader.getLastError().c_str());
+      return false;
+    }
+    return true;
+  }
+
+  const char* getName() const { return "shared memory"; }
+
+  bool send(const uint8_t* pData, uint32_t uiSize, int64_t tStart, uint64_t uiSequenceNumber)
+  {
+    return m_writer.write(pData, uiSize, tStart, tStart, uiSequenceNumber);
+  }
+
+  bool receive(int64_t& tStart, uint64_t& uiSequenceNumber, uint32_t& uiSize, uint32_t uiTimeoutMs)
+  {
+    SharedMemoryRingReader::PacketView packet;
+    if (!m_reader.peek(packet) && (!m_reader.wait(uiTimeoutMs) || !m_reader.peek(packet))) return false;
+    // the sender would hand the payload to its socket from here, without a copy of its own
+    tStart = packet.tStart;
+    uiSequenceNumber = packet.uiSequenceNumber;
+    uiSize = packet.uiSize;
+    m_reader.consume();
+    return true;
+  }
+
+  uint64_t getDroppedCount() const { return m_writer.getDroppedCount(); }
+
+private:
+  SharedMemoryRingWriter m_writer;
+  SharedMemoryRingReader m_reader;
+};
+
+/**
+ * @brief The local socket path: the packet and its timestamps are copied into the kernel with one system call and
+ * copied out with at least another one.
+ */
+class SocketTransport : public Transport
+{
+public:
+  SocketTransport() :m_writer(INVALID_SOCKET), m_reader(INVALID_SOCKET) {}
+
+  ~SocketTransport()
+  {
+    if (m_writer != INVALID_SOCKET) closeSocket(m_writer);
+    if (m_reader != INVALID_SOCKET) closeSocket(m_reader);
+  }
+
+  /// a loopback TCP connection, which local sockets are on Windows
+  bool open()
+  {
+    socket_t listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t addressSize = sizeof(address);
+    bool bOk = listener != INVALID_SOCKET && bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 &&
+      listen(listener, 1) == 0 && getsockname(listener, reinterpret_cast<sockaddr*>(&address), &addressSize) == 0;
+    if (bOk)
+    {
+      m_writer = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      bOk = m_writer != INVALID_SOCKET && connect(m_writer, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    }
+    if (bOk)
+    {
+      m_reader = accept(listener, nullptr, nullptr);
+      bOk = m_reader != INVALID_SOCKET;
+    }
+    if (listener != INVALID_SOCKET) closeSocket(listener);
+    if (!bOk)
+    {
+      printf("Unable to connect a loopback socket\n");
+      return false;
+    }
+    // every packet goes out as it is written, as the sender's packets would
+    int iNoDelay = 1;
+    setsockopt(m_writer, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&iNoDelay), sizeof(iNoDelay));
+    return true;
+  }
+
+  const char* getName() const { return "socket"; }
+
+  bool send(const uint8_t* pData, uint32_t uiSize, int64_t tStart, uint64_t uiSequenceNumber)
+  {
+    // the record of the ring, so that both carry the same bytes
+    m_vSend.resize(sizeof(ShmRecordHeader) + uiSize);
+    ShmRecordHeader record = { uiSize, 0, tStart, tStart, uiSequenceNumber };
+    memcpy(m_vSend.data(), &record, sizeof(record));
+    memcpy(m_vSend.data() + sizeof(record), pData, uiSize);
+    return sendAll(m_vSend.data(), m_vSend.size());
+  }
+
+  bool receive(int64_t& tStart, uint64_t& uiSequenceNumber, uint32_t& uiSize, uint32_t uiTimeoutMs)
+  {
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(m_reader, &readable);
+    timeval timeout = { static_cast<long>(uiTimeoutMs / 1000), static_cast<long>(uiTimeoutMs % 1000) * 1000 };
+    if (select(static_cast<int>(m_reader) + 1, &readable, nullptr, nullptr, &timeout) <= 0) return false;
+    ShmRecordHeader record;
+    if (!receiveAll(reinterpret_cast<uint8_t*>(&record), sizeof(record))) return false;
+    m_vReceive.resize(record.size);
+    if (!receiveAll(m_vReceive.data(), record.size)) return false;
+    tStart = record.startTime;
+    uiSequenceNumber = record.sequenceNumber;
+    uiSize = record.size;
+    return true;
+  }
+
+private:
+  bool sendAll(const uint8_t* pData, size_t uiSize)
+  {
+    while (uiSize > 0)
+    {
+      const int iSent = ::send(m_writer, reinterpret_cast<const char*>(pData), static_cast<int>(uiSize), 0);
+      if (iSent <= 0) return false;
+      pData += iSent;
+      uiSize -= iSent;
+    }
+    return true;
+  }
+
+  bool receiveAll(uint8_t* pData, size_t uiSize)
+  {
+    while (uiSize > 0)
+    {
+      const int iReceived = recv(m_reader, reinterpret_cast<char*>(pData), static_cast<int>(uiSize), 0);
+      if (iReceived <= 0) return false;
+      pData += iReceived;
+      uiSize -= iReceived;
+    }
+    return true;
+  }
+
+  socket_t m_writer;
+  socket_t m_reader;
+  std::vector<uint8_t> m_vSend;
+  std::vector<uint8_t> m_vReceive;
+};
+
+struct Result
+{
+  double dPacketsPerSecond;
+  /// sends that found the ring full and were retried
+  uint64_t uiRetries;
+  std::vector<double> vLatencyUs;
+  /// packets lost or out of order
+  uint64_t uiErrors;
+};
+
+/**
+ * @brief Sends uiPackets packets from this thread to a reader thread, every uiIntervalUs or as fast as possible
+ */
+static Result run(Transport& transport, uint32_t uiPackets, uint32_t uiPacketSize, uint32_t uiIntervalUs)
+{
+  Result result = { 0.0, 0, std::vector<double>(), 0 };
+  result.vLatencyUs.reserve(uiPackets);
+  std::atomic<bool> bReaderReady(false);
+  std::thread reader([&]()
+  {
+    bReaderReady = true;
+    for (uint32_t i = 0; i < uiPackets; ++i)
+    {
+      int64_t tStart;
+      uint64_t uiSequenceNumber;
+      uint32_t uiSize;
+      if (!transport.receive(tStart, uiSequenceNumber, uiSize, 1000))
+      {
+        result.uiErrors += uiPackets - i;
+        return;
+      }
+      result.vLatencyUs.push_back((nowNs() - tStart) / 1000.0);
+      if (uiSequenceNumber != i || uiSize != uiPacketSize) ++result.uiErrors;
+    }
+  });
+  while (!bReaderReady) std::this_thread::yield();
+
+  std::vector<uint8_t> vPacket(uiPacketSize);
+  for (uint32_t i = 0; i < uiPacketSize; ++i) vPacket[i] = static_cast<uint8_t>(i * 7);
+  const int64_t tBegin = nowNs();
+  for (uint32_t i = 0; i < uiPackets; ++i)
+  {
+    if (uiIntervalUs > 0)
+    {
+      std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(tBegin + static_cast<int64_t>(i) * uiIntervalUs * 1000)));
+    }
+    while (!transport.send(vPacket.data(), uiPacketSize, nowNs(), i))
+    {
+      // the ring is full: let the reader catch up
+      ++result.uiRetries;
+      std::this_thread::yield();
+    }
+  }
+  reader.join();
+  result.dPacketsPerSecond = uiPackets * 1e9 / (nowNs() - tBegin);
+  return result;
+}
+
+static void printResult(const char* szTest, const Transport& transport, Result& result, uint32_t uiPacketSize)
+{
+  std::sort(result.vLatencyUs.begin(), result.vLatencyUs.end());
+  auto percentile = [&result](double dPercent)
+  {
+    if (result.vLatencyUs.empty()) return 0.0;
+    return result.vLatencyUs[std::min(result.vLatencyUs.size() - 1, static_cast<size_t>(dPercent / 100.0 * result.vLatencyUs.size()))];
+  };
+  printf("%-12s %-14s %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f %10llu\n", szTest, transport.getName(), result.dPacketsPerSecond,
+    result.dPacketsPerSecond * uiPacketSize / 1e6, percentile(50.0), percentile(99.0), percentile(99.9),
+    result.vLatencyUs.empty() ? 0.0 : result.vLatencyUs.back(), static_cast<unsigned long long>(result.uiRetries));
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t uiPackets = 1000000;
+  uint32_t uiLatencyPackets = 10000;
+  uint32_t uiPacketSize = DEFAULT_PACKET_SIZE;
+  uint32_t uiIntervalUs = 1000;
+  uint32_t uiCapacity = 1 << 16;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "--packets=", 10) == 0)
+      uiPackets = static_cast<uint32_t>(atoi(argv[i] + 10));
+    else if (strncmp(argv[i], "--latency-packets=", 18) == 0)
+      uiLatencyPackets = static_cast<uint32_t>(atoi(argv[i] + 18));
+    else if (strncmp(argv[i], "--size=", 7) == 0)
+      uiPacketSize = static_cast<uint32_t>(atoi(argv[i] + 7));
+    else if (strncmp(argv[i], "--interval-us=", 14) == 0)
+      uiIntervalUs = static_cast<uint32_t>(atoi(argv[i] + 14));
+    else if (strncmp(argv[i], "--capacity=", 11) == 0)
+      uiCapacity = static_cast<uint32_t>(atoi(argv[i] + 11));
+    else
+    {
+      printf("Usage: %s [--packets=n] [--latency-packets=n] [--size=bytes] [--interval-us=us] [--capacity=ring bytes]\n", argv[0]);
+      printf("Sends packets from an encoder thread to a sender thread through the shared memory ring and through a loopback\n");
+      printf("socket: first as fast as possible for the throughput, then one every interval for the latency of a paced stream.\n");
+      return 1;
+    }
+  }
+  if (uiPackets == 0 || uiLatencyPackets == 0 || uiPacketSize == 0 || uiPacketSize > uiCapacity / 4)
+  {
+    printf("Invalid packet count or size\n");
+    return 1;
+  }
+#ifdef _WIN32
+  WSADATA wsaData;
+  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+  {
+    printf("Unable to initialise Winsock\n");
+    return 1;
+  }
+#endif
+
+  printf("%u byte packets, %u packets for the throughput, %u packets every %u us for the latency\n", uiPacketSize, uiPackets,
+    uiLatencyPackets, uiIntervalUs);
+  printf("%-12s %-14s %12s %10s %10s %10s %10s %10s %10s\n", "test", "transport", "packets/s", "MB/s", "p50 us", "p99 us",
+    "p99.9 us", "max us", "retries");
+  uint64_t uiErrors = 0;
+  for (int iTest = 0; iTest < 2; ++iTest)
+  {
+    const bool bThroughput = iTest == 0;
+    const uint32_t uiCount = bThroughput ? uiPackets : uiLatencyPackets;
+    const uint32_t uiInterval = bThroughput ? 0 : uiIntervalUs;
+    ShmTransport shm;
+    if (!shm.open(uiCapacity)) return 1;
+    Result shmResult = run(shm, uiCount, uiPacketSize, uiInterval);
+    printResult(bThroughput ? "throughput" : "latency", shm, shmResult, uiPacketSize);
+    SocketTransport sock;
+    if (!sock.open()) return 1;
+    Result socketResult = run(sock, uiCount, uiPacketSize, uiInterval);
+    printResult(bThroughput ? "throughput" : "latency", sock, socketResult, uiPacketSize);
+    uiErrors += shmResult.uiErrors + socketResult.uiErrors;
+  }
+  if (uiErrors > 0)
+  {
+    printf("%llu packets were lost or out of order\n", static_cast<unsigned long long>(uiErrors));
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,318 @@
+/** @file
+
+MODULE				: TraceReplay
+
+FILE NAME			: TraceReplay.cpp
+
+DESCRIPTION			: Replays an encoder input trace through the encode engine
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "EncodeTrace.h"
+#include "EncoderGovernor.h"
+#include "OpusEncodeEngine.h"
+#include "RealtimeScheduling.h"
+#include <CodecUtils/ICodecv2.h>
+
+#ifndef AM_SAMPLE_DATADISCONTINUITY
+#define AM_SAMPLE_DATADISCONTINUITY 0x4
+#endif
+
+// an Opus packet of 120 ms
+static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+
+/**
+ * @brief The filter parameters that are applied to the engine together
+ */
+struct ReplaySettings
+{
+  uint32_t uiGap[3];
+  FrameDurationController::Config adaptiveConfig;
+  uint32_t uiCbr[2];
+  uint32_t uiFec[2];
+  InputConditioner::Config conditioning;
+};
+
+/**
+ * @brief Applies a recorded SetParameter call. Parameters the engine doesn't handle go to the codec, as in the filter.
+ */
+static void applyParameter(OpusEncodeEngine& engine, const TraceRecord& record, ReplaySettings& settings)
+{
+  uint32_t* uiGap = settings.uiGap;
+  FrameDurationController::Config& adaptiveConfig = settings.adaptiveConfig;
+  const char* szName = record.sName.c_str();
+  uint32_t uiValue = static_cast<uint32_t>(strtoul(record.sValue.c_str(), nullptr, 10));
+  if (strcmp(szName, "drift_compensation") == 0)
+  {
+    engine.enableDriftCompensation(uiValue != 0, uiValue == 2 ? DriftCompensator::Mode::DC_OCCUPANCY : DriftCompensator::Mode::DC_TIMESTAMPS);
+  }
+  else if (strcmp(szName, "stream_priority") == 0)
+  {
+    engine.setPriority(uiValue);
+  }
+  else if (strcmp(szName, "cpu_budget_percent") == 0)
+  {
+    EncoderGovernor::instance().setBudgetPercent(uiValue);
+  }
+  else if (strcmp(szName, "quality_monitor") == 0)
+  {
+    engine.enableQualityMonitor(uiValue != 0);
+  }
+  else if (strncmp(szName, "gap_", 4) == 0)
+  {
+    if (strcmp(szName, "gap_policy") == 0) uiGap[0] = uiValue;
+    else if (strcmp(szName, "gap_tolerance_ms") == 0) uiGap[1] = uiValue;
+    else if (strcmp(szName, "gap_max_fill_ms") == 0) uiGap[2] = uiValue;
+    GapPolicy ePolicy = uiGap[0] == 0 ? GapPolicy::GP_IGNORE : (uiGap[0] == 2 ? GapPolicy::GP_SIGNAL_LOSS : GapPolicy::GP_FILL_SILENCE);
+    engine.setGapPolicy(ePolicy, uiGap[1] * 10000LL, uiGap[2] * 10000LL);
+  }
+  else if (strcmp(szName, "fec_mode") == 0 || strcmp(szName, "fec_expected_loss_percent") == 0)
+  {
+    settings.uiFec[strcmp(szName, "fec_mode") == 0 ? 0 : 1] = uiValue;
+    engine.getFecController().setMode(settings.uiFec[0] == 1 ? FecController::Mode::FM_FIXED :
+      settings.uiFec[0] == 2 ? FecController::Mode::FM_ADAPTIVE : FecController::Mode::FM_OFF, settings.uiFec[1]);
+  }
+  else if (strcmp(szName, "loss_report") == 0)
+  {
+    char* szEnd = nullptr;
+    double dLossPercent = strtod(record.sValue.c_str(), &szEnd);
+    engine.getFecController().reportLoss(dLossPercent / 100.0, *szEnd == ',' ? strtod(szEnd + 1, nullptr) : 1.0);
+  }
+  else if (strcmp(szName, "cbr_link_rate_bps") == 0 || strcmp(szName, "cbr_link_overhead_bytes") == 0)
+  {
+    settings.uiCbr[strcmp(szName, "cbr_link_rate_bps") == 0 ? 0 : 1] = uiValue;
+    engine.setConstantBitrate(settings.uiCbr[0], settings.uiCbr[1]);
+  }
+  else if (strcmp(szName, "dc_removal") == 0 || strcmp(szName, "highpass_hz") == 0 || strcmp(szName, "noise_gate_db") == 0)
+  {
+    if (strcmp(szName, "dc_removal") == 0) settings.conditioning.dcRemoval = uiValue != 0;
+    else if (strcmp(szName, "highpass_hz") == 0) settings.conditioning.highPassHz = uiValue;
+    else settings.conditioning.noiseGateDb = uiValue;
+    engine.setConditioningConfig(settings.conditioning);
+  }
+  else if (strcmp(szName, "adaptive_frame_duration") == 0)
+  {
+    engine.enableAdaptiveFrameDuration(uiValue != 0);
+  }
+  else if (strcmp(szName, "max_frame_duration_ms") == 0 || strcmp(szName, "packet_rate_budget") == 0 || strcmp(szName, "packet_header_bytes") == 0)
+  {
+    if (strcmp(szName, "packet_rate_budget") == 0) adaptiveConfig.packetRateBudget = uiValue;
+    else if (strcmp(szName, "packet_header_bytes") == 0) adaptiveConfig.headerBytes = uiValue;
+    else adaptiveConfig.maxFrameDuration = uiValue >= 60 ? OpusFrameDuration::OFD_60_MS : uiValue >= 40 ? OpusFrameDuration::OFD_40_MS :
+      uiValue >= 20 ? OpusFrameDuration::OFD_20_MS : OpusFrameDuration::OFD_10_MS;
+    engine.setAdaptiveFrameDurationConfig(adaptiveConfig);
+  }
+  else if (strcmp(szName, "complexity") == 0)
+  {
+    // the governor degrades from the complexity the filter set
+    engine.setComplexity(uiValue);
+  }
+  else
+  {
+    engine.getCodec()->SetParameter(szName, record.sValue.c_str());
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s <trace> [--realtime] [--sched=<0|1|2>] [--cores=<set>] [--hog=<threads>]\n", argv[0]);
+    printf("Drives the encode engine with a trace recorded through the trace_record_path filter parameter.\n");
+    printf("  --realtime      feed the samples at their recorded cadence\n");
+    printf("  --sched         scheduling as the realtime_scheduling filter parameter: 0 normal, 1 real-time, 2 deadline\n");
+    printf("  --cores         core set such as 0-3,6 as the realtime_cores filter parameter\n");
+    printf("  --hog           busy threads competing for the CPU, to compare the completion times with and without --sched\n");
+    return 1;
+  }
+  bool bRealtime = false;
+  RealtimePolicy policy;
+  unsigned uiHogThreads = 0;
+  for (int i = 2; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--realtime") == 0) bRealtime = true;
+    else if (strncmp(argv[i], "--sched=", 8) == 0)
+    {
+      int iMode = atoi(argv[i] + 8);
+      policy.eMode = iMode == 2 ? RealtimeMode::RM_DEADLINE : iMode == 1 ? RealtimeMode::RM_REALTIME : RealtimeMode::RM_NONE;
+    }
+    else if (strncmp(argv[i], "--cores=", 8) == 0)
+    {
+      if (!parseCoreSet(argv[i] + 8, policy.vCores))
+      {
+        printf("Invalid core set: %s\n", argv[i] + 8);
+        return 1;
+      }
+    }
+    else if (strncmp(argv[i], "--hog=", 6) == 0) uiHogThreads = static_cast<unsigned>(atoi(argv[i] + 6));
+    else
+    {
+      printf("Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  TraceReader reader;
+  if (!reader.open(argv[1]))
+  {
+    printf("%s\n", reader.getLastError().c_str());
+    return 1;
+  }
+  const TraceFormat& format = reader.getFormat();
+  OpusEncodeEngine engine;
+  // the filter defaults
+  ReplaySettings settings = { { 0, 10, 1000 }, FrameDurationController::getDefaultConfig(), { 0, 0 }, { 0, 10 }, InputConditioner::getDefaultConfig() };
+  engine.setGapPolicy(GapPolicy::GP_FILL_SILENCE, settings.uiGap[1] * 10000LL, settings.uiGap[2] * 10000LL);
+  if (!engine.open(format.samplesPerSecond, format.channels, format.bitsPerSample, format.targetBitrateKbps))
+  {
+    printf("%s\n", engine.getLastError().c_str());
+    return 1;
+  }
+  printf("%u Hz, %u channels, %u bits, %u kbps%s\n", format.samplesPerSecond, format.channels, format.bitsPerSample,
+    format.targetBitrateKbps, bRealtime ? ", real-time cadence" : "");
+
+  // the hogs run on the same cores as the encoder so that they compete with it
+  std::atomic<bool> bHogStop(false);
+  std::vector<std::thread> vHogs;
+  RealtimePolicy hogPolicy;
+  hogPolicy.vCores = policy.vCores;
+  for (unsigned i = 0; i < uiHogThreads; ++i)
+  {
+    vHogs.emplace_back([&bHogStop, &hogPolicy]()
+    {
+      RealtimeScope affinity(hogPolicy);
+      volatile uint64_t uiSpin = 0;
+      while (!bHogStop.load(std::memory_order_relaxed)) uiSpin = uiSpin + 1;
+    });
+  }
+  policy.tPeriod = static_cast<REFERENCE_TIME>(engine.getAudioBuffer()->getFrameDurationMs() * 10000);
+  policy.tRuntime = policy.tPeriod / 2;
+  std::unique_ptr<RealtimeScope> pRealtime = std::make_unique<RealtimeScope>(policy);
+  if (policy.eMode != RealtimeMode::RM_NONE && !pRealtime->isRealtime())
+  {
+    printf("Real-time scheduling unavailable: %s\n", pRealtime->getLastError().c_str());
+  }
+
+  std::vector<uint8_t> vPacket(MAX_PACKET_SIZE);
+  std::vector<double> vEncodeMs;
+  uint64_t uiBytes = 0;
+  auto encodeAvailable = [&]()
+  {
+    REFERENCE_TIME tStart, tStop;
+    uint8_t* pFrame = nullptr;
+    while (engine.readNextAudioFrame(tStart, tStop, pFrame))
+    {
+      int iSize = engine.encodeFrame(pFrame, vPacket.data(), static_cast<int>(vPacket.size()));
+      if (iSize < 0)
+      {
+        printf("Encoding failed: %s\n", engine.getLastError().c_str());
+        return false;
+      }
+      vEncodeMs.push_back(engine.getLastEncodeMs());
+      uiBytes += iSize;
+    }
+    engine.measureDriftOccupancy();
+    return true;
+  };
+
+  TraceRecord record;
+  bool bFirst = true;
+  REFERENCE_TIME tFirst = 0;
+  auto tWallStart = std::chrono::steady_clock::now();
+  while (reader.next(record))
+  {
+    switch (record.eType)
+    {
+    case TraceRecordType::TR_SAMPLE:
+      if (bRealtime)
+      {
+        if (bFirst) tFirst = record.tStart;
+        std::this_thread::sleep_until(tWallStart + std::chrono::microseconds((record.tStart - tFirst) / 10));
+      }
+      bFirst = false;
+      if (record.uiFlags & AM_SAMPLE_DATADISCONTINUITY)
+      {
+        engine.startNewSegment(record.tStart);
+      }
+      if (engine.addAudioData(record.vData.data(), static_cast<uint32_t>(record.vData.size()), record.tStart, record.tStop) == -1)
+      {
+        printf("Audio buffer overflow\n");
+      }
+      if (!encodeAvailable()) return 1;
+      break;
+    case TraceRecordType::TR_PARAMETER:
+      applyParameter(engine, record, settings);
+      break;
+    case TraceRecordType::TR_END_OF_STREAM:
+      if (engine.padPartialFrame() && !encodeAvailable()) return 1;
+      break;
+    case TraceRecordType::TR_FLUSH:
+    case TraceRecordType::TR_NEW_SEGMENT:
+      engine.reset();
+      break;
+    }
+  }
+  if (!reader.getLastError().empty())
+  {
+    printf("%s\n", reader.getLastError().c_str());
+  }
+  double dWallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tWallStart).count();
+  pRealtime.reset();
+  bHogStop = true;
+  for (std::thread& hog : vHogs) hog.join();
+  if (vEncodeMs.empty())
+  {
+    printf("No frames encoded\n");
+    return 0;
+  }
+
+  double dTotalMs = 0.0;
+  for (double dMs : vEncodeMs) dTotalMs += dMs;
+  std::vector<double> vSorted(vEncodeMs);
+  std::sort(vSorted.begin(), vSorted.end());
+  auto percentile = [&vSorted](double dPercent) { return vSorted[static_cast<size_t>(dPercent / 100.0 * (vSorted.size() - 1))]; };
+  double dAudioMs = static_cast<double>(vEncodeMs.size()) * engine.getBytesPerFrame() * 1000.0 /
+    (format.samplesPerSecond * format.channels * (format.bitsPerSample / 8));
+  printf("frames %zu, bytes %llu, audio %.0f ms, wall %.0f ms\n", vEncodeMs.size(), static_cast<unsigned long long>(uiBytes), dAudioMs, dWallMs);
+  printf("encode ms: mean %.3f p50 %.3f p99 %.3f max %.3f, real-time factor %.1f\n", dTotalMs / vEncodeMs.size(), percentile(50),
+    percentile(99), vSorted.back(), dAudioMs / dTotalMs);
+  // measured from the arrival of the audio, i.e. including the time the encoder waited for the CPU
+  DeadlineTracker::Stats deadlines = engine.getDeadlineTracker().getStats();
+  printf("completion ms: p99 %.2f p99.9 %.2f max %.2f, deadline misses %llu of %llu\n", deadlines.p99Ms, deadlines.p999Ms,
+    deadlines.maxMs, static_cast<unsigned long long>(deadlines.misses), static_cast<unsigned long long>(deadlines.frames));
+  // where to start profiling
+  size_t uiWorst = std::max_element(vEncodeMs.begin(), vEncodeMs.end()) - vEncodeMs.begin();
+  printf("slowest frame %zu at %.0f ms of audio\n", uiWorst, dAudioMs * uiWorst / vEncodeMs.size());
+  return 0;
+}
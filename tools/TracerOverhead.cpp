@@ -0,0 +1,207 @@
+/** @file
+
+MODULE				: TracerOverhead
+
+FILE NAME			: TracerOverhead.cpp
+
+DESCRIPTION			: Measures the cost of the frame trace points on the encode loop and checks that trace rings are recycled
+
+LICENSE: Software License Agreement (BSD License)
+
+Copyright (c) 2014, CSIR
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of the CSIR nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+===========================================================================
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "FrameTracer.h"
+#include "OpusEncodeEngine.h"
+
+// an Opus packet of 120 ms
+static const int MAX_PACKET_SIZE = 6 * 1275 + 7;
+// the size of the blocks handed to the engine, as a capture device would
+static const int BLOCK_MS = 10;
+
+/// 32 bit linear congruential generator so that the input is the same on every platform
+static uint32_t nextRandom(uint32_t& uiState)
+{
+  uiState = uiState * 1664525u + 1013904223u;
+  return uiState;
+}
+
+/**
+ * @brief Feeds the input through the engine with the trace points of OpusEncoderFilter::Receive and deliverFrame.
+ * With bTraced false the trace points are compiled out, as in a build without OPUS_ENCODER_TRACING.
+ * @return the time taken in seconds or a negative value if encoding failed
+ */
+template <bool bTraced>
+static double encodeLoop(OpusEncodeEngine& engine, const std::vector<int16_t>& vInput, int iSamplesPerSecond, int iChannels, int iBlocks)
+{
+  const size_t uiBlockSamples = static_cast<size_t>(iSamplesPerSecond) * BLOCK_MS / 1000;
+  const size_t uiInputBlocks = vInput.size() / iChannels / uiBlockSamples;
+  std::vector<uint8_t> vPacket(MAX_PACKET_SIZE);
+  const uint32_t uiStreamId = 1;
+  uint32_t uiFrame = 0;
+  REFERENCE_TIME tStart = 0;
+  const auto tBegin = std::chrono::steady_clock::now();
+  for (int i = 0; i < iBlocks; ++i)
+  {
+    if (bTraced) FRAME_TRACE(SampleArrival, uiStreamId, uiFrame);
+    const REFERENCE_TIME tStop = tStart + BLOCK_MS * 10000LL;
+    const int16_t* pBlock = vInput.data() + (i % uiInputBlocks) * uiBlockSamples * iChannels;
+    if (engine.addAudioData(reinterpret_cast<uint8_t*>(const_cast<int16_t*>(pBlock)),
+      static_cast<uint32_t>(uiBlockSamples * iChannels * sizeof(int16_t)), tStart, tStop) == -1) return -1.0;
+    REFERENCE_TIME tFrameStart, tFrameStop;
+    uint8_t* pFrame = nullptr;
+    while (engine.readNextAudioFrame(tFrameStart, tFrameStop, pFrame))
+    {
+      if (bTraced) FRAME_TRACE(FrameCut, uiStreamId, uiFrame);
+      if (bTraced) FRAME_TRACE(AllocatorWaitStart, uiStreamId, uiFrame);
+      if (bTraced) FRAME_TRACE(AllocatorWaitEnd, uiStreamId, uiFrame);
+      if (bTraced) FRAME_TRACE(EncodeStart, uiStreamId, uiFrame);
+      if (engine.encodeFrame(pFrame, vPacket.data(), MAX_PACKET_SIZE) < 0) return -1.0;
+      if (bTraced) FRAME_TRACE(EncodeEnd, uiStreamId, uiFrame);
+      ++uiFrame;
+      if (bTraced) FRAME_TRACE(DeliverStart, uiStreamId, uiFrame - 1);
+      if (bTraced) FRAME_TRACE(DeliverEnd, uiStreamId, uiFrame - 1);
+    }
+    tStart = tStop;
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - tBegin).count();
+}
+
+/**
+ * @brief Records from short-lived threads one after another, as graph restarts do.
+ * @return the number of rings allocated by the threads
+ */
+static size_t recordFromThreads(int iThreads)
+{
+  const size_t uiRings = FrameTracer::getRingCount();
+  for (int i = 0; i < iThreads; ++i)
+  {
+    std::thread thread([i]() { FrameTracer::record(FrameTracer::Event::SampleArrival, 1, static_cast<uint32_t>(i)); });
+    thread.join();
+  }
+  return FrameTracer::getRingCount() - uiRings;
+}
+
+int main(int argc, char** argv)
+{
+  int iSamplesPerSecond = 48000;
+  int iChannels = 2;
+  uint32_t uiKbps = 64;
+  int iSeconds = 60;
+  int iRounds = 5;
+  double dMaxOverheadPercent = 1.0;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "--rate=", 7) == 0)
+      iSamplesPerSecond = atoi(argv[i] + 7);
+    else if (strncmp(argv[i], "--channels=", 11) == 0)
+      iChannels = atoi(argv[i] + 11);
+    else if (strncmp(argv[i], "--bitrate=", 10) == 0)
+      uiKbps = static_cast<uint32_t>(atoi(argv[i] + 10));
+    else if (strncmp(argv[i], "--seconds=", 10) == 0)
+      iSeconds = atoi(argv[i] + 10);
+    else if (strncmp(argv[i], "--rounds=", 9) == 0)
+      iRounds = atoi(argv[i] + 9);
+    else if (strncmp(argv[i], "--max-overhead=", 15) == 0)
+      dMaxOverheadPercent = atof(argv[i] + 15);
+    else
+    {
+      printf("Usage: %s [--rate=Hz] [--channels=n] [--bitrate=kbps] [--seconds=s of audio per round] [--rounds=n]\n", argv[0]);
+      printf("  [--max-overhead=percent]\n");
+      printf("Encodes the same audio with the trace points compiled out, compiled in but disabled and enabled, and fails if\n");
+      printf("tracing costs more than the maximum overhead, by default 1%%. Then checks that exited threads hand on their rings.\n");
+      return 1;
+    }
+  }
+  if (iSeconds < 1 || iRounds < 1)
+  {
+    printf("Invalid duration\n");
+    return 1;
+  }
+
+  // a second of noise at about -20 dBFS
+  std::vector<int16_t> vInput(static_cast<size_t>(iSamplesPerSecond) * iChannels);
+  uint32_t uiSeed = 0xC0FFEEu;
+  for (auto& sample : vInput) sample = static_cast<int16_t>((static_cast<int32_t>(nextRandom(uiSeed) >> 16) - 32768) / 10);
+
+  OpusEncodeEngine engine;
+  if (!engine.open(iSamplesPerSecond, iChannels, 16, uiKbps))
+  {
+    printf("Unable to open the encoder: %s\n", engine.getLastError().c_str());
+    return 1;
+  }
+  const int iBlocks = iSeconds * 1000 / BLOCK_MS;
+  // the modes take turns so that frequency scaling and other load affect them alike; the fastest round of each counts
+  double dOff = 1e9, dDisabled = 1e9, dEnabled = 1e9;
+  encodeLoop<false>(engine, vInput, iSamplesPerSecond, iChannels, iBlocks / 10);
+  for (int i = 0; i < iRounds; ++i)
+  {
+    FrameTracer::setEnabled(false);
+    const double dRoundOff = encodeLoop<false>(engine, vInput, iSamplesPerSecond, iChannels, iBlocks);
+    const double dRoundDisabled = encodeLoop<true>(engine, vInput, iSamplesPerSecond, iChannels, iBlocks);
+    FrameTracer::clear();
+    FrameTracer::setEnabled(true);
+    const double dRoundEnabled = encodeLoop<true>(engine, vInput, iSamplesPerSecond, iChannels, iBlocks);
+    if (dRoundOff < 0.0 || dRoundDisabled < 0.0 || dRoundEnabled < 0.0)
+    {
+      printf("Encoding failed: %s\n", engine.getLastError().c_str());
+      return 1;
+    }
+    dOff = std::min(dOff, dRoundOff);
+    dDisabled = std::min(dDisabled, dRoundDisabled);
+    dEnabled = std::min(dEnabled, dRoundEnabled);
+  }
+  FrameTracer::setEnabled(false);
+  const double dDisabledPercent = 100.0 * (dDisabled - dOff) / dOff;
+  const double dEnabledPercent = 100.0 * (dEnabled - dOff) / dOff;
+  printf("%d Hz, %d channels, %u kbps, %d s of audio, best of %d rounds\n", iSamplesPerSecond, iChannels, uiKbps, iSeconds, iRounds);
+  printf("%-24s %10.3f s\n", "compiled out", dOff);
+  printf("%-24s %10.3f s %+8.3f%%\n", "compiled in, disabled", dDisabled, dDisabledPercent);
+  printf("%-24s %10.3f s %+8.3f%%\n", "enabled", dEnabled, dEnabledPercent);
+
+  // a thread that exits hands its ring to the next one
+  FrameTracer::setEnabled(true);
+  const size_t uiNewRings = recordFromThreads(100);
+  FrameTracer::setEnabled(false);
+  printf("100 short-lived threads allocated %u rings\n", static_cast<unsigned>(uiNewRings));
+
+  bool bFailed = false;
+  if (dDisabledPercent > dMaxOverheadPercent || dEnabledPercent > dMaxOverheadPercent)
+  {
+    printf("Tracing exceeds the maximum overhead of %.3f%%\n", dMaxOverheadPercent);
+    bFailed = true;
+  }
+  if (uiNewRings > 1)
+  {
+    printf("Trace rings are not recycled\n");
+    bFailed = true;
+  }
+  return bFailed ? 1 : 0;
+}